@@ -0,0 +1,225 @@
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <vector>
+
+#include <string.h>
+
+#include "advise.hpp"
+#include "index.hpp"
+
+/**
+ * Size at `percentile` of the sizes of `size_counts`, `count` sizes in all,
+ * as if they were sorted.
+ */
+static uint64_t size_percentile(const std::map<uint64_t, uint64_t>& size_counts, uint64_t count, int percentile) {
+    uint64_t rank = (count - 1) * percentile / 100;
+    uint64_t sizes_up_to = 0;
+    for (const std::pair<const uint64_t, uint64_t>& size_count : size_counts) {
+        sizes_up_to += size_count.second;
+        if (sizes_up_to > rank) {
+            return size_count.first;
+        }
+    }
+    return size_counts.rbegin()->first;
+}
+
+/**
+ * Reads the lines of `reader` one at a time into `stats` and `bucket_sizes`,
+ * keeping only a count per line size for the percentiles.
+ */
+static void read_line_stats(
+        SparseLineExtentReader& reader,
+        const SparsificationConfiguration& sparse_config,
+        SparseBucketSizes& bucket_sizes,
+        struct vcfc_line_stats *stats) {
+    size_t headers_size = sparse_config.record_headers_size();
+    std::map<uint64_t, uint64_t> size_counts;
+    stats->line_count = 0;
+    stats->total_size = 0;
+    stats->occupied_megabases = 0;
+    stats->max_lines_per_megabase = 0;
+    stats->max_lines_per_position = 0;
+    uint32_t max_reference_idx = 0;
+    uint64_t megabase_lines = 0, position_lines = 0;
+    struct sparse_line_extent line, previous_line;
+    memset(&previous_line, 0, sizeof(previous_line));
+    while (reader.next(&line) == 1) {
+        bucket_sizes.add_line(line);
+        uint64_t size = line.size - headers_size;
+        size_counts[size]++;
+        if (stats->line_count == 0 || size > stats->max_size) {
+            stats->max_size = size;
+            max_reference_idx = line.reference_idx;
+            stats->max_position = line.position;
+        }
+        // the lines are sorted, so the lines of a window or a position are consecutive
+        bool same_reference = stats->line_count > 0 && line.reference_idx == previous_line.reference_idx;
+        if (same_reference && line.position / VCFC_ADVISE_MEGABASE == previous_line.position / VCFC_ADVISE_MEGABASE) {
+            megabase_lines++;
+        } else {
+            stats->occupied_megabases++;
+            megabase_lines = 1;
+        }
+        if (same_reference && line.position == previous_line.position) {
+            position_lines++;
+        } else {
+            position_lines = 1;
+        }
+        stats->max_lines_per_megabase = std::max(stats->max_lines_per_megabase, megabase_lines);
+        stats->max_lines_per_position = std::max(stats->max_lines_per_position, position_lines);
+        stats->line_count++;
+        stats->total_size += size;
+        previous_line = line;
+    }
+    if (stats->line_count == 0) {
+        return;
+    }
+    stats->min_size = size_counts.begin()->first;
+    stats->p50_size = size_percentile(size_counts, stats->line_count, 50);
+    stats->p90_size = size_percentile(size_counts, stats->line_count, 90);
+    stats->p99_size = size_percentile(size_counts, stats->line_count, 99);
+    stats->max_reference_name = sparse_config.name_map.int_to_reference(max_reference_idx);
+}
+
+void advise_file(
+        const std::string& compressed_filename,
+        const AdviseConfiguration& advise_configuration,
+        struct vcfc_line_stats *stats,
+        struct advised_parameters *parameters) {
+    FILE *input_file = fopen(compressed_filename.c_str(), "r");
+    if (input_file == NULL) {
+        perror("fopen");
+        throw std::runtime_error("Failed to open file " + compressed_filename);
+    }
+    VcfCompressionSchema schema;
+    std::vector<std::string> meta_header_lines;
+    decompress2_metadata_headers(input_file, meta_header_lines, schema);
+    SparsificationConfiguration sparse_config;
+    sparse_config.set_reference_names(schema.reference_names);
+    SparseBucketSizes bucket_sizes;
+    try {
+        SparseLineExtentReader reader(input_file, sparse_config);
+        read_line_stats(reader, sparse_config, bucket_sizes, stats);
+    } catch (const std::exception&) {
+        fclose(input_file);
+        throw;
+    }
+    fclose(input_file);
+    if (stats->line_count == 0) {
+        throw std::runtime_error("No lines in file " + compressed_filename);
+    }
+
+    // bucketed layout with slots no larger than a scan
+    size_t max_slot_size = advise_configuration.max_scan_bytes
+        / VCFC_SPARSE_SLOT_ALIGNMENT * VCFC_SPARSE_SLOT_ALIGNMENT;
+    max_slot_size = std::max(max_slot_size, (size_t) VCFC_SPARSE_SLOT_ALIGNMENT);
+    SparsificationConfiguration bucketed_config = sparse_config;
+    parameters->sparse_data_size = bucketed_config.choose_bucket_layout(bucket_sizes, max_slot_size);
+    parameters->multiplication_factor = bucketed_config.multiplication_factor;
+    parameters->block_size = bucketed_config.block_size;
+    parameters->bucket_width = bucketed_config.bucket_width;
+
+    // the layout is within the space target if its slots and overflow area
+    // are, the record headers of the lines count as overhead too
+    uint64_t max_data_size = (uint64_t) (stats->total_size * (1 + advise_configuration.max_space_overhead));
+    parameters->sparse_overhead_met = parameters->sparse_data_size <= max_data_size;
+    parameters->sparse_headers_overhead =
+        (double) stats->line_count * sparse_config.record_headers_size() / stats->total_size;
+    parameters->overhead_block_size = 0;
+    parameters->overhead_bucket_width = 0;
+    parameters->overhead_data_size = 0;
+    if (!parameters->sparse_overhead_met && parameters->sparse_headers_overhead <= advise_configuration.max_space_overhead) {
+        // larger slots allow wider buckets and fewer slots, smallest first
+        for (size_t slot_cap = max_slot_size * 2; slot_cap <= VCFC_ADVISE_MAX_SLOT_SIZE; slot_cap *= 2) {
+            SparsificationConfiguration overhead_config = sparse_config;
+            uint64_t data_size = overhead_config.choose_bucket_layout(bucket_sizes, slot_cap);
+            if (data_size <= max_data_size) {
+                parameters->overhead_block_size = overhead_config.block_size;
+                parameters->overhead_bucket_width = overhead_config.bucket_width;
+                parameters->overhead_data_size = data_size;
+                break;
+            }
+        }
+    }
+
+    // direct layout with slots of whole pages that fit all but the largest lines
+    uint64_t p99_record_size = stats->p99_size + sparse_config.record_headers_size();
+    parameters->direct_multiplication_factor = std::max((uint64_t) 1,
+        (p99_record_size + VCFC_PAGE_SIZE - 1) / VCFC_PAGE_SIZE);
+    SparsificationConfiguration direct_config = sparse_config;
+    direct_config.set_bucket_layout(parameters->direct_multiplication_factor, VCFC_PAGE_SIZE, 1);
+    parameters->direct_data_size = direct_config.overflow_offset();
+
+    // bins of a scan of bytes, larger by whole pages if the index would take too much space
+    uint64_t bin_bytes = std::max(advise_configuration.max_scan_bytes, (size_t) 1);
+    if (advise_configuration.max_space_overhead > 0
+            && (double) struct_index_entry_size / bin_bytes > advise_configuration.max_space_overhead) {
+        uint64_t min_bin_bytes = (uint64_t) (struct_index_entry_size / advise_configuration.max_space_overhead);
+        bin_bytes = (min_bin_bytes + VCFC_PAGE_SIZE - 1) / VCFC_PAGE_SIZE * VCFC_PAGE_SIZE;
+    }
+    parameters->bin_size = std::to_string(bin_bytes) + "b";
+    uint64_t bin_count = std::min(stats->line_count, std::max((uint64_t) 1, stats->total_size / bin_bytes));
+    parameters->binned_index_size = bin_count * struct_index_entry_size;
+
+    // the sparse external index keeps the entries of a position in one slot
+    uint64_t external_index_size = stats->max_lines_per_position * struct_index_entry_size;
+    parameters->external_index_slot_size = 1;
+    while (parameters->external_index_slot_size < external_index_size) {
+        parameters->external_index_slot_size *= 2;
+    }
+}
+
+int write_advised_parameters(const std::string& config_filename, const struct advised_parameters& parameters) {
+    std::ofstream config_fstream(config_filename);
+    if (!config_fstream) {
+        return -1;
+    }
+    config_fstream << "# written by advise, read by sparsify and create-binned-index" << std::endl;
+    config_fstream << "multiplication_factor=" << parameters.multiplication_factor << std::endl;
+    config_fstream << "block_size=" << parameters.block_size << std::endl;
+    config_fstream << "bucket_width=" << parameters.bucket_width << std::endl;
+    config_fstream << "bin_size=" << parameters.bin_size << std::endl;
+    return config_fstream ? 0 : -1;
+}
+
+int read_advised_parameters(const std::string& config_filename, struct advised_parameters *parameters) {
+    std::ifstream config_fstream(config_filename);
+    if (!config_fstream) {
+        return -1;
+    }
+    std::string line;
+    while (std::getline(config_fstream, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        size_t equals_idx = line.find('=');
+        if (equals_idx == std::string::npos) {
+            return -1;
+        }
+        std::string key = line.substr(0, equals_idx);
+        std::string value = line.substr(equals_idx + 1);
+        if (key == "bin_size") {
+            parameters->bin_size = value;
+            continue;
+        }
+        int *layout_value = NULL;
+        if (key == "multiplication_factor") {
+            layout_value = &parameters->multiplication_factor;
+        } else if (key == "block_size") {
+            layout_value = &parameters->block_size;
+        } else if (key == "bucket_width") {
+            layout_value = &parameters->bucket_width;
+        } else {
+            continue;
+        }
+        bool success = false;
+        uint64_t number = str_to_uint64(value, success);
+        if (!success || number == 0 || number > INT32_MAX) {
+            return -1;
+        }
+        *layout_value = (int) number;
+    }
+    return 0;
+}
@@ -0,0 +1,101 @@
+#pragma once
+#ifndef _ADVISE_H
+#define _ADVISE_H
+
+#include <string>
+
+#include <stdint.h>
+
+#include "sparse.hpp"
+
+// Parameters written by advise next to a compressed file, read by sparsify
+// and create-binned-index
+#define VCFC_CONFIG_EXTENSION ".vcfc-config"
+#define VCFC_ADVISE_MEGABASE 1000000
+// Largest slot advise tries for a bucketed layout that meets the space target
+#define VCFC_ADVISE_MAX_SLOT_SIZE (1 << 20)
+
+/**
+ * Targets the parameters recommended by advise are chosen for. A lookup
+ * reads up to max_scan_bytes of lines after finding their slot or bin, and
+ * an index takes up to max_space_overhead of the size of the lines.
+ */
+class AdviseConfiguration {
+public:
+    AdviseConfiguration(){};
+
+    double max_space_overhead = 0.01;
+    size_t max_scan_bytes = VCFC_SPARSE_MAX_SLOT_SIZE;
+};
+
+// Statistics of the lines of a compressed file, from one pass over the lines
+struct vcfc_line_stats {
+    uint64_t line_count;
+    uint64_t total_size;                // of the compressed lines
+    uint64_t min_size;
+    uint64_t p50_size;
+    uint64_t p90_size;
+    uint64_t p99_size;
+    uint64_t max_size;
+    std::string max_reference_name;     // of the largest line
+    uint64_t max_position;
+    uint64_t occupied_megabases;        // VCFC_ADVISE_MEGABASE windows of a contig with lines
+    uint64_t max_lines_per_megabase;
+    uint64_t max_lines_per_position;
+};
+
+/**
+ * Parameters recommended for a compressed file. The bucketed sparse layout
+ * and the bin size are the ones written to and read from the config file.
+ */
+struct advised_parameters {
+    // bucketed sparse layout, see SparsificationConfiguration
+    int multiplication_factor;
+    int block_size;
+    int bucket_width;
+    uint64_t sparse_data_size;          // estimated, slots and overflow area
+    bool sparse_overhead_met;           // whether sparse_data_size is within max_space_overhead
+    double sparse_headers_overhead;     // of the record headers alone, the least any layout has
+    // smallest layout within max_space_overhead with slots over max_scan_bytes,
+    // block_size 0 if there is none up to VCFC_ADVISE_MAX_SLOT_SIZE
+    int overhead_block_size;
+    int overhead_bucket_width;
+    uint64_t overhead_data_size;
+    // direct sparse layout with slots of multiplication_factor * 4096 bytes
+    int direct_multiplication_factor;
+    uint64_t direct_data_size;          // apparent, holes included
+    // bin size of the binned index, see parse_binning_policy
+    std::string bin_size;
+    uint64_t binned_index_size;         // estimated
+    // slot of the sparse external index that fits the densest position
+    uint64_t external_index_slot_size;
+};
+
+/**
+ * Reads the lines of `compressed_filename` once and recommends the sparse
+ * layout and the bin size that meet the targets of `advise_configuration`.
+ * Slots of the bucketed layout are at most max_scan_bytes. If that layout
+ * exceeds max_space_overhead, larger slots are searched for one that meets
+ * it, which is reported besides. Bins hold max_scan_bytes of lines unless
+ * the index would then exceed max_space_overhead, in which case bins are
+ * made larger to meet it.
+ */
+void advise_file(
+        const std::string& compressed_filename,
+        const AdviseConfiguration& advise_configuration,
+        struct vcfc_line_stats *stats,
+        struct advised_parameters *parameters);
+
+/**
+ * Writes the bucketed sparse layout and the bin size of `parameters` to
+ * `config_filename` as key=value lines. Returns 0 on success.
+ */
+int write_advised_parameters(const std::string& config_filename, const struct advised_parameters& parameters);
+
+/**
+ * Reads the parameters written by write_advised_parameters. Keys not in the
+ * file are left as they are, unknown keys are ignored. Returns 0 on success.
+ */
+int read_advised_parameters(const std::string& config_filename, struct advised_parameters *parameters);
+
+#endif
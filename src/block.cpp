@@ -0,0 +1,494 @@
+#include <stdexcept>
+#include <algorithm>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "block.hpp"
+#include "compress.hpp"
+
+const size_t block_table_entry_size = 8 + 4 + 4;
+
+static_assert(sizeof(struct vcfc_trailer) == VCFC_TRAILER_SIZE, "vcfc_trailer must be 64 bytes");
+static_assert(sizeof(struct block_table_entry) == 16, "block_table_entry must be 16 bytes");
+
+// Important, these assume little-endian integer layout
+static void write_uint32(std::ofstream& out, uint32_t val) {
+    out.write((const char*) &val, 4);
+}
+
+static void write_uint64(std::ofstream& out, uint64_t val) {
+    out.write((const char*) &val, 8);
+}
+
+static void read_exact(FILE *input_file, void *buf, size_t len, const char *what) {
+    if (len > 0 && fread(buf, 1, len, input_file) != len) {
+        throw VcfValidationError(string_format("Unexpected EOF reading %s", what).c_str());
+    }
+}
+
+// Length of the compressed line at the start of `line`, including its length header
+static size_t compressed_line_size(const byte_t *line) {
+    uint32_t line_length = ((line[0] & 0x3F) << 24) | (line[1] << 16) | (line[2] << 8) | line[3];
+    return 4 + line_length;
+}
+
+/**
+ * Parses the length headers of the compressed line at the start of `line`.
+ * Returns the offset of the required columns.
+ */
+static size_t parse_line_headers(const byte_t *line, struct compressed_line_length_headers *length_headers) {
+    size_t header_length = parse_compressed_line_length_headers(
+        line, compressed_line_size(line), length_headers);
+    if (header_length == 0) {
+        throw VcfValidationError("Malformed compressed line in block");
+    }
+    return header_length;
+}
+
+
+/**
+ * Reads reference name, POS and END from the required columns of a compressed line.
+ * END is taken from the line header when it was stored at compression time.
+ */
+static void summarize_compressed_line(
+        const byte_t *line,
+        std::string& reference_name,
+        uint32_t *position,
+        uint32_t *end_position) {
+    struct compressed_line_length_headers length_headers;
+    size_t header_length = parse_line_headers(line, &length_headers);
+    std::string required_columns((const char*) line + header_length, length_headers.required_columns_length);
+    std::vector<std::string> terms = split_string(required_columns, "\t", VCF_REQUIRED_COL_COUNT);
+    if (terms.size() < VCF_REQUIRED_COL_COUNT) {
+        throw VcfValidationError("Compressed line did not contain at least 8 terms");
+    }
+    long pos;
+    if (str_to_long(terms[1], &pos) != 0) {
+        throw VcfValidationError(("Failed to parse integer pos from " + terms[1]).c_str());
+    }
+    reference_name = terms[0];
+    *position = (uint32_t) pos;
+    if (length_headers.has_end_position) {
+        *end_position = (uint32_t) pos + length_headers.end_position_delta;
+    } else {
+        *end_position = (uint32_t) compute_end_position(pos, terms[0], terms[3], terms[4], terms[7]);
+    }
+}
+
+
+VcfBlockWriter::VcfBlockWriter(std::ofstream& out, const VcfBlockConfiguration& config)
+        : out(out), config(config) {
+    if (this->config.block_size == 0) {
+        this->config.block_size = VCFC_DEFAULT_BLOCK_SIZE;
+    }
+    this->block_buffer.reserve(this->config.block_size + 4096);
+    // dictionary only used by zstd
+    this->dictionary_ready = !config.zstd;
+    if (config.zstd) {
+        #ifdef VCFC_ZSTD
+        this->cctx = ZSTD_createCCtx();
+        #else
+        throw std::runtime_error("zstd blocks requested but vcfc was built without zstd, rebuild with `make ZSTD=1`");
+        #endif
+    }
+}
+
+VcfBlockWriter::~VcfBlockWriter() {
+    #ifdef VCFC_ZSTD
+    ZSTD_freeCDict(this->cdict);
+    ZSTD_freeCCtx(this->cctx);
+    #endif
+}
+
+void VcfBlockWriter::add_line(const std::vector<byte_t>& line) {
+    if (!this->dictionary_ready) {
+        // hold lines back until the dictionary they are compressed with is written
+        this->pending_lines.insert(this->pending_lines.end(), line.begin(), line.end());
+        struct compressed_line_length_headers length_headers;
+        size_t header_length = parse_line_headers(line.data(), &length_headers);
+        uint32_t required_length = length_headers.required_columns_length;
+        this->training_samples.insert(
+            this->training_samples.end(),
+            line.begin() + header_length, line.begin() + header_length + required_length);
+        this->training_sample_sizes.push_back(required_length);
+        if (this->training_samples.size() >= this->config.dictionary_training_size) {
+            train_dictionary();
+            write_lines_to_blocks(this->pending_lines);
+            std::vector<byte_t>().swap(this->pending_lines);
+        }
+        return;
+    }
+    append_line(line.data(), line.size());
+}
+
+void VcfBlockWriter::append_line(const byte_t *line, size_t line_size) {
+    std::string reference_name;
+    uint32_t position, end_position;
+    summarize_compressed_line(line, reference_name, &position, &end_position);
+    // a line on another contig must be on a later one of the dictionary
+    if (reference_name != this->block_reference_name) {
+        uint32_t reference_idx = this->ref_name_map.reference_to_int(reference_name);
+        if (reference_idx == 0 || reference_idx <= this->last_reference_idx) {
+            this->lines_sorted = false;
+        }
+        this->last_reference_idx = reference_idx;
+    } else if (position < this->block_last_position) {
+        this->lines_sorted = false;
+    }
+    // a block only holds lines of one contig
+    if (this->block_line_count > 0 && reference_name != this->block_reference_name) {
+        flush_block();
+    }
+    if (this->block_line_count == 0) {
+        this->block_reference_name = reference_name;
+        this->block_first_position = position;
+        this->block_max_end_position = 0;
+    }
+    this->block_last_position = position;
+    if (end_position > this->block_max_end_position) {
+        this->block_max_end_position = end_position;
+    }
+    this->block_buffer.insert(this->block_buffer.end(), line, line + line_size);
+    this->block_line_count++;
+    if (this->block_buffer.size() >= this->config.block_size) {
+        flush_block();
+    }
+}
+
+void VcfBlockWriter::write_lines_to_blocks(const std::vector<byte_t>& lines) {
+    size_t offset = 0;
+    while (offset < lines.size()) {
+        size_t line_size = compressed_line_size(lines.data() + offset);
+        append_line(lines.data() + offset, line_size);
+        offset += line_size;
+    }
+}
+
+void VcfBlockWriter::train_dictionary() {
+    this->dictionary_ready = true;
+    #ifdef VCFC_ZSTD
+    std::vector<byte_t> dictionary(this->config.dictionary_size);
+    size_t dictionary_length = 0;
+    // zdict refuses to train on very few samples, compress without a dictionary then
+    if (this->training_sample_sizes.size() >= 16) {
+        dictionary_length = ZDICT_trainFromBuffer(
+            dictionary.data(), dictionary.size(),
+            this->training_samples.data(),
+            this->training_sample_sizes.data(),
+            (unsigned) this->training_sample_sizes.size());
+        if (ZDICT_isError(dictionary_length)) {
+            debugf("%s dictionary training failed: %s\n", __FUNCTION__, ZDICT_getErrorName(dictionary_length));
+            dictionary_length = 0;
+        }
+    }
+    debugf("%s trained %lu byte dictionary from %lu samples\n",
+        __FUNCTION__, dictionary_length, this->training_sample_sizes.size());
+    if (dictionary_length > 0) {
+        this->out.put(VCFC_ITEM_DICTIONARY);
+        write_uint32(this->out, (uint32_t) dictionary_length);
+        this->out.write((const char*) dictionary.data(), dictionary_length);
+        this->cdict = ZSTD_createCDict(dictionary.data(), dictionary_length, this->config.zstd_level);
+    }
+    #endif
+    std::vector<byte_t>().swap(this->training_samples);
+    std::vector<size_t>().swap(this->training_sample_sizes);
+}
+
+void VcfBlockWriter::flush_block() {
+    if (this->block_line_count == 0) {
+        return;
+    }
+    struct block_table_entry entry;
+    entry.byte_offset = (uint64_t) this->out.tellp();
+    entry.line_count = this->block_line_count;
+    entry.raw_length = (uint32_t) this->block_buffer.size();
+
+    uint8_t flags = 0;
+    const byte_t *payload = this->block_buffer.data();
+    size_t payload_length = this->block_buffer.size();
+
+    #ifdef VCFC_ZSTD
+    if (this->config.zstd) {
+        this->stored_buffer.resize(ZSTD_compressBound(this->block_buffer.size()));
+        size_t stored_length;
+        if (this->cdict != NULL) {
+            stored_length = ZSTD_compress_usingCDict(
+                this->cctx,
+                this->stored_buffer.data(), this->stored_buffer.size(),
+                this->block_buffer.data(), this->block_buffer.size(),
+                this->cdict);
+        } else {
+            stored_length = ZSTD_compressCCtx(
+                this->cctx,
+                this->stored_buffer.data(), this->stored_buffer.size(),
+                this->block_buffer.data(), this->block_buffer.size(),
+                this->config.zstd_level);
+        }
+        if (ZSTD_isError(stored_length)) {
+            throw std::runtime_error(string_format(
+                "zstd failed to compress block: %s", ZSTD_getErrorName(stored_length)));
+        }
+        // keep incompressible blocks as they are
+        if (stored_length < this->block_buffer.size()) {
+            flags |= BLOCK_FLAG_ZSTD;
+            payload = this->stored_buffer.data();
+            payload_length = stored_length;
+        }
+    }
+    #endif
+
+    size_t reference_name_length = this->block_reference_name.size();
+    if (reference_name_length > 0xFFFF) {
+        throw VcfValidationError(string_format(
+            "Contig name of %lu bytes is too long for a block header", reference_name_length).c_str());
+    } else if (reference_name_length > 0xFF) {
+        flags |= BLOCK_FLAG_LONG_REFERENCE_NAME;
+    }
+
+    debugf("%s writing block at offset %lu, lines = %u, raw_length = %u, stored_length = %lu\n",
+        __FUNCTION__, entry.byte_offset, entry.line_count, entry.raw_length, payload_length);
+    this->out.put(VCFC_ITEM_BLOCK);
+    this->out.put((char) flags);
+    write_uint32(this->out, entry.line_count);
+    write_uint32(this->out, entry.raw_length);
+    write_uint32(this->out, (uint32_t) payload_length);
+    write_uint32(this->out, this->block_first_position);
+    write_uint32(this->out, this->block_last_position);
+    write_uint32(this->out, this->block_max_end_position);
+    if (flags & BLOCK_FLAG_LONG_REFERENCE_NAME) {
+        uint16_t long_reference_name_length = (uint16_t) reference_name_length;
+        this->out.write((const char*) &long_reference_name_length, 2);
+    } else {
+        this->out.put((char) reference_name_length);
+    }
+    this->out.write(this->block_reference_name.c_str(), reference_name_length);
+    this->out.write((const char*) payload, payload_length);
+
+    this->block_table.push_back(entry);
+    this->block_buffer.clear();
+    this->block_line_count = 0;
+}
+
+void VcfBlockWriter::finish() {
+    if (!this->dictionary_ready) {
+        train_dictionary();
+        write_lines_to_blocks(this->pending_lines);
+        std::vector<byte_t>().swap(this->pending_lines);
+    }
+    flush_block();
+
+    struct vcfc_trailer trailer;
+    memset(&trailer, 0, sizeof(trailer));
+    trailer.block_table_offset = (uint64_t) this->out.tellp();
+    trailer.block_count = this->block_table.size();
+    if (this->lines_sorted) {
+        trailer.flags |= VCFC_TRAILER_FLAG_SORTED;
+    }
+
+    this->out.put(VCFC_ITEM_BLOCK_TABLE);
+    write_uint64(this->out, this->block_table.size());
+    for (const struct block_table_entry& entry : this->block_table) {
+        write_uint64(this->out, entry.byte_offset);
+        write_uint32(this->out, entry.line_count);
+        write_uint32(this->out, entry.raw_length);
+    }
+    write_vcfc_trailer(this->out, trailer);
+    debugf("%s wrote %lu blocks, block table at offset %lu\n",
+        __FUNCTION__, this->block_table.size(), trailer.block_table_offset);
+}
+
+
+VcfBlockReader::VcfBlockReader(FILE *input_file): input_file(input_file) {
+    struct stat st;
+    if (fstat(fileno(input_file), &st) < 0) {
+        perror("fstat");
+        throw std::runtime_error("Failed to stat block container");
+    }
+    this->file_size = st.st_size;
+    #ifdef VCFC_ZSTD
+    this->dctx = ZSTD_createDCtx();
+    #endif
+}
+
+VcfBlockReader::~VcfBlockReader() {
+    #ifdef VCFC_ZSTD
+    ZSTD_freeDDict(this->ddict);
+    ZSTD_freeDCtx(this->dctx);
+    #endif
+}
+
+int VcfBlockReader::next_block_header(struct block_header *header) {
+    while (true) {
+        int c = fgetc(this->input_file);
+        if (c == VCFC_ITEM_DICTIONARY) {
+            uint32_t dictionary_length;
+            read_exact(this->input_file, &dictionary_length, 4, "dictionary length");
+            std::vector<byte_t> dictionary(dictionary_length);
+            read_exact(this->input_file, dictionary.data(), dictionary_length, "dictionary");
+            #ifdef VCFC_ZSTD
+            ZSTD_freeDDict(this->ddict);
+            this->ddict = ZSTD_createDDict(dictionary.data(), dictionary.size());
+            #else
+            throw std::runtime_error("File contains zstd blocks but vcfc was built without zstd, rebuild with `make ZSTD=1`");
+            #endif
+            continue;
+        } else if (c == VCFC_ITEM_BLOCK) {
+            read_exact(this->input_file, &header->flags, 1, "block header");
+            read_exact(this->input_file, &header->line_count, 4, "block header");
+            read_exact(this->input_file, &header->raw_length, 4, "block header");
+            read_exact(this->input_file, &header->stored_length, 4, "block header");
+            read_exact(this->input_file, &header->first_position, 4, "block header");
+            read_exact(this->input_file, &header->last_position, 4, "block header");
+            read_exact(this->input_file, &header->max_end_position, 4, "block header");
+            uint16_t reference_name_length = 0;
+            read_exact(this->input_file, &reference_name_length,
+                (header->flags & BLOCK_FLAG_LONG_REFERENCE_NAME) ? 2 : 1, "block header");
+            header->reference_name.resize(reference_name_length);
+            read_exact(this->input_file, &header->reference_name[0], reference_name_length, "block header");
+            // the lengths size the buffers of the payload, don't trust them past the file
+            uint64_t remaining_length = this->file_size - (uint64_t) ftell(this->input_file);
+            if (header->stored_length > remaining_length) {
+                throw VcfValidationError(string_format(
+                    "Block of %u bytes is longer than the %lu bytes left in the file",
+                    header->stored_length, remaining_length).c_str());
+            }
+            if ((header->flags & BLOCK_FLAG_ZSTD) == 0 && header->stored_length != header->raw_length) {
+                throw VcfValidationError(string_format(
+                    "Uncompressed block has a stored length of %u bytes and a raw length of %u bytes",
+                    header->stored_length, header->raw_length).c_str());
+            }
+            debugf("%s block %s:%u-%u (max end %u), lines = %u, raw_length = %u, stored_length = %u\n",
+                __FUNCTION__, header->reference_name.c_str(),
+                header->first_position, header->last_position, header->max_end_position,
+                header->line_count, header->raw_length, header->stored_length);
+            return 1;
+        }
+        // block table, trailer or EOF
+        if (c != EOF) {
+            ungetc(c, this->input_file);
+        }
+        return 0;
+    }
+}
+
+void VcfBlockReader::read_block_payload(const struct block_header& header, std::vector<byte_t>& raw) {
+    if ((header.flags & BLOCK_FLAG_ZSTD) == 0) {
+        // next_block_header checked that raw_length is stored_length
+        raw.resize(header.raw_length);
+        read_exact(this->input_file, raw.data(), header.stored_length, "block");
+        return;
+    }
+    this->stored_buffer.resize(header.stored_length);
+    read_exact(this->input_file, this->stored_buffer.data(), header.stored_length, "block");
+    #ifdef VCFC_ZSTD
+    // a zstd block inflates past the file size, check the raw length against
+    // the content size of its frame before allocating it
+    unsigned long long content_size = ZSTD_getFrameContentSize(
+        this->stored_buffer.data(), this->stored_buffer.size());
+    if (content_size != header.raw_length) {
+        throw VcfValidationError(string_format(
+            "zstd block has a raw length of %u bytes in its header and a content size of %llu bytes",
+            header.raw_length, content_size).c_str());
+    }
+    raw.resize(header.raw_length);
+    size_t raw_length;
+    if (this->ddict != NULL) {
+        raw_length = ZSTD_decompress_usingDDict(
+            this->dctx,
+            raw.data(), raw.size(),
+            this->stored_buffer.data(), this->stored_buffer.size(),
+            this->ddict);
+    } else {
+        raw_length = ZSTD_decompressDCtx(
+            this->dctx,
+            raw.data(), raw.size(),
+            this->stored_buffer.data(), this->stored_buffer.size());
+    }
+    if (ZSTD_isError(raw_length) || raw_length != header.raw_length) {
+        throw VcfValidationError("Failed to inflate zstd block");
+    }
+    #else
+    throw std::runtime_error("File contains zstd blocks but vcfc was built without zstd, rebuild with `make ZSTD=1`");
+    #endif
+}
+
+void VcfBlockReader::skip_block_payload(const struct block_header& header) {
+    fseek(this->input_file, header.stored_length, SEEK_CUR);
+}
+
+void VcfBlockReader::seek_block(uint64_t byte_offset) {
+    if (byte_offset >= this->file_size) {
+        throw VcfValidationError(string_format(
+            "Block table entry at offset %lu is past the end of the file", byte_offset).c_str());
+    }
+    if (fseek(this->input_file, byte_offset, SEEK_SET) != 0) {
+        perror("fseek");
+        throw std::runtime_error("Failed to seek to block");
+    }
+}
+
+int VcfBlockReader::next_block(struct block_header *header, std::vector<byte_t>& raw) {
+    if (next_block_header(header) == 0) {
+        return 0;
+    }
+    read_block_payload(*header, raw);
+    return 1;
+}
+
+
+bool is_block_container(FILE *input_file) {
+    int c = peek(input_file);
+    return c == VCFC_ITEM_DICTIONARY
+        || c == VCFC_ITEM_BLOCK
+        || c == VCFC_ITEM_BLOCK_TABLE;
+}
+
+FILE *open_block_lines(std::vector<byte_t>& raw) {
+    FILE *lines_file = fmemopen(raw.data(), raw.size(), "r");
+    if (lines_file == NULL) {
+        perror("fmemopen");
+        throw std::runtime_error("Failed to open block for reading");
+    }
+    return lines_file;
+}
+
+void write_vcfc_trailer(std::ofstream& out, struct vcfc_trailer& trailer) {
+    memcpy(trailer.magic, VCFC_TRAILER_MAGIC, sizeof(trailer.magic));
+    out.write((const char*) &trailer, sizeof(trailer));
+}
+
+int read_vcfc_trailer(int fd, struct vcfc_trailer *trailer) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("fstat");
+        return -1;
+    }
+    if (st.st_size < VCFC_TRAILER_SIZE) {
+        return -1;
+    }
+    ssize_t n = pread(fd, trailer, VCFC_TRAILER_SIZE, st.st_size - VCFC_TRAILER_SIZE);
+    if (n != VCFC_TRAILER_SIZE) {
+        return -1;
+    }
+    if (memcmp(trailer->magic, VCFC_TRAILER_MAGIC, sizeof(trailer->magic)) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int read_block_table(int fd, const struct vcfc_trailer& trailer, std::vector<block_table_entry>& table) {
+    size_t table_length = 1 + 8 + trailer.block_count * block_table_entry_size;
+    std::vector<byte_t> buf(table_length);
+    ssize_t n = pread(fd, buf.data(), table_length, trailer.block_table_offset);
+    if (n < 0 || (size_t) n != table_length) {
+        perror("pread");
+        return -1;
+    }
+    if (buf[0] != VCFC_ITEM_BLOCK_TABLE) {
+        return -1;
+    }
+    table.resize(trailer.block_count);
+    memcpy(table.data(), buf.data() + 1 + 8, trailer.block_count * block_table_entry_size);
+    return 0;
+}
@@ -0,0 +1,230 @@
+#pragma once
+#ifndef _BLOCK_H
+#define _BLOCK_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "utils.hpp"
+
+#ifdef VCFC_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+////////////////////////////////////////////////////////////////
+// Block container
+//
+// In a block container file the data section after the header line is a
+// sequence of items instead of a flat sequence of lines. Every compressed
+// line starts with a length header whose 2 high bits are set (extension
+// count 3), so an item starting with a byte below 0xC0 is not a line:
+//
+//   'D' uint32 length, zstd dictionary bytes
+//   'B' block header, then `stored_length` payload bytes. The payload is
+//       a run of compressed lines, zstd compressed if BLOCK_FLAG_ZSTD.
+//       The header summarizes the lines: all lines of a block are on one
+//       contig, and the first and last POS and the max END of the lines
+//       are recorded so readers can skip blocks without inflating them.
+//   'T' uint64 block count, then one block_table_entry per block
+//   'I' uint64 entry count, then the entries of a binned index, in the
+//       same packed layout as a .vcfci file (see index.hpp)
+//
+// The file ends with a fixed size vcfc_trailer pointing to the block table
+// and the embedded index. A file of plain lines can also carry an embedded
+// index and trailer, readers of lines stop at the first non-line item.
+// If the lines are sorted by contig id and POS the trailer is flagged with
+// VCFC_TRAILER_FLAG_SORTED, and queries binary search the block table.
+// All integers are stored little-endian.
+////////////////////////////////////////////////////////////////
+
+#define VCFC_ITEM_DICTIONARY        'D'
+#define VCFC_ITEM_BLOCK             'B'
+#define VCFC_ITEM_BLOCK_TABLE       'T'
+#define VCFC_ITEM_BINNED_INDEX      'I'
+
+#define BLOCK_FLAG_ZSTD             0x01
+// The reference name length is a uint16 instead of one byte
+#define BLOCK_FLAG_LONG_REFERENCE_NAME 0x02
+
+#define VCFC_DEFAULT_BLOCK_SIZE     (64 * 1024)
+#define VCFC_TRAILER_MAGIC          "VCFCTRLR"
+#define VCFC_TRAILER_SIZE           64
+// All lines are on contigs of the dictionary and sorted by contig id and POS
+#define VCFC_TRAILER_FLAG_SORTED    0x01
+
+// True if `b` can be the first byte of a compressed line
+inline bool is_line_start_byte(int b) {
+    return b != EOF && (b & 0xC0) == 0xC0;
+}
+
+struct block_header {
+    uint8_t flags;
+    uint32_t line_count;
+    uint32_t raw_length;        // length of the compressed lines in the block
+    uint32_t stored_length;     // length of the payload in the file
+    uint32_t first_position;
+    uint32_t last_position;
+    uint32_t max_end_position;
+    std::string reference_name; // stored as a 1 byte length, 2 with BLOCK_FLAG_LONG_REFERENCE_NAME, then the name
+};
+
+struct block_table_entry {
+    uint64_t byte_offset;       // offset of the block item type byte
+    uint32_t line_count;
+    uint32_t raw_length;
+};
+extern const size_t block_table_entry_size;
+
+struct vcfc_trailer {
+    uint64_t block_table_offset;        // 0 if the file has no blocks
+    uint64_t block_count;
+    uint64_t binned_index_offset;       // 0 if no index is embedded
+    uint64_t binned_index_entry_count;
+    uint64_t flags;                     // VCFC_TRAILER_FLAG_*
+    uint64_t reserved[2];
+    char magic[8];
+};
+
+class VcfBlockConfiguration {
+public:
+    VcfBlockConfiguration(){};
+
+    size_t block_size = VCFC_DEFAULT_BLOCK_SIZE; // target uncompressed bytes per block
+    bool zstd = false;
+    int zstd_level = 3;
+    size_t dictionary_size = 112640;    // zstd's default dictionary size, 110 KiB
+    // bytes of required columns to collect before training the dictionary
+    size_t dictionary_training_size = 100 * 112640;
+};
+
+/**
+ * Groups compressed lines into blocks and writes the block items, block table
+ * and trailer to `out`. When zstd is enabled, lines are held back until enough
+ * required column bytes were seen to train a dictionary, which is written
+ * ahead of the first block.
+ */
+class VcfBlockWriter {
+public:
+    VcfBlockWriter(std::ofstream& out, const VcfBlockConfiguration& config);
+    ~VcfBlockWriter();
+
+    // `line` is one line as produced by compress_data_line
+    void add_line(const std::vector<byte_t>& line);
+    // Flushes remaining lines and writes the block table and trailer
+    void finish();
+
+    // Contig dictionary of the file, which orders the lines of a sorted file
+    void set_reference_names(const reference_name_map& ref_name_map) {
+        this->ref_name_map = ref_name_map;
+    }
+
+private:
+    void train_dictionary();
+    void flush_block();
+    void write_lines_to_blocks(const std::vector<byte_t>& lines);
+    void append_line(const byte_t *line, size_t line_size);
+
+    std::ofstream& out;
+    VcfBlockConfiguration config;
+
+    std::vector<byte_t> block_buffer;
+    uint32_t block_line_count = 0;
+    std::string block_reference_name;
+    uint32_t block_first_position = 0;
+    uint32_t block_last_position = 0;
+    uint32_t block_max_end_position = 0;
+    std::vector<block_table_entry> block_table;
+
+    reference_name_map ref_name_map;
+    bool lines_sorted = true;
+    uint32_t last_reference_idx = 0;
+
+    bool dictionary_ready = false;
+    std::vector<byte_t> pending_lines;
+    std::vector<byte_t> training_samples;
+    std::vector<size_t> training_sample_sizes;
+
+    std::vector<byte_t> stored_buffer;
+    #ifdef VCFC_ZSTD
+    ZSTD_CCtx *cctx = NULL;
+    ZSTD_CDict *cdict = NULL;
+    #endif
+};
+
+/**
+ * Iterates the blocks of a block container. `input_file` must be positioned at
+ * the start of the data section.
+ */
+class VcfBlockReader {
+public:
+    VcfBlockReader(FILE *input_file);
+    ~VcfBlockReader();
+
+    /**
+     * Reads the next block into `raw`, inflating it if needed. Returns 1 if a
+     * block was read, 0 at the end of the data section.
+     */
+    int next_block(struct block_header *header, std::vector<byte_t>& raw);
+
+    /**
+     * Reads the next block header and leaves the stream at the payload.
+     * Returns 1 if a header was read, 0 at the end of the data section.
+     */
+    int next_block_header(struct block_header *header);
+
+    // Reads the payload of the block whose header was just read
+    void read_block_payload(const struct block_header& header, std::vector<byte_t>& raw);
+
+    // Seeks past the payload of the block whose header was just read
+    void skip_block_payload(const struct block_header& header);
+
+    /**
+     * Seeks to the block at `byte_offset`, from the block table. The
+     * dictionary must have been read, by reading the first block header.
+     */
+    void seek_block(uint64_t byte_offset);
+
+private:
+    FILE *input_file;
+    uint64_t file_size;
+    std::vector<byte_t> stored_buffer;
+    #ifdef VCFC_ZSTD
+    ZSTD_DCtx *dctx = NULL;
+    ZSTD_DDict *ddict = NULL;
+    #endif
+};
+
+/**
+ * Returns true if the data section at the current offset of `input_file`
+ * starts with block container items. Does not move the stream.
+ */
+bool is_block_container(FILE *input_file);
+
+/**
+ * Opens a read-only stream over the compressed lines of an inflated block, to
+ * be passed to decompress2_data_line. Must be closed by the caller.
+ */
+FILE *open_block_lines(std::vector<byte_t>& raw);
+
+/**
+ * Writes `trailer` with its magic set. Must be the last write to the file.
+ */
+void write_vcfc_trailer(std::ofstream& out, struct vcfc_trailer& trailer);
+
+/**
+ * Reads the trailer at the end of `fd` with a single pread. Returns 0 on
+ * success, negative if the file has no trailer.
+ */
+int read_vcfc_trailer(int fd, struct vcfc_trailer *trailer);
+
+/**
+ * Loads the block table pointed to by `trailer`. Returns 0 on success.
+ */
+int read_block_table(int fd, const struct vcfc_trailer& trailer, std::vector<block_table_entry>& table);
+
+#endif
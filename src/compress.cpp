@@ -1,8 +1,20 @@
 #include <unordered_map>
 #include <array>
+#include <memory>
 #include "compress.hpp"
+#include "sparse.hpp"
 
 int compress_data_line(const std::string& line, const VcfCompressionSchema& schema, std::vector<byte_t>& byte_vec, bool add_newline) {
+    VcfCompressionConfiguration config;
+    return compress_data_line(line, schema, config, byte_vec, add_newline);
+}
+
+int compress_data_line(
+        const std::string& line,
+        const VcfCompressionSchema& schema,
+        const VcfCompressionConfiguration& config,
+        std::vector<byte_t>& byte_vec,
+        bool add_newline) {
     // Potentially use SplitIterator, might have better performance.
     std::vector<std::string> terms = split_string(line, "\t");
     const size_t terms_size = terms.size();
@@ -48,6 +60,25 @@ int compress_data_line(const std::string& line, const VcfCompressionSchema& sche
     byte_vec.push_back(required_col_length_header_bytes[2]);
     byte_vec.push_back(required_col_length_header_bytes[3]);
 
+    // END - POS as a varint after the length headers, see REQUIRED_COLUMNS_FLAG_END
+    bool store_end_position = false;
+    long pos_value;
+    if (config.store_end_position && str_to_long(position, &pos_value) == 0) {
+        long end_position = pos_value - 1;
+        try {
+            end_position = compute_end_position(pos_value, ref_name, ref_bases, alt_bases, info);
+        } catch (std::runtime_error& e) {
+            // malformed END or SVLEN, leave it to readers of INFO
+            debugf("Not storing END position: %s\n", e.what());
+        }
+        if (end_position >= pos_value && end_position - pos_value <= UINT32_MAX) {
+            uint8_t varint_bytes[VARINT_MAX_LENGTH_32];
+            size_t varint_length = uint32_to_varint((uint32_t) (end_position - pos_value), varint_bytes);
+            byte_vec.insert(byte_vec.end(), varint_bytes, varint_bytes + varint_length);
+            store_end_position = true;
+        }
+    }
+
     push_string_to_byte_vector(byte_vec, ref_name);
     byte_vec.push_back('\t');
     push_string_to_byte_vector(byte_vec, position);
@@ -98,6 +129,12 @@ int compress_data_line(const std::string& line, const VcfCompressionSchema& sche
     byte_vec[5] = (required_length32 >> 16) & 0xFF;
     byte_vec[6] = (required_length32 >> 8) & 0xFF;
     byte_vec[7] = (required_length32 >> 0) & 0xFF;
+    if (store_end_position) {
+        if (required_length32 > REQUIRED_COLUMNS_FLAG_END_MAX_LENGTH) {
+            throw VcfValidationError("Required columns too long to store END position");
+        }
+        byte_vec[4] |= REQUIRED_COLUMNS_FLAG_END;
+    }
     debugf("Required length header bytes: 0x%02X 0x%02X 0x%02X 0x%02X\n", byte_vec[4], byte_vec[5], byte_vec[6], byte_vec[7]);
 
     std::vector<std::string> samples; // copy of sample data
@@ -120,6 +157,8 @@ int compress_data_line(const std::string& line, const VcfCompressionSchema& sche
     debugf("\n");
     #endif
 
+    // offset of the first sample byte, used by the entropy coding stage
+    const size_t sample_start = byte_vec.size();
 
     for (size_t i = 0; i < samples.size(); i++) {
         const std::string& sample_val = samples.at(i);
@@ -185,6 +224,23 @@ int compress_data_line(const std::string& line, const VcfCompressionSchema& sche
         }
     }
 
+    if (config.entropy_code_samples && samples.size() > 0) {
+        size_t raw_length = byte_vec.size() - sample_start;
+        std::vector<byte_t> encoded;
+        encoded.reserve(raw_length);
+        entropy_encode_samples(byte_vec.data() + sample_start, raw_length, encoded);
+        // 1 flag byte plus 4 bytes of decoded length, only use if smaller than the raw runs
+        if (encoded.size() + 5 < raw_length) {
+            debugf("Entropy coded %lu sample bytes to %lu\n", raw_length, encoded.size());
+            uint8_t raw_length_bytes[4];
+            uint32_to_uint8_array((uint32_t) raw_length, raw_length_bytes);
+            byte_vec.resize(sample_start);
+            byte_vec.push_back(SAMPLE_MASKED_ENTROPY);
+            byte_vec.insert(byte_vec.end(), raw_length_bytes, raw_length_bytes + 4);
+            byte_vec.insert(byte_vec.end(), encoded.begin(), encoded.end());
+        }
+    }
+
     if (add_newline) {
         byte_vec.push_back('\n');
     }
@@ -203,6 +259,14 @@ int compress_data_line(const std::string& line, const VcfCompressionSchema& sche
 }
 
 int compress(const std::string& input_filename, const std::string& output_filename) {
+    VcfCompressionConfiguration config;
+    return compress(input_filename, output_filename, config);
+}
+
+int compress(
+        const std::string& input_filename,
+        const std::string& output_filename,
+        const VcfCompressionConfiguration& config) {
     std::ifstream input_fstream(input_filename);
     //size_t readbuf_size = 10 * 1024 * 1024; // 1 MiB
     //char *local_readbuf = new char[readbuf_size];
@@ -211,9 +275,42 @@ int compress(const std::string& input_filename, const std::string& output_filena
     //VcfLineStateMachine lineStateMachine;
     std::string linebuf;
     VcfCompressionSchema schema;
+    std::vector<std::string> meta_lines;    // for the contig dictionary
     size_t variant_count = 0;
     std::vector<byte_t> compressed_line;
     compressed_line.reserve(4096);
+    // freed when compress returns or throws, an unfinished block writer
+    // writes nothing more
+    std::unique_ptr<VcfBlockWriter> block_writer;
+    std::unique_ptr<BinnedIndexBuilder> embedded_index_builder;
+    std::unique_ptr<BinnedIndexBuilder> index_builder;
+    std::unique_ptr<SparseIndexBuilder> sparse_index_builder;
+    int sparse_index_fd = -1;
+    if (config.blocks && (config.embedded_index_binning.enabled() || config.index_binning.enabled() || config.sparse_index)) {
+        // index entries point at lines, block headers already summarize their lines, see block.hpp
+        throw std::runtime_error("Indexes are not supported with blocks");
+    }
+    if ((config.eytzinger_index || config.elias_fano_index || config.two_level_index) && !config.index_binning.enabled()) {
+        throw std::runtime_error("The eytzinger, elias-fano and two-level index layouts require a binned index bin size");
+    }
+    if (config.embedded_index_binning.enabled()) {
+        embedded_index_builder.reset(new BinnedIndexBuilder(
+            config.embedded_index_binning));
+    }
+    if (config.index_binning.enabled()) {
+        index_builder.reset(new BinnedIndexBuilder(
+            config.index_binning));
+    }
+    if (config.sparse_index) {
+        std::string sparse_index_filename = output_filename + VCFC_SPARSE_INDEX_EXTENSION;
+        sparse_index_fd = open(sparse_index_filename.c_str(), DEFAULT_FILE_CREATE_FLAGS, DEFAULT_FILE_CREATE_MODE);
+        if (sparse_index_fd < 0) {
+            perror("open");
+            throw std::runtime_error("Failed to open output file: " + sparse_index_filename);
+        }
+        sparse_index_builder.reset(new SparseIndexBuilder(sparse_index_fd, sparse_external_index_configuration()));
+    }
+    const bool indexing = embedded_index_builder || index_builder || sparse_index_builder;
 
     while (std::getline(input_fstream, linebuf)) {
         if (linebuf.size() == 0) {
@@ -224,6 +321,7 @@ int compress(const std::string& input_filename, const std::string& output_filena
             // compress vcf header
             // TODO
             output_fstream << linebuf << "\n";
+            meta_lines.push_back(linebuf);
         } else if (linebuf[0] == '#' /*linebuf.substr(0, 1) == "#"*/) {
             //lineStateMachine.to_header();
             // get the number of samples from the header
@@ -234,6 +332,17 @@ int compress(const std::string& input_filename, const std::string& output_filena
             }
             schema.sample_count = line_terms.size() - VCF_REQUIRED_COL_COUNT - 1;
             debugf("sample count: %ld\n", schema.sample_count);
+            // same dictionary as decompress2_metadata_headers builds from the output
+            schema.reference_names = reference_name_map(meta_lines);
+            if (embedded_index_builder) {
+                embedded_index_builder->set_reference_names(schema.reference_names);
+            }
+            if (index_builder) {
+                index_builder->set_reference_names(schema.reference_names);
+            }
+            if (sparse_index_builder) {
+                sparse_index_builder->set_reference_names(schema.reference_names);
+            }
             // insert header in raw format
             output_fstream << linebuf << "\n";
         } else {
@@ -241,16 +350,123 @@ int compress(const std::string& input_filename, const std::string& output_filena
             variant_count++;
             //lineStateMachine.to_variant();
             compressed_line.clear();
-            /*int status = */compress_data_line(linebuf, schema, compressed_line, true);
+            /*int status = */compress_data_line(linebuf, schema, config, compressed_line, true);
             if (compressed_line.back() != '\n') {
                 throw std::runtime_error("No newline at end of compressed line!");
             }
+            if (config.blocks) {
+                if (!block_writer) {
+                    block_writer.reset(new VcfBlockWriter(output_fstream, config.block_configuration));
+                    block_writer->set_reference_names(schema.reference_names);
+                }
+                block_writer->add_line(compressed_line);
+                continue;
+            }
+            if (indexing) {
+                // only the required columns are needed, don't split the samples
+                std::vector<std::string> terms = split_string(linebuf, "\t", VCF_REQUIRED_COL_COUNT);
+                // the indexes order lines by contig id, which only contigs of the dictionary have
+                if (schema.reference_names.reference_to_int(terms[0]) == 0) {
+                    throw VcfValidationError(string_format(
+                        "Contig %s of line %lu is not in the ##contig lines, or in the default contigs 1-22, X, Y and M of a file without them",
+                        terms[0].c_str(), variant_count).c_str());
+                }
+                long pos;
+                if (str_to_long(terms[1], &pos) != 0) {
+                    throw VcfValidationError(("Failed to parse integer pos from " + terms[1]).c_str());
+                }
+                struct compressed_line_length_headers length_headers;
+                parse_compressed_line_length_headers(compressed_line.data(), compressed_line.size(), &length_headers);
+                long end_position = length_headers.has_end_position
+                    ? pos + length_headers.end_position_delta
+                    : compute_end_position(pos, terms[0], terms[3], terms[4], terms[7]);
+                uint64_t line_byte_offset = output_fstream.tellp();
+                if (embedded_index_builder) {
+                    embedded_index_builder->add_line(terms[0], end_position, line_byte_offset);
+                }
+                if (index_builder) {
+                    index_builder->add_line(terms[0], end_position, line_byte_offset);
+                }
+                if (sparse_index_builder) {
+                    sparse_index_builder->add_line(terms[0], pos, line_byte_offset);
+                }
+            }
             for (std::vector<byte_t>::iterator iter = compressed_line.begin(); iter != compressed_line.end(); iter++) {
                 output_fstream.write((const char*)(&(*iter)), 1);
             }
             //output_fstream.write("\n", 1);
         }
     }
+    // layouts of the binned index, stamped once the output is complete
+    std::vector<std::string> layout_filenames;
+    if (index_builder) {
+        std::string index_filename = output_filename + VCFC_BINNING_INDEX_EXTENSION;
+        FILE *index_file = fopen(index_filename.c_str(), "w");
+        if (index_file == NULL) {
+            perror("fopen");
+            throw std::runtime_error("Failed to open output file: " + index_filename);
+        }
+        std::vector<struct index_entry> entries = index_builder->get_entries();
+        for (size_t i = 0; i < entries.size(); i++) {
+            write_index_entry(index_file, &entries[i]);
+        }
+        fclose(index_file);
+        if (config.eytzinger_index) {
+            std::string eytzinger_filename = output_filename + VCFC_EYTZINGER_INDEX_EXTENSION;
+            if (write_eytzinger_index(eytzinger_filename, entries) != 0) {
+                throw std::runtime_error("Failed to write index: " + eytzinger_filename);
+            }
+            layout_filenames.push_back(eytzinger_filename);
+        }
+        if (config.elias_fano_index) {
+            std::string elias_fano_filename = output_filename + VCFC_ELIAS_FANO_INDEX_EXTENSION;
+            if (write_elias_fano_index(elias_fano_filename, entries) != 0) {
+                throw std::runtime_error("Failed to write index: " + elias_fano_filename);
+            }
+            layout_filenames.push_back(elias_fano_filename);
+        }
+        if (config.two_level_index) {
+            std::string two_level_filename = output_filename + VCFC_TWO_LEVEL_INDEX_EXTENSION;
+            if (write_two_level_index(two_level_filename, entries) != 0) {
+                throw std::runtime_error("Failed to write index: " + two_level_filename);
+            }
+            layout_filenames.push_back(two_level_filename);
+        }
+    }
+    if (sparse_index_builder) {
+        close(sparse_index_fd);
+    }
+    if (embedded_index_builder) {
+        struct vcfc_trailer trailer;
+        memset(&trailer, 0, sizeof(trailer));
+        const std::vector<struct index_entry>& entries = embedded_index_builder->get_entries();
+        trailer.binned_index_offset = output_fstream.tellp();
+        trailer.binned_index_entry_count = entries.size();
+        output_fstream.put(VCFC_ITEM_BINNED_INDEX);
+        uint64_t entry_count = entries.size();
+        output_fstream.write((const char*) &entry_count, sizeof(entry_count));
+        // same packed layout as write_index_entry
+        for (const struct index_entry& entry : entries) {
+            output_fstream.write((const char*) &entry.reference_name_idx, sizeof(entry.reference_name_idx));
+            output_fstream.write((const char*) &entry.position, sizeof(entry.position));
+            output_fstream.write((const char*) &entry.byte_offset, sizeof(entry.byte_offset));
+        }
+        write_vcfc_trailer(output_fstream, trailer);
+        debugf("Embedded %lu index entries at offset %lu\n", entries.size(), trailer.binned_index_offset);
+    }
+    if (config.blocks) {
+        if (!block_writer) {
+            // no data lines, still write the empty block table and trailer
+            block_writer.reset(new VcfBlockWriter(output_fstream, config.block_configuration));
+        }
+        block_writer->finish();
+    }
+    output_fstream.close();
+    for (const std::string& layout_filename : layout_filenames) {
+        if (stamp_index_data(layout_filename, output_filename) != 0) {
+            throw std::runtime_error("Failed to stamp index: " + layout_filename);
+        }
+    }
     debugf("variant count: %ld\n", variant_count);
     //delete local_readbuf;
     return 0;
@@ -258,12 +474,71 @@ int compress(const std::string& input_filename, const std::string& output_filena
 
 
 
+/**
+ * Clears the END flag from the first byte of the required columns length header
+ * so it can be deserialized, recording it in `length_headers`.
+ */
+static void decode_required_columns_flags(
+        uint8_t required_columns_length_header_bytes[4],
+        struct compressed_line_length_headers *length_headers) {
+    length_headers->has_end_position =
+        (required_columns_length_header_bytes[0] & REQUIRED_COLUMNS_FLAG_END) != 0;
+    length_headers->end_position_delta = 0;
+    length_headers->end_position_length = 0;
+    required_columns_length_header_bytes[0] &= ~REQUIRED_COLUMNS_FLAG_END;
+}
+
+size_t parse_compressed_line_length_headers(
+        const byte_t *line,
+        size_t len,
+        struct compressed_line_length_headers *length_headers) {
+    if (len < compressed_line_length_headers_size || !is_line_start_byte(line[0])) {
+        return 0;
+    }
+    uint8_t header_bytes[8];
+    memcpy(header_bytes, line, 8);
+    decode_required_columns_flags(header_bytes + 4, length_headers);
+    LineLengthHeader line_length_header;
+    line_length_header.deserialize(header_bytes);
+    length_headers->line_length = line_length_header.length;
+    line_length_header.deserialize(header_bytes + 4);
+    length_headers->required_columns_length = line_length_header.length;
+    size_t header_length = compressed_line_length_headers_size;
+    if (length_headers->has_end_position) {
+        size_t varint_length = varint_to_uint32(
+            line + header_length, len - header_length, &length_headers->end_position_delta);
+        if (varint_length == 0) {
+            throw VcfValidationError("Malformed END position in line header");
+        }
+        length_headers->end_position_length = varint_length;
+        header_length += varint_length;
+    }
+    return header_length;
+}
+
+size_t serialize_compressed_line_length_headers(
+        const struct compressed_line_length_headers& length_headers,
+        uint8_t out[8 + VARINT_MAX_LENGTH_32]) {
+    LineLengthHeader length_header_serializer;
+    length_header_serializer.set_extension_count(3);
+    length_header_serializer.set_length(length_headers.line_length);
+    length_header_serializer.serialize(out);
+    length_header_serializer.set_length(length_headers.required_columns_length);
+    length_header_serializer.serialize(out + 4);
+    size_t header_length = compressed_line_length_headers_size;
+    if (length_headers.has_end_position) {
+        out[4] |= REQUIRED_COLUMNS_FLAG_END;
+        header_length += uint32_to_varint(length_headers.end_position_delta, out + header_length);
+    }
+    return header_length;
+}
+
 /**
  * Read the line length headers from the start of a compressed data line, store in `length_headers`.
  *
  * On success returns a positive integer indicating the number of bytes read.
  *
- * If EOF, returns 0.
+ * If EOF, or the next item is not a line (see block.hpp), returns 0.
  *
  * If negative, is the error return status from read(2).
  */
@@ -294,6 +569,11 @@ int read_compressed_line_length_headers(FILE *input_file, struct compressed_line
             return status;
         }
     }
+    if (!is_line_start_byte(line_length_header_bytes[0])) {
+        // a block container item, the end of the line data
+        fseek(input_file, -8, SEEK_CUR);
+        return 0;
+    }
 
     uint8_t *required_columns_length_header_bytes = line_length_header_bytes + 4;
 
@@ -317,9 +597,25 @@ int read_compressed_line_length_headers(FILE *input_file, struct compressed_line
     line_length_header.deserialize(line_length_header_bytes);
     length_headers->line_length = line_length_header.length;
 
+    decode_required_columns_flags(required_columns_length_header_bytes, length_headers);
     line_length_header.deserialize(required_columns_length_header_bytes);
     length_headers->required_columns_length = line_length_header.length;
 
+    if (length_headers->has_end_position) {
+        uint8_t varint_bytes[VARINT_MAX_LENGTH_32];
+        size_t varint_length = 0;
+        do {
+            int c = fgetc(input_file);
+            if (c == EOF || varint_length == VARINT_MAX_LENGTH_32) {
+                throw VcfValidationError("Malformed END position in line header");
+            }
+            varint_bytes[varint_length++] = (uint8_t) c;
+        } while (varint_bytes[varint_length - 1] & 0x80);
+        varint_to_uint32(varint_bytes, varint_length, &length_headers->end_position_delta);
+        length_headers->end_position_length = varint_length;
+        read_bytes += varint_length;
+    }
+
     #ifdef TIMING
     end = std::chrono::steady_clock::now();
     duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
@@ -335,7 +631,7 @@ int read_compressed_line_length_headers(FILE *input_file, struct compressed_line
  *
  * On success returns a positive integer indicating the number of bytes read.
  *
- * If EOF, returns 0.
+ * If EOF, or the next item is not a line (see block.hpp), returns 0.
  *
  * If negative, is the error return status from read(2).
  */
@@ -365,6 +661,11 @@ int read_compressed_line_length_headers_fd(int input_fd, struct compressed_line_
             return status;
         }
     }
+    if (!is_line_start_byte(line_length_header_bytes[0])) {
+        // a block container item, the end of the line data
+        lseek(input_fd, -8, SEEK_CUR);
+        return 0;
+    }
 
     uint8_t *required_columns_length_header_bytes = line_length_header_bytes + 4;
 
@@ -388,9 +689,25 @@ int read_compressed_line_length_headers_fd(int input_fd, struct compressed_line_
     line_length_header.deserialize(line_length_header_bytes);
     length_headers->line_length = line_length_header.length;
 
+    decode_required_columns_flags(required_columns_length_header_bytes, length_headers);
     line_length_header.deserialize(required_columns_length_header_bytes);
     length_headers->required_columns_length = line_length_header.length;
 
+    if (length_headers->has_end_position) {
+        uint8_t varint_bytes[VARINT_MAX_LENGTH_32];
+        size_t varint_length = 0;
+        do {
+            if (varint_length == VARINT_MAX_LENGTH_32
+                    || read(input_fd, &varint_bytes[varint_length], 1) != 1) {
+                throw VcfValidationError("Malformed END position in line header");
+            }
+            varint_length++;
+        } while (varint_bytes[varint_length - 1] & 0x80);
+        varint_to_uint32(varint_bytes, varint_length, &length_headers->end_position_delta);
+        length_headers->end_position_length = varint_length;
+        read_bytes += varint_length;
+    }
+
     #ifdef TIMING
     end = std::chrono::steady_clock::now();
     duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
@@ -771,11 +1088,13 @@ int decompress2_data_line(
     if (status == 0 && feof(input_file)) {
         debugf("%s, no data in input_fd\n", __FUNCTION__);
         return 0;
-    } else if (status < (long) sizeof(struct compressed_line_length_headers)) {
+    } else if (status < (long) compressed_line_length_headers_size) {
         debugf("Unknown error when reading compressed line length headers: %d\n", status);
         return 0;
     }
-    line_byte_count += compressed_line_length_headers_size;
+    // includes the END varint if present
+    const size_t line_headers_length = status;
+    line_byte_count += line_headers_length;
 
     uint32_t required_length = line_length_headers.required_columns_length;
     debugf("Skipping %u bytes for required columns section\n", required_length);
@@ -827,12 +1146,57 @@ int decompress2_data_line(
         }
     }
 
+    // An entropy coded sample section is decoded into memory and the sample
+    // bytes are then read from there instead of from input_file
+    FILE *sample_file = input_file;
+    std::string decoded_samples;
+    bool entropy_coded = false;
+    size_t entropy_section_length = 0;
+    if (schema.sample_count > 0) {
+        int first_sample_byte = fgetc(input_file);
+        if (first_sample_byte == SAMPLE_MASKED_ENTROPY) {
+            entropy_coded = true;
+            uint8_t raw_length_bytes[4];
+            if (fread(raw_length_bytes, 1, 4, input_file) < 4) {
+                throw VcfValidationError("Failed to read entropy coded sample length");
+            }
+            uint32_t raw_length =
+                ((uint32_t) raw_length_bytes[0] << 24) | ((uint32_t) raw_length_bytes[1] << 16)
+                | ((uint32_t) raw_length_bytes[2] << 8) | ((uint32_t) raw_length_bytes[3]);
+            // line_length excludes its own 4 bytes, and includes the required column
+            // length header and END varint, the required columns, the 5 byte preamble
+            // and the newline
+            size_t preamble_length = (line_headers_length - 4) + required_length + 5 + 1;
+            if (line_length_headers.line_length < preamble_length) {
+                throw VcfValidationError("Line too short for entropy coded samples");
+            }
+            size_t encoded_length = line_length_headers.line_length - preamble_length;
+            std::vector<byte_t> encoded(encoded_length);
+            if (fread(encoded.data(), 1, encoded_length, input_file) < encoded_length) {
+                throw VcfValidationError("Failed to read entropy coded samples");
+            }
+            decoded_samples.reserve(raw_length + 1);
+            if (entropy_decode_samples(encoded.data(), encoded_length, raw_length, decoded_samples) != 0) {
+                throw VcfValidationError("Failed to decode entropy coded samples");
+            }
+            decoded_samples.push_back('\n');
+            sample_file = fmemopen(&decoded_samples[0], decoded_samples.size(), "r");
+            if (sample_file == NULL) {
+                perror("fmemopen");
+                throw std::runtime_error("Failed to open decoded sample buffer");
+            }
+            entropy_section_length = 5 + encoded_length;
+        } else if (first_sample_byte != EOF) {
+            ungetc(first_sample_byte, input_file);
+        }
+    }
+
     debugf("Reading sample columns\n");
     // read the sample columns
     while (line_sample_count < schema.sample_count) {
         //debugf("Trying to read a sample column\n");
         // if (read(input_fd, &b, 1) <= 0) {
-        if (fread(&b, 1, 1, input_file) < 1) {
+        if (fread(&b, 1, 1, sample_file) < 1) {
             std::ostringstream msg;
             msg << "Missing samples, expected " << schema.sample_count
                 << ", received " << line_sample_count;
@@ -873,7 +1237,7 @@ int decompress2_data_line(
             uint8_t ucounter = 0; // number of uncompressed columns
             while (ucounter < uncompressed_count) {
                 // if (read(input_fd, &b, 1) <= 0) {
-                if (fread(&b, 1, 1, input_file) < 1) {
+                if (fread(&b, 1, 1, sample_file) < 1) {
                     throw std::runtime_error("Couldn't read from input_fd");
                 }
                 // fread(&b, sizeof(char), 1, input_stream);
@@ -888,7 +1252,7 @@ int decompress2_data_line(
                     }
                     // ending newline handled outside loop
                     debugf("got ending newline\n");
-                    fseek(input_file, -1, SEEK_CUR);
+                    fseek(sample_file, -1, SEEK_CUR);
                 }
                 else if (b == '\t') {
                     // don't push tabs, handled outside if
@@ -955,7 +1319,7 @@ int decompress2_data_line(
     debugf("Finished reading samples\n");
 
     // if (read(input_fd, &b, 1) <= 0) {
-    if (fread(&b, 1, 1, input_file) < 1) {
+    if (fread(&b, 1, 1, sample_file) < 1) {
         throw std::runtime_error("Failed to read line ending");
     }
     if (b == '\n') {
@@ -965,6 +1329,15 @@ int decompress2_data_line(
         throw VcfValidationError("Sample line did not end in a newline\n");
     }
 
+    if (entropy_coded) {
+        fclose(sample_file);
+        // consume the real line ending which follows the coded stream
+        if (fread(&b, 1, 1, input_file) < 1 || b != '\n') {
+            throw VcfValidationError("Entropy coded sample line did not end in a newline\n");
+        }
+        line_byte_count = line_headers_length + required_length + entropy_section_length;
+    }
+
     *compressed_line_length = line_byte_count;
 
     // debugf("input_fd offset: %ld\n", tellfd(input_fd));
@@ -1089,6 +1462,8 @@ int decompress2_metadata_headers(
     }
     debugf("Line counts: metadata = %ld, header = %ld\n", meta_count, header_count);
     debugf("Sample count: %ld\n", output_schema.sample_count);
+    output_schema.reference_names = reference_name_map(output_vector);
+    debugf("Contig count: %lu\n", output_schema.reference_names.size());
     #ifdef TIMING
     end = std::chrono::steady_clock::now();
     duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
@@ -1202,6 +1577,8 @@ int decompress2_metadata_headers_fd(
     }
     debugf("Line counts: metadata = %ld, header = %ld\n", meta_count, header_count);
     debugf("Sample count: %ld\n", output_schema.sample_count);
+    output_schema.reference_names = reference_name_map(output_vector);
+    debugf("Contig count: %lu\n", output_schema.reference_names.size());
     #ifdef TIMING
     end = std::chrono::steady_clock::now();
     duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
@@ -1211,6 +1588,36 @@ int decompress2_metadata_headers_fd(
 }
 
 
+size_t decompress2_blocks(
+        FILE *input_file,
+        int output_fd,
+        const VcfCompressionSchema& schema) {
+    size_t variant_line_count = 0;
+    std::string variant_line;
+    variant_line.reserve(16 * 1024); // 16 KiB
+    std::vector<byte_t> block;
+    struct block_header header;
+    VcfBlockReader block_reader(input_file);
+
+    while (block_reader.next_block(&header, block) == 1) {
+        FILE *block_file = open_block_lines(block);
+        while (true) {
+            variant_line.clear();
+            size_t compressed_line_length = 0;
+            int status = decompress2_data_line(block_file, schema, variant_line, &compressed_line_length);
+            if (status == 0) {
+                break;
+            } else if (status < 0) {
+                throw VcfValidationError("Failed to decompress block");
+            }
+            write(output_fd, variant_line.c_str(), variant_line.size());
+            variant_line_count++;
+        }
+        fclose(block_file);
+    }
+    return variant_line_count;
+}
+
 int decompress2_fd(const std::string& input_filename, const std::string& output_filename) {
     debugf("Decompressing %s to %s\n", input_filename.c_str(), output_filename.c_str());
     int input_fd = open(input_filename.c_str(), O_RDONLY);
@@ -1232,6 +1639,20 @@ int decompress2_fd(const std::string& input_filename, const std::string& output_
     // string_t variant_line;
     // string_init(&variant_line);
 
+    int input_fd_dup = dup(input_fd);
+    FILE *input_file = fdopen(input_fd_dup, "r");
+    if (is_block_container(input_file)) {
+        variant_line_count = decompress2_blocks(input_file, output_fd, schema);
+        debugf("variant_line_count: %lu\n", variant_line_count);
+        fclose(input_file);
+        close(input_fd);
+        close(output_fd);
+        return 0;
+    }
+    // the FILE shares the offset of input_fd, reset it to account for readahead
+    lseek(input_fd, ftell(input_file), SEEK_SET);
+    fclose(input_file);
+
     while (true) {
         variant_line_count++;
         // string_clear(&variant_line);
@@ -11,21 +11,67 @@
 #include <fcntl.h>
 
 #include "utils.hpp"
+#include "entropy.hpp"
+#include "block.hpp"
+#include "index.hpp"
 #include "string_t.h"
 
+class VcfCompressionConfiguration {
+public:
+    VcfCompressionConfiguration(){};
+
+    // Entropy code the sample run bytes of each line (see entropy.hpp)
+    bool entropy_code_samples = false;
+
+    // Store END - POS of each variant in the line header (see utils.hpp)
+    bool store_end_position = true;
+
+    // Group lines into blocks (see block.hpp), optionally zstd compressed
+    bool blocks = false;
+    VcfBlockConfiguration block_configuration;
+
+    // Bins of a binned index appended to the file, none if not enabled
+    VcfPackedBinningIndexConfiguration embedded_index_binning = VcfPackedBinningIndexConfiguration(0);
+
+    // Indexes written next to the output file while compressing, the same as
+    // create-binned-index and create-sparse-index produce from the output
+    VcfPackedBinningIndexConfiguration index_binning = VcfPackedBinningIndexConfiguration(0); // bins of a .vcfci index
+    bool eytzinger_index = false;   // also write the binned index as .vcfci-eytzinger
+    bool elias_fano_index = false;  // also write the binned index as .vcfci-ef
+    bool two_level_index = false;   // also write the binned index as .vcfci-2level
+    bool sparse_index = false;      // write a .vcfci-sparse index
+};
+
 /** Compression **/
 int compress(
         const std::string& input_filename,
         const std::string& output_filename);
+int compress(
+        const std::string& input_filename,
+        const std::string& output_filename,
+        const VcfCompressionConfiguration& config);
+int compress_data_line(
+        const std::string& line,
+        const VcfCompressionSchema& schema,
+        std::vector<byte_t>& byte_vec, bool add_newline);
 int compress_data_line(
         const std::string& line,
         const VcfCompressionSchema& schema,
+        const VcfCompressionConfiguration& config,
         std::vector<byte_t>& byte_vec, bool add_newline);
 
 /** Decompression **/
 int decompress2_fd(
         const std::string& input_filename,
         const std::string& output_filename);
+/**
+ * Decompresses every block of a block container to `output_fd`, `input_file`
+ * positioned at the start of the data section. Returns the number of lines.
+ */
+size_t decompress2_blocks(
+        FILE *input_file,
+        int output_fd,
+        const VcfCompressionSchema& schema);
 int decompress2_metadata_headers_fd(
         int input_fd,
         std::vector<std::string>& output_vector,
@@ -54,4 +100,20 @@ int read_compressed_line_length_headers(
 int read_compressed_line_length_headers_fd(
         int input_fd,
         struct compressed_line_length_headers *length_headers);
+/**
+ * Parses the length headers at the start of an in-memory compressed line.
+ * Returns the number of header bytes including the END varint, 0 if `line`
+ * does not start with a compressed line.
+ */
+size_t parse_compressed_line_length_headers(
+        const byte_t *line,
+        size_t len,
+        struct compressed_line_length_headers *length_headers);
+/**
+ * Serializes `length_headers` as they are written at the start of a compressed
+ * line. Returns the number of bytes written to `out`.
+ */
+size_t serialize_compressed_line_length_headers(
+        const struct compressed_line_length_headers& length_headers,
+        uint8_t out[8 + VARINT_MAX_LENGTH_32]);
 #endif
\ No newline at end of file
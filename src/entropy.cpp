@@ -0,0 +1,234 @@
+#include <string>
+#include <string.h>
+
+#include "entropy.hpp"
+
+#define RANGE_TOP_VALUE ((uint32_t)1 << 24)
+
+SampleRunModel::SampleRunModel() {
+    for (size_t c = 0; c < ENTROPY_CLASS_COUNT; c++) {
+        for (size_t i = 0; i < 8; i++) {
+            class_probs[c][i] = ENTROPY_PROB_INIT;
+        }
+        for (size_t i = 0; i < 128; i++) {
+            length_probs[c][i] = ENTROPY_PROB_INIT;
+        }
+    }
+    for (size_t i = 0; i < 256; i++) {
+        literal_probs[i] = ENTROPY_PROB_INIT;
+    }
+}
+
+/**
+ * LZMA-style carryless range encoder over adaptive bit probabilities.
+ */
+class RangeEncoder {
+public:
+    RangeEncoder(std::vector<byte_t>& out): out(out) {}
+
+    void encode_bit(uint16_t& prob, int bit) {
+        uint32_t bound = (range >> ENTROPY_PROB_BITS) * prob;
+        if (bit == 0) {
+            range = bound;
+            prob += ((1 << ENTROPY_PROB_BITS) - prob) >> ENTROPY_ADAPT_SHIFT;
+        } else {
+            low += bound;
+            range -= bound;
+            prob -= prob >> ENTROPY_ADAPT_SHIFT;
+        }
+        while (range < RANGE_TOP_VALUE) {
+            range <<= 8;
+            shift_low();
+        }
+    }
+
+    void encode_tree(uint16_t *probs, int bits, uint32_t value) {
+        uint32_t m = 1;
+        for (int i = bits - 1; i >= 0; i--) {
+            int bit = (value >> i) & 1;
+            encode_bit(probs[m], bit);
+            m = (m << 1) | bit;
+        }
+    }
+
+    void flush() {
+        for (int i = 0; i < 5; i++) {
+            shift_low();
+        }
+    }
+
+private:
+    void shift_low() {
+        if ((uint32_t)low < 0xFF000000 || (low >> 32) != 0) {
+            byte_t carry = (byte_t)(low >> 32);
+            byte_t temp = cache;
+            do {
+                out.push_back((byte_t)(temp + carry));
+                temp = 0xFF;
+            } while (--cache_size != 0);
+            cache = (byte_t)(low >> 24);
+        }
+        cache_size++;
+        low = (low & 0x00FFFFFF) << 8;
+    }
+
+    std::vector<byte_t>& out;
+    uint64_t low = 0;
+    uint32_t range = 0xFFFFFFFF;
+    byte_t cache = 0;
+    uint64_t cache_size = 1;
+};
+
+class RangeDecoder {
+public:
+    RangeDecoder(const byte_t *in, size_t in_len): in(in), in_len(in_len) {
+        for (int i = 0; i < 5; i++) {
+            code = (code << 8) | next_byte();
+        }
+    }
+
+    int decode_bit(uint16_t& prob) {
+        uint32_t bound = (range >> ENTROPY_PROB_BITS) * prob;
+        int bit;
+        if (code < bound) {
+            range = bound;
+            prob += ((1 << ENTROPY_PROB_BITS) - prob) >> ENTROPY_ADAPT_SHIFT;
+            bit = 0;
+        } else {
+            code -= bound;
+            range -= bound;
+            prob -= prob >> ENTROPY_ADAPT_SHIFT;
+            bit = 1;
+        }
+        while (range < RANGE_TOP_VALUE) {
+            range <<= 8;
+            code = (code << 8) | next_byte();
+        }
+        return bit;
+    }
+
+    uint32_t decode_tree(uint16_t *probs, int bits) {
+        uint32_t m = 1;
+        for (int i = 0; i < bits; i++) {
+            m = (m << 1) | decode_bit(probs[m]);
+        }
+        return m - ((uint32_t)1 << bits);
+    }
+
+    // true if the decoder consumed more bytes than the stream holds
+    bool overrun() {
+        return pos > in_len + 4;
+    }
+
+private:
+    byte_t next_byte() {
+        byte_t b = pos < in_len ? in[pos] : 0;
+        pos++;
+        return b;
+    }
+
+    const byte_t *in;
+    size_t in_len;
+    size_t pos = 0;
+    uint32_t code = 0;
+    uint32_t range = 0xFFFFFFFF;
+};
+
+// Number of run length bits stored for each genotype class
+static inline int class_length_bits(int cls) {
+    return cls == ENTROPY_CLASS_00 ? 7 : 5;
+}
+
+static inline int run_byte_class(byte_t b) {
+    if ((b & SAMPLE_MASK_00) == SAMPLE_MASKED_00) {
+        return ENTROPY_CLASS_00;
+    }
+    switch (b & SAMPLE_MASK_01_10_11) {
+        case SAMPLE_MASKED_01: return ENTROPY_CLASS_01;
+        case SAMPLE_MASKED_10: return ENTROPY_CLASS_10;
+        case SAMPLE_MASKED_11: return ENTROPY_CLASS_11;
+        default: return ENTROPY_CLASS_UNCOMPRESSED;
+    }
+}
+
+static const byte_t class_masks[ENTROPY_CLASS_COUNT] = {
+    SAMPLE_MASKED_00,
+    SAMPLE_MASKED_01,
+    SAMPLE_MASKED_10,
+    SAMPLE_MASKED_11,
+    SAMPLE_MASKED_UNCOMPRESSED
+};
+
+size_t entropy_encode_samples(
+        const byte_t *raw,
+        size_t raw_len,
+        std::vector<byte_t>& out) {
+    size_t initial_size = out.size();
+    SampleRunModel model;
+    RangeEncoder encoder(out);
+    int prev_class = ENTROPY_CLASS_00;
+    // tabs left to see before the current uncompressed run ends
+    size_t literal_tabs_remaining = 0;
+
+    for (size_t i = 0; i < raw_len; i++) {
+        byte_t b = raw[i];
+        if (literal_tabs_remaining > 0) {
+            encoder.encode_tree(model.literal_probs, 8, b);
+            if (b == '\t') {
+                literal_tabs_remaining--;
+            }
+            continue;
+        }
+        int cls = run_byte_class(b);
+        int length_bits = class_length_bits(cls);
+        uint32_t run_length = b & ((1 << length_bits) - 1);
+        encoder.encode_tree(model.class_probs[prev_class], 3, cls);
+        encoder.encode_tree(model.length_probs[cls], length_bits, run_length);
+        if (cls == ENTROPY_CLASS_UNCOMPRESSED) {
+            literal_tabs_remaining = run_length;
+        }
+        prev_class = cls;
+    }
+    encoder.flush();
+    debugf("%s encoded %lu sample bytes to %lu bytes\n",
+        __FUNCTION__, raw_len, out.size() - initial_size);
+    return out.size() - initial_size;
+}
+
+int entropy_decode_samples(
+        const byte_t *encoded,
+        size_t encoded_len,
+        size_t raw_len,
+        std::string& out) {
+    SampleRunModel model;
+    RangeDecoder decoder(encoded, encoded_len);
+    int prev_class = ENTROPY_CLASS_00;
+    size_t literal_tabs_remaining = 0;
+
+    for (size_t i = 0; i < raw_len; i++) {
+        if (literal_tabs_remaining > 0) {
+            byte_t b = (byte_t) decoder.decode_tree(model.literal_probs, 8);
+            if (b == '\t') {
+                literal_tabs_remaining--;
+            }
+            out.push_back(b);
+            continue;
+        }
+        uint32_t cls = decoder.decode_tree(model.class_probs[prev_class], 3);
+        if (cls >= ENTROPY_CLASS_COUNT) {
+            debugf("%s decoded invalid genotype class %u\n", __FUNCTION__, cls);
+            return -1;
+        }
+        uint32_t run_length = decoder.decode_tree(model.length_probs[cls], class_length_bits(cls));
+        out.push_back(class_masks[cls] | (byte_t) run_length);
+        if (cls == ENTROPY_CLASS_UNCOMPRESSED) {
+            literal_tabs_remaining = run_length;
+        }
+        prev_class = cls;
+    }
+    if (decoder.overrun()) {
+        debugf("%s read past end of %lu byte stream\n", __FUNCTION__, encoded_len);
+        return -1;
+    }
+    return 0;
+}
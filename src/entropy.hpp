@@ -0,0 +1,71 @@
+#pragma once
+#ifndef _ENTROPY_H
+#define _ENTROPY_H
+
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "utils.hpp"
+
+////////////////////////////////////////////////////////////////
+// Adaptive binary range coder for the sample run bytes of a line.
+//
+// The run bytes produced by compress_data_line are modelled as a
+// sequence of (genotype class, run length) symbols. The class of each
+// run is coded in the context of the class of the previous run, and
+// the run length is coded in the context of its own class, so 0|0 runs
+// (mostly length 127) and het runs (mostly short) get separate models.
+// Raw text following an uncompressed flag is coded with a literal model.
+//
+// Models start from p=0.5 at the start of every line so each line stays
+// independently decodable.
+////////////////////////////////////////////////////////////////
+
+#define ENTROPY_PROB_BITS 11
+#define ENTROPY_PROB_INIT (1 << (ENTROPY_PROB_BITS - 1))
+#define ENTROPY_ADAPT_SHIFT 4
+
+// genotype classes, in order of their flag masks in utils.hpp
+#define ENTROPY_CLASS_00 0
+#define ENTROPY_CLASS_01 1
+#define ENTROPY_CLASS_10 2
+#define ENTROPY_CLASS_11 3
+#define ENTROPY_CLASS_UNCOMPRESSED 4
+#define ENTROPY_CLASS_COUNT 5
+
+class SampleRunModel {
+public:
+    SampleRunModel();
+
+    // 3-bit tree for the class, indexed by previous class
+    uint16_t class_probs[ENTROPY_CLASS_COUNT][8];
+    // 7-bit tree for run lengths, indexed by class. Only 0|0 uses all 7 bits.
+    uint16_t length_probs[ENTROPY_CLASS_COUNT][128];
+    // 8-bit tree for the bytes of uncompressed sample values
+    uint16_t literal_probs[256];
+};
+
+/**
+ * Entropy codes `raw_len` sample bytes (everything between the tab after the
+ * FORMAT column and the line ending newline) and appends the result to `out`.
+ *
+ * Returns the number of bytes appended.
+ */
+size_t entropy_encode_samples(
+        const byte_t *raw,
+        size_t raw_len,
+        std::vector<byte_t>& out);
+
+/**
+ * Decodes `encoded_len` bytes into exactly `raw_len` sample bytes, appended to `out`.
+ *
+ * Returns 0 on success, negative if the stream is malformed.
+ */
+int entropy_decode_samples(
+        const byte_t *encoded,
+        size_t encoded_len,
+        size_t raw_len,
+        std::string& out);
+
+#endif
@@ -0,0 +1,2093 @@
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <stdexcept>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "index.hpp"
+#include "compress.hpp"
+
+size_t struct_index_entry_size =
+    sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint64_t);
+
+int write_index_entry_fd(int fd, struct index_entry *entry) {
+    write(fd, &entry->reference_name_idx, sizeof(entry->reference_name_idx));
+    write(fd, &entry->position, sizeof(entry->position));
+    write(fd, &entry->byte_offset, sizeof(entry->byte_offset));
+    return 0;
+}
+
+long write_index_entry(FILE *file, struct index_entry *entry) {
+    // write(fd, &entry->reference_name_idx, sizeof(entry->reference_name_idx));
+    // write(fd, &entry->position, sizeof(entry->position));
+    // write(fd, &entry->byte_offset, sizeof(entry->byte_offset));
+
+    long total_bytes = 0;
+    total_bytes += fwrite(&entry->reference_name_idx, sizeof(entry->reference_name_idx), 1, file);
+    total_bytes += fwrite(&entry->position, sizeof(entry->position), 1, file);
+    total_bytes += fwrite(&entry->byte_offset, sizeof(entry->byte_offset), 1, file);
+    return total_bytes;
+}
+
+/**
+ * Returns 0 on success. Sets `bytes_read` to the number of bytes read. Should be the
+ * sum of the size of the fields in a struct index_entry.
+ */
+int read_index_entry_fd(int fd, struct index_entry *entry, int *bytes_read) {
+    int read_count = 0, n = 0;
+    n = read(fd, &(entry->reference_name_idx), sizeof(entry->reference_name_idx));
+    if (n == 0) {
+        debugf("Unexpected EOF\n");
+        return -1;
+    } else if (n < 0) {
+        perror("read");
+        debugf("Failed to read reference_name_idx, status = %d\n", n);
+        return -1;
+    } else {
+        read_count += n;
+    }
+
+    n = read(fd, &entry->position, sizeof(uint32_t));
+    if (n == 0) {
+        debugf("Unexpected EOF\n");
+        return -1;
+    } else if (n < 0) {
+        perror("read");
+        debugf("Failed to read position, status = %d\n", n);
+        return -1;
+    } else {
+        read_count += n;
+    }
+
+    n = read(fd, &entry->byte_offset, sizeof(uint64_t));
+    if (n == 0) {
+        debugf("Unexpected EOF\n");
+        return -1;
+    } else if (n < 0) {
+        perror("read");
+        debugf("Failed to read byte_offset, status = %d\n", n);
+        return -1;
+    } else {
+        read_count += n;
+    }
+
+    *bytes_read = read_count;
+    return 0;
+}
+
+/**
+ * Returns 0 on success. Sets `bytes_read` to the number of bytes read. Should be the
+ * sum of the size of the fields in a struct index_entry.
+ */
+int read_index_entry(FILE *file, struct index_entry *entry, int *bytes_read) {
+    int read_count = 0, n = 0;
+    // n = read(fd, &(entry->reference_name_idx), sizeof(uint8_t));
+    n = fread(&(entry->reference_name_idx), sizeof(entry->reference_name_idx), 1, file);
+    if (n < 1) {
+        debugf("Failed to read reference_name_idx, status = %d\n", n);
+        debugf("Unexpected EOF\n");
+        perror("fread");
+        return -1;
+    } else {
+        read_count += n * sizeof(entry->reference_name_idx);
+    }
+
+    n = fread(&entry->position, sizeof(uint32_t), 1, file);
+    if (n < 1) {
+        debugf("Failed to read position, status = %d\n", n);
+        debugf("Unexpected EOF\n");
+        perror("fread");
+        return -1;
+    } else {
+        read_count += n * sizeof(uint32_t);
+    }
+
+    n = fread(&entry->byte_offset, sizeof(uint64_t), 1, file);
+    if (n < 1) {
+        debugf("Failed to read byte_offset, status = %d\n", n);
+        debugf("Unexpected EOF\n");
+        perror("read");
+        return -1;
+    } else {
+        read_count += n * sizeof(uint64_t);
+    }
+
+    *bytes_read = read_count;
+    return 0;
+}
+
+int read_index_entries(const std::string& filename, std::vector<struct index_entry>& entries) {
+    FILE *index_file = fopen(filename.c_str(), "r");
+    if (index_file == NULL) {
+        perror("fopen");
+        return -1;
+    }
+    long index_size = file_size(filename.c_str());
+    if (index_size % struct_index_entry_size != 0) {
+        debugf("Index size %ld was not a multiple of entry size: %ld\n", index_size, struct_index_entry_size);
+        fclose(index_file);
+        return -1;
+    }
+    size_t entry_count = index_size / struct_index_entry_size;
+    entries.resize(entry_count);
+    for (size_t i = 0; i < entry_count; i++) {
+        int bytes_read;
+        if (read_index_entry(index_file, &entries[i], &bytes_read) != 0) {
+            fclose(index_file);
+            return -1;
+        }
+    }
+    fclose(index_file);
+    return 0;
+}
+
+int parse_binning_policy(const std::string& spec, VcfPackedBinningIndexConfiguration *config) {
+    config->entries_per_bin = 0;
+    config->bytes_per_bin = 0;
+    config->align_bins = false;
+    if (spec == "page") {
+        config->bytes_per_bin = VCFC_PAGE_SIZE;
+        config->align_bins = true;
+        return 0;
+    }
+    std::string size_str = spec;
+    const std::string aligned_suffix = ":aligned";
+    if (size_str.size() > aligned_suffix.size()
+            && size_str.compare(size_str.size() - aligned_suffix.size(), aligned_suffix.size(), aligned_suffix) == 0) {
+        config->align_bins = true;
+        size_str.resize(size_str.size() - aligned_suffix.size());
+    }
+    bool bytes = size_str.size() > 0 && size_str.back() == 'b';
+    if (bytes) {
+        size_str.pop_back();
+    } else if (config->align_bins) {
+        // only byte bins can be aligned
+        return -1;
+    }
+    bool success = false;
+    uint64_t size = str_to_uint64(size_str, success);
+    if (!success || size == 0 || size > INT32_MAX) {
+        return -1;
+    }
+    if (bytes) {
+        config->bytes_per_bin = size;
+    } else {
+        config->entries_per_bin = size;
+    }
+    return 0;
+}
+
+BinnedIndexBuilder::BinnedIndexBuilder(const VcfPackedBinningIndexConfiguration& index_configuration):
+        index_configuration(index_configuration) {
+}
+
+void BinnedIndexBuilder::add_line(
+        const std::string& reference_name,
+        uint32_t end_position,
+        uint64_t byte_offset) {
+    struct index_entry new_entry;
+    new_entry.reference_name_idx = ref_name_map.reference_to_int(reference_name);
+    if (new_entry.reference_name_idx == 0) {
+        // entries are ordered by contig id, a line without one can't be found
+        throw std::runtime_error("Contig " + reference_name + " is not in the contig dictionary of the file");
+    }
+    new_entry.position = end_position; // CHANGED TO END
+    new_entry.byte_offset = byte_offset;
+
+    if (index_vector.size() > 0 && index_vector.back().reference_name_idx == new_entry.reference_name_idx) {
+        // END is only compared within a contig
+        uint32_t last_index_end = index_vector.back().position;
+        bool bin_full;
+        if (index_configuration.bytes_per_bin > 0) {
+            uint64_t bin_offset = index_vector.back().byte_offset;
+            if (index_configuration.align_bins) {
+                bin_full = byte_offset / index_configuration.bytes_per_bin
+                    != bin_offset / index_configuration.bytes_per_bin;
+            } else {
+                bin_full = byte_offset - bin_offset >= index_configuration.bytes_per_bin;
+            }
+        } else {
+            bin_full = line_number % index_configuration.entries_per_bin == 0;
+        }
+        if (bin_full) {
+            if (end_position > last_index_end) {
+                debugf("Current line end %u is greater than last index end %u. Adding entry for current line\n",
+                    end_position, last_index_end);
+                index_vector.push_back(new_entry);
+            }
+        } else {
+            // can only grow into prevous entry
+            if (end_position > last_index_end) {
+                debugf("Growing last entry position end from %u to %u\n",
+                    last_index_end, end_position);
+                index_vector.back().position = end_position;
+            } else {
+                debugf("Line was within previous index entry bounds, doing nothing\n");
+            }
+        }
+    } else {
+        // the first line of each contig starts a bin
+        debugf("First index entry of contig %u\n", new_entry.reference_name_idx);
+        index_vector.push_back(new_entry);
+        line_number = 0;
+    }
+    line_number++;
+}
+
+
+static_assert(sizeof(struct index_file_header) == VCFC_INDEX_HEADER_SIZE, "index_file_header must be 64 bytes");
+static_assert(sizeof(struct keyed_index_record) == 16, "keyed_index_record must be 16 bytes");
+
+#define FNV1A_OFFSET_BASIS 0xcbf29ce484222325ULL
+
+/**
+ * FNV-1a of `len` bytes continuing from `hash`.
+ */
+static uint64_t fnv1a_hash(const char *bytes, size_t len, uint64_t hash) {
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t) bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * Size of the compressed file and FNV-1a of its last VCFC_INDEX_CHECKSUM_SIZE
+ * bytes, which cover the last lines and the trailer. Returns 0 on success.
+ */
+static int compute_data_fingerprint(const std::string& compressed_filename, uint64_t *data_size, uint64_t *data_checksum) {
+    int fd = ::open(compressed_filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    size_t tail_size = std::min((size_t) st.st_size, (size_t) VCFC_INDEX_CHECKSUM_SIZE);
+    std::vector<char> tail(tail_size);
+    if (pread(fd, tail.data(), tail_size, st.st_size - tail_size) != (ssize_t) tail_size) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    *data_size = st.st_size;
+    *data_checksum = fnv1a_hash(tail.data(), tail_size, FNV1A_OFFSET_BASIS);
+    return 0;
+}
+
+/**
+ * Offset of data_size, followed by data_checksum, in the header of the index
+ * open as `fd`, by its magic. Returns -1 for a file without a stamped header.
+ */
+static long index_fingerprint_offset(int fd) {
+    char magic[8];
+    if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic)) {
+        return -1;
+    }
+    if (memcmp(magic, VCFC_INDEX_MAGIC, sizeof(magic)) == 0) {
+        return offsetof(struct index_file_header, data_size);
+    } else if (memcmp(magic, VCFC_LEARNED_INDEX_MAGIC, sizeof(magic)) == 0) {
+        return offsetof(struct learned_index_header, data_size);
+    }
+    return -1;
+}
+
+int stamp_index_data(const std::string& index_filename, const std::string& compressed_filename) {
+    uint64_t fingerprint[2];
+    if (compute_data_fingerprint(compressed_filename, &fingerprint[0], &fingerprint[1]) != 0) {
+        return -1;
+    }
+    int fd = ::open(index_filename.c_str(), O_RDWR);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+    long fingerprint_offset = index_fingerprint_offset(fd);
+    if (fingerprint_offset < 0) {
+        close(fd);
+        return -1;
+    }
+    // data_size and data_checksum are adjacent
+    if (pwrite(fd, fingerprint, sizeof(fingerprint), fingerprint_offset) != sizeof(fingerprint)) {
+        perror("pwrite");
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+bool index_matches_data(const std::string& index_filename, const std::string& compressed_filename) {
+    int fd = ::open(index_filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    uint64_t fingerprint[2];
+    long fingerprint_offset = index_fingerprint_offset(fd);
+    ssize_t read_ret = fingerprint_offset < 0 ? -1 : pread(fd, fingerprint, sizeof(fingerprint), fingerprint_offset);
+    close(fd);
+    uint64_t data_size, data_checksum;
+    if (read_ret != sizeof(fingerprint)
+            || compute_data_fingerprint(compressed_filename, &data_size, &data_checksum) != 0) {
+        return false;
+    }
+    return fingerprint[0] == data_size && fingerprint[1] == data_checksum;
+}
+
+/**
+ * Fills the Eytzinger subtree rooted at `k` from `sorted`, starting at sorted index `i`.
+ * Returns the next unused sorted index.
+ */
+static size_t eytzinger_fill(
+        const std::vector<struct keyed_index_record>& sorted,
+        std::vector<struct keyed_index_record>& records,
+        size_t i,
+        size_t k) {
+    if (k < records.size()) {
+        i = eytzinger_fill(sorted, records, i, 2 * k);
+        records[k] = sorted[i++];
+        i = eytzinger_fill(sorted, records, i, 2 * k + 1);
+    }
+    return i;
+}
+
+/**
+ * Converts `entries` to records sorted by key.
+ */
+static void sorted_index_records(
+        const std::vector<struct index_entry>& entries,
+        std::vector<struct keyed_index_record>& sorted) {
+    sorted.resize(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+        sorted[i].key = index_entry_key(entries[i].reference_name_idx, entries[i].position);
+        sorted[i].byte_offset = entries[i].byte_offset;
+    }
+    // entries are built in file order, which is already sorted for a sorted file
+    std::stable_sort(sorted.begin(), sorted.end(),
+        [](const struct keyed_index_record& a, const struct keyed_index_record& b) {
+            return a.key < b.key;
+        });
+}
+
+int write_eytzinger_index(const std::string& filename, const std::vector<struct index_entry>& entries) {
+    std::vector<struct keyed_index_record> sorted;
+    sorted_index_records(entries, sorted);
+
+    // record 0 is unused so that children of k are at 2k, 2k+1
+    std::vector<struct keyed_index_record> records(sorted.size() + 1);
+    memset(records.data(), 0, sizeof(struct keyed_index_record));
+    eytzinger_fill(sorted, records, 0, 1);
+
+    struct index_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, VCFC_INDEX_MAGIC, sizeof(header.magic));
+    header.version = VCFC_INDEX_VERSION_EYTZINGER;
+    header.record_size = sizeof(struct keyed_index_record);
+    header.entry_count = entries.size();
+
+    FILE *index_file = fopen(filename.c_str(), "w");
+    if (index_file == NULL) {
+        perror("fopen");
+        return -1;
+    }
+    if (fwrite(&header, sizeof(header), 1, index_file) != 1
+            || fwrite(records.data(), sizeof(struct keyed_index_record), records.size(), index_file) != records.size()) {
+        perror("fwrite");
+        fclose(index_file);
+        return -1;
+    }
+    fclose(index_file);
+    return 0;
+}
+
+EytzingerIndex::~EytzingerIndex() {
+    if (this->map != NULL) {
+        munmap(this->map, this->map_length);
+    }
+}
+
+int EytzingerIndex::open(const std::string& filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < VCFC_INDEX_HEADER_SIZE + sizeof(struct keyed_index_record)) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    // lookups touch one path from the root, don't read ahead the rest
+    madvise(map, st.st_size, MADV_RANDOM);
+
+    const struct index_file_header *header = (const struct index_file_header*) map;
+    if (memcmp(header->magic, VCFC_INDEX_MAGIC, sizeof(header->magic)) != 0
+            || header->version != VCFC_INDEX_VERSION_EYTZINGER
+            || header->record_size != sizeof(struct keyed_index_record)
+            || VCFC_INDEX_HEADER_SIZE + (header->entry_count + 1) * header->record_size != (size_t) st.st_size) {
+        debugf("%s is not a version %d index\n", filename.c_str(), VCFC_INDEX_VERSION_EYTZINGER);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    this->map = map;
+    this->map_length = st.st_size;
+    this->records = (const struct keyed_index_record*) ((const char*) map + VCFC_INDEX_HEADER_SIZE);
+    this->entry_count = header->entry_count;
+    return 0;
+}
+
+int EytzingerIndex::search(uint32_t reference_name_idx, uint32_t position, struct index_entry *entry) const {
+    size_t n = this->entry_count;
+    if (n == 0) {
+        return 0;
+    }
+    uint64_t key = index_entry_key(reference_name_idx, position);
+    size_t k = 1;
+    while (k <= n) {
+        // the 4 grandchildren of k are one cache line, fetch it while comparing k
+        __builtin_prefetch(this->records + 4 * k);
+        k = 2 * k + (this->records[k].key < key);
+    }
+    // the last right turn was at the greatest key before `key`
+    k >>= __builtin_ffsll(k);
+    if (k == 0) {
+        // no entry is before `key`, use the leftmost
+        k = 1;
+        while (2 * k <= n) {
+            k = 2 * k;
+        }
+    }
+    entry->reference_name_idx = (uint32_t) (this->records[k].key >> 32);
+    entry->position = (uint32_t) this->records[k].key;
+    entry->byte_offset = this->records[k].byte_offset;
+    return 1;
+}
+
+
+static_assert(sizeof(struct elias_fano_header) == 64, "elias_fano_header must be 64 bytes");
+
+void elias_fano_encode(
+        const std::vector<uint64_t>& values,
+        struct elias_fano_header *header,
+        std::vector<uint64_t>& words) {
+    size_t n = values.size();
+    memset(header, 0, sizeof(struct elias_fano_header));
+    header->length = n;
+    header->max_value = n > 0 ? values.back() : 0;
+    // floor(log2(universe / n)) low bits minimizes the total size
+    uint64_t bucket_width = n > 0 ? (header->max_value + 1) / n : 0;
+    header->low_bits = bucket_width > 1 ? 63 - __builtin_clzll(bucket_width) : 0;
+    header->high_bit_count = n + (header->max_value >> header->low_bits) + 1;
+    header->low_word_count = (n * header->low_bits + 63) / 64;
+    header->high_word_count = (header->high_bit_count + 63) / 64;
+
+    std::vector<uint64_t> low_words(header->low_word_count, 0);
+    std::vector<uint64_t> high_words(header->high_word_count, 0);
+    std::vector<uint64_t> select1_samples;
+    std::vector<uint64_t> select0_samples;
+    const uint32_t l = header->low_bits;
+    const uint64_t low_mask = l == 0 ? 0 : (~0ULL >> (64 - l));
+    for (size_t i = 0; i < n; i++) {
+        if (i > 0 && values[i] < values[i - 1]) {
+            throw std::runtime_error("Elias-Fano values must be non-decreasing");
+        }
+        if (l > 0) {
+            uint64_t bit = i * l;
+            uint64_t low = values[i] & low_mask;
+            low_words[bit / 64] |= low << (bit % 64);
+            if (bit % 64 + l > 64) {
+                low_words[bit / 64 + 1] |= low >> (64 - bit % 64);
+            }
+        }
+        uint64_t high_bit = (values[i] >> l) + i;
+        high_words[high_bit / 64] |= 1ULL << (high_bit % 64);
+    }
+    uint64_t ones = 0, zeros = 0;
+    for (uint64_t bit = 0; bit < header->high_bit_count; bit++) {
+        if (high_words[bit / 64] & (1ULL << (bit % 64))) {
+            if (ones++ % VCFC_ELIAS_FANO_SAMPLE_RATE == 0) {
+                select1_samples.push_back(bit);
+            }
+        } else {
+            if (zeros++ % VCFC_ELIAS_FANO_SAMPLE_RATE == 0) {
+                select0_samples.push_back(bit);
+            }
+        }
+    }
+    header->select1_sample_count = select1_samples.size();
+    header->select0_sample_count = select0_samples.size();
+
+    words.insert(words.end(), low_words.begin(), low_words.end());
+    words.insert(words.end(), high_words.begin(), high_words.end());
+    words.insert(words.end(), select1_samples.begin(), select1_samples.end());
+    words.insert(words.end(), select0_samples.begin(), select0_samples.end());
+}
+
+size_t EliasFanoSequence::init(const struct elias_fano_header *header, const uint64_t *words) {
+    this->header = header;
+    this->low_words = words;
+    this->high_words = this->low_words + header->low_word_count;
+    this->select1_samples = this->high_words + header->high_word_count;
+    this->select0_samples = this->select1_samples + header->select1_sample_count;
+    return header->low_word_count + header->high_word_count
+        + header->select1_sample_count + header->select0_sample_count;
+}
+
+// Position of the set bit with index `rank` in `word`
+static inline uint32_t select_in_word(uint64_t word, uint32_t rank) {
+    for (uint32_t i = 0; i < rank; i++) {
+        word &= word - 1;
+    }
+    return __builtin_ctzll(word);
+}
+
+uint64_t EliasFanoSequence::select1(size_t i) const {
+    uint64_t bit = this->select1_samples[i / VCFC_ELIAS_FANO_SAMPLE_RATE];
+    size_t remaining = i % VCFC_ELIAS_FANO_SAMPLE_RATE;
+    size_t word_idx = bit / 64;
+    uint64_t word = this->high_words[word_idx] & (~0ULL << (bit % 64));
+    while (true) {
+        size_t count = __builtin_popcountll(word);
+        if (remaining < count) {
+            return word_idx * 64 + select_in_word(word, remaining);
+        }
+        remaining -= count;
+        word = this->high_words[++word_idx];
+    }
+}
+
+uint64_t EliasFanoSequence::select0(size_t i) const {
+    uint64_t bit = this->select0_samples[i / VCFC_ELIAS_FANO_SAMPLE_RATE];
+    size_t remaining = i % VCFC_ELIAS_FANO_SAMPLE_RATE;
+    size_t word_idx = bit / 64;
+    uint64_t word = ~this->high_words[word_idx] & (~0ULL << (bit % 64));
+    while (true) {
+        size_t count = __builtin_popcountll(word);
+        if (remaining < count) {
+            return word_idx * 64 + select_in_word(word, remaining);
+        }
+        remaining -= count;
+        word = ~this->high_words[++word_idx];
+    }
+}
+
+uint64_t EliasFanoSequence::low_value(size_t i) const {
+    const uint32_t l = this->header->low_bits;
+    if (l == 0) {
+        return 0;
+    }
+    uint64_t bit = i * l;
+    uint64_t low = this->low_words[bit / 64] >> (bit % 64);
+    if (bit % 64 + l > 64) {
+        low |= this->low_words[bit / 64 + 1] << (64 - bit % 64);
+    }
+    return low & (~0ULL >> (64 - l));
+}
+
+uint64_t EliasFanoSequence::access(size_t i) const {
+    uint64_t high = select1(i) - i;
+    return (high << this->header->low_bits) | low_value(i);
+}
+
+size_t EliasFanoSequence::lower_bound(uint64_t x) const {
+    size_t n = size();
+    if (n == 0 || x > this->header->max_value) {
+        return n;
+    }
+    const uint32_t l = this->header->low_bits;
+    uint64_t bucket = x >> l;
+    // the values with high part `bucket` follow the zero which ends bucket - 1
+    uint64_t bit = bucket == 0 ? 0 : select0(bucket - 1) + 1;
+    size_t i = bit - bucket;
+    uint64_t x_low = l == 0 ? 0 : x & (~0ULL >> (64 - l));
+    while (i < n && (this->high_words[bit / 64] & (1ULL << (bit % 64)))) {
+        if (low_value(i) >= x_low) {
+            return i;
+        }
+        i++;
+        bit++;
+    }
+    // the next value is in a later bucket, so greater than x
+    return i;
+}
+
+int write_elias_fano_index(const std::string& filename, const std::vector<struct index_entry>& entries) {
+    std::vector<uint64_t> keys(entries.size());
+    std::vector<uint64_t> offsets(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+        keys[i] = index_entry_key(entries[i].reference_name_idx, entries[i].position);
+        offsets[i] = entries[i].byte_offset;
+        if (i > 0 && (keys[i] < keys[i - 1] || offsets[i] < offsets[i - 1])) {
+            debugf("Index entry %lu is out of order, file must be sorted\n", i);
+            return -1;
+        }
+    }
+
+    struct index_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, VCFC_INDEX_MAGIC, sizeof(header.magic));
+    header.version = VCFC_INDEX_VERSION_ELIAS_FANO;
+    header.record_size = 0;
+    header.entry_count = entries.size();
+
+    struct elias_fano_header sequence_headers[2];
+    std::vector<uint64_t> words;
+    elias_fano_encode(keys, &sequence_headers[0], words);
+    elias_fano_encode(offsets, &sequence_headers[1], words);
+
+    FILE *index_file = fopen(filename.c_str(), "w");
+    if (index_file == NULL) {
+        perror("fopen");
+        return -1;
+    }
+    fwrite(&header, sizeof(header), 1, index_file);
+    fwrite(sequence_headers, sizeof(struct elias_fano_header), 2, index_file);
+    fwrite(words.data(), sizeof(uint64_t), words.size(), index_file);
+    if (ferror(index_file)) {
+        perror("fwrite");
+        fclose(index_file);
+        return -1;
+    }
+    fclose(index_file);
+    debugf("Wrote %lu entries in %lu bytes\n",
+        entries.size(), sizeof(header) + 2 * sizeof(struct elias_fano_header) + words.size() * sizeof(uint64_t));
+    return 0;
+}
+
+EliasFanoIndex::~EliasFanoIndex() {
+    if (this->map != NULL) {
+        munmap(this->map, this->map_length);
+    }
+}
+
+int EliasFanoIndex::open(const std::string& filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    const size_t headers_size = VCFC_INDEX_HEADER_SIZE + 2 * sizeof(struct elias_fano_header);
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < headers_size) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    madvise(map, st.st_size, MADV_RANDOM);
+
+    const struct index_file_header *header = (const struct index_file_header*) map;
+    const struct elias_fano_header *sequence_headers =
+        (const struct elias_fano_header*) ((const char*) map + VCFC_INDEX_HEADER_SIZE);
+    size_t word_count = 0;
+    for (int i = 0; i < 2; i++) {
+        word_count += sequence_headers[i].low_word_count + sequence_headers[i].high_word_count
+            + sequence_headers[i].select1_sample_count + sequence_headers[i].select0_sample_count;
+    }
+    if (memcmp(header->magic, VCFC_INDEX_MAGIC, sizeof(header->magic)) != 0
+            || header->version != VCFC_INDEX_VERSION_ELIAS_FANO
+            || sequence_headers[0].length != header->entry_count
+            || sequence_headers[1].length != header->entry_count
+            || headers_size + word_count * sizeof(uint64_t) != (size_t) st.st_size) {
+        debugf("%s is not a version %d index\n", filename.c_str(), VCFC_INDEX_VERSION_ELIAS_FANO);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    this->map = map;
+    this->map_length = st.st_size;
+    const uint64_t *words = (const uint64_t*) ((const char*) map + headers_size);
+    words += this->keys.init(&sequence_headers[0], words);
+    this->offsets.init(&sequence_headers[1], words);
+    return 0;
+}
+
+int EliasFanoIndex::search(uint32_t reference_name_idx, uint32_t position, struct index_entry *entry) const {
+    size_t n = this->keys.size();
+    if (n == 0) {
+        return 0;
+    }
+    size_t i = this->keys.lower_bound(index_entry_key(reference_name_idx, position));
+    // the entry before the first one not before the key, or the first entry
+    if (i > 0) {
+        i--;
+    }
+    uint64_t key = this->keys.access(i);
+    entry->reference_name_idx = (uint32_t) (key >> 32);
+    entry->position = (uint32_t) key;
+    entry->byte_offset = this->offsets.access(i);
+    return 1;
+}
+
+
+int write_two_level_index(const std::string& filename, const std::vector<struct index_entry>& entries) {
+    std::vector<struct keyed_index_record> sorted;
+    sorted_index_records(entries, sorted);
+
+    const size_t records_per_leaf = VCFC_TWO_LEVEL_RECORDS_PER_LEAF;
+    size_t leaf_count = (sorted.size() + records_per_leaf - 1) / records_per_leaf;
+    std::vector<uint64_t> summary(leaf_count);
+    for (size_t leaf = 0; leaf < leaf_count; leaf++) {
+        summary[leaf] = sorted[leaf * records_per_leaf].key;
+    }
+
+    struct index_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, VCFC_INDEX_MAGIC, sizeof(header.magic));
+    header.version = VCFC_INDEX_VERSION_TWO_LEVEL;
+    header.record_size = sizeof(struct keyed_index_record);
+    header.entry_count = sorted.size();
+    header.reserved[0] = records_per_leaf;
+    header.reserved[1] = leaf_count;
+
+    // leaves start page aligned, so reading one never touches two pages
+    size_t summary_end = VCFC_INDEX_HEADER_SIZE + leaf_count * sizeof(uint64_t);
+    std::vector<char> padding((VCFC_PAGE_SIZE - summary_end % VCFC_PAGE_SIZE) % VCFC_PAGE_SIZE, 0);
+
+    FILE *index_file = fopen(filename.c_str(), "w");
+    if (index_file == NULL) {
+        perror("fopen");
+        return -1;
+    }
+    if (fwrite(&header, sizeof(header), 1, index_file) != 1
+            || fwrite(summary.data(), sizeof(uint64_t), summary.size(), index_file) != summary.size()
+            || fwrite(padding.data(), 1, padding.size(), index_file) != padding.size()
+            || fwrite(sorted.data(), sizeof(struct keyed_index_record), sorted.size(), index_file) != sorted.size()) {
+        perror("fwrite");
+        fclose(index_file);
+        return -1;
+    }
+    fclose(index_file);
+    return 0;
+}
+
+TwoLevelIndex::~TwoLevelIndex() {
+    if (this->fd >= 0) {
+        close(this->fd);
+    }
+}
+
+int TwoLevelIndex::open(const std::string& filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    struct index_file_header header;
+    if (fstat(fd, &st) != 0
+            || pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)
+            || memcmp(header.magic, VCFC_INDEX_MAGIC, sizeof(header.magic)) != 0
+            || header.version != VCFC_INDEX_VERSION_TWO_LEVEL
+            || header.record_size != sizeof(struct keyed_index_record)
+            || header.reserved[0] == 0
+            || header.reserved[1] != (header.entry_count + header.reserved[0] - 1) / header.reserved[0]) {
+        debugf("%s is not a version %d index\n", filename.c_str(), VCFC_INDEX_VERSION_TWO_LEVEL);
+        close(fd);
+        return -1;
+    }
+    size_t leaf_count = header.reserved[1];
+    size_t summary_end = VCFC_INDEX_HEADER_SIZE + leaf_count * sizeof(uint64_t);
+    off_t leaf_offset = (summary_end + VCFC_PAGE_SIZE - 1) / VCFC_PAGE_SIZE * VCFC_PAGE_SIZE;
+    if ((size_t) st.st_size != leaf_offset + header.entry_count * header.record_size) {
+        debugf("%s is truncated\n", filename.c_str());
+        close(fd);
+        return -1;
+    }
+    this->summary.resize(leaf_count);
+    ssize_t summary_length = leaf_count * sizeof(uint64_t);
+    if (pread(fd, this->summary.data(), summary_length, VCFC_INDEX_HEADER_SIZE) != summary_length) {
+        perror("pread");
+        close(fd);
+        return -1;
+    }
+    // leaves are read one at a time, don't read ahead the rest
+    posix_fadvise(fd, leaf_offset, 0, POSIX_FADV_RANDOM);
+
+    this->fd = fd;
+    this->entry_count = header.entry_count;
+    this->records_per_leaf = header.reserved[0];
+    this->leaf_offset = leaf_offset;
+    return 0;
+}
+
+int TwoLevelIndex::search(uint32_t reference_name_idx, uint32_t position, struct index_entry *entry) const {
+    if (this->entry_count == 0) {
+        return 0;
+    }
+    uint64_t key = index_entry_key(reference_name_idx, position);
+    // the last leaf starting before the key holds the last record before it
+    size_t leaf = std::lower_bound(this->summary.begin(), this->summary.end(), key) - this->summary.begin();
+    if (leaf > 0) {
+        leaf--;
+    }
+    size_t first_record = leaf * this->records_per_leaf;
+    size_t record_count = std::min(this->records_per_leaf, this->entry_count - first_record);
+    std::vector<struct keyed_index_record> records(record_count);
+    ssize_t leaf_length = record_count * sizeof(struct keyed_index_record);
+    if (pread(this->fd, records.data(), leaf_length,
+            this->leaf_offset + first_record * sizeof(struct keyed_index_record)) != leaf_length) {
+        perror("pread");
+        return -1;
+    }
+    // the entry before the first one not before the key, or the first entry
+    size_t i = std::lower_bound(records.begin(), records.end(), key,
+        [](const struct keyed_index_record& record, uint64_t key) {
+            return record.key < key;
+        }) - records.begin();
+    if (i > 0) {
+        i--;
+    }
+    entry->reference_name_idx = (uint32_t) (records[i].key >> 32);
+    entry->position = (uint32_t) records[i].key;
+    entry->byte_offset = records[i].byte_offset;
+    return 1;
+}
+
+
+static_assert(sizeof(struct interval_index_record) == 24, "interval_index_record must be 24 bytes");
+static_assert(sizeof(struct interval_index_contig) == 64, "interval_index_contig must be 64 bytes");
+
+IntervalIndexBuilder::IntervalIndexBuilder(uint32_t lines_per_record):
+        lines_per_record(lines_per_record == 0 ? 1 : lines_per_record) {
+}
+
+void IntervalIndexBuilder::add_line(
+        const std::string& reference_name,
+        uint32_t position,
+        uint32_t end_position,
+        uint64_t byte_offset) {
+    if (this->current_records == NULL || reference_name != this->current_reference_name) {
+        // contigs of an unsorted file may come back, keep one list per name
+        size_t i = std::find(this->reference_names.begin(), this->reference_names.end(), reference_name)
+            - this->reference_names.begin();
+        if (i == this->reference_names.size()) {
+            if (reference_name.size() > VCFC_INTERVAL_INDEX_MAX_NAME) {
+                throw std::runtime_error("Reference name too long for interval index: " + reference_name);
+            }
+            this->reference_names.push_back(reference_name);
+            this->contig_records.push_back(std::vector<struct interval_index_record>());
+        }
+        this->current_reference_name = reference_name;
+        this->current_records = &this->contig_records[i];
+        // don't extend a span of an earlier run of this contig
+        this->current_records->push_back({position, end_position + 1, 0, 1, byte_offset});
+        return;
+    }
+    struct interval_index_record& span = this->current_records->back();
+    if (span.line_count < this->lines_per_record) {
+        span.line_count++;
+        span.start = std::min(span.start, position);
+        span.end = std::max(span.end, end_position + 1);
+    } else {
+        this->current_records->push_back({position, end_position + 1, 0, 1, byte_offset});
+    }
+}
+
+/**
+ * Sets max_end of the implicit tree over `a`, which must be sorted by start.
+ * Leaves are the even indexes, the node at i on level k has children
+ * i - 2^(k-1) and i + 2^(k-1). Returns the level of the root, -1 if empty.
+ */
+static int interval_tree_index(struct interval_index_record *a, int64_t n) {
+    if (n == 0) {
+        return -1;
+    }
+    int64_t last_i = 0;
+    uint32_t last = 0;
+    for (int64_t i = 0; i < n; i += 2) {
+        last_i = i;
+        last = a[i].max_end = a[i].end;
+    }
+    int k;
+    for (k = 1; (1LL << k) <= n; k++) {
+        int64_t x = 1LL << (k - 1);
+        int64_t i0 = (x << 1) - 1;
+        int64_t step = x << 2;
+        for (int64_t i = i0; i < n; i += step) {
+            uint32_t left = a[i - x].max_end;
+            // a right subtree past the end inherits the max of the last node
+            uint32_t right = i + x < n ? a[i + x].max_end : last;
+            a[i].max_end = std::max(a[i].end, std::max(left, right));
+        }
+        last_i = (last_i >> k) & 1 ? last_i - x : last_i + x;
+        if (last_i < n && a[last_i].max_end > last) {
+            last = a[last_i].max_end;
+        }
+    }
+    return k - 1;
+}
+
+int IntervalIndexBuilder::write(const std::string& filename) {
+    std::vector<struct interval_index_contig> contigs(this->reference_names.size());
+    uint64_t record_count = 0;
+    for (size_t c = 0; c < contigs.size(); c++) {
+        std::vector<struct interval_index_record>& records = this->contig_records[c];
+        std::stable_sort(records.begin(), records.end(),
+            [](const struct interval_index_record& a, const struct interval_index_record& b) {
+                return a.start < b.start;
+            });
+        memset(&contigs[c], 0, sizeof(struct interval_index_contig));
+        contigs[c].first_record = record_count;
+        contigs[c].record_count = records.size();
+        contigs[c].max_level = interval_tree_index(records.data(), records.size());
+        contigs[c].name_length = this->reference_names[c].size();
+        memcpy(contigs[c].name, this->reference_names[c].data(), contigs[c].name_length);
+        record_count += records.size();
+    }
+
+    struct index_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, VCFC_INDEX_MAGIC, sizeof(header.magic));
+    header.version = VCFC_INDEX_VERSION_INTERVAL;
+    header.record_size = sizeof(struct interval_index_record);
+    header.entry_count = record_count;
+    header.reserved[0] = contigs.size();
+
+    FILE *index_file = fopen(filename.c_str(), "w");
+    if (index_file == NULL) {
+        perror("fopen");
+        return -1;
+    }
+    fwrite(&header, sizeof(header), 1, index_file);
+    fwrite(contigs.data(), sizeof(struct interval_index_contig), contigs.size(), index_file);
+    for (const std::vector<struct interval_index_record>& records : this->contig_records) {
+        fwrite(records.data(), sizeof(struct interval_index_record), records.size(), index_file);
+    }
+    if (ferror(index_file)) {
+        perror("fwrite");
+        fclose(index_file);
+        return -1;
+    }
+    fclose(index_file);
+    return 0;
+}
+
+IntervalIndex::~IntervalIndex() {
+    if (this->map != NULL) {
+        munmap(this->map, this->map_length);
+    }
+}
+
+int IntervalIndex::open(const std::string& filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < VCFC_INDEX_HEADER_SIZE) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    const struct index_file_header *header = (const struct index_file_header*) map;
+    size_t contig_count = header->reserved[0];
+    if (memcmp(header->magic, VCFC_INDEX_MAGIC, sizeof(header->magic)) != 0
+            || header->version != VCFC_INDEX_VERSION_INTERVAL
+            || header->record_size != sizeof(struct interval_index_record)
+            || VCFC_INDEX_HEADER_SIZE
+                + contig_count * sizeof(struct interval_index_contig)
+                + header->entry_count * sizeof(struct interval_index_record) != (size_t) st.st_size) {
+        debugf("%s is not a version %d index\n", filename.c_str(), VCFC_INDEX_VERSION_INTERVAL);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    this->map = map;
+    this->map_length = st.st_size;
+    this->contigs = (const struct interval_index_contig*) ((const char*) map + VCFC_INDEX_HEADER_SIZE);
+    this->contig_count = contig_count;
+    this->records = (const struct interval_index_record*) (this->contigs + contig_count);
+    return 0;
+}
+
+void IntervalIndex::query(
+        const std::string& reference_name,
+        uint32_t start,
+        uint32_t end,
+        std::vector<struct interval_index_record>& records) const {
+    const struct interval_index_contig *contig = NULL;
+    for (size_t c = 0; c < this->contig_count; c++) {
+        if (this->contigs[c].name_length == reference_name.size()
+                && memcmp(this->contigs[c].name, reference_name.data(), reference_name.size()) == 0) {
+            contig = &this->contigs[c];
+            break;
+        }
+    }
+    if (contig == NULL || contig->max_level < 0) {
+        return;
+    }
+    const struct interval_index_record *a = this->records + contig->first_record;
+    const int64_t n = contig->record_count;
+    // records overlap [st, en) if a.start < en && st < a.end
+    const uint64_t st = start;
+    const uint64_t en = (uint64_t) end + 1;
+    size_t first_result = records.size();
+
+    // depth first over (level, node, left subtree done)
+    struct stack_item {
+        int k;
+        int64_t x;
+        bool left_done;
+    } stack[64];
+    int t = 0;
+    stack[t++] = {contig->max_level, (1LL << contig->max_level) - 1, false};
+    while (t > 0) {
+        struct stack_item z = stack[--t];
+        if (z.k <= 3) {
+            // small subtree, scan its nodes in order
+            int64_t i0 = z.x >> z.k << z.k;
+            int64_t i1 = std::min<int64_t>(i0 + (1LL << (z.k + 1)) - 1, n);
+            for (int64_t i = i0; i < i1 && a[i].start < en; i++) {
+                if (st < a[i].end) {
+                    records.push_back(a[i]);
+                }
+            }
+        } else if (!z.left_done) {
+            int64_t y = z.x - (1LL << (z.k - 1));
+            stack[t++] = {z.k, z.x, true};
+            if (y >= n || a[y].max_end > st) {
+                stack[t++] = {z.k - 1, y, false};
+            }
+        } else if (z.x < n && a[z.x].start < en) {
+            if (st < a[z.x].end) {
+                records.push_back(a[z.x]);
+            }
+            stack[t++] = {z.k - 1, z.x + (1LL << (z.k - 1)), false};
+        }
+    }
+    std::sort(records.begin() + first_result, records.end(),
+        [](const struct interval_index_record& a, const struct interval_index_record& b) {
+            return a.byte_offset < b.byte_offset;
+        });
+}
+
+
+static_assert(sizeof(struct learned_index_header) == 40, "learned_index_header must be 40 bytes");
+static_assert(sizeof(struct learned_index_segment) == 24, "learned_index_segment must be 24 bytes");
+
+LearnedIndexBuilder::LearnedIndexBuilder(uint32_t epsilon):
+        epsilon(epsilon) {
+}
+
+void LearnedIndexBuilder::add_line(
+        const std::string& reference_name,
+        uint32_t end_position,
+        uint64_t byte_offset) {
+    if (this->contigs.empty() || this->contigs.back().reference_name != reference_name) {
+        close_segment();
+        if (!this->contigs.empty()) {
+            this->contigs.back().end_offset = byte_offset;
+        }
+        struct learned_index_contig contig;
+        contig.reference_name = reference_name;
+        contig.first_segment = this->segments.size();
+        contig.segment_count = 0;
+        contig.end_offset = 0;
+        this->contigs.push_back(contig);
+    } else if (end_position <= this->max_end_position) {
+        // key did not grow, the line is covered by the previous point
+        return;
+    }
+    this->max_end_position = end_position;
+
+    if (this->segment_open) {
+        const struct learned_index_segment& segment = this->segments.back();
+        double dx = (double) end_position - segment.first_key;
+        double dy = (double) byte_offset - segment.first_offset;
+        double low = std::max(this->slope_low, (dy - this->epsilon) / dx);
+        double high = std::min(this->slope_high, (dy + this->epsilon) / dx);
+        if (low <= high) {
+            this->slope_low = low;
+            this->slope_high = high;
+            return;
+        }
+        debugf("Starting new segment at key %u, offset %lu\n", end_position, byte_offset);
+        close_segment();
+    }
+
+    struct learned_index_segment segment;
+    segment.first_offset = byte_offset;
+    segment.slope = 0;
+    segment.first_key = end_position;
+    segment.reserved = 0;
+    this->segments.push_back(segment);
+    this->contigs.back().segment_count++;
+    this->segment_open = true;
+    // offsets only grow with the key, so the slope is never negative
+    this->slope_low = 0;
+    this->slope_high = std::numeric_limits<double>::infinity();
+}
+
+void LearnedIndexBuilder::close_segment() {
+    if (!this->segment_open) {
+        return;
+    }
+    if (this->slope_high == std::numeric_limits<double>::infinity()) {
+        // single point segment
+        this->segments.back().slope = this->slope_low;
+    } else {
+        this->segments.back().slope = (this->slope_low + this->slope_high) / 2;
+    }
+    this->segment_open = false;
+}
+
+int LearnedIndexBuilder::write(const std::string& filename, uint64_t end_offset) {
+    close_segment();
+    if (!this->contigs.empty()) {
+        this->contigs.back().end_offset = end_offset;
+    }
+
+    FILE *index_file = fopen(filename.c_str(), "w");
+    if (index_file == NULL) {
+        perror("fopen");
+        return -1;
+    }
+    struct learned_index_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, VCFC_LEARNED_INDEX_MAGIC, sizeof(header.magic));
+    header.version = VCFC_LEARNED_INDEX_VERSION;
+    header.epsilon = this->epsilon;
+    header.contig_count = this->contigs.size();
+    header.segment_count = this->segments.size();
+    fwrite(&header, sizeof(header), 1, index_file);
+    for (const struct learned_index_contig& contig : this->contigs) {
+        uint8_t name_length = contig.reference_name.size();
+        fwrite(&name_length, 1, 1, index_file);
+        fwrite(contig.reference_name.data(), 1, name_length, index_file);
+        fwrite(&contig.first_segment, sizeof(contig.first_segment), 1, index_file);
+        fwrite(&contig.segment_count, sizeof(contig.segment_count), 1, index_file);
+        fwrite(&contig.end_offset, sizeof(contig.end_offset), 1, index_file);
+    }
+    fwrite(this->segments.data(), sizeof(struct learned_index_segment), this->segments.size(), index_file);
+    if (ferror(index_file)) {
+        perror("fwrite");
+        fclose(index_file);
+        return -1;
+    }
+    fclose(index_file);
+    debugf("Wrote %lu segments for %lu contigs\n", this->segments.size(), this->contigs.size());
+    return 0;
+}
+
+int LearnedIndex::load(const std::string& filename) {
+    FILE *index_file = fopen(filename.c_str(), "r");
+    if (index_file == NULL) {
+        return -1;
+    }
+    int status = -1;
+    struct learned_index_header header;
+    if (fread(&header, sizeof(header), 1, index_file) != 1
+            || memcmp(header.magic, VCFC_LEARNED_INDEX_MAGIC, sizeof(header.magic)) != 0
+            || header.version != VCFC_LEARNED_INDEX_VERSION) {
+        debugf("%s is not a learned index\n", filename.c_str());
+        fclose(index_file);
+        return -1;
+    }
+    this->epsilon = header.epsilon;
+    this->contigs.resize(header.contig_count);
+    for (struct learned_index_contig& contig : this->contigs) {
+        uint8_t name_length;
+        char name[256];
+        if (fread(&name_length, 1, 1, index_file) != 1
+                || fread(name, 1, name_length, index_file) != name_length
+                || fread(&contig.first_segment, sizeof(contig.first_segment), 1, index_file) != 1
+                || fread(&contig.segment_count, sizeof(contig.segment_count), 1, index_file) != 1
+                || fread(&contig.end_offset, sizeof(contig.end_offset), 1, index_file) != 1) {
+            goto done;
+        }
+        contig.reference_name.assign(name, name_length);
+        if ((uint64_t) contig.first_segment + contig.segment_count > header.segment_count) {
+            goto done;
+        }
+    }
+    this->segments.resize(header.segment_count);
+    if (fread(this->segments.data(), sizeof(struct learned_index_segment), header.segment_count, index_file)
+            != header.segment_count) {
+        goto done;
+    }
+    status = 0;
+done:
+    fclose(index_file);
+    return status;
+}
+
+/**
+ * Checks if a compressed line of `reference_name` starts at `line`, the bytes
+ * read from `file_offset` of `fd`. The headers must be consistent, the
+ * required columns must start with the contig and an integer POS, and the line
+ * must end with a newline.
+ */
+static bool is_line_at(
+        int fd,
+        const byte_t *line,
+        size_t len,
+        uint64_t file_offset,
+        const std::string& reference_name) {
+    if (len < compressed_line_length_headers_size || !is_line_start_byte(line[4])) {
+        // the required columns length header has the same extension bits
+        return false;
+    }
+    struct compressed_line_length_headers length_headers;
+    size_t header_length = 0;
+    try {
+        header_length = parse_compressed_line_length_headers(line, len, &length_headers);
+    } catch (VcfValidationError& e) {
+        return false;
+    }
+    if (header_length == 0 || length_headers.required_columns_length >= length_headers.line_length) {
+        return false;
+    }
+    size_t i = header_length + reference_name.size();
+    if (i + 2 > len
+            || memcmp(line + header_length, reference_name.data(), reference_name.size()) != 0
+            || line[i] != '\t') {
+        return false;
+    }
+    size_t digit_count = 0;
+    for (i++; i < len && line[i] >= '0' && line[i] <= '9'; i++) {
+        digit_count++;
+    }
+    if (digit_count == 0 || i >= len || line[i] != '\t') {
+        return false;
+    }
+    byte_t last_byte;
+    if (pread(fd, &last_byte, 1, file_offset + 4 + length_headers.line_length - 1) != 1) {
+        return false;
+    }
+    return last_byte == '\n';
+}
+
+/**
+ * Returns the first line start of `reference_name` in [`start`, `anchor`),
+ * or `anchor` if none is found. `anchor` must be a line start.
+ */
+static uint64_t find_line_start(
+        int fd,
+        const std::string& reference_name,
+        uint64_t start,
+        uint64_t anchor) {
+    const size_t window_size = 64 * 1024;
+    // enough bytes past a candidate to check its headers, contig and POS
+    const size_t probe_size = 8 + VARINT_MAX_LENGTH_32 + reference_name.size() + 1 + 12;
+    std::vector<byte_t> buf(1 + window_size + probe_size);
+    for (uint64_t window_start = start; window_start < anchor; window_start += window_size) {
+        size_t candidate_count = std::min((uint64_t) window_size, anchor - window_start);
+        // include the byte before the window, a line starts after a newline
+        ssize_t n = pread(fd, buf.data(), 1 + candidate_count + probe_size, window_start - 1);
+        if (n < 0) {
+            perror("pread");
+            break;
+        }
+        for (size_t i = 1; i <= candidate_count && i < (size_t) n; i++) {
+            if (buf[i - 1] == '\n' && is_line_start_byte(buf[i])
+                    && is_line_at(fd, buf.data() + i, n - i, window_start + i - 1, reference_name)) {
+                return window_start + i - 1;
+            }
+        }
+    }
+    return anchor;
+}
+
+int64_t LearnedIndex::find_scan_start(int fd, const std::string& reference_name, uint32_t position) const {
+    const struct learned_index_contig *contig = NULL;
+    for (const struct learned_index_contig& c : this->contigs) {
+        if (c.reference_name == reference_name) {
+            contig = &c;
+            break;
+        }
+    }
+    if (contig == NULL || contig->segment_count == 0) {
+        return -1;
+    }
+    const struct learned_index_segment *first = this->segments.data() + contig->first_segment;
+    const struct learned_index_segment *last = first + contig->segment_count;
+    // segment containing `position`
+    const struct learned_index_segment *next = std::upper_bound(first, last, position,
+        [](uint32_t p, const struct learned_index_segment& segment) {
+            return p < segment.first_key;
+        });
+    if (next == first) {
+        return first->first_offset;
+    }
+    const struct learned_index_segment& segment = *(next - 1);
+    uint64_t anchor = next == last ? contig->end_offset : next->first_offset;
+
+    double predicted = segment.first_offset + segment.slope * (position - segment.first_key);
+    int64_t window_start = (int64_t) predicted - this->epsilon - 1;
+    debugf("Predicted offset %.0f, searching for a line from %ld\n", predicted, window_start);
+    if (window_start <= (int64_t) segment.first_offset) {
+        return segment.first_offset;
+    } else if ((uint64_t) window_start >= anchor) {
+        return anchor;
+    }
+    return find_line_start(fd, reference_name, window_start, anchor);
+}
+
+
+/**
+ * Mixes the bits of an FNV hash so the low bits used as the table slot depend
+ * on the whole key (splitmix64 finalizer). Never returns 0, the empty key.
+ */
+static uint64_t finish_key_hash(uint64_t hash) {
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+    return hash == 0 ? 1 : hash;
+}
+
+uint64_t variant_key_hash(const std::string& reference_name, uint64_t position, const std::string& ref, const std::string& alt) {
+    std::string position_str = std::to_string(position);
+    // fields are separated by a byte that can't occur in them
+    uint64_t hash = FNV1A_OFFSET_BASIS;
+    hash = fnv1a_hash(reference_name.c_str(), reference_name.size() + 1, hash);
+    hash = fnv1a_hash(position_str.c_str(), position_str.size() + 1, hash);
+    hash = fnv1a_hash(ref.c_str(), ref.size() + 1, hash);
+    hash = fnv1a_hash(alt.c_str(), alt.size(), hash);
+    return finish_key_hash(hash);
+}
+
+uint64_t id_key_hash(const std::string& id) {
+    return finish_key_hash(fnv1a_hash(id.c_str(), id.size(), FNV1A_OFFSET_BASIS));
+}
+
+void HashIndexBuilder::add_line(
+        const std::string& reference_name,
+        uint64_t position,
+        const std::string& id,
+        const std::string& ref,
+        const std::string& alt,
+        uint64_t byte_offset) {
+    struct keyed_index_record record;
+    record.byte_offset = byte_offset;
+    for (const std::string& alt_allele : split_string(alt, ",")) {
+        uint64_t normalized_position = position;
+        std::string normalized_ref = ref;
+        std::string normalized_alt = alt_allele;
+        normalize_variant(&normalized_position, normalized_ref, normalized_alt);
+        record.key = variant_key_hash(reference_name, normalized_position, normalized_ref, normalized_alt);
+        this->variant_keys.push_back(record);
+    }
+    if (id != ".") {
+        for (const std::string& id_value : split_string(id, ";")) {
+            record.key = id_key_hash(id_value);
+            this->id_keys.push_back(record);
+        }
+    }
+}
+
+/**
+ * Capacity of a table holding `n` keys, a power of two at least twice `n`.
+ */
+static size_t hash_table_capacity(size_t n) {
+    size_t capacity = n > 0 ? 2 : 0;
+    while (capacity < 2 * n) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+/**
+ * Builds a linearly probed table from `keys`. Keys are inserted in order, so
+ * the lines of a key are probed in file order.
+ */
+static void build_hash_table(
+        const std::vector<struct keyed_index_record>& keys,
+        std::vector<struct keyed_index_record>& table) {
+    table.assign(hash_table_capacity(keys.size()), keyed_index_record{0, 0});
+    const size_t mask = table.size() - 1;
+    for (const struct keyed_index_record& record : keys) {
+        size_t slot = record.key & mask;
+        while (table[slot].key != 0) {
+            slot = (slot + 1) & mask;
+        }
+        table[slot] = record;
+    }
+}
+
+int HashIndexBuilder::write(const std::string& filename) {
+    std::vector<struct keyed_index_record> variant_table;
+    std::vector<struct keyed_index_record> id_table;
+    build_hash_table(this->variant_keys, variant_table);
+    build_hash_table(this->id_keys, id_table);
+
+    struct index_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, VCFC_INDEX_MAGIC, sizeof(header.magic));
+    header.version = VCFC_INDEX_VERSION_HASH;
+    header.record_size = sizeof(struct keyed_index_record);
+    header.entry_count = this->variant_keys.size() + this->id_keys.size();
+    header.reserved[0] = variant_table.size();
+    header.reserved[1] = id_table.size();
+
+    FILE *index_file = fopen(filename.c_str(), "w");
+    if (index_file == NULL) {
+        perror("fopen");
+        return -1;
+    }
+    if (fwrite(&header, sizeof(header), 1, index_file) != 1
+            || fwrite(variant_table.data(), sizeof(struct keyed_index_record), variant_table.size(), index_file) != variant_table.size()
+            || fwrite(id_table.data(), sizeof(struct keyed_index_record), id_table.size(), index_file) != id_table.size()) {
+        perror("fwrite");
+        fclose(index_file);
+        return -1;
+    }
+    fclose(index_file);
+    return 0;
+}
+
+HashIndex::~HashIndex() {
+    if (this->map != NULL) {
+        munmap(this->map, this->map_length);
+    }
+}
+
+int HashIndex::open(const std::string& filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < VCFC_INDEX_HEADER_SIZE) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    // a lookup touches one slot and its probes
+    madvise(map, st.st_size, MADV_RANDOM);
+
+    const struct index_file_header *header = (const struct index_file_header*) map;
+    size_t variant_capacity = header->reserved[0];
+    size_t id_capacity = header->reserved[1];
+    if (memcmp(header->magic, VCFC_INDEX_MAGIC, sizeof(header->magic)) != 0
+            || header->version != VCFC_INDEX_VERSION_HASH
+            || header->record_size != sizeof(struct keyed_index_record)
+            || (variant_capacity & (variant_capacity - 1)) != 0
+            || (id_capacity & (id_capacity - 1)) != 0
+            || VCFC_INDEX_HEADER_SIZE + (variant_capacity + id_capacity) * header->record_size != (size_t) st.st_size) {
+        debugf("%s is not a version %d index\n", filename.c_str(), VCFC_INDEX_VERSION_HASH);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    this->map = map;
+    this->map_length = st.st_size;
+    this->variant_table = (const struct keyed_index_record*) ((const char*) map + VCFC_INDEX_HEADER_SIZE);
+    this->variant_capacity = variant_capacity;
+    this->id_table = this->variant_table + variant_capacity;
+    this->id_capacity = id_capacity;
+    return 0;
+}
+
+/**
+ * Appends the offsets stored under `key` in a linearly probed table.
+ */
+static void probe_hash_table(
+        const struct keyed_index_record *table,
+        size_t capacity,
+        uint64_t key,
+        std::vector<uint64_t>& offsets) {
+    if (capacity == 0) {
+        return;
+    }
+    const size_t mask = capacity - 1;
+    size_t first = offsets.size();
+    // the table is at most half full, so the run ends at an empty slot
+    for (size_t slot = key & mask; table[slot].key != 0; slot = (slot + 1) & mask) {
+        if (table[slot].key == key) {
+            offsets.push_back(table[slot].byte_offset);
+        }
+    }
+    std::sort(offsets.begin() + first, offsets.end());
+    offsets.erase(std::unique(offsets.begin() + first, offsets.end()), offsets.end());
+}
+
+void HashIndex::find_variant(uint64_t key, std::vector<uint64_t>& offsets) const {
+    probe_hash_table(this->variant_table, this->variant_capacity, key, offsets);
+}
+
+void HashIndex::find_id(uint64_t key, std::vector<uint64_t>& offsets) const {
+    probe_hash_table(this->id_table, this->id_capacity, key, offsets);
+}
+
+
+static_assert(sizeof(struct bloom_filter_bin) == 32, "bloom_filter_bin must be 32 bytes");
+
+/**
+ * Bit `i` of the k bits of `key` in a filter of `bit_count` bits.
+ */
+static inline uint64_t bloom_filter_bit(uint64_t key, uint32_t i, uint64_t bit_count) {
+    uint64_t h1 = (uint32_t) key;
+    uint64_t h2 = (key >> 32) | 1;
+    return (h1 + i * h2) % bit_count;
+}
+
+static void bloom_filter_add(uint64_t *words, size_t word_count, uint32_t hash_count, uint64_t key) {
+    for (uint32_t i = 0; i < hash_count; i++) {
+        uint64_t bit = bloom_filter_bit(key, i, (uint64_t) word_count * 64);
+        words[bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+static bool bloom_filter_may_contain(const uint64_t *words, size_t word_count, uint32_t hash_count, uint64_t key) {
+    for (uint32_t i = 0; i < hash_count; i++) {
+        uint64_t bit = bloom_filter_bit(key, i, (uint64_t) word_count * 64);
+        if ((words[bit / 64] & (1ULL << (bit % 64))) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+BloomFilterIndexBuilder::BloomFilterIndexBuilder(const VcfPackedBinningIndexConfiguration& index_configuration, uint32_t bits_per_key):
+        index_configuration(index_configuration),
+        bits_per_key(bits_per_key) {
+    // k = ln 2 * bits per key minimizes the false positive rate
+    this->hash_count = std::max<uint32_t>(1, std::min<uint32_t>(16, (uint32_t) (bits_per_key * 0.69 + 0.5)));
+}
+
+void BloomFilterIndexBuilder::close_bin(uint64_t end_offset) {
+    if (this->bins.empty() || this->bins.back().end_offset != 0) {
+        return;
+    }
+    struct bloom_filter_bin& bin = this->bins.back();
+    bin.end_offset = end_offset;
+    bin.first_word = this->words.size();
+    bin.key_count = this->bin_keys.size();
+    bin.word_count = std::max<uint64_t>(1, ((uint64_t) bin.key_count * this->bits_per_key + 63) / 64);
+    this->words.resize(this->words.size() + bin.word_count, 0);
+    for (uint64_t key : this->bin_keys) {
+        bloom_filter_add(&this->words[bin.first_word], bin.word_count, this->hash_count, key);
+    }
+    this->bin_keys.clear();
+}
+
+void BloomFilterIndexBuilder::add_line(
+        const std::string& reference_name,
+        uint64_t position,
+        const std::string& id,
+        const std::string& ref,
+        const std::string& alt,
+        uint64_t byte_offset) {
+    bool bin_full = this->bins.empty();
+    if (!bin_full) {
+        uint64_t bin_offset = this->bins.back().start_offset;
+        if (this->index_configuration.bytes_per_bin > 0) {
+            if (this->index_configuration.align_bins) {
+                bin_full = byte_offset / this->index_configuration.bytes_per_bin
+                    != bin_offset / this->index_configuration.bytes_per_bin;
+            } else {
+                bin_full = byte_offset - bin_offset >= this->index_configuration.bytes_per_bin;
+            }
+        } else {
+            bin_full = this->bin_line_count >= (size_t) this->index_configuration.entries_per_bin;
+        }
+    }
+    if (bin_full) {
+        close_bin(byte_offset);
+        struct bloom_filter_bin bin;
+        memset(&bin, 0, sizeof(bin));
+        bin.start_offset = byte_offset;
+        this->bins.push_back(bin);
+        this->bin_line_count = 0;
+    }
+    this->bin_line_count++;
+
+    // the same keys as the hash index
+    for (const std::string& alt_allele : split_string(alt, ",")) {
+        uint64_t normalized_position = position;
+        std::string normalized_ref = ref;
+        std::string normalized_alt = alt_allele;
+        normalize_variant(&normalized_position, normalized_ref, normalized_alt);
+        this->bin_keys.push_back(variant_key_hash(reference_name, normalized_position, normalized_ref, normalized_alt));
+    }
+    if (id != ".") {
+        for (const std::string& id_value : split_string(id, ";")) {
+            this->bin_keys.push_back(id_key_hash(id_value));
+        }
+    }
+}
+
+int BloomFilterIndexBuilder::write(const std::string& filename, uint64_t end_offset, struct bloom_filter_stats *stats) {
+    close_bin(end_offset);
+
+    memset(stats, 0, sizeof(struct bloom_filter_stats));
+    stats->bin_count = this->bins.size();
+    stats->filter_bytes = this->words.size() * sizeof(uint64_t);
+    for (const struct bloom_filter_bin& bin : this->bins) {
+        stats->key_count += bin.key_count;
+        // (1 - e^(-kn/m))^k
+        double bit_count = (double) bin.word_count * 64;
+        stats->expected_false_positive_rate += std::pow(
+            1 - std::exp(-(double) this->hash_count * bin.key_count / bit_count), this->hash_count);
+    }
+    if (!this->bins.empty()) {
+        stats->expected_false_positive_rate /= this->bins.size();
+        // random keys are absent, except for a hash collision
+        const size_t probe_count = 100000;
+        size_t positives = 0;
+        uint64_t state = 0x9e3779b97f4a7c15ULL;
+        for (size_t i = 0; i < probe_count; i++) {
+            state += 0x9e3779b97f4a7c15ULL;
+            uint64_t key = finish_key_hash(state);
+            struct bloom_filter_bin& bin = this->bins[(key >> 17) % this->bins.size()];
+            positives += bloom_filter_may_contain(&this->words[bin.first_word], bin.word_count, this->hash_count, key);
+        }
+        stats->measured_false_positive_rate = (double) positives / probe_count;
+    }
+
+    struct index_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, VCFC_INDEX_MAGIC, sizeof(header.magic));
+    header.version = VCFC_INDEX_VERSION_BLOOM;
+    header.record_size = sizeof(struct bloom_filter_bin);
+    header.entry_count = this->bins.size();
+    header.reserved[0] = this->hash_count;
+    header.reserved[1] = this->bits_per_key;
+
+    FILE *index_file = fopen(filename.c_str(), "w");
+    if (index_file == NULL) {
+        perror("fopen");
+        return -1;
+    }
+    if (fwrite(&header, sizeof(header), 1, index_file) != 1
+            || fwrite(this->bins.data(), sizeof(struct bloom_filter_bin), this->bins.size(), index_file) != this->bins.size()
+            || fwrite(this->words.data(), sizeof(uint64_t), this->words.size(), index_file) != this->words.size()) {
+        perror("fwrite");
+        fclose(index_file);
+        return -1;
+    }
+    fclose(index_file);
+    return 0;
+}
+
+BloomFilterIndex::~BloomFilterIndex() {
+    if (this->map != NULL) {
+        munmap(this->map, this->map_length);
+    }
+}
+
+int BloomFilterIndex::open(const std::string& filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < VCFC_INDEX_HEADER_SIZE) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    const struct index_file_header *header = (const struct index_file_header*) map;
+    size_t bins_end = VCFC_INDEX_HEADER_SIZE + header->entry_count * sizeof(struct bloom_filter_bin);
+    if (memcmp(header->magic, VCFC_INDEX_MAGIC, sizeof(header->magic)) != 0
+            || header->version != VCFC_INDEX_VERSION_BLOOM
+            || header->record_size != sizeof(struct bloom_filter_bin)
+            || header->reserved[0] == 0
+            || bins_end > (size_t) st.st_size
+            || (st.st_size - bins_end) % sizeof(uint64_t) != 0) {
+        debugf("%s is not a version %d index\n", filename.c_str(), VCFC_INDEX_VERSION_BLOOM);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    this->bins = (const struct bloom_filter_bin*) ((const char*) map + VCFC_INDEX_HEADER_SIZE);
+    this->bin_count = header->entry_count;
+    this->words = (const uint64_t*) ((const char*) map + bins_end);
+    size_t word_count = (st.st_size - bins_end) / sizeof(uint64_t);
+    for (size_t i = 0; i < this->bin_count; i++) {
+        if (this->bins[i].word_count == 0 || this->bins[i].first_word + this->bins[i].word_count > word_count) {
+            debugf("%s has a filter past the end of the file\n", filename.c_str());
+            munmap(map, st.st_size);
+            return -1;
+        }
+    }
+    this->map = map;
+    this->map_length = st.st_size;
+    this->hash_count = header->reserved[0];
+    return 0;
+}
+
+void BloomFilterIndex::find(uint64_t key, std::vector<struct bloom_filter_bin>& bins) const {
+    for (size_t i = 0; i < this->bin_count; i++) {
+        const struct bloom_filter_bin& bin = this->bins[i];
+        if (bloom_filter_may_contain(&this->words[bin.first_word], bin.word_count, this->hash_count, key)) {
+            bins.push_back(bin);
+        }
+    }
+}
+
+
+static_assert(sizeof(struct zone_map_record) == 128, "zone_map_record must be 128 bytes");
+
+const char *zone_map_field_names[VCFC_ZONE_MAP_FIELD_COUNT] = {"QUAL", "AF", "AC", "DP"};
+
+/**
+ * Parses all of `s` as a number. Returns 0 on success.
+ */
+static int parse_zone_map_value(const std::string& s, double *value) {
+    if (s.empty() || s == ".") {
+        return -1;
+    }
+    char *end = NULL;
+    *value = strtod(s.c_str(), &end);
+    if (end != s.c_str() + s.size() || std::isnan(*value)) {
+        return -1;
+    }
+    return 0;
+}
+
+void parse_zone_map_line(
+        const std::string& qual,
+        const std::string& filter,
+        const std::string& info,
+        struct zone_map_line *line) {
+    for (size_t field = 0; field < VCFC_ZONE_MAP_FIELD_COUNT; field++) {
+        line->values[field].clear();
+    }
+    line->filters.clear();
+
+    double value;
+    if (parse_zone_map_value(qual, &value) == 0) {
+        line->values[0].push_back(value);
+    }
+    if (filter != ".") {
+        line->filters = split_string(filter, ";");
+    }
+    for (const std::string& term : split_string(info, ";")) {
+        size_t eq_idx = term.find('=');
+        if (eq_idx == std::string::npos) {
+            continue;
+        }
+        for (size_t field = 1; field < VCFC_ZONE_MAP_FIELD_COUNT; field++) {
+            if (term.compare(0, eq_idx, zone_map_field_names[field]) == 0) {
+                for (const std::string& value_str : split_string(term.substr(eq_idx + 1), ",")) {
+                    if (parse_zone_map_value(value_str, &value) == 0) {
+                        line->values[field].push_back(value);
+                    }
+                }
+                break;
+            }
+        }
+    }
+}
+
+static std::string trim_spaces(const std::string& s) {
+    size_t first = s.find_first_not_of(' ');
+    if (first == std::string::npos) {
+        return "";
+    }
+    return s.substr(first, s.find_last_not_of(' ') - first + 1);
+}
+
+int parse_zone_map_predicates(const std::string& s, std::vector<struct zone_map_predicate>& predicates) {
+    // longer operators first, so >= is not read as >
+    static const std::vector<std::pair<std::string,zone_map_operator>> operators = {
+        {">=", zone_map_operator::GE}, {"<=", zone_map_operator::LE}, {"!=", zone_map_operator::NE},
+        {">", zone_map_operator::GT}, {"<", zone_map_operator::LT}, {"=", zone_map_operator::EQ}};
+    for (const std::string& term_str : split_string(s, " and ")) {
+        std::string term = trim_spaces(term_str);
+        size_t op_idx = term.find_first_of("<>!=");
+        if (op_idx == std::string::npos || op_idx == 0) {
+            return -1;
+        }
+        struct zone_map_predicate predicate;
+        bool found_operator = false;
+        for (const std::pair<std::string,zone_map_operator>& op : operators) {
+            if (term.compare(op_idx, op.first.size(), op.first) == 0) {
+                predicate.op = op.second;
+                found_operator = true;
+                break;
+            }
+        }
+        if (!found_operator) {
+            return -1;
+        }
+        std::string name = trim_spaces(term.substr(0, op_idx));
+        std::string value_str = trim_spaces(term.substr(op_idx + (term[op_idx + 1] == '=' ? 2 : 1)));
+        if (name.compare(0, 5, "INFO/") == 0) {
+            name = name.substr(5);
+        }
+        if (name == "FILTER") {
+            if (value_str.empty() || (predicate.op != zone_map_operator::EQ && predicate.op != zone_map_operator::NE)) {
+                return -1;
+            }
+            predicate.field = -1;
+            predicate.value = 0;
+            predicate.filter = value_str;
+        } else {
+            predicate.field = -1;
+            for (size_t field = 0; field < VCFC_ZONE_MAP_FIELD_COUNT; field++) {
+                if (name == zone_map_field_names[field]) {
+                    predicate.field = field;
+                }
+            }
+            if (predicate.field < 0 || parse_zone_map_value(value_str, &predicate.value) != 0) {
+                return -1;
+            }
+        }
+        predicates.push_back(predicate);
+    }
+    return predicates.empty() ? -1 : 0;
+}
+
+static bool zone_map_compare(double a, zone_map_operator op, double b) {
+    switch (op) {
+        case zone_map_operator::LT: return a < b;
+        case zone_map_operator::LE: return a <= b;
+        case zone_map_operator::GT: return a > b;
+        case zone_map_operator::GE: return a >= b;
+        case zone_map_operator::EQ: return a == b;
+        case zone_map_operator::NE: return a != b;
+    }
+    return false;
+}
+
+bool zone_map_line_matches(const struct zone_map_line& line, const std::vector<struct zone_map_predicate>& predicates) {
+    for (const struct zone_map_predicate& predicate : predicates) {
+        bool matches = false;
+        if (predicate.field < 0) {
+            bool has_filter = std::find(line.filters.begin(), line.filters.end(), predicate.filter) != line.filters.end();
+            matches = predicate.op == zone_map_operator::EQ ? has_filter : !has_filter;
+        } else {
+            for (double value : line.values[predicate.field]) {
+                if (zone_map_compare(value, predicate.op, predicate.value)) {
+                    matches = true;
+                    break;
+                }
+            }
+        }
+        if (!matches) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint64_t ZoneMapBuilder::filter_bit(const std::string& filter) {
+    size_t i = std::find(this->filter_names.begin(), this->filter_names.end(), filter) - this->filter_names.begin();
+    if (i == this->filter_names.size()) {
+        this->filter_names.push_back(filter);
+    }
+    return 1ULL << std::min<size_t>(i, VCFC_ZONE_MAP_FILTER_BITS - 1);
+}
+
+void ZoneMapBuilder::add_line(
+        size_t bin,
+        const std::string& reference_name,
+        uint32_t position,
+        uint32_t end_position,
+        const std::string& qual,
+        const std::string& filter,
+        const std::string& info,
+        uint64_t byte_offset) {
+    if (bin >= this->records.size()) {
+        if (!this->records.empty()) {
+            this->records.back().end_offset = byte_offset;
+        }
+        struct zone_map_record record;
+        memset(&record, 0, sizeof(record));
+        record.start_offset = byte_offset;
+        record.first_position = position;
+        record.reference_name_idx = this->ref_name_map.reference_to_int(reference_name);
+        record.filter_all = ~0ULL;
+        for (size_t field = 0; field < VCFC_ZONE_MAP_FIELD_COUNT; field++) {
+            record.min[field] = std::numeric_limits<double>::infinity();
+            record.max[field] = -std::numeric_limits<double>::infinity();
+        }
+        this->records.push_back(record);
+    }
+    struct zone_map_record& record = this->records.back();
+    record.max_end_position = std::max(record.max_end_position, end_position);
+
+    struct zone_map_line line;
+    parse_zone_map_line(qual, filter, info, &line);
+    uint64_t filter_bits = 0;
+    for (const std::string& filter_name : line.filters) {
+        filter_bits |= filter_bit(filter_name);
+    }
+    record.filter_any |= filter_bits;
+    record.filter_all &= filter_bits;
+    for (size_t field = 0; field < VCFC_ZONE_MAP_FIELD_COUNT; field++) {
+        if (line.values[field].empty()) {
+            continue;
+        }
+        record.count[field]++;
+        for (double value : line.values[field]) {
+            record.min[field] = std::min(record.min[field], value);
+            record.max[field] = std::max(record.max[field], value);
+        }
+    }
+}
+
+int ZoneMapBuilder::write(const std::string& filename, uint64_t end_offset) {
+    if (!this->records.empty()) {
+        this->records.back().end_offset = end_offset;
+    }
+    std::vector<uint8_t> names;
+    for (const std::string& filter_name : this->filter_names) {
+        uint8_t name_length = std::min<size_t>(filter_name.size(), UINT8_MAX);
+        names.push_back(name_length);
+        names.insert(names.end(), filter_name.begin(), filter_name.begin() + name_length);
+    }
+    names.resize((names.size() + 7) / 8 * 8, 0);
+
+    struct index_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, VCFC_INDEX_MAGIC, sizeof(header.magic));
+    header.version = VCFC_INDEX_VERSION_ZONE_MAP;
+    header.record_size = sizeof(struct zone_map_record);
+    header.entry_count = this->records.size();
+    header.reserved[0] = this->filter_names.size();
+
+    FILE *index_file = fopen(filename.c_str(), "w");
+    if (index_file == NULL) {
+        perror("fopen");
+        return -1;
+    }
+    if (fwrite(&header, sizeof(header), 1, index_file) != 1
+            || fwrite(names.data(), 1, names.size(), index_file) != names.size()
+            || fwrite(this->records.data(), sizeof(struct zone_map_record), this->records.size(), index_file) != this->records.size()) {
+        perror("fwrite");
+        fclose(index_file);
+        return -1;
+    }
+    fclose(index_file);
+    return 0;
+}
+
+ZoneMap::~ZoneMap() {
+    if (this->map != NULL) {
+        munmap(this->map, this->map_length);
+    }
+}
+
+int ZoneMap::open(const std::string& filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < VCFC_INDEX_HEADER_SIZE) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    const struct index_file_header *header = (const struct index_file_header*) map;
+    if (memcmp(header->magic, VCFC_INDEX_MAGIC, sizeof(header->magic)) != 0
+            || header->version != VCFC_INDEX_VERSION_ZONE_MAP
+            || header->record_size != sizeof(struct zone_map_record)) {
+        debugf("%s is not a version %d index\n", filename.c_str(), VCFC_INDEX_VERSION_ZONE_MAP);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    const uint8_t *names = (const uint8_t*) map + VCFC_INDEX_HEADER_SIZE;
+    const uint8_t *map_end = (const uint8_t*) map + st.st_size;
+    std::vector<std::string> filter_names;
+    for (size_t i = 0; i < header->reserved[0]; i++) {
+        if (names >= map_end || names + 1 + names[0] > map_end) {
+            debugf("%s has truncated FILTER names\n", filename.c_str());
+            munmap(map, st.st_size);
+            return -1;
+        }
+        filter_names.push_back(std::string((const char*) names + 1, names[0]));
+        names += 1 + names[0];
+    }
+    size_t records_offset = (names - (const uint8_t*) map + 7) / 8 * 8;
+    if (records_offset + header->entry_count * sizeof(struct zone_map_record) != (size_t) st.st_size) {
+        debugf("%s has a wrong size\n", filename.c_str());
+        munmap(map, st.st_size);
+        return -1;
+    }
+    this->map = map;
+    this->map_length = st.st_size;
+    this->filter_names = filter_names;
+    this->records = (const struct zone_map_record*) ((const char*) map + records_offset);
+    this->record_count = header->entry_count;
+    return 0;
+}
+
+size_t ZoneMap::search(uint32_t reference_name_idx, uint32_t position) const {
+    uint64_t key = index_entry_key(reference_name_idx, position);
+    // the bin before the first one whose max END reaches the key
+    size_t low = 0, high = this->record_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (index_entry_key(this->records[mid].reference_name_idx, this->records[mid].max_end_position) < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low > 0 ? low - 1 : 0;
+}
+
+bool ZoneMap::may_match(size_t bin, const std::vector<struct zone_map_predicate>& predicates) const {
+    const struct zone_map_record& record = this->records[bin];
+    for (const struct zone_map_predicate& predicate : predicates) {
+        if (predicate.field < 0) {
+            size_t i = std::find(this->filter_names.begin(), this->filter_names.end(), predicate.filter)
+                - this->filter_names.begin();
+            bool shared_bit = i >= VCFC_ZONE_MAP_FILTER_BITS - 1;
+            uint64_t bit = 1ULL << std::min<size_t>(i, VCFC_ZONE_MAP_FILTER_BITS - 1);
+            if (predicate.op == zone_map_operator::EQ && (record.filter_any & bit) == 0) {
+                return false;
+            }
+            if (predicate.op == zone_map_operator::NE && !shared_bit && (record.filter_all & bit) != 0) {
+                return false;
+            }
+            continue;
+        }
+        double min = record.min[predicate.field];
+        double max = record.max[predicate.field];
+        if (record.count[predicate.field] == 0) {
+            return false;
+        }
+        bool ruled_out = false;
+        switch (predicate.op) {
+            case zone_map_operator::LT: ruled_out = min >= predicate.value; break;
+            case zone_map_operator::LE: ruled_out = min > predicate.value; break;
+            case zone_map_operator::GT: ruled_out = max <= predicate.value; break;
+            case zone_map_operator::GE: ruled_out = max < predicate.value; break;
+            case zone_map_operator::EQ: ruled_out = predicate.value < min || predicate.value > max; break;
+            case zone_map_operator::NE: ruled_out = min == predicate.value && max == predicate.value; break;
+        }
+        if (ruled_out) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,847 @@
+#pragma once
+#ifndef _INDEX_H
+#define _INDEX_H
+
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "utils.hpp"
+
+#define VCFC_PAGE_SIZE 4096
+
+class VcfPackedBinningIndexConfiguration {
+public:
+    VcfPackedBinningIndexConfiguration(int entries_per_bin):
+            entries_per_bin(entries_per_bin) {
+
+    }
+
+    int entries_per_bin;
+
+    // When set, bins hold about this many compressed bytes instead of
+    // entries_per_bin lines, so every bin is scanned with a similar read
+    size_t bytes_per_bin = 0;
+    // Start a bin only at the first line in each bytes_per_bin aligned window
+    // of the file, e.g. one bin per page
+    bool align_bins = false;
+
+    bool enabled() const {
+        return this->entries_per_bin > 0 || this->bytes_per_bin > 0;
+    }
+};
+
+/**
+ * Parses a bin size: `<lines>`, `<bytes>b`, `<bytes>b:aligned`, or `page` for
+ * `4096b:aligned`. Returns 0 on success.
+ */
+int parse_binning_policy(const std::string& spec, VcfPackedBinningIndexConfiguration *config);
+
+struct index_entry {
+    uint32_t reference_name_idx;    // id in the file's contig dictionary, see reference_name_map
+    uint32_t position;
+    uint64_t byte_offset;
+};
+// packed size of the fields as written to an index file
+extern size_t struct_index_entry_size;
+
+int write_index_entry_fd(int fd, struct index_entry *entry);
+long write_index_entry(FILE *file, struct index_entry *entry);
+int read_index_entry_fd(int fd, struct index_entry *entry, int *bytes_read);
+int read_index_entry(FILE *file, struct index_entry *entry, int *bytes_read);
+/**
+ * Reads all entries of a packed .vcfci index. Returns 0 on success.
+ */
+int read_index_entries(const std::string& filename, std::vector<struct index_entry>& entries);
+
+/**
+ * Builds the entries of a binned index from the lines of a file, in file order.
+ * Every `entries_per_bin` lines start a new entry, whose position is the max END
+ * of the lines it covers. A new entry is only started if the line extends past
+ * the END of the previous entry.
+ */
+class BinnedIndexBuilder {
+public:
+    BinnedIndexBuilder(const VcfPackedBinningIndexConfiguration& index_configuration);
+
+    void add_line(
+            const std::string& reference_name,
+            uint32_t end_position,
+            uint64_t byte_offset);
+
+    // Contig dictionary of the file, the legacy list if not set
+    void set_reference_names(const reference_name_map& ref_name_map) {
+        this->ref_name_map = ref_name_map;
+    }
+
+    const std::vector<struct index_entry>& get_entries() {
+        return this->index_vector;
+    }
+
+private:
+    VcfPackedBinningIndexConfiguration index_configuration;
+    reference_name_map ref_name_map;
+    std::vector<struct index_entry> index_vector;
+    // Counter to handle entries per bin
+    size_t line_number = 0;
+};
+
+////////////////////////////////////////////////////////////////
+// Eytzinger index (.vcfci-eytzinger)
+//
+// Version 2 of the binned index. The entries are the same as in a .vcfci
+// file, but stored as aligned 16 byte records in Eytzinger (BFS) order: the
+// root is record 1 and the children of record k are 2k and 2k+1. Record 0 is
+// unused, so with the 64 byte header the 4 grandchildren of a record share
+// one cache line. The file is mmapped by queries and searched in place.
+////////////////////////////////////////////////////////////////
+
+#define VCFC_INDEX_MAGIC                "VCFCIDX2"
+#define VCFC_INDEX_VERSION_EYTZINGER    2
+#define VCFC_INDEX_HEADER_SIZE          64
+
+// Bytes at the end of the compressed file covered by the data checksum
+#define VCFC_INDEX_CHECKSUM_SIZE        4096
+
+struct index_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t entry_count;
+    uint64_t reserved[3];
+    // of the compressed file the index was built from, 0 if not recorded,
+    // see stamp_index_data
+    uint64_t data_size;
+    uint64_t data_checksum;
+};
+
+/**
+ * Records the size and a checksum of the end of `compressed_filename` in the
+ * header of the index `index_filename`, once the compressed file is
+ * complete. The index is either one of the index_file_header layouts or a
+ * learned index. The .vcfci entries and the sparse external index have no
+ * header and are not stamped. Returns 0 on success.
+ */
+int stamp_index_data(const std::string& index_filename, const std::string& compressed_filename);
+
+/**
+ * Whether the index `index_filename` exists and was stamped for the current
+ * contents of `compressed_filename`, see stamp_index_data. An index built
+ * for an earlier version of the file would give wrong byte offsets.
+ */
+bool index_matches_data(const std::string& index_filename, const std::string& compressed_filename);
+
+// Entry of the fixed record layouts
+struct keyed_index_record {
+    uint64_t key;               // see index_entry_key, a key hash in the hash index
+    uint64_t byte_offset;
+};
+
+// Sort key of an entry, orders by reference then position
+inline uint64_t index_entry_key(uint32_t reference_name_idx, uint32_t position) {
+    return ((uint64_t) reference_name_idx << 32) | position;
+}
+
+/**
+ * Writes `entries` as a .vcfci-eytzinger index. Returns 0 on success.
+ */
+int write_eytzinger_index(const std::string& filename, const std::vector<struct index_entry>& entries);
+
+/**
+ * Read-only view of a mmapped .vcfci-eytzinger index.
+ */
+class EytzingerIndex {
+public:
+    EytzingerIndex(){};
+    ~EytzingerIndex();
+
+    /**
+     * Maps `filename`. Returns 0 on success, negative if the file does not
+     * exist or is not a version 2 index.
+     */
+    int open(const std::string& filename);
+
+    /**
+     * Finds the entry to start scanning from for lines overlapping
+     * (reference_name_idx, position): the last entry ordered before it, or the
+     * first entry if there is none. Returns 1 and sets `entry`, 0 if the index
+     * is empty.
+     */
+    int search(uint32_t reference_name_idx, uint32_t position, struct index_entry *entry) const;
+
+    size_t size() const {
+        return this->entry_count;
+    }
+
+private:
+    void *map = NULL;
+    size_t map_length = 0;
+    const struct keyed_index_record *records = NULL;
+    size_t entry_count = 0;
+};
+
+////////////////////////////////////////////////////////////////
+// Elias-Fano index (.vcfci-ef)
+//
+// Version 3 of the binned index. The entry keys (see index_entry_key) and the
+// byte offsets are both non-decreasing, so each is stored as an Elias-Fano
+// sequence: the low `low_bits` bits of every value packed in an array, and the
+// high bits in unary in a bit vector, where value i sets bit (v >> l) + i.
+// Samples of every VCFC_ELIAS_FANO_SAMPLE_RATE-th one and zero bit support
+// select, which is used to access values and to find the bucket of a key.
+//
+// Layout: index_file_header, 2 elias_fano_header (keys, offsets), then per
+// sequence its low words, high words, select1 samples and select0 samples,
+// all uint64. The file is mmapped and queried in place.
+////////////////////////////////////////////////////////////////
+
+#define VCFC_INDEX_VERSION_ELIAS_FANO   3
+#define VCFC_ELIAS_FANO_SAMPLE_RATE     256
+
+struct elias_fano_header {
+    uint64_t length;            // number of values
+    uint64_t max_value;
+    uint32_t low_bits;
+    uint32_t reserved;
+    uint64_t high_bit_count;
+    uint64_t low_word_count;
+    uint64_t high_word_count;
+    uint64_t select1_sample_count;
+    uint64_t select0_sample_count;
+};
+
+/**
+ * Encodes the non-decreasing `values`, appending the words of the sequence to
+ * `words` and describing them in `header`.
+ */
+void elias_fano_encode(
+        const std::vector<uint64_t>& values,
+        struct elias_fano_header *header,
+        std::vector<uint64_t>& words);
+
+/**
+ * Read-only view of an encoded sequence, does not own its words.
+ */
+class EliasFanoSequence {
+public:
+    EliasFanoSequence(){};
+
+    // `words` is the start of the sequence's words. Returns the number of words used.
+    size_t init(const struct elias_fano_header *header, const uint64_t *words);
+
+    // Value at index `i`
+    uint64_t access(size_t i) const;
+
+    // Index of the first value not less than `x`, or size() if there is none
+    size_t lower_bound(uint64_t x) const;
+
+    size_t size() const {
+        return this->header == NULL ? 0 : this->header->length;
+    }
+
+private:
+    // Bit position of the one with index `i` / zero with index `i` in the high bits
+    uint64_t select1(size_t i) const;
+    uint64_t select0(size_t i) const;
+    uint64_t low_value(size_t i) const;
+
+    const struct elias_fano_header *header = NULL;
+    const uint64_t *low_words = NULL;
+    const uint64_t *high_words = NULL;
+    const uint64_t *select1_samples = NULL;
+    const uint64_t *select0_samples = NULL;
+};
+
+/**
+ * Writes `entries` as a .vcfci-ef index. Returns 0 on success, negative if
+ * the entries are not ordered by both key and offset.
+ */
+int write_elias_fano_index(const std::string& filename, const std::vector<struct index_entry>& entries);
+
+/**
+ * A mmapped .vcfci-ef index.
+ */
+class EliasFanoIndex {
+public:
+    EliasFanoIndex(){};
+    ~EliasFanoIndex();
+
+    /**
+     * Maps `filename`. Returns 0 on success, negative if the file does not
+     * exist or is not a version 3 index.
+     */
+    int open(const std::string& filename);
+
+    // Same as EytzingerIndex::search
+    int search(uint32_t reference_name_idx, uint32_t position, struct index_entry *entry) const;
+
+    size_t size() const {
+        return this->keys.size();
+    }
+
+private:
+    void *map = NULL;
+    size_t map_length = 0;
+    EliasFanoSequence keys;
+    EliasFanoSequence offsets;
+};
+
+////////////////////////////////////////////////////////////////
+// Two-level index (.vcfci-2level)
+//
+// Version 5 of the binned index, for indexes too large to load. The sorted
+// records are split into leaves of one page each, and the key of the first
+// record of every leaf forms a summary. Only the header and the summary are
+// read when opening the index, a lookup searches the summary and reads the one
+// leaf it points to with a single pread.
+//
+// Layout: index_file_header (reserved[0] holds the records per leaf and
+// reserved[1] the leaf count), the summary as uint64 keys, then, starting at
+// the next page boundary, the leaves of VCFC_TWO_LEVEL_RECORDS_PER_LEAF
+// keyed_index_record. The last leaf may be short.
+////////////////////////////////////////////////////////////////
+
+#define VCFC_INDEX_VERSION_TWO_LEVEL    5
+#define VCFC_TWO_LEVEL_RECORDS_PER_LEAF (VCFC_PAGE_SIZE / sizeof(struct keyed_index_record))
+
+/**
+ * Writes `entries` as a .vcfci-2level index. Returns 0 on success.
+ */
+int write_two_level_index(const std::string& filename, const std::vector<struct index_entry>& entries);
+
+/**
+ * An open .vcfci-2level index, holds the summary in memory.
+ */
+class TwoLevelIndex {
+public:
+    TwoLevelIndex(){};
+    ~TwoLevelIndex();
+
+    /**
+     * Opens `filename` and reads its summary. Returns 0 on success, negative
+     * if the file does not exist or is not a version 5 index.
+     */
+    int open(const std::string& filename);
+
+    // Same as EytzingerIndex::search, returns -1 if the leaf can't be read
+    int search(uint32_t reference_name_idx, uint32_t position, struct index_entry *entry) const;
+
+    size_t size() const {
+        return this->entry_count;
+    }
+
+private:
+    int fd = -1;
+    size_t entry_count = 0;
+    size_t records_per_leaf = 0;
+    off_t leaf_offset = 0;
+    std::vector<uint64_t> summary;
+};
+
+////////////////////////////////////////////////////////////////
+// Interval index (.vcfci-interval)
+//
+// Version 4 of the index. Runs of `lines_per_record` lines of one contig are
+// recorded as [first POS, max END] spans with the offset of their first line.
+// Per contig the records are sorted by start and form an implicit augmented
+// interval tree: the record at index i is a node at the level of its lowest
+// unset bit, and max_end holds the max END of its subtree. A query visits only
+// the subtrees whose max END reaches the query start, and returns exactly the
+// spans overlapping it, so long structural variants don't widen the scan.
+//
+// Layout: index_file_header (reserved[0] holds the contig count), one
+// interval_index_contig per contig, then all interval_index_record.
+////////////////////////////////////////////////////////////////
+
+#define VCFC_INDEX_VERSION_INTERVAL     4
+#define VCFC_INTERVAL_INDEX_MAX_NAME    40
+
+struct interval_index_record {
+    uint32_t start;             // first POS of the span
+    uint32_t end;               // max END of the span, plus 1
+    uint32_t max_end;           // max `end` of the subtree of this record
+    uint32_t line_count;
+    uint64_t byte_offset;       // offset of the first line of the span
+};
+
+struct interval_index_contig {
+    uint64_t first_record;
+    uint64_t record_count;
+    int32_t max_level;          // level of the root, -1 if there are no records
+    uint32_t name_length;
+    char name[VCFC_INTERVAL_INDEX_MAX_NAME];
+};
+
+class IntervalIndexBuilder {
+public:
+    IntervalIndexBuilder(uint32_t lines_per_record);
+
+    void add_line(
+            const std::string& reference_name,
+            uint32_t position,
+            uint32_t end_position,
+            uint64_t byte_offset);
+
+    int write(const std::string& filename);
+
+private:
+    uint32_t lines_per_record;
+    std::vector<std::string> reference_names;
+    std::vector<std::vector<struct interval_index_record>> contig_records;
+    std::string current_reference_name;
+    std::vector<struct interval_index_record> *current_records = NULL;
+};
+
+/**
+ * A mmapped .vcfci-interval index.
+ */
+class IntervalIndex {
+public:
+    IntervalIndex(){};
+    ~IntervalIndex();
+
+    /**
+     * Maps `filename`. Returns 0 on success, negative if the file does not
+     * exist or is not a version 4 index.
+     */
+    int open(const std::string& filename);
+
+    /**
+     * Appends the records of `reference_name` overlapping [start, end] to
+     * `records`, in file order.
+     */
+    void query(
+            const std::string& reference_name,
+            uint32_t start,
+            uint32_t end,
+            std::vector<struct interval_index_record>& records) const;
+
+private:
+    void *map = NULL;
+    size_t map_length = 0;
+    const struct interval_index_contig *contigs = NULL;
+    size_t contig_count = 0;
+    const struct interval_index_record *records = NULL;
+};
+
+////////////////////////////////////////////////////////////////
+// Learned index (.vcfci-learned)
+//
+// Per contig, fits piecewise linear segments over (key, byte_offset) points
+// with every point within `epsilon` bytes of its segment. The key of a line is
+// the running max END of the lines of its contig up to it, which is monotone
+// and, for SNVs, the POS. A point is recorded only where the key grows, so the
+// first line whose key reaches a query start is the first that can overlap it.
+//
+// Layout, little-endian:
+//   learned_index_header, with the fingerprint of stamp_index_data
+//   per contig: uint8 name length, name, uint32 first segment,
+//               uint32 segment count, uint64 offset past the contig's last line
+//   segment_count learned_index_segment records
+////////////////////////////////////////////////////////////////
+
+#define VCFC_LEARNED_INDEX_MAGIC            "VCFCLRN1"
+#define VCFC_LEARNED_INDEX_VERSION          2
+#define VCFC_LEARNED_INDEX_DEFAULT_EPSILON  4096
+
+struct learned_index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t epsilon;
+    uint32_t contig_count;
+    uint32_t segment_count;
+    // see index_file_header
+    uint64_t data_size;
+    uint64_t data_checksum;
+};
+
+struct learned_index_segment {
+    uint64_t first_offset;      // exact offset of the line the segment starts at
+    double slope;               // bytes per key
+    uint32_t first_key;
+    uint32_t reserved;
+};
+
+struct learned_index_contig {
+    std::string reference_name;
+    uint32_t first_segment;
+    uint32_t segment_count;
+    uint64_t end_offset;
+};
+
+/**
+ * Fits the segments of a learned index from the lines of a file, in file order.
+ * Uses a shrinking cone: a segment is anchored at its first point and its slope
+ * range narrowed by each following point, until no slope fits within epsilon.
+ */
+class LearnedIndexBuilder {
+public:
+    LearnedIndexBuilder(uint32_t epsilon);
+
+    void add_line(
+            const std::string& reference_name,
+            uint32_t end_position,
+            uint64_t byte_offset);
+
+    // `end_offset` is the offset past the last line
+    int write(const std::string& filename, uint64_t end_offset);
+
+private:
+    void close_segment();
+
+    uint32_t epsilon;
+    std::vector<struct learned_index_contig> contigs;
+    std::vector<struct learned_index_segment> segments;
+
+    uint32_t max_end_position = 0;
+    bool segment_open = false;
+    double slope_low = 0;
+    double slope_high = 0;
+};
+
+/**
+ * A loaded .vcfci-learned index. The whole file is read, it holds a few
+ * segments per contig.
+ */
+class LearnedIndex {
+public:
+    LearnedIndex(){};
+
+    // Returns 0 on success, negative if the file is missing or malformed
+    int load(const std::string& filename);
+
+    /**
+     * Returns the offset of a line of the compressed file `fd` at or before the
+     * first line of `reference_name` whose END reaches `position`, or -1 if the
+     * contig is not indexed. The predicted offset is rounded down to a line
+     * start by checking the candidate lines inside the error window.
+     */
+    int64_t find_scan_start(int fd, const std::string& reference_name, uint32_t position) const;
+
+    uint32_t get_epsilon() const {
+        return this->epsilon;
+    }
+
+private:
+    uint32_t epsilon = 0;
+    std::vector<struct learned_index_contig> contigs;
+    std::vector<struct learned_index_segment> segments;
+};
+
+////////////////////////////////////////////////////////////////
+// Hash index (.vcfci-hash)
+//
+// Version 6 of the index, for exact lookups instead of ranges. Two open
+// addressing tables of keyed_index_record map the hash of a key to the offset
+// of a line holding it: one keyed on the normalized (CHROM, POS, REF, ALT) of
+// every ALT allele (see normalize_variant), one on every ID of the ID column.
+// Tables are linearly probed, at most half full, and a slot with key 0 is
+// empty. Keys are hashes, so lookups return candidate lines that the caller
+// checks against the line.
+//
+// Layout: index_file_header (reserved[0] and reserved[1] hold the capacities
+// of the variant and ID tables, entry_count the number of keys in both), then
+// the variant table and the ID table. The file is mmapped and queried in place.
+////////////////////////////////////////////////////////////////
+
+#define VCFC_INDEX_VERSION_HASH         6
+
+// Hash of a variant key, `ref` and `alt` already normalized
+uint64_t variant_key_hash(const std::string& reference_name, uint64_t position, const std::string& ref, const std::string& alt);
+uint64_t id_key_hash(const std::string& id);
+
+class HashIndexBuilder {
+public:
+    HashIndexBuilder(){};
+
+    // `alt` and `id` are the full columns, with multiple values
+    void add_line(
+            const std::string& reference_name,
+            uint64_t position,
+            const std::string& id,
+            const std::string& ref,
+            const std::string& alt,
+            uint64_t byte_offset);
+
+    int write(const std::string& filename);
+
+private:
+    std::vector<struct keyed_index_record> variant_keys;
+    std::vector<struct keyed_index_record> id_keys;
+};
+
+/**
+ * A mmapped .vcfci-hash index.
+ */
+class HashIndex {
+public:
+    HashIndex(){};
+    ~HashIndex();
+
+    /**
+     * Maps `filename`. Returns 0 on success, negative if the file does not
+     * exist or is not a version 6 index.
+     */
+    int open(const std::string& filename);
+
+    /**
+     * Appends the offsets of the lines that may hold the key hash `key` (see
+     * variant_key_hash and id_key_hash) to `offsets`, in file order and
+     * without duplicates.
+     */
+    void find_variant(uint64_t key, std::vector<uint64_t>& offsets) const;
+    void find_id(uint64_t key, std::vector<uint64_t>& offsets) const;
+
+private:
+    void *map = NULL;
+    size_t map_length = 0;
+    const struct keyed_index_record *variant_table = NULL;
+    size_t variant_capacity = 0;
+    const struct keyed_index_record *id_table = NULL;
+    size_t id_capacity = 0;
+};
+
+////////////////////////////////////////////////////////////////
+// Bloom filter index (.vcfci-bloom)
+//
+// Version 7 of the index. The file is split into bins like a binned index, and
+// a Bloom filter per bin holds the keys of the hash index (see variant_key_hash
+// and id_key_hash) of its lines. A lookup reads only the bins whose filter may
+// hold the key, so an absent key does not touch the data file.
+//
+// A filter of m bits sets k bits per key, bit (h1 + i * h2) mod m for i < k,
+// with h1 and h2 the low and high halves of the key hash.
+//
+// Layout: index_file_header (reserved[0] holds k, reserved[1] the bits per
+// key), one bloom_filter_bin per bin, then the uint64 words of all filters.
+////////////////////////////////////////////////////////////////
+
+#define VCFC_INDEX_VERSION_BLOOM        7
+#define VCFC_BLOOM_DEFAULT_BITS_PER_KEY 10
+
+struct bloom_filter_bin {
+    uint64_t start_offset;      // offset of the first line of the bin
+    uint64_t end_offset;        // offset past the last line of the bin
+    uint64_t first_word;
+    uint32_t word_count;
+    uint32_t key_count;
+};
+
+struct bloom_filter_stats {
+    size_t bin_count;
+    size_t key_count;
+    size_t filter_bytes;
+    double expected_false_positive_rate;    // mean over bins, from the filter sizes
+    double measured_false_positive_rate;    // of random keys against random bins
+};
+
+class BloomFilterIndexBuilder {
+public:
+    BloomFilterIndexBuilder(const VcfPackedBinningIndexConfiguration& index_configuration, uint32_t bits_per_key);
+
+    // Same columns as HashIndexBuilder::add_line
+    void add_line(
+            const std::string& reference_name,
+            uint64_t position,
+            const std::string& id,
+            const std::string& ref,
+            const std::string& alt,
+            uint64_t byte_offset);
+
+    // `end_offset` is the offset past the last line
+    int write(const std::string& filename, uint64_t end_offset, struct bloom_filter_stats *stats);
+
+private:
+    void close_bin(uint64_t end_offset);
+
+    VcfPackedBinningIndexConfiguration index_configuration;
+    uint32_t bits_per_key;
+    uint32_t hash_count;
+    std::vector<struct bloom_filter_bin> bins;
+    std::vector<uint64_t> words;
+    std::vector<uint64_t> bin_keys;
+    size_t bin_line_count = 0;
+};
+
+/**
+ * A mmapped .vcfci-bloom index.
+ */
+class BloomFilterIndex {
+public:
+    BloomFilterIndex(){};
+    ~BloomFilterIndex();
+
+    /**
+     * Maps `filename`. Returns 0 on success, negative if the file does not
+     * exist or is not a version 7 index.
+     */
+    int open(const std::string& filename);
+
+    // Appends the bins whose filter may hold the key hash `key` to `bins`
+    void find(uint64_t key, std::vector<struct bloom_filter_bin>& bins) const;
+
+private:
+    void *map = NULL;
+    size_t map_length = 0;
+    uint32_t hash_count = 0;
+    const struct bloom_filter_bin *bins = NULL;
+    size_t bin_count = 0;
+    const uint64_t *words = NULL;
+};
+
+////////////////////////////////////////////////////////////////
+// Zone maps (.vcfci-zonemap)
+//
+// Version 8 of the index. One zone_map_record per bin of a binned index, with
+// the range of the bin and, over its lines, the min and max of QUAL and of the
+// numeric INFO fields AF, AC and DP, and which FILTER values any and all of
+// its lines have. A query with predicates on these fields skips the bins whose
+// zone map rules out every line.
+//
+// FILTER values are numbered in order of appearance, the first 63 get a bit
+// of their own and the rest share bit 63.
+//
+// Layout: index_file_header (reserved[0] holds the FILTER value count), per
+// FILTER value a uint8 name length and the name, zero padding to a multiple
+// of 8 bytes, then entry_count zone_map_record.
+////////////////////////////////////////////////////////////////
+
+#define VCFC_INDEX_VERSION_ZONE_MAP     8
+#define VCFC_ZONE_MAP_FIELD_COUNT       4   // QUAL, AF, AC, DP
+#define VCFC_ZONE_MAP_FILTER_BITS       64
+
+// Names of the numeric fields, QUAL then the INFO keys
+extern const char *zone_map_field_names[VCFC_ZONE_MAP_FIELD_COUNT];
+
+struct zone_map_record {
+    uint64_t start_offset;      // offset of the first line of the bin
+    uint64_t end_offset;        // offset past the last line of the bin
+    uint32_t first_position;    // POS of the first line
+    uint32_t max_end_position;  // max END of the lines, as in the binned index
+    uint32_t reference_name_idx;    // of the first line
+    uint8_t reserved[4];
+    uint64_t filter_any;        // FILTER bits set by any line
+    uint64_t filter_all;        // FILTER bits set by every line
+    double min[VCFC_ZONE_MAP_FIELD_COUNT];
+    double max[VCFC_ZONE_MAP_FIELD_COUNT];
+    uint32_t count[VCFC_ZONE_MAP_FIELD_COUNT];  // lines with a value of the field
+};
+
+// The values of the zone map fields of one line
+struct zone_map_line {
+    std::vector<double> values[VCFC_ZONE_MAP_FIELD_COUNT];
+    std::vector<std::string> filters;
+};
+
+/**
+ * Parses the QUAL, FILTER and INFO columns of a line. Missing values ('.')
+ * and values that are not numbers are left out.
+ */
+void parse_zone_map_line(
+        const std::string& qual,
+        const std::string& filter,
+        const std::string& info,
+        struct zone_map_line *line);
+
+enum class zone_map_operator { LT, LE, GT, GE, EQ, NE };
+
+/**
+ * A comparison of a field with a value. A numeric comparison holds for a line
+ * if it holds for any of the line's values of the field, FILTER=x if x is one
+ * of the line's FILTER values and FILTER!=x if it is not.
+ */
+struct zone_map_predicate {
+    int field;                  // index in zone_map_field_names, -1 for FILTER
+    zone_map_operator op;
+    double value;
+    std::string filter;
+};
+
+/**
+ * Parses predicates joined by `and`, e.g. `AF>0.01 and FILTER=PASS`.
+ * Returns 0 on success.
+ */
+int parse_zone_map_predicates(const std::string& s, std::vector<struct zone_map_predicate>& predicates);
+
+bool zone_map_line_matches(const struct zone_map_line& line, const std::vector<struct zone_map_predicate>& predicates);
+
+/**
+ * Builds the zone maps of the bins of a BinnedIndexBuilder, fed the same lines.
+ */
+class ZoneMapBuilder {
+public:
+    ZoneMapBuilder(){};
+
+    /**
+     * Adds a line to bin `bin`, the index of the binned index entry the line
+     * was added to. Bins are added in order.
+     */
+    void add_line(
+            size_t bin,
+            const std::string& reference_name,
+            uint32_t position,
+            uint32_t end_position,
+            const std::string& qual,
+            const std::string& filter,
+            const std::string& info,
+            uint64_t byte_offset);
+
+    // `end_offset` is the offset past the last line
+    int write(const std::string& filename, uint64_t end_offset);
+
+    void set_reference_names(const reference_name_map& ref_name_map) {
+        this->ref_name_map = ref_name_map;
+    }
+
+private:
+    uint64_t filter_bit(const std::string& filter);
+
+    reference_name_map ref_name_map;
+    std::vector<std::string> filter_names;
+    std::vector<struct zone_map_record> records;
+};
+
+/**
+ * A mmapped .vcfci-zonemap index.
+ */
+class ZoneMap {
+public:
+    ZoneMap(){};
+    ~ZoneMap();
+
+    /**
+     * Maps `filename`. Returns 0 on success, negative if the file does not
+     * exist or is not a version 8 index.
+     */
+    int open(const std::string& filename);
+
+    /**
+     * Index of the bin to start scanning from for lines overlapping
+     * (reference_name_idx, position), the same bin the binned index search
+     * starts from.
+     */
+    size_t search(uint32_t reference_name_idx, uint32_t position) const;
+
+    // Whether a line of the bin may satisfy all of the predicates
+    bool may_match(size_t bin, const std::vector<struct zone_map_predicate>& predicates) const;
+
+    const struct zone_map_record& get_record(size_t bin) const {
+        return this->records[bin];
+    }
+
+    size_t size() const {
+        return this->record_count;
+    }
+
+private:
+    void *map = NULL;
+    size_t map_length = 0;
+    std::vector<std::string> filter_names;
+    const struct zone_map_record *records = NULL;
+    size_t record_count = 0;
+};
+
+#endif
@@ -22,13 +22,22 @@
 #include "split_iterator.hpp"
 #include "compress.hpp"
 #include "sparse.hpp"
+#include "index.hpp"
+#include "advise.hpp"
 #include "string_t.h"
 
-#define SPARSE_EXTERNAL_INDEX_BLOCK_SIZE 256
-
 
 int usage() {
     std::cerr << "./main [compress|decompress|sparsify] <input_file> <output_file>" << std::endl;
+    std::cerr << "./main compress <input_file> <output_file> [--entropy] [--blocks] [--block-size=<bytes>] [--zstd] [--zstd-level=<n>] [--embed-index=<bin-size>] [--index binned:<bin-size>,eytzinger,elias-fano,two-level,sparse] [--no-end]" << std::endl;
+    std::cerr << "  <bin-size> is a number of lines <n>, of compressed bytes <n>b or <n>b:aligned, or page (4096b:aligned)" << std::endl;
+    std::cerr << "./main sparsify <input_file> <output_file> [--direct] [--threads <n>] [--regions] [--preallocate]" << std::endl;
+    std::cerr << "./main sparse-stats <sparse_file>" << std::endl;
+    std::cerr << "./main sparse-pack <sparse_file> <packed_file>|-" << std::endl;
+    std::cerr << "./main sparse-unpack <packed_file>|- <sparse_file> [--threads <n>]" << std::endl;
+    std::cerr << "./main sparse-count <sparse_file> <region>" << std::endl;
+    std::cerr << "./main advise <compressed_file> [--max-overhead=<percent>] [--max-scan-bytes=<n>] [--write-config]" << std::endl;
+    std::cerr << "  --write-config writes <compressed_file>" VCFC_CONFIG_EXTENSION ", used by sparsify and by create-binned-index config" << std::endl;
     return 1;
 }
 
@@ -65,10 +74,20 @@ public:
         this->end_position = rhs.end_position;
         this->has_start_position = rhs.has_start_position;
         this->has_end_position = rhs.has_end_position;
-        // this->ref_name_map = rhs.ref_name_map;
+        this->ref_name_map = rhs.ref_name_map;
+        this->reference_name_idx = rhs.reference_name_idx;
         return *this;
     }
 
+    /**
+     * Sets the contig dictionary of the file the query runs on, which orders
+     * references in compare_to and compare_to_range.
+     */
+    void set_reference_names(const reference_name_map& ref_name_map) {
+        this->ref_name_map = ref_name_map;
+        this->reference_name_idx = ref_name_map.reference_to_int(this->reference_name);
+    }
+
     /**
      * Returns true if the input values are within the range of this query
      */
@@ -85,20 +104,37 @@ public:
         return true;
     }
 
+    /**
+     * Returns true if any position in [first_position, last_position] of the
+     * reference could match this query
+     */
+    bool matches_range(const std::string& reference_name, uint64_t first_position, uint64_t last_position) {
+        if (this->reference_name.size() > 0 && this->reference_name != reference_name) {
+            return false;
+        }
+        if (this->has_start_position && last_position < this->start_position) {
+            return false;
+        }
+        if (this->has_end_position && first_position > this->end_position) {
+            return false;
+        }
+        return true;
+    }
+
     int compare_to(const std::string& reference_name, uint64_t position) {
-        uint8_t input_reference_name_idx = this->ref_name_map.reference_to_int(reference_name);
-        uint8_t this_reference_name_idx = this->ref_name_map.reference_to_int(this->reference_name);
+        uint32_t input_reference_name_idx = this->ref_name_map.reference_to_int(reference_name);
+        uint32_t this_reference_name_idx = this->reference_name_idx;
 
         // This is greater than arguments
         if (input_reference_name_idx < this_reference_name_idx
                 || (input_reference_name_idx == this_reference_name_idx
-                        && position < this->start_position)) {
+                        && this->has_start_position && position < this->start_position)) {
             return 1;
         }
         // This is less than arguments
         else if (input_reference_name_idx > this_reference_name_idx
                 || (input_reference_name_idx == this_reference_name_idx
-                        && position > this->end_position)) {
+                        && this->has_end_position && position > this->end_position)) {
             return -1;
         }
         // This is equal to (within range of) arguments
@@ -108,20 +144,21 @@ public:
     }
 
     int compare_to_range(const std::string& reference_name, uint64_t start_input, uint64_t end_input) {
-        uint8_t input_reference_name_idx = this->ref_name_map.reference_to_int(reference_name);
-        uint8_t this_reference_name_idx = this->ref_name_map.reference_to_int(this->reference_name);
+        uint32_t input_reference_name_idx = this->ref_name_map.reference_to_int(reference_name);
+        uint32_t this_reference_name_idx = this->reference_name_idx;
         int ret = 0;
 
-        // This is greater than arguments
+        // This is greater than arguments, a query without a start or an end
+        // covers the whole contig on that side
         if (input_reference_name_idx < this_reference_name_idx
                 || (input_reference_name_idx == this_reference_name_idx
-                        && end_input < this->start_position)) {
+                        && this->has_start_position && end_input < this->start_position)) {
             ret = 1;
         }
         // This is less than arguments
         else if (input_reference_name_idx > this_reference_name_idx
                 || (input_reference_name_idx == this_reference_name_idx
-                        && start_input > this->end_position)) {
+                        && this->has_end_position && start_input > this->end_position)) {
             ret = -1;
         }
         // This is equal to (within range of) arguments
@@ -168,6 +205,14 @@ public:
         return this->end_position;
     }
 
+    bool get_has_start_position() {
+        return this->has_start_position;
+    }
+
+    bool get_has_end_position() {
+        return this->has_end_position;
+    }
+
 private:
     std::string reference_name;
     uint64_t start_position;
@@ -175,6 +220,8 @@ private:
     bool has_start_position;
     bool has_end_position;
     reference_name_map ref_name_map;
+    // of reference_name in ref_name_map
+    uint32_t reference_name_idx = ref_name_map.reference_to_int(reference_name);
 };
 
 class VcfLineStateMachine {
@@ -232,13 +279,24 @@ byte_array byte_vector_to_bytearray(const std::vector<byte_t>& v) {
 }
 
 
+/**
+ * Whether the sparse file record whose distance headers were just read from
+ * `input_fd` is a redirect to a line in the overflow area, see sparse.hpp.
+ */
+static bool sparse_record_is_redirect(int input_fd) {
+    uint8_t b = 0;
+    if (pread(input_fd, &b, 1, tellfd(input_fd)) != 1) {
+        throw std::runtime_error("Reached end of file unexpectedly when reading a sparse record");
+    }
+    return !is_line_start_byte(b);
+}
+
 void query_sparse_file_fd(const std::string& input_filename, VcfCoordinateQuery query) {
     int input_fd = open(input_filename.c_str(), O_RDONLY);
     if (input_fd < 0) {
         perror("open");
         throw std::runtime_error("Failed to open file: " + input_filename);
     }
-    off_t lseek_ret = 0;
     VcfCompressionSchema schema;
     debugf("Parsing metadata lines and header line\n");
     std::vector<std::string> meta_header_lines;
@@ -257,8 +315,16 @@ void query_sparse_file_fd(const std::string& input_filename, VcfCoordinateQuery
     printf("TIMING decompress2_metadata_headers: %lu\n", duration.count());
     #endif
 
-    // Leave default sparse config
+    // Layout from the meta lines of the sparse file
     SparsificationConfiguration sparse_config;
+    if (sparse_config.parse_meta_lines(meta_header_lines) != 0) {
+        throw std::runtime_error("Invalid sparse layout line in file: " + input_filename);
+    }
+    if (query.has_criteria() && !sparse_config.contains(query.get_reference_name(), query.get_start_position())) {
+        debugf("Query start is not in the sparse file\n");
+        close(input_fd);
+        return;
+    }
 
     long off = tellfd(input_fd);
     if (off < 0) {
@@ -278,293 +344,194 @@ void query_sparse_file_fd(const std::string& input_filename, VcfCoordinateQuery
     if (query.has_criteria() && (query.get_start_position() == query.get_end_position())) {
         debugf("Single variant lookup\n");
         size_t variant_offset = sparse_config.compute_sparse_offset(query.get_reference_name(), query.get_start_position());
+        long record_offset = data_start_offset + variant_offset;
+        debugf("variant_offset = %lu, file_offset = %ld\n", variant_offset, record_offset);
 
-        off64_t new_offset = data_start_offset + variant_offset;
-        debugf("variant_offset = %lu, file_offset = %lu\n", variant_offset, new_offset);
-
-        loff_t initial_lookup_offset = lseek(input_fd, new_offset, SEEK_SET);
-        debugf("initial_lookup_offset = %ld\n", initial_lookup_offset);
-        if (initial_lookup_offset != new_offset) {
-            perror("lseek");
-            debugf("Failed to seek to line in file\n");
-            return;
-        }
-
-        union {
-            struct {
-                uint64_t distance_to_previous;
-                uint64_t distance_to_next;
-            } lengths;
-            uint8_t bytes[16];
-        } _length_headers;
-        if (read(input_fd, &_length_headers.bytes, 16) == 0) {
-            throw std::runtime_error("Reached end of file unexpectedly");
+        uint8_t distance_headers[VCFC_SPARSE_DISTANCE_HEADERS_SIZE];
+        uint64_t distance_to_previous = 0;
+        if (pread(input_fd, distance_headers, sizeof(distance_headers), record_offset) == (ssize_t) sizeof(distance_headers)) {
+            uint8_array_to_uint64(distance_headers, &distance_to_previous);
         }
-        debugf("distance_to_previous = %lu, distance_to_next = %lu\n",
-            _length_headers.lengths.distance_to_previous, _length_headers.lengths.distance_to_next);
-
         // IF prev offset value is zero and this is not the first line, must be an invalid location
-        if (_length_headers.lengths.distance_to_previous == 0 &&
-                initial_lookup_offset != (long)(first_line_offset + data_start_offset)) {
-            // seek ahead to next viable line start
-            long seek_distance = sparse_config.multiplication_factor * sparse_config.block_size;
-            seek_distance -= 16; // Already read this many bytes
-            lseek(input_fd, seek_distance, SEEK_CUR);
-            debugf("Offset %ld was not a data line for single variant lookup, output no data\n",
-                tellfd(input_fd) + 16 - seek_distance);
-
+        if (distance_to_previous == 0 && record_offset != (long)(first_line_offset + data_start_offset)) {
+            debugf("Offset %ld was not a data line for single variant lookup, output no data\n", record_offset);
         } else {
-            debugf("Found requested single variant line\n");
+            debugf("Found a line in the slot of the requested variant\n");
+            // the slot holds the lines of its bucket, follow them to the
+            // variant, through the overflow area if the bucket overflowed,
+            // after skipping the lines before it
+            record_offset = skip_sparse_lines_before(input_fd, sparse_config, record_offset,
+                query.get_reference_name(), query.get_start_position());
             std::string linebuf;
             linebuf.reserve(4 * 1024); // 4 KiB
-            // string_t linebuf;
-            // string_reserve(&linebuf, 4 * 1024);
-            size_t linelength;
-            int status = decompress2_data_line_FILEwrapper(input_fd, schema, linebuf, &linelength);
-            if (status == 0) {
-                throw std::runtime_error("Unexpected EOF\n");
-            } else if (status < 0) {
-                throw std::runtime_error("Failed to decompress data line\n");
-            }
-            for (size_t i = 0; i < linebuf.size(); i++) {
-                printf("%c", linebuf[i]);
+            struct sparse_record_headers headers;
+            std::string reference_name;
+            uint64_t pos = 0;
+            while (true) {
+                if (read_sparse_record(input_fd, sparse_config, record_offset, &headers, reference_name, &pos)) {
+                    if (reference_name != query.get_reference_name() || pos > query.get_start_position()) {
+                        break;
+                    }
+                    if (pos == query.get_start_position()) {
+                        lseek64(input_fd, record_offset + sparse_config.record_headers_size(), SEEK_SET);
+                        size_t linelength;
+                        linebuf.clear();
+                        int status = decompress2_data_line_FILEwrapper(input_fd, schema, linebuf, &linelength);
+                        if (status == 0) {
+                            throw std::runtime_error("Unexpected EOF\n");
+                        } else if (status < 0) {
+                            throw std::runtime_error("Failed to decompress data line\n");
+                        }
+                        fwrite(linebuf.c_str(), sizeof(char), linebuf.size(), stdout); // newline included already
+                    }
+                }
+                if (headers.distance_to_next == 0) {
+                    break;
+                }
+                // backward distances wrap
+                record_offset = (long) ((uint64_t) record_offset + headers.distance_to_next);
             }
         }
     }
     // Multi-variant lookup
     else if (query.has_criteria() && (query.get_start_position() != query.get_end_position())) {
         debugf("Multiple variant lookup\n");
-        size_t start_variant_offset = sparse_config.compute_sparse_offset(query.get_reference_name(), query.get_start_position());
-
-        debugf("start of range: variant_offset = %lu, file_offset = %lu\n", start_variant_offset, data_start_offset + start_variant_offset);
-
-        // seek to start of range
-        long initial_lookup_offset = lseek(input_fd, data_start_offset + start_variant_offset, SEEK_SET);
-
-        long initial_seek_data = lseek(input_fd, initial_lookup_offset, SEEK_DATA);
-        if (initial_seek_data < initial_lookup_offset) {
-            perror("lseek");
-            throw std::runtime_error("Failed to call lseek SEEK_DATA from "
-                + std::to_string(initial_lookup_offset)
-                + ", status = " + std::to_string(initial_seek_data));
-        }
-        debugf("initial_lookup_offset = %ld, initial_seek_data = %ld\n",
-            initial_lookup_offset, initial_seek_data);
-
-        // Landed in a sparse hole
-        if (initial_lookup_offset != initial_seek_data) {
-            debugf("SEEK_DATA moved from initially requested offset\n");
-            // Update to correspond to a viable start-of-line offset
-            // Below is the viable offset modulo for offsets minus data_start_offset
-            long viable_line_offset_modulo = sparse_config.multiplication_factor * sparse_config.block_size;
-            if ((initial_seek_data - data_start_offset) % viable_line_offset_modulo != 0) {
-                // go backwards to previous viable start offset
-                //long previous_viable_line_distance = (initial_seek_data - data_start_offset) % viable_line_offset_modulo;
-                long next_viable_line_distance = viable_line_offset_modulo - ((initial_seek_data - data_start_offset) % viable_line_offset_modulo);
-                //previous_viable_line_distance += data_start_offset;
-
-                // lseek(input_fd, -previous_viable_line_distance, SEEK_CUR);
-                // debugf("Seeked backwards previous_viable_line_distance = %ld\n", previous_viable_line_distance);
-                off_t current_offset = tellfd(input_fd);
-                lseek_ret = lseek(input_fd, next_viable_line_distance, SEEK_CUR);
-                if (lseek_ret != next_viable_line_distance + current_offset) {
-                    perror("lseek");
-                    debugf("Could not seek to next viable line address %ld, got %ld\n",
-                        next_viable_line_distance + current_offset, lseek_ret);
-                    return;
-                }
-                debugf("Seeked forwards next_viable_line_distance = %ld to %ld\n", next_viable_line_distance, tellfd(input_fd));
-            }
+        const long slot_size = (long) sparse_config.multiplication_factor * sparse_config.block_size;
+        // past the last slot holding a line, the overflow area only holds
+        // lines of earlier buckets
+        const long overflow_start_offset = data_start_offset + sparse_config.overflow_offset();
+        const long first_record_offset = data_start_offset + first_line_offset;
+        const long headers_size = sparse_config.record_headers_size();
+
+        // slots from the start of the range to the end of the range or of the contig region
+        long span_start_offset = data_start_offset + sparse_config.compute_sparse_offset(
+            query.get_reference_name(), query.get_start_position());
+        long span_end_offset;
+        if (sparse_config.contains(query.get_reference_name(), query.get_end_position())) {
+            span_end_offset = data_start_offset + slot_size + sparse_config.compute_sparse_offset(
+                query.get_reference_name(), query.get_end_position());
+        } else {
+            span_end_offset = data_start_offset + sparse_config.reference_end_offset(query.get_reference_name());
         }
+        span_end_offset = std::min(span_end_offset, overflow_start_offset);
 
-        // Determine if the current offset corresponds to a data line, if not, seek to the next one
-        while (true) {
-            // union {
-            //     struct {
-            //         uint64_t distance_to_previous;
-            //         uint64_t distance_to_next;
-            //     } lengths;
-            //     uint8_t bytes[16];
-            // } _length_headers;
-            // if (read(input_fd, &_length_headers.bytes, 16) == 0) {
-            //     throw std::runtime_error("Reached end of file unexpectedly");
-            // }
-            // debugf("distance_to_previous = %lu, distance_to_next = %lu\n",
-            //     _length_headers.lengths.distance_to_previous, _length_headers.lengths.distance_to_next);
-            uint8_t distance_headers[16];
-            memset(distance_headers, 0, 16);
-            size_t read_ret = read(input_fd, distance_headers, 16);
-            if (read_ret < 16) {
-                throw std::runtime_error("Reached end of file unexpectedly when reading distance headers: " + std::to_string(read_ret));
-            }
-            uint64_t distance_to_previous = 0, distance_to_next = 0;
-            uint8_array_to_uint64(distance_headers, &distance_to_previous);
-            uint8_array_to_uint64(distance_headers + 8, &distance_to_next);
-            debugf("distance_to_previous = %lu (0x%08lx), distance_to_next = %lu (0x%08lx)\n",
-                distance_to_previous, distance_to_previous, distance_to_next, distance_to_next);
-
-            // IF prev offset value is zero and this is not the first line, must be an invalid location
-            if (distance_to_previous == 0 &&
-                    initial_lookup_offset != (long)(first_line_offset + data_start_offset)) {
-                // seek ahead to next viable line start
-                long seek_distance = sparse_config.multiplication_factor * sparse_config.block_size;
-                seek_distance -= 16; // Already read this many bytes
-                lseek64(input_fd, seek_distance, SEEK_CUR);
-                debugf("Offset %ld was not a data line, seeked to next viable offset %ld\n",
-                    tellfd(input_fd) + 16 - seek_distance, // same as initial_lookup_offset
-                    tellfd(input_fd));
-            } else {
-                debugf("Offset was a data location, begin linear traversal\n");
-                lseek64(input_fd, -16, SEEK_CUR);
-                break;
-            }
+        // Populated slots of the span, the holes between them are never read
+        std::vector<struct sparse_data_extent> extents;
+        find_sparse_data_extents(input_fd, span_start_offset, span_end_offset, data_start_offset, slot_size, extents);
+        debugf("%lu data extents from %ld to %ld\n", extents.size(), span_start_offset, span_end_offset);
+        for (const struct sparse_data_extent& extent : extents) {
+            posix_fadvise(input_fd, extent.begin, extent.end - extent.begin, POSIX_FADV_WILLNEED);
         }
 
-        debugf("Determined actual start offset for data in the query range: %ld\n", tellfd(input_fd));
-
-        // max offset of the beginning of the last matching variant line
-        // size_t end_variant_offset = sparse_config.compute_sparse_offset(query.get_reference_name(), query.get_end_position());
-
+        std::vector<uint8_t> batch;
+        long max_batch_size = std::max(slot_size, VCFC_SPARSE_SCAN_BATCH_SIZE / slot_size * slot_size);
         std::string linebuf;
         linebuf.reserve(16 * 1024);
         size_t linelength;
-        debugf("Starting linear variant enumeration from reference = %s %lu to %lu\n",
-                query.get_reference_name().c_str(),
-                query.get_start_position(),
-                query.get_end_position());
-
-        while (true) {
-            // Important
-            linebuf.clear();
-            size_t line_start_offset = tellfd(input_fd);
-            debugf("line_start_offset = %lu\n", line_start_offset);
-
-            // uint64_t distance_to_previous, distance_to_next;
-            // if (read(input_fd, &distance_to_previous, sizeof(uint64_t)) <= 0) {
-            //     throw std::runtime_error("couldn't read from file");
-            // }
-            // if (read(input_fd, &distance_to_next, sizeof(uint64_t)) <= 0) {
-            //     throw std::runtime_error("couldn't read from file");
-            // }
-            // debugf("distance_to_previous = %lu, distance_to_next = %lu\n", distance_to_previous, distance_to_next);
-
-            uint8_t distance_headers[16];
-            memset(distance_headers, 0, 16);
-
-            if (read(input_fd, distance_headers, 16) < 16) {
-                throw std::runtime_error("Reached end of file unexpectedly when reading distance headers");
-            }
-            uint64_t distance_to_previous = 0, distance_to_next = 0;
-            uint8_array_to_uint64(distance_headers, &distance_to_previous);
-            uint8_array_to_uint64(distance_headers + 8, &distance_to_next);
-            debugf("distance_to_previous = %lu (0x%08lx), distance_to_next = %lu (0x%08lx)\n",
-                distance_to_previous, distance_to_previous, distance_to_next, distance_to_next);
-
-            // Not positioned at a data line
-            if (distance_to_previous == 0 && distance_to_next == 0) {
-                throw std::runtime_error("No previous or next distance values");
-            }
-            bool end_of_reference = false;
-            if (distance_to_next == 0) {
-                end_of_reference = true;
-            }
-
-            #ifdef TIMING
-            start = std::chrono::steady_clock::now();
-            #endif
-            debugf("current offset: %ld\n", tellfd(input_fd));
-            int status = decompress2_data_line_FILEwrapper(input_fd, schema, linebuf, &linelength);
-            #ifdef TIMING
-            end = std::chrono::steady_clock::now();
-            duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
-            printf("TIMING decompress2_data_line: %lu\n", duration.count());
-            #endif
-            if (status == 0) {
-                throw std::runtime_error("Unexpected EOF");
-            } else if (status < 0) {
-                throw std::runtime_error("Failed to decompress data line\n");
-            }
-
-            debugf("compressed bytes read: %lu\n", linelength);
-            // Update distance_to_next based on bytes already read from input stream
-            //distance_to_next += linelength + 16; // line length plus 2 uint64s at start
-            long bytes_read_so_far = (tellfd(input_fd) - line_start_offset);
-            distance_to_next -= bytes_read_so_far;
-            debugf("bytes_read_so_far = %lu, new distance_to_next = %lu\n", bytes_read_so_far, distance_to_next);
-
-            // time copy of linebuf
-            #ifdef TIMING
-            start = std::chrono::steady_clock::now();
-            #endif
-            SplitIterator spi(linebuf, "\t");
-            #ifdef TIMING
-            end = std::chrono::steady_clock::now();
-            duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
-            printf("TIMING SplitIterator.constructor: %lu\n", duration.count());
-            #endif
-
-            #ifdef TIMING
-            start = std::chrono::steady_clock::now();
-            #endif
-            std::string reference_name = spi.next();
-            std::string pos_str = spi.next();
-            #ifdef TIMING
-            end = std::chrono::steady_clock::now();
-            duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
-            printf("TIMING SplitIterator.next: %lu\n", duration.count());
-            #endif
-
-            #ifdef TIMING
-            start = std::chrono::steady_clock::now();
-            #endif
-            char *endptr = NULL;
-            size_t pos = std::strtoul(pos_str.c_str(), &endptr, 10);
-            if (endptr != pos_str.data() + pos_str.size()) {
-                throw new std::runtime_error("Couldn't parse pos column: " + pos_str);
-            }
-            #ifdef TIMING
-            end = std::chrono::steady_clock::now();
-            duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
-            printf("TIMING strtoul: %lu\n", duration.count());
-            #endif
-
-            debugf("line reference_name = %s, pos = %lu; query reference_name = %s, end_position = %lu\n",
-                    reference_name.c_str(), pos,
-                    query.get_reference_name().c_str(), query.get_end_position());
-
-            if (reference_name == query.get_reference_name() && pos <= query.get_end_position()) {
-                // Meets filter criteria, print the line
-                fwrite(linebuf.c_str(), sizeof(char), linebuf.size(), stdout); // newline included already
-
-                if (end_of_reference) {
-                    debugf("Reached end of reference %s\n", query.get_reference_name().c_str());
-                    break;
-                } else if (pos >= query.get_end_position()) {
-                    debugf("Reached end of query range %lu\n", query.get_end_position());
-                    break;
-                } else {
-                    debugf("Seeking ahead to next line\n");
-                    #ifdef DEBUG
-                    long current_offset = tellfd(input_fd);
-                    #endif
+        bool end_of_query = false;
+        for (size_t extent_i = 0; extent_i < extents.size() && !end_of_query; extent_i++) {
+            long batch_offset = extents[extent_i].begin;
+            while (batch_offset < extents[extent_i].end && !end_of_query) {
+                long batch_size = std::min(extents[extent_i].end - batch_offset, max_batch_size);
+                batch.assign(batch_size, 0);
+                // short read past the end of the file leaves the rest zero
+                if (pread(input_fd, batch.data(), batch_size, batch_offset) < 0) {
+                    perror("pread");
+                    throw std::runtime_error(string_format("Failed to read %ld bytes at offset %ld", batch_size, batch_offset));
+                }
+                debugf("Read batch of %ld bytes at offset %ld\n", batch_size, batch_offset);
+                FILE *batch_file = open_block_lines(batch);
+
+                for (long slot_offset = batch_offset;
+                        slot_offset < batch_offset + batch_size && !end_of_query;
+                        slot_offset += slot_size) {
+                    uint64_t distance_to_previous = 0;
+                    uint8_array_to_uint64(batch.data() + (slot_offset - batch_offset), &distance_to_previous);
+                    // IF prev offset value is zero and this is not the first line, the slot is empty
+                    if (distance_to_previous == 0 && slot_offset != first_record_offset) {
+                        continue;
+                    }
 
-                    #ifdef TIMING
-                    start = std::chrono::steady_clock::now();
-                    #endif
-                    lseek64(input_fd, distance_to_next, SEEK_CUR);
-                    #ifdef TIMING
-                    end = std::chrono::steady_clock::now();
-                    duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
-                    printf("TIMING lseek: %lu\n", duration.count());
-                    #endif
+                    // the records of the slot are in the batch, the bucket's
+                    // records in the overflow area are read from the file.
+                    // Lines of the start bucket before the query start are skipped.
+                    long record_offset = slot_offset;
+                    if (slot_offset == span_start_offset) {
+                        record_offset = skip_sparse_lines_before(input_fd, sparse_config, slot_offset,
+                            query.get_reference_name(), query.get_start_position());
+                    }
+                    while (true) {
+                        bool in_batch = record_offset >= slot_offset && record_offset < slot_offset + slot_size;
+                        bool is_redirect;
+                        struct sparse_record_headers headers;
+                        if (in_batch) {
+                            uint8_t *record_bytes = batch.data() + (record_offset - batch_offset);
+                            decode_sparse_record_headers(sparse_config, record_bytes, &headers);
+                            is_redirect = !is_line_start_byte(record_bytes[headers_size]);
+                            fseek(batch_file, record_offset - batch_offset + headers_size, SEEK_SET);
+                        } else {
+                            uint8_t header_bytes[VCFC_SPARSE_DISTANCE_HEADERS_SIZE + 2 * sizeof(uint64_t)];
+                            if (pread(input_fd, header_bytes, headers_size, record_offset) < (ssize_t) headers_size) {
+                                throw std::runtime_error("Reached end of file unexpectedly when reading distance headers");
+                            }
+                            decode_sparse_record_headers(sparse_config, header_bytes, &headers);
+                            lseek64(input_fd, record_offset + headers_size, SEEK_SET);
+                            is_redirect = sparse_record_is_redirect(input_fd);
+                        }
+                        uint64_t distance_to_next = headers.distance_to_next;
+                        debugf("record_offset = %ld, distance_to_next = %lu, in_batch = %d, is_redirect = %d\n",
+                            record_offset, distance_to_next, in_batch, is_redirect);
+
+                        if (!is_redirect) {
+                            linebuf.clear();
+                            int status;
+                            if (in_batch) {
+                                status = decompress2_data_line(batch_file, schema, linebuf, &linelength);
+                            } else {
+                                status = decompress2_data_line_FILEwrapper(input_fd, schema, linebuf, &linelength);
+                            }
+                            if (status == 0) {
+                                throw std::runtime_error("Unexpected EOF");
+                            } else if (status < 0) {
+                                throw std::runtime_error("Failed to decompress data line\n");
+                            }
+                            SplitIterator spi(linebuf, "\t");
+                            std::string reference_name = spi.next();
+                            std::string pos_str = spi.next();
+                            char *endptr = NULL;
+                            size_t pos = std::strtoul(pos_str.c_str(), &endptr, 10);
+                            if (endptr != pos_str.data() + pos_str.size()) {
+                                throw std::runtime_error("Couldn't parse pos column: " + pos_str);
+                            }
+                            if (reference_name != query.get_reference_name() || pos > query.get_end_position()) {
+                                debugf("Reached end of query range %lu\n", query.get_end_position());
+                                end_of_query = true;
+                                break;
+                            }
+                            // Lines of the start bucket before the query start are skipped
+                            if (pos >= query.get_start_position()) {
+                                fwrite(linebuf.c_str(), sizeof(char), linebuf.size(), stdout); // newline included already
+                            }
+                        }
 
-                    debugf("Previously at address: %ld, now at address: %ld\n", current_offset, tellfd(input_fd));
+                        if (distance_to_next == 0) {
+                            debugf("Reached last line of the file\n");
+                            end_of_query = true;
+                            break;
+                        }
+                        // backward distances wrap
+                        record_offset = (long) ((uint64_t) record_offset + distance_to_next);
+                        if (record_offset < overflow_start_offset
+                                && (record_offset < slot_offset || record_offset >= slot_offset + slot_size)) {
+                            // slot of the next bucket, reached by the scan
+                            break;
+                        }
+                    }
                 }
-            } else {
-                break;
+                fclose(batch_file);
+                batch_offset += batch_size;
             }
         }
-
     }
     // No filter
     else {
@@ -581,138 +548,138 @@ void query_sparse_file_fd(const std::string& input_filename, VcfCoordinateQuery
     close(input_fd);
 }
 
-
-
-
-
-class VcfPackedBinningIndexConfiguration {
-public:
-    VcfPackedBinningIndexConfiguration(int entries_per_bin):
-            entries_per_bin(entries_per_bin) {
-
-    }
-
-    int entries_per_bin;
-
-};
-
-
-size_t struct_index_entry_size =
-    sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint64_t);
-
-struct index_entry {
-    uint8_t reference_name_idx;
-    uint32_t position;
-    uint64_t byte_offset;
-};
-
-int write_index_entry_fd(int fd, struct index_entry *entry) {
-    write(fd, &entry->reference_name_idx, sizeof(entry->reference_name_idx));
-    write(fd, &entry->position, sizeof(entry->position));
-    write(fd, &entry->byte_offset, sizeof(entry->byte_offset));
-    return 0;
-}
-
-long write_index_entry(FILE *file, struct index_entry *entry) {
-    // write(fd, &entry->reference_name_idx, sizeof(entry->reference_name_idx));
-    // write(fd, &entry->position, sizeof(entry->position));
-    // write(fd, &entry->byte_offset, sizeof(entry->byte_offset));
-
-    long total_bytes = 0;
-    total_bytes += fwrite(&entry->reference_name_idx, sizeof(entry->reference_name_idx), 1, file);
-    total_bytes += fwrite(&entry->position, sizeof(entry->position), 1, file);
-    total_bytes += fwrite(&entry->byte_offset, sizeof(entry->byte_offset), 1, file);
-    return total_bytes;
-}
-
 /**
- * Returns 0 on success. Sets `bytes_read` to the number of bytes read. Should be the
- * sum of the size of the fields in a struct index_entry.
+ * Prints the number of lines of a sparse file in the range of `query`. Runs
+ * of lines in the range are counted by following their skip pointers, so only
+ * the lines at the ends of the hops are read.
  */
-int read_index_entry_fd(int fd, struct index_entry *entry, int *bytes_read) {
-    int read_count = 0, n = 0;
-    n = read(fd, &(entry->reference_name_idx), sizeof(uint8_t));
-    if (n == 0) {
-        debugf("Unexpected EOF\n");
-        return -1;
-    } else if (n < 0) {
-        perror("read");
-        debugf("Failed to read reference_name_idx, status = %d\n", n);
-        return -1;
-    } else {
-        read_count += n;
+void count_sparse_file_fd(const std::string& input_filename, VcfCoordinateQuery query) {
+    int input_fd = open(input_filename.c_str(), O_RDONLY);
+    if (input_fd < 0) {
+        perror("open");
+        throw std::runtime_error("Failed to open file: " + input_filename);
     }
+    VcfCompressionSchema schema;
+    std::vector<std::string> meta_header_lines;
+    meta_header_lines.reserve(256);
+    decompress2_metadata_headers_fd(input_fd, meta_header_lines, schema);
 
-    n = read(fd, &entry->position, sizeof(uint32_t));
-    if (n == 0) {
-        debugf("Unexpected EOF\n");
-        return -1;
-    } else if (n < 0) {
-        perror("read");
-        debugf("Failed to read position, status = %d\n", n);
-        return -1;
-    } else {
-        read_count += n;
+    SparsificationConfiguration sparse_config;
+    if (sparse_config.parse_meta_lines(meta_header_lines) != 0) {
+        throw std::runtime_error("Invalid sparse layout line in file: " + input_filename);
     }
-
-    n = read(fd, &entry->byte_offset, sizeof(uint64_t));
-    if (n == 0) {
-        debugf("Unexpected EOF\n");
-        return -1;
-    } else if (n < 0) {
-        perror("read");
-        debugf("Failed to read byte_offset, status = %d\n", n);
-        return -1;
-    } else {
-        read_count += n;
+    if (!sparse_config.contains(query.get_reference_name(), query.get_start_position())) {
+        debugf("Query start is not in the sparse file\n");
+        printf("0\n");
+        close(input_fd);
+        return;
     }
 
-    *bytes_read = read_count;
-    return 0;
-}
-
-/**
- * Returns 0 on success. Sets `bytes_read` to the number of bytes read. Should be the
- * sum of the size of the fields in a struct index_entry.
- */
-int read_index_entry(FILE *file, struct index_entry *entry, int *bytes_read) {
-    int read_count = 0, n = 0;
-    // n = read(fd, &(entry->reference_name_idx), sizeof(uint8_t));
-    n = fread(&(entry->reference_name_idx), sizeof(uint8_t), 1, file);
-    if (n < 1) {
-        debugf("Failed to read reference_name_idx, status = %d\n", n);
-        debugf("Unexpected EOF\n");
-        perror("fread");
-        return -1;
-    } else {
-        read_count += n * sizeof(uint8_t);
+    long data_start_offset = tellfd(input_fd) + 8;
+    uint64_t first_line_offset = 0;
+    if (read(input_fd, &first_line_offset, sizeof(uint64_t)) < (int)sizeof(uint64_t)) {
+        throw std::runtime_error("Failed to read first_line_offset value from file");
     }
-
-    n = fread(&entry->position, sizeof(uint32_t), 1, file);
-    if (n < 1) {
-        debugf("Failed to read position, status = %d\n", n);
-        debugf("Unexpected EOF\n");
-        perror("fread");
-        return -1;
+    const long slot_size = (long) sparse_config.multiplication_factor * sparse_config.block_size;
+    const long overflow_start_offset = data_start_offset + sparse_config.overflow_offset();
+    const long first_record_offset = data_start_offset + first_line_offset;
+    long span_start_offset = data_start_offset + sparse_config.compute_sparse_offset(
+        query.get_reference_name(), query.get_start_position());
+    long span_end_offset;
+    if (sparse_config.contains(query.get_reference_name(), query.get_end_position())) {
+        span_end_offset = data_start_offset + slot_size + sparse_config.compute_sparse_offset(
+            query.get_reference_name(), query.get_end_position());
     } else {
-        read_count += n * sizeof(uint32_t);
+        span_end_offset = data_start_offset + sparse_config.reference_end_offset(query.get_reference_name());
+    }
+    span_end_offset = std::min(span_end_offset, overflow_start_offset);
+
+    // first populated slot of the range
+    std::vector<struct sparse_data_extent> extents;
+    find_sparse_data_extents(input_fd, span_start_offset, span_end_offset, data_start_offset, slot_size, extents);
+    long record_offset = -1;
+    for (size_t extent_i = 0; extent_i < extents.size() && record_offset < 0; extent_i++) {
+        for (long slot_offset = extents[extent_i].begin; slot_offset < extents[extent_i].end; slot_offset += slot_size) {
+            uint8_t distance_headers[VCFC_SPARSE_DISTANCE_HEADERS_SIZE];
+            uint64_t distance_to_previous = 0;
+            if (pread(input_fd, distance_headers, sizeof(distance_headers), slot_offset) == (ssize_t) sizeof(distance_headers)) {
+                uint8_array_to_uint64(distance_headers, &distance_to_previous);
+            }
+            if (distance_to_previous != 0 || slot_offset == first_record_offset) {
+                record_offset = slot_offset;
+                break;
+            }
+        }
     }
 
-    n = fread(&entry->byte_offset, sizeof(uint64_t), 1, file);
-    if (n < 1) {
-        debugf("Failed to read byte_offset, status = %d\n", n);
-        debugf("Unexpected EOF\n");
-        perror("read");
-        return -1;
-    } else {
-        read_count += n * sizeof(uint64_t);
+    uint64_t line_count = 0;
+    struct sparse_record_headers headers;
+    std::string reference_name;
+    uint64_t pos = 0;
+    bool in_range = false;
+    if (record_offset >= 0) {
+        if (record_offset == span_start_offset) {
+            record_offset = skip_sparse_lines_before(input_fd, sparse_config, record_offset,
+                query.get_reference_name(), query.get_start_position());
+        }
+        // first line at or after the query start
+        while (true) {
+            bool is_line = read_sparse_record(input_fd, sparse_config, record_offset, &headers, reference_name, &pos);
+            if (is_line && (reference_name != query.get_reference_name() || pos > query.get_end_position())) {
+                break;
+            }
+            if (is_line && pos >= query.get_start_position()) {
+                in_range = true;
+                break;
+            }
+            if (headers.distance_to_next == 0) {
+                break;
+            }
+            // backward distances wrap
+            record_offset = (long) ((uint64_t) record_offset + headers.distance_to_next);
+        }
     }
 
-    *bytes_read = read_count;
-    return 0;
+    const uint64_t skip_lengths[2] = {VCFC_SPARSE_SKIP_SHORT, VCFC_SPARSE_SKIP_LONG};
+    while (in_range) {
+        line_count++;
+        // longest hop that stays in the range, the lines it passes are too
+        bool skipped = false;
+        for (int level = 1; level >= 0 && !skipped; level--) {
+            if (headers.skip_distances[level] == 0) {
+                continue;
+            }
+            long skip_offset = (long) ((uint64_t) record_offset + headers.skip_distances[level]);
+            struct sparse_record_headers skip_headers;
+            read_sparse_record(input_fd, sparse_config, skip_offset, &skip_headers, reference_name, &pos);
+            if (reference_name == query.get_reference_name() && pos <= query.get_end_position()) {
+                line_count += skip_lengths[level] - 1;
+                record_offset = skip_offset;
+                headers = skip_headers;
+                skipped = true;
+            }
+        }
+        if (skipped) {
+            continue;
+        }
+        // next line, past redirects
+        in_range = false;
+        while (headers.distance_to_next != 0) {
+            record_offset = (long) ((uint64_t) record_offset + headers.distance_to_next);
+            if (read_sparse_record(input_fd, sparse_config, record_offset, &headers, reference_name, &pos)) {
+                in_range = reference_name == query.get_reference_name() && pos <= query.get_end_position();
+                break;
+            }
+        }
+    }
+    printf("%lu\n", line_count);
+    close(input_fd);
 }
 
 
+
+
+
 inline long read_to(FILE *input_file, unsigned char end, bool remove_end, std::string& out) {
     unsigned char cur = 0;
     long counter = 0;
@@ -734,121 +701,28 @@ inline long read_to(FILE *input_file, unsigned char end, bool remove_end, std::s
     return -1;
 }
 
-int parse_kvp(const std::string& input, std::map<std::string,std::string>& output_map) {
-    const std::vector<std::string> pairs = split_string(input, ";");
-    for (size_t pair_i = 0; pair_i < pairs.size(); pair_i++) {
-        const std::string& pair = pairs[pair_i];
-        const std::vector<std::string> parts = split_string(pair, "=");
-        if (parts.size() == 2) {
-            const std::string& key = parts[0];
-            const std::string& val = parts[1];
-            // No duplicate checking
-            output_map[key] = val;
-        } else if (parts.size() == 1) {
-            const std::string& key = parts[0];
-            const std::string& val = "";
-            // No duplicate checking
-            output_map[key] = val;
-        } else {
-            throw std::runtime_error("Invalid kvp format: " + input);
-        }
+/**
+ * Whether `compressed_filename` holds lines rather than blocks of compress
+ * --blocks. Readers of lines stop at the first block, so the actions that
+ * read lines check this first and print why they can't run if not.
+ */
+static bool check_line_container(const std::string& compressed_filename, const std::string& action) {
+    FILE *input_file = fopen(compressed_filename.c_str(), "r");
+    if (input_file == NULL) {
+        perror("fopen");
+        throw std::runtime_error("Failed to open file: " + compressed_filename);
     }
-    return 0;
-}
-
-bool alt_is_structural(const std::string& alt) {
-    return alt.find('<') != std::string::npos;
-}
-
-long compute_end_position(
-        long pos,
-        const std::string& reference_name,
-        const std::string& ref,
-        const std::string& alt,
-        const std::string& info) {
-    // long read_to_ret = 0;
-    long end_position = 0;
-    // debugf("ID=%s\n", id.c_str());
-    // debugf("REF=%s\n", ref.c_str());
-    debugf("ALT=%s\n", alt.c_str());
-
-    #ifdef TIMING
-    std::chrono::time_point<std::chrono::steady_clock> start;
-    std::chrono::time_point<std::chrono::steady_clock> end;
-    std::chrono::nanoseconds duration;
-    #endif
-
-    #ifdef TIMING
-    start = std::chrono::steady_clock::now();
-    #endif
-
-    if (alt_is_structural(alt)) {
-        debugf("ALT is structural: %s\n", alt.c_str());
-        // std::string info;
-        debugf("INFO=%s\n", info.c_str());
-        std::map<std::string,std::string> info_kvp;
-        if (parse_kvp(info, info_kvp) < 0) {
-            throw std::runtime_error("Failed to parse info kvp");
-        }
-        std::string svtype = info_kvp["SVTYPE"];
-        debugf("Structural variant type: %s\n", svtype.c_str());
-
-        // SV without END info: SVA, ALU (alt begins with: <INS:)
-        if (info_kvp.count("END")) {
-            long end;
-            std::vector<std::string> end_strings = split_string(info_kvp["END"], ",");
-            long max_end = 0;
-            for (auto iter = end_strings.begin(); iter != end_strings.end(); iter++) {
-                if (str_to_long(*iter, &end) != 0) {
-                    throw std::runtime_error("Failed to parse END integer: " + *iter);
-                }
-                if (end > max_end) {
-                    max_end = end;
-                }
-            }
-            end_position = std::abs(max_end);
-        } else if (info_kvp.count("SVLEN")) {
-            long svlen = 0, max_svlen = 0;
-            std::vector<std::string> svlen_strings = split_string(info_kvp["SVLEN"], ",");
-            for (size_t i = 0; i < svlen_strings.size(); i++) {
-                if (str_to_long(svlen_strings[i], &svlen) != 0) {
-                    throw std::runtime_error("Failed to parse SVLEN integer: " + svlen_strings[i]);
-                }
-                // Using abs to handle INS types, and DEL, DUP together
-                if (std::abs(svlen) > max_svlen) {
-                    max_svlen = std::abs(svlen);
-                }
-            }
-            end_position = pos + max_svlen - 1;
-        } else {
-            debugf("Could not find END or SVLEN to determine end position of structural variant, using start_position\n");
-            end_position = pos;
-        }
-
-    } else {
-        debugf("Non structural variant\n");
-        std::vector<std::string> alts = split_string(alt, ",");
-        size_t max_alt_size = 0;
-        for (auto iter = alts.begin(); iter != alts.end(); iter++) {
-            if (iter->size() > max_alt_size) {
-                max_alt_size = iter->size();
-            }
-        }
-        // POS plus longest region, either insertion or deletion
-        // end_position = pos + std::abs((long)(reference_name.size() - max_alt_size));
-        if (ref.size() >= max_alt_size) {
-            end_position = pos + ref.size() - 1;
-        } else {
-            end_position = pos + max_alt_size - 1;
-        }
+    VcfCompressionSchema schema;
+    std::vector<std::string> meta_header_lines;
+    decompress2_metadata_headers(input_file, meta_header_lines, schema);
+    bool blocks = is_block_container(input_file);
+    fclose(input_file);
+    if (blocks) {
+        std::cerr << compressed_filename << " holds blocks, " << action
+            << " needs a file compressed without --blocks" << std::endl;
+        return false;
     }
-
-    #ifdef TIMING
-    end = std::chrono::steady_clock::now();
-    duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
-    printf("TIMING compute_end_position: %lu\n", duration.count());
-    #endif
-    return end_position;
+    return true;
 }
 
 void create_sparse_external_index(
@@ -872,8 +746,9 @@ void create_sparse_external_index(
     std::vector<std::string> meta_header_lines;
     meta_header_lines.reserve(256);
     decompress2_metadata_headers(input_file, meta_header_lines, schema);
+    sparse_config.set_reference_names(schema.reference_names);
 
-    reference_name_map ref_name_map;
+    SparseIndexBuilder index_builder(output_fd, sparse_config);
 
     std::vector<byte_t> line_bytes;
     line_bytes.reserve(16 * 1024);
@@ -895,7 +770,7 @@ void create_sparse_external_index(
         if (status == 0) {
             debugf("Finished creating index\n");
             break;
-        } else if (status != (int) compressed_line_length_headers_size) {
+        } else if (status < (int) compressed_line_length_headers_size) {
             throw std::runtime_error("Failed to read line length headers");
         }
 
@@ -950,20 +825,7 @@ void create_sparse_external_index(
 
         // }
 
-        size_t sparse_offset = sparse_config.compute_sparse_offset(reference_name, pos);
-        off_t lseek_ret = lseek(output_fd, sparse_offset, SEEK_SET);
-        if (lseek_ret != (off_t) sparse_offset) {
-            perror("lseek");
-            debugf("Failed to seek to offset %ld, got %ld\n", sparse_offset, lseek_ret);
-            return;
-        }
-        struct index_entry entry;
-        entry.reference_name_idx = ref_name_map.reference_to_int(reference_name);
-        entry.position = pos;
-        entry.byte_offset = line_byte_offset;
-        debugf("Writing entry (%d %d %ld) to index file offset %lu\n",
-            entry.reference_name_idx, entry.position, entry.byte_offset, sparse_offset);
-        write_index_entry_fd(output_fd, &entry);
+        index_builder.add_line(reference_name, pos, line_byte_offset);
 
         // Determine whether to write this entry to the index or whether it is inside the current bin
         // if (line_number % index_configuration.entries_per_bin == 0) {
@@ -1037,15 +899,6 @@ void query_sparse_external_index(
         return;
     }
 
-    // test SEEK_DATA
-    off_t test_seek_data_offset = 10000000;
-    lseek_ret = lseek(index_fd, test_seek_data_offset, SEEK_DATA);
-    if (lseek_ret < 0) {
-        perror("fseek");
-        debugf("SEEK_DATA failed: %ld\n", lseek_ret);
-        return;
-    }
-
 
     #ifdef TIMING
     end = std::chrono::steady_clock::now();
@@ -1062,9 +915,14 @@ void query_sparse_external_index(
     struct index_entry start_entry;
     memset(&start_entry, 0, sizeof(start_entry));
 
-    reference_name_map ref_name_map;
-
-    // uint8_t query_reference_name_idx = ref_name_map.reference_to_int(query.get_reference_name());
+    sparse_config.set_reference_names(schema.reference_names);
+    query.set_reference_names(schema.reference_names);
+    if (!sparse_config.contains(query.get_reference_name(), query.get_start_position())) {
+        debugf("Query start is not in the index\n");
+        fclose(compressed_file);
+        close(index_fd);
+        return;
+    }
 
     size_t sparse_offset_s = sparse_config.compute_sparse_offset(
         query.get_reference_name(), query.get_start_position());
@@ -1281,10 +1139,15 @@ void query_sparse_external_index(
 }
 
 
-void create_binned_index4(
+/**
+ * Creates a .vcfci index, and the zone maps of its bins if `zone_map_filename`
+ * is not empty.
+ */
+void create_binned_index4(
         const std::string& compressed_input_filename,
         const std::string& index_filename,
-        VcfPackedBinningIndexConfiguration& index_configuration) {
+        VcfPackedBinningIndexConfiguration& index_configuration,
+        const std::string& zone_map_filename = "") {
     FILE *input_file = fopen(compressed_input_filename.c_str(), "r");
     if (input_file == NULL) {
         perror("fopen");
@@ -1303,14 +1166,9 @@ void create_binned_index4(
     meta_header_lines.reserve(256);
     decompress2_metadata_headers(input_file, meta_header_lines, schema);
 
-    reference_name_map ref_name_map;
-
     // std::vector<byte_t> line_bytes;
     // line_bytes.reserve(16 * 1024);
 
-    // Counter to handle entries per bin
-    size_t line_number = 0;
-
     // Iterate through lines of compressed file
     // long total_write_bytes = 0;
 
@@ -1318,17 +1176,22 @@ void create_binned_index4(
     // std::map<size_t,std::pair<size_t,struct index_entry>> index_map;
 
     typedef struct _position {
-        uint8_t reference_name_idx;
+        uint32_t reference_name_idx;
         long start;
         long end;
     } position_t;
 
     // std::vector<std::pair<position_t,struct index_entry>> index_vector;
-    std::vector<struct index_entry> index_vector;
+    BinnedIndexBuilder index_builder(index_configuration);
+    index_builder.set_reference_names(schema.reference_names);
+    ZoneMapBuilder zone_map_builder;
+    zone_map_builder.set_reference_names(schema.reference_names);
+    bool zone_maps = !zone_map_filename.empty();
+    long line_byte_offset;
 
     while (true) {
         // line_bytes.clear();
-        long line_byte_offset = ftell(input_file);
+        line_byte_offset = ftell(input_file);
 
         debugf("Start of line, stream positioned so next byte is at position %ld (0x%08lx)\n",
                 line_byte_offset,
@@ -1340,7 +1203,7 @@ void create_binned_index4(
         if (status == 0) {
             debugf("Finished creating index\n");
             break;
-        } else if (status != (int) compressed_line_length_headers_size) {
+        } else if (status < (int) compressed_line_length_headers_size) {
             throw std::runtime_error("Failed to read line length headers");
         }
 
@@ -1383,36 +1246,45 @@ void create_binned_index4(
         if (!success) {
             throw std::runtime_error("Failed to parse pos: " + pos_str);
         }
-        std::string id;
-        read_to_ret = read_to(input_file, '\t', true, id);
-        std::string ref;
-        read_to_ret = read_to(input_file, '\t', true, ref);
-        std::string alt;
-        read_to_ret = read_to(input_file, '\t', true, alt);
-
-
         std::string info;
         std::string qual;
         std::string filter;
-        if (read_to(input_file, '\t', true, qual) <= 0) {
-            throw std::runtime_error("Failed to read qual");
-        }
-        if (read_to(input_file, '\t', true, filter) <= 0) {
-            throw std::runtime_error("Failed to read filter");
-        }
-        if (read_to(input_file, '\t', true, info) <= 0) {
-            throw std::runtime_error("Failed to read info");
-        }
-        debugf("CHR=%s\n", reference_name.c_str());
-        debugf("POS=%s\n", pos_str.c_str());
-        debugf("ID=%s\n", id.c_str());
-        debugf("REF=%s\n", ref.c_str());
-        debugf("ALT=%s\n", alt.c_str());
-        debugf("QUAL=%s\n", qual.c_str());
-        debugf("FILTER=%s\n", filter.c_str());
-        debugf("INFO=%s\n", info.c_str());
+        if (line_length_headers.has_end_position && !zone_maps) {
+            // END was computed at compression time, no need to read further
+            end_position = pos + line_length_headers.end_position_delta;
+        } else {
+            std::string id;
+            read_to_ret = read_to(input_file, '\t', true, id);
+            std::string ref;
+            read_to_ret = read_to(input_file, '\t', true, ref);
+            std::string alt;
+            read_to_ret = read_to(input_file, '\t', true, alt);
 
-        end_position = compute_end_position(pos, reference_name, ref, alt, info);
+
+            if (read_to(input_file, '\t', true, qual) <= 0) {
+                throw std::runtime_error("Failed to read qual");
+            }
+            if (read_to(input_file, '\t', true, filter) <= 0) {
+                throw std::runtime_error("Failed to read filter");
+            }
+            if (read_to(input_file, '\t', true, info) <= 0) {
+                throw std::runtime_error("Failed to read info");
+            }
+            debugf("CHR=%s\n", reference_name.c_str());
+            debugf("POS=%s\n", pos_str.c_str());
+            debugf("ID=%s\n", id.c_str());
+            debugf("REF=%s\n", ref.c_str());
+            debugf("ALT=%s\n", alt.c_str());
+            debugf("QUAL=%s\n", qual.c_str());
+            debugf("FILTER=%s\n", filter.c_str());
+            debugf("INFO=%s\n", info.c_str());
+
+            if (line_length_headers.has_end_position) {
+                end_position = pos + line_length_headers.end_position_delta;
+            } else {
+                end_position = compute_end_position(pos, reference_name, ref, alt, info);
+            }
+        }
         debugf("END_POS=%ld\n", end_position);
 
         // insert index entries for every position between [pos, end_position]
@@ -1420,191 +1292,13 @@ void create_binned_index4(
 
         // insert or update index entries which exist if this for this positional range [pos, end_position]
 
-        uint8_t reference_name_idx = ref_name_map.reference_to_int(reference_name);
-
-        // position_t line_position;
-        // line_position.reference_name_idx = reference_name_idx;
-        // line_position.start = pos;
-        // line_position.end = end_position;
-
-        struct index_entry new_entry;
-        new_entry.reference_name_idx = reference_name_idx;
-        new_entry.position = end_position; // CHANGED TO END
-        new_entry.byte_offset = line_byte_offset;
-
-
-        if (index_vector.size() > 0) {
-            // Determine if should be added to vector
-            // if (line_number % index_configuration.entries_per_bin == 0) {
-                struct index_entry last_index_entry = index_vector.back();
-                // position_t last_index_position = last_index_added.first;
-                // long last_index_start = last_index_position.start;
-                uint32_t last_index_end = last_index_entry.position;
-
-                // struct index_entry last_index_entry = last_index_added.second;
-
-                bool added_duplicate = false;
-
-                if (line_number % index_configuration.entries_per_bin == 0) {
-                    // if (pos <= last_index_end) {
-                    //     // Add duplicate entry for previous index entry, with current position
-                    //     debugf("Current line is overlapping previous entry, adding new entry\n");
-                    //     // last_index_entry.position = end_position; // CHANGED TO END
-
-                    //     // // last_index_position.end = line_position.end;
-                    //     // // auto dup_index_item = std::pair<position_t,struct index_entry>(last_index_position, last_index_entry);
-
-                    //     // index_vector.push_back(last_index_entry);
-                    //     index_vector.push_back(new_entry);
-                    // } else {
-                    //     debugf("Current line start %u is greater than last index end %ld. Adding entry for current line\n",
-                    //         pos, last_index_end);
-                    //     index_vector.push_back(new_entry);
-
-                    // }
-
-                    if (end_position > last_index_end) {
-                        debugf("Current line end %u is greater than last index end %ld. Adding entry for current line\n",
-                            end_position, last_index_end);
-                        index_vector.push_back(new_entry);
-                    }
-
-
-                } else {
-                    // can only grow into prevous entry
-                    if (end_position > last_index_end) {
-                        debugf("Growing last entry position end from %u to %lu\n",
-                        index_vector[index_vector.size()-1].position, end_position);
-                        index_vector[index_vector.size()-1].position = end_position;
-                    } else {
-                        debugf("Line was within previous index entry bounds, doing nothing\n");
-                    }
-                }
-
-                // if (pos < last_index_end) {
-                //     // Add duplicate entry for previous index entry, with current position
-                //     debugf("Adding duplicate entry\n");
-                //     last_index_entry.position = end_position; // CHANGED TO END
-                //     // last_index_position.end = line_position.end;
-                //     // auto dup_index_item = std::pair<position_t,struct index_entry>(last_index_position, last_index_entry);
-
-                //     index_vector.push_back(last_index_entry);
-                //     added_duplicate = true;
-                // } else if (line_number % index_configuration.entries_per_bin == 0) {
-
-                //     debugf("Adding entry for current line\n");
-                //     // Add new entry for current line
-                //     // auto new_index_item = std::pair<position_t,struct index_entry>(line_position, new_entry);
-
-                //     index_vector.push_back(new_entry);
-                // } else {
-                //     debugf("Growing last entry position end from %u to %lu\n",
-                //         index_vector[index_vector.size()-1].position, end_position);
-                //     index_vector[index_vector.size()-1].position = end_position; // CHANGED to end
-                // }
-
-
-                // if (line_position.end > last_index_end) {
-
-                // }
-
-
-                // if (line_position.start < last_index_end) {
-                //     // Add duplicate entry for previous index entry, with current position
-                //     debugf("Adding duplicate entry\n");
-                //     last_index_entry.position = line_position.end; // CHANGED TO END
-                //     auto dup_index_item = std::pair<position_t,struct index_entry>(last_index_position, last_index_entry);
-                //     index_vector.push_back(dup_index_item);
-                // }
-
-
-                // if (line_position.end > last_index_end) {
-                //     if (line_number % index_configuration.entries_per_bin == 0) {
-
-                //         debugf("Adding entry for current line\n");
-                //         // Add new entry for current line
-                //         auto new_index_item = std::pair<position_t,struct index_entry>(line_position, new_entry);
-                //         index_vector.push_back(new_index_item);
-                //     } else {
-                //         debugf("Growing last entry position end from %u to %lu\n",
-                //             index_vector[index_vector.size()-1].second.position, end_position);
-                //         index_vector[index_vector.size()-1].second.position = end_position; // CHANGED to end
-                //         index_vector[index_vector.size()-1].first.end = end_position;
-                //     }
-                // }
-
-
-            // } else {
-            //     debugf("Not yet met entries_per_bin\n");
-            // }
-
-
-        } else {
-            // add to vector
-            debugf("First index entry\n");
-            // index_vector.push_back(std::pair<position_t,struct index_entry>(line_position, new_entry));
-            index_vector.push_back(new_entry);
+        index_builder.add_line(reference_name, end_position, line_byte_offset);
+        if (zone_maps) {
+            // the line went to the last entry, a new one or the one it grew
+            zone_map_builder.add_line(index_builder.get_entries().size() - 1,
+                reference_name, pos, end_position, qual, filter, info, line_byte_offset);
         }
 
-
-
-        // size_t map_max_start_position = 0;
-        // size_t map_max_end_position = 0;
-        // if (index_map.size() != 0) {
-        //     const std::pair<size_t,std::pair<size_t,struct index_entry>> max_index_map_entry = *(index_map.rbegin());
-        //     map_max_start_position = max_index_map_entry.first;
-        //     map_max_end_position = max_index_map_entry.second.first;
-        //     debugf("index current max position = %lu\n", map_max_start_position);
-
-        // }
-
-        // size_t first_index_position_to_write;
-        // if (pos >= map_max_start_position) {
-        //     first_index_position_to_write = pos;
-        // } else {
-        //     first_index_position_to_write = map_max_start_position;
-        // }
-
-        // if (first_index_position_to_write <= end_position) {
-        //     size_t count = (size_t) ((end_position - first_index_position_to_write) / index_configuration.entries_per_bin);
-        //     count += 1; // allow trailing fragment for rounding in above calculation
-        //     size_t last_index_position_to_write = (end_position + count*index_configuration.entries_per_bin);
-        //     debugf("Expecting to write at most %lu entries between %lu and %lu\n",
-        //         count, first_index_position_to_write, last_index_position_to_write);
-
-        //     for (
-        //             size_t index_position = first_index_position_to_write;
-        //             index_position <= last_index_position_to_write;
-        //             index_position += index_configuration.entries_per_bin) {
-        //         struct index_entry new_entry;
-        //         new_entry.reference_name_idx = reference_name_idx;
-        //         new_entry.position = index_position; // starting position for a query
-        //         new_entry.byte_offset = line_byte_offset;
-        //         debugf("Inserting new index ref_idx=%d, entry start=%u, end=%lu, byte_offset=%lu\n",
-        //             new_entry.reference_name_idx, new_entry.position, end_position, new_entry.byte_offset);
-        //         index_map[index_position] = std::pair<size_t,struct index_entry>(end_position, new_entry);
-        //     }
-        // }
-
-
-        // Determine whether to write this entry to the index or whether it is inside the current bin
-        // if (line_number % index_configuration.entries_per_bin == 0) {
-        //     struct index_entry entry;
-        //     // char *endptr;
-        //     entry.reference_name_idx = ref_name_map.reference_to_int(reference_name);
-        //     entry.position = pos;
-        //     entry.byte_offset = line_byte_offset;
-        //     debugf("Writing entry to index %d %d %ld\n",
-        //         entry.reference_name_idx, entry.position, entry.byte_offset);
-
-        //     long index_entry_bytes = write_index_entry(output_file, &entry);
-        //     total_write_bytes += index_entry_bytes;
-        //     debugf("Wrote %ld bytes to index, new size: %ld\n", index_entry_bytes, total_write_bytes);
-        // } else {
-        //     debugf("Not writing entry to index\n");
-        // }
-        line_number++;
-
         // seek to next line
         long next_line_distance = line_length_headers.line_length - (ftell(input_file) - line_byte_offset);
         next_line_distance += 4; // include line_length header bytes itself
@@ -1618,9 +1312,9 @@ void create_binned_index4(
         }
     }
 
+    const std::vector<struct index_entry>& index_vector = index_builder.get_entries();
     for (size_t i = 0; i < index_vector.size(); i++) {
         auto item_entry = index_vector[i];
-        auto item_position = item_entry.position;
         // auto item_entry = item.second;
         debugf("Writing entry ref = %u, position = %u, offset = %lu\n",
             item_entry.reference_name_idx, item_entry.position, item_entry.byte_offset);
@@ -1634,6 +1328,10 @@ void create_binned_index4(
 
     fclose(output_file);
     fclose(input_file);
+
+    if (zone_maps && zone_map_builder.write(zone_map_filename, line_byte_offset) != 0) {
+        throw std::runtime_error("Failed to write zone maps: " + zone_map_filename);
+    }
 }
 
 void create_binned_index3(
@@ -1658,7 +1356,7 @@ void create_binned_index3(
     meta_header_lines.reserve(256);
     decompress2_metadata_headers(input_file, meta_header_lines, schema);
 
-    reference_name_map ref_name_map;
+    const reference_name_map& ref_name_map = schema.reference_names;
 
     // std::vector<byte_t> line_bytes;
     // line_bytes.reserve(16 * 1024);
@@ -1673,7 +1371,7 @@ void create_binned_index3(
     // std::map<size_t,std::pair<size_t,struct index_entry>> index_map;
 
     typedef struct _position {
-        uint8_t reference_name_idx;
+        uint32_t reference_name_idx;
         long start;
         long end;
     } position_t;
@@ -1694,7 +1392,7 @@ void create_binned_index3(
         if (status == 0) {
             debugf("Finished creating index\n");
             break;
-        } else if (status != (int) compressed_line_length_headers_size) {
+        } else if (status < (int) compressed_line_length_headers_size) {
             throw std::runtime_error("Failed to read line length headers");
         }
 
@@ -1774,7 +1472,7 @@ void create_binned_index3(
 
         // insert or update index entries which exist if this for this positional range [pos, end_position]
 
-        uint8_t reference_name_idx = ref_name_map.reference_to_int(reference_name);
+        uint32_t reference_name_idx = ref_name_map.reference_to_int(reference_name);
 
         position_t line_position;
         line_position.reference_name_idx = reference_name_idx;
@@ -1976,7 +1674,7 @@ void create_binned_index2(
     meta_header_lines.reserve(256);
     decompress2_metadata_headers(input_file, meta_header_lines, schema);
 
-    reference_name_map ref_name_map;
+    const reference_name_map& ref_name_map = schema.reference_names;
 
     std::vector<byte_t> line_bytes;
     line_bytes.reserve(16 * 1024);
@@ -2010,7 +1708,7 @@ void create_binned_index2(
         if (status == 0) {
             debugf("Finished creating index\n");
             break;
-        } else if (status != (int) compressed_line_length_headers_size) {
+        } else if (status < (int) compressed_line_length_headers_size) {
             throw std::runtime_error("Failed to read line length headers");
         }
 
@@ -2090,7 +1788,7 @@ void create_binned_index2(
 
         // insert or update index entries which exist if this for this positional range [pos, end_position]
 
-        uint8_t reference_name_idx = ref_name_map.reference_to_int(reference_name);
+        uint32_t reference_name_idx = ref_name_map.reference_to_int(reference_name);
 
         size_t map_max_start_position = 0;
         size_t map_max_end_position = 0;
@@ -2191,7 +1889,7 @@ void create_binned_index(const std::string& compressed_input_filename, const std
     meta_header_lines.reserve(256);
     decompress2_metadata_headers(input_file, meta_header_lines, schema);
 
-    reference_name_map ref_name_map;
+    const reference_name_map& ref_name_map = schema.reference_names;
 
     std::vector<byte_t> line_bytes;
     line_bytes.reserve(16 * 1024);
@@ -2215,11 +1913,11 @@ void create_binned_index(const std::string& compressed_input_filename, const std
         if (status == 0) {
             debugf("Finished creating index\n");
             break;
-        } else if (status != (int) compressed_line_length_headers_size) {
+        } else if (status < (int) compressed_line_length_headers_size) {
             throw std::runtime_error("Failed to read line length headers");
         }
 
-        uint64_t read_bytes = 4 + 4; // length headers
+        uint64_t read_bytes = status; // length headers, including any END position
 
         debugf("After length headers, stream positioned so next byte is at position %ld (0x%08lx)\n",
                 ftell(input_file),
@@ -2268,8 +1966,8 @@ void create_binned_index(const std::string& compressed_input_filename, const std
         size_t pos = 0;
 
         // iterate over the rest of the line
-        // subtract 4 due to length of required_columns_length_header_bytes, which are already read
-        while (i++ < line_length_headers.line_length - 4) {
+        // subtract the header bytes after the line length header, which are already read
+        while (i++ < line_length_headers.line_length - (read_bytes - 4)) {
             unsigned char b;
             // if (read(input_fd, &b, 1) <= 0) {
             if (fread(&b, 1, 1, input_file) < 1) {
@@ -2617,8 +2315,9 @@ void query_binned_index_binarysearch_inmemory(const std::string& compressed_file
     // struct index_entry start_entry;
     // memset(&start_entry, 0, sizeof(start_entry));
 
-    reference_name_map ref_name_map;
-    uint8_t query_reference_name_idx = ref_name_map.reference_to_int(query.get_reference_name());
+    const reference_name_map& ref_name_map = schema.reference_names;
+    query.set_reference_names(ref_name_map);
+    uint32_t query_reference_name_idx = ref_name_map.reference_to_int(query.get_reference_name());
 
     // already checked file existence
     long index_size = file_size(index_filename.c_str());
@@ -2842,7 +2541,7 @@ void query_binned_index_binarysearch_inmemory(const std::string& compressed_file
             if (status == 0) {
                 debugf("Finished creating index\n");
                 break;
-            } else if (status != (int) compressed_line_length_headers_size) {
+            } else if (status < (int) compressed_line_length_headers_size) {
                 throw std::runtime_error("Failed to read line length headers");
             }
             // uint64_t read_bytes = 4 + 4; // length headers
@@ -2868,27 +2567,32 @@ void query_binned_index_binarysearch_inmemory(const std::string& compressed_file
             if (!success) {
                 throw std::runtime_error("Failed to parse pos: " + pos_str);
             }
-            if (read_to(compressed_file, '\t', true, id) <= 0) {
-                throw std::runtime_error("Failed to read id");
-            }
-            if (read_to(compressed_file, '\t', true, ref) <= 0) {
-                throw std::runtime_error("Failed to read ref");
-            }
-            if (read_to(compressed_file, '\t', true, alt) <= 0) {
-                throw std::runtime_error("Failed to read alt");
-            }
-            if (alt_is_structural(alt)) {
-                if (read_to(compressed_file, '\t', true, qual) <= 0) {
-                    throw std::runtime_error("Failed to read qual");
+            long end_position;
+            if (line_length_headers.has_end_position) {
+                end_position = (long) pos + line_length_headers.end_position_delta;
+            } else {
+                if (read_to(compressed_file, '\t', true, id) <= 0) {
+                    throw std::runtime_error("Failed to read id");
+                }
+                if (read_to(compressed_file, '\t', true, ref) <= 0) {
+                    throw std::runtime_error("Failed to read ref");
                 }
-                if (read_to(compressed_file, '\t', true, filter) <= 0) {
-                    throw std::runtime_error("Failed to read filter");
+                if (read_to(compressed_file, '\t', true, alt) <= 0) {
+                    throw std::runtime_error("Failed to read alt");
                 }
-                if (read_to(compressed_file, '\t', true, info) <= 0) {
-                    throw std::runtime_error("Failed to read info");
+                if (alt_is_structural(alt)) {
+                    if (read_to(compressed_file, '\t', true, qual) <= 0) {
+                        throw std::runtime_error("Failed to read qual");
+                    }
+                    if (read_to(compressed_file, '\t', true, filter) <= 0) {
+                        throw std::runtime_error("Failed to read filter");
+                    }
+                    if (read_to(compressed_file, '\t', true, info) <= 0) {
+                        throw std::runtime_error("Failed to read info");
+                    }
                 }
+                end_position = compute_end_position((long)pos, reference_name, ref, alt, info);
             }
-            long end_position = compute_end_position((long)pos, reference_name, ref, alt, info);
 
 
             debugf("Checking reference_name = %s, pos = %lu against query reference_name = %s, start = %lu, end = %lu\n",
@@ -2988,12 +2692,41 @@ void query_binned_index_binarysearch(const std::string& compressed_filename, Vcf
         debugf("Failed to open input file: %s\n", compressed_filename.c_str());
         return;
     }
-    debugf("Opening %s\n", index_filename.c_str());
-    FILE *index_file = fopen(index_filename.c_str(), "r");
-    if (index_file == NULL) {
-        perror("fopen");
-        debugf("Failed to open index file: %s\n", index_filename.c_str());
-        return;
+
+    // Prefer an index embedded in the compressed file, found through its trailer
+    FILE *index_file = NULL;
+    long index_base_offset = 0;
+    long entry_count = 0;
+    struct vcfc_trailer trailer;
+    if (read_vcfc_trailer(fileno(compressed_file), &trailer) == 0 && trailer.binned_index_offset != 0) {
+        debugf("Using embedded index at offset %lu\n", trailer.binned_index_offset);
+        // open the file a second time, a dup'd descriptor would share its
+        // offset with compressed_file and the index seeks would move the data
+        index_file = fopen(compressed_filename.c_str(), "r");
+        if (index_file == NULL) {
+            perror("fopen");
+            fclose(compressed_file);
+            return;
+        }
+        index_base_offset = trailer.binned_index_offset + 1 + sizeof(uint64_t);
+        entry_count = trailer.binned_index_entry_count;
+    } else {
+        debugf("Opening %s\n", index_filename.c_str());
+        index_file = fopen(index_filename.c_str(), "r");
+        if (index_file == NULL) {
+            perror("fopen");
+            printf("Index file does not exist: %s\n", index_filename.c_str());
+            fclose(compressed_file);
+            return;
+        }
+        long index_size = file_size(index_filename.c_str());
+        if (index_size % struct_index_entry_size != 0) {
+            throw std::runtime_error(string_format(
+                "Index size %ld was not a multiple of entry size: %ld",
+                index_size, struct_index_entry_size));
+        }
+        entry_count = index_size / struct_index_entry_size;
+        debugf("Index of size %ld has %ld entries\n", index_size, entry_count);
     }
 
     debugf("Parsing metadata lines and header line\n");
@@ -3005,25 +2738,14 @@ void query_binned_index_binarysearch(const std::string& compressed_filename, Vcf
     // struct index_entry start_entry;
     // memset(&start_entry, 0, sizeof(start_entry));
 
-    reference_name_map ref_name_map;
-    uint8_t query_reference_name_idx = ref_name_map.reference_to_int(query.get_reference_name());
+    const reference_name_map& ref_name_map = schema.reference_names;
+    query.set_reference_names(ref_name_map);
+    uint32_t query_reference_name_idx = ref_name_map.reference_to_int(query.get_reference_name());
 
     #ifdef TIMING
     start = std::chrono::steady_clock::now();
     #endif
 
-    // already checked file existence
-    long index_size = file_size(index_filename.c_str());
-
-    if (index_size % struct_index_entry_size != 0) {
-        throw std::runtime_error(string_format(
-            "Index size %ld was not a multiple of entry size: %ld",
-            index_size, struct_index_entry_size));
-    }
-
-    long entry_count = index_size / struct_index_entry_size;
-    debugf("Index of size %ld has %ld entries\n", index_size, entry_count);
-
     if (entry_count == 0) {
         fclose(compressed_file);
         fclose(index_file);
@@ -3078,7 +2800,7 @@ void query_binned_index_binarysearch(const std::string& compressed_filename, Vcf
         }
 
         search_mid = get_mid(search_start, search_end);
-        long mid_offset = search_mid * struct_index_entry_size;
+        long mid_offset = index_base_offset + search_mid * struct_index_entry_size;
         debugf("Search mid_index = %ld, mid_offset = %ld\n", search_mid, mid_offset);
 
         status = fseek(index_file, mid_offset, SEEK_SET);
@@ -3147,7 +2869,7 @@ void query_binned_index_binarysearch(const std::string& compressed_filename, Vcf
                         && entry.position > query.get_start_position())) {
             debugf("Backing up one entry\n");
             search_mid = search_mid - 1;
-            long mid_offset = search_mid * struct_index_entry_size;
+            long mid_offset = index_base_offset + search_mid * struct_index_entry_size;
             debugf("Search mid_index = %ld, mid_offset = %ld\n", search_mid, mid_offset);
 
             status = fseek(index_file, mid_offset, SEEK_SET);
@@ -3219,7 +2941,7 @@ void query_binned_index_binarysearch(const std::string& compressed_filename, Vcf
             if (status == 0) {
                 debugf("Finished creating index\n");
                 break;
-            } else if (status != (int) compressed_line_length_headers_size) {
+            } else if (status < (int) compressed_line_length_headers_size) {
                 throw std::runtime_error("Failed to read line length headers");
             }
             // uint64_t read_bytes = 4 + 4; // length headers
@@ -3245,27 +2967,32 @@ void query_binned_index_binarysearch(const std::string& compressed_filename, Vcf
             if (!success) {
                 throw std::runtime_error("Failed to parse pos: " + pos_str);
             }
-            if (read_to(compressed_file, '\t', true, id) <= 0) {
-                throw std::runtime_error("Failed to read id");
-            }
-            if (read_to(compressed_file, '\t', true, ref) <= 0) {
-                throw std::runtime_error("Failed to read ref");
-            }
-            if (read_to(compressed_file, '\t', true, alt) <= 0) {
-                throw std::runtime_error("Failed to read alt");
-            }
-            if (alt_is_structural(alt)) {
-                if (read_to(compressed_file, '\t', true, qual) <= 0) {
-                    throw std::runtime_error("Failed to read qual");
+            long end_position;
+            if (line_length_headers.has_end_position) {
+                end_position = (long) pos + line_length_headers.end_position_delta;
+            } else {
+                if (read_to(compressed_file, '\t', true, id) <= 0) {
+                    throw std::runtime_error("Failed to read id");
                 }
-                if (read_to(compressed_file, '\t', true, filter) <= 0) {
-                    throw std::runtime_error("Failed to read filter");
+                if (read_to(compressed_file, '\t', true, ref) <= 0) {
+                    throw std::runtime_error("Failed to read ref");
                 }
-                if (read_to(compressed_file, '\t', true, info) <= 0) {
-                    throw std::runtime_error("Failed to read info");
+                if (read_to(compressed_file, '\t', true, alt) <= 0) {
+                    throw std::runtime_error("Failed to read alt");
+                }
+                if (alt_is_structural(alt)) {
+                    if (read_to(compressed_file, '\t', true, qual) <= 0) {
+                        throw std::runtime_error("Failed to read qual");
+                    }
+                    if (read_to(compressed_file, '\t', true, filter) <= 0) {
+                        throw std::runtime_error("Failed to read filter");
+                    }
+                    if (read_to(compressed_file, '\t', true, info) <= 0) {
+                        throw std::runtime_error("Failed to read info");
+                    }
                 }
+                end_position = compute_end_position((long)pos, reference_name, ref, alt, info);
             }
-            long end_position = compute_end_position((long)pos, reference_name, ref, alt, info);
 
 
             debugf("Checking reference_name = %s, pos = %lu against query reference_name = %s, start = %lu, end = %lu\n",
@@ -3318,37 +3045,958 @@ void query_binned_index_binarysearch(const std::string& compressed_filename, Vcf
                 // continue; // fall through
             }
 
-            long bytes_read_in_line = ftell(compressed_file) - line_byte_offset;
-            long distance_to_next = line_length_headers.line_length + 4 - bytes_read_in_line;
-            status = fseek(compressed_file, distance_to_next, SEEK_CUR);
-            if (status != 0) {
-                perror("fseek");
-                throw std::runtime_error("Failed to seek to next line");
+            long bytes_read_in_line = ftell(compressed_file) - line_byte_offset;
+            long distance_to_next = line_length_headers.line_length + 4 - bytes_read_in_line;
+            status = fseek(compressed_file, distance_to_next, SEEK_CUR);
+            if (status != 0) {
+                perror("fseek");
+                throw std::runtime_error("Failed to seek to next line");
+            }
+
+        }
+        debugf("lines decompressed before query = %d\n", before_count);
+
+    } else {
+        debugf("Index was empty\n");
+    }
+
+    #ifdef TIMING
+    decompress_end = std::chrono::steady_clock::now();
+    duration = std::chrono::duration_cast<std::chrono::nanoseconds>(decompress_end - decompress_start);
+    if (current_state == query_state::BEFORE_QUERY) {
+        // No lines were printed, and didn't reach end of query interval
+        printf("TIMING decompress_seeking: %lu\n", duration.count());
+    } else {
+        printf("TIMING decompress_iteration: %lu\n", duration.count());
+    }
+    #endif
+
+    fclose(index_file);
+    fclose(compressed_file);
+}
+
+
+/**
+ * Reads the reference name, POS and END of the line whose length headers were
+ * just read from `compressed_file`. Leaves the stream inside the line.
+ */
+static void read_line_coordinates(
+        FILE *compressed_file,
+        const compressed_line_length_headers& line_length_headers,
+        std::string& reference_name,
+        uint64_t *pos,
+        long *end_position) {
+    bool success = false;
+    std::string pos_str, id, ref, alt, qual, filter, info;
+    reference_name.clear();
+    if (read_to(compressed_file, '\t', true, reference_name) <= 0) {
+        throw std::runtime_error("Failed to read reference_name");
+    }
+    if (read_to(compressed_file, '\t', true, pos_str) <= 0) {
+        throw std::runtime_error("Failed to read pos");
+    }
+    *pos = str_to_uint64(pos_str, success);
+    if (!success) {
+        throw std::runtime_error("Failed to parse pos: " + pos_str);
+    }
+    if (line_length_headers.has_end_position) {
+        *end_position = (long) *pos + line_length_headers.end_position_delta;
+        return;
+    }
+    if (read_to(compressed_file, '\t', true, id) <= 0
+            || read_to(compressed_file, '\t', true, ref) <= 0
+            || read_to(compressed_file, '\t', true, alt) <= 0) {
+        throw std::runtime_error("Failed to read required columns");
+    }
+    if (alt_is_structural(alt)) {
+        if (read_to(compressed_file, '\t', true, qual) <= 0
+                || read_to(compressed_file, '\t', true, filter) <= 0
+                || read_to(compressed_file, '\t', true, info) <= 0) {
+            throw std::runtime_error("Failed to read required columns");
+        }
+    }
+    *end_position = compute_end_position((long) *pos, reference_name, ref, alt, info);
+}
+
+/**
+ * Prints the lines overlapping `query`, scanning from the line at `start_offset`
+ * until a line after the query. Returns the number of lines printed.
+ */
+static int print_overlapping_lines(
+        FILE *compressed_file,
+        VcfCompressionSchema& schema,
+        VcfCoordinateQuery& query,
+        uint64_t start_offset) {
+    int status;
+    std::string linebuf;
+    linebuf.reserve(4 * 4096);
+    std::string reference_name;
+    int before_count = 0;
+    int printed_count = 0;
+
+    fseek(compressed_file, start_offset, SEEK_SET);
+    while (true) {
+        long line_byte_offset = ftell(compressed_file);
+
+        compressed_line_length_headers line_length_headers;
+        memset(&line_length_headers, 0, sizeof(compressed_line_length_headers));
+        status = read_compressed_line_length_headers(compressed_file, &line_length_headers);
+        if (status == 0) {
+            break;
+        } else if (status < (int) compressed_line_length_headers_size) {
+            throw std::runtime_error("Failed to read line length headers");
+        }
+
+        uint64_t pos;
+        long end_position;
+        read_line_coordinates(compressed_file, line_length_headers, reference_name, &pos, &end_position);
+
+        int query_compare_to_line = query.compare_to_range(reference_name, pos, end_position);
+        if (query_compare_to_line == 0) {
+            status = fseek(compressed_file, line_byte_offset, SEEK_SET);
+            if (status != 0) {
+                throw std::runtime_error("Failed to return to start of line");
+            }
+            linebuf.clear();
+            size_t compressed_line_length;
+            status = decompress2_data_line(compressed_file, schema, linebuf, &compressed_line_length);
+            if (status < 0) {
+                throw std::runtime_error("Failed to decompress line");
+            }
+            fputs(linebuf.c_str(), stdout);
+            printed_count++;
+            continue;
+        } else if (query_compare_to_line < 0) { // line is after query
+            break;
+        }
+        before_count++;
+
+        long bytes_read_in_line = ftell(compressed_file) - line_byte_offset;
+        long distance_to_next = line_length_headers.line_length + 4 - bytes_read_in_line;
+        status = fseek(compressed_file, distance_to_next, SEEK_CUR);
+        if (status != 0) {
+            perror("fseek");
+            throw std::runtime_error("Failed to seek to next line");
+        }
+    }
+    debugf("lines decompressed before query = %d\n", before_count);
+    return printed_count;
+}
+
+/**
+ * Query using a .vcfci-eytzinger index. The index is mmapped and searched in
+ * place, so there is no load step and a lookup touches about one cache line
+ * per 2 levels of the tree.
+ */
+/**
+ * Whether the binned index layout with `extension` exists next to the
+ * compressed file and was built from its current contents. A layout left
+ * from an earlier version of the file is ignored with a warning.
+ */
+static bool use_index_layout(
+        const std::string& compressed_filename,
+        const std::string& extension,
+        const std::string& create_action = "create-binned-index") {
+    std::string index_filename = compressed_filename + extension;
+    if (!file_exists(index_filename.c_str())) {
+        return false;
+    }
+    if (!index_matches_data(index_filename, compressed_filename)) {
+        std::cerr << "Ignoring " << index_filename << ", it was not built from the current "
+            << compressed_filename << ", rebuild it with " << create_action << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Whether the index `index_filename` of an index specific query was built
+ * from the current contents of the compressed file. Prints how to rebuild
+ * it if not.
+ */
+static bool check_index_data(
+        const std::string& compressed_filename,
+        const std::string& index_filename,
+        const std::string& create_action) {
+    if (!index_matches_data(index_filename, compressed_filename)) {
+        std::cerr << index_filename << " was not built from the current "
+            << compressed_filename << ", rebuild it with " << create_action << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void query_binned_index_eytzinger(const std::string& compressed_filename, VcfCoordinateQuery query) {
+    #ifdef TIMING
+    std::chrono::time_point<std::chrono::steady_clock> start;
+    std::chrono::time_point<std::chrono::steady_clock> end;
+    std::chrono::nanoseconds duration;
+    #endif
+
+    std::string index_filename = compressed_filename + VCFC_EYTZINGER_INDEX_EXTENSION;
+    EytzingerIndex index;
+    if (index.open(index_filename) != 0) {
+        printf("Index file does not exist: %s\n", index_filename.c_str());
+        return;
+    }
+    FILE *compressed_file = fopen(compressed_filename.c_str(), "r");
+    if (compressed_file == NULL) {
+        perror("fopen");
+        debugf("Failed to open input file: %s\n", compressed_filename.c_str());
+        return;
+    }
+
+    debugf("Parsing metadata lines and header line\n");
+    VcfCompressionSchema schema;
+    std::vector<std::string> meta_header_lines;
+    meta_header_lines.reserve(256);
+    decompress2_metadata_headers(compressed_file, meta_header_lines, schema);
+
+    const reference_name_map& ref_name_map = schema.reference_names;
+    query.set_reference_names(ref_name_map);
+    uint32_t query_reference_name_idx = ref_name_map.reference_to_int(query.get_reference_name());
+
+    #ifdef TIMING
+    start = std::chrono::steady_clock::now();
+    #endif
+
+    // Same start entry as the binary search, the bin before the first one
+    // whose max END reaches the query start
+    struct index_entry entry;
+    int found = index.search(query_reference_name_idx, query.get_start_position(), &entry);
+
+    #ifdef TIMING
+    end = std::chrono::steady_clock::now();
+    duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
+    printf("TIMING index_search: %lu\n", duration.count());
+    #endif
+
+    if (!found) {
+        debugf("Index was empty\n");
+        fclose(compressed_file);
+        return;
+    }
+    debugf("entry reference_name_idx = %u, position = %u, byte_offset = %lu\n",
+        entry.reference_name_idx, entry.position, entry.byte_offset);
+
+    print_overlapping_lines(compressed_file, schema, query, entry.byte_offset);
+    fclose(compressed_file);
+}
+
+/**
+ * Query using a .vcfci-ef index. The keys and offsets are mmapped Elias-Fano
+ * sequences, the start entry is found with select instead of a binary search.
+ */
+void query_binned_index_elias_fano(const std::string& compressed_filename, VcfCoordinateQuery query) {
+    #ifdef TIMING
+    std::chrono::time_point<std::chrono::steady_clock> start;
+    std::chrono::time_point<std::chrono::steady_clock> end;
+    std::chrono::nanoseconds duration;
+    #endif
+
+    std::string index_filename = compressed_filename + VCFC_ELIAS_FANO_INDEX_EXTENSION;
+    EliasFanoIndex index;
+    if (index.open(index_filename) != 0) {
+        printf("Index file does not exist: %s\n", index_filename.c_str());
+        return;
+    }
+    FILE *compressed_file = fopen(compressed_filename.c_str(), "r");
+    if (compressed_file == NULL) {
+        perror("fopen");
+        debugf("Failed to open input file: %s\n", compressed_filename.c_str());
+        return;
+    }
+
+    VcfCompressionSchema schema;
+    std::vector<std::string> meta_header_lines;
+    meta_header_lines.reserve(256);
+    decompress2_metadata_headers(compressed_file, meta_header_lines, schema);
+
+    const reference_name_map& ref_name_map = schema.reference_names;
+    query.set_reference_names(ref_name_map);
+    uint32_t query_reference_name_idx = ref_name_map.reference_to_int(query.get_reference_name());
+
+    #ifdef TIMING
+    start = std::chrono::steady_clock::now();
+    #endif
+
+    struct index_entry entry;
+    int found = index.search(query_reference_name_idx, query.get_start_position(), &entry);
+
+    #ifdef TIMING
+    end = std::chrono::steady_clock::now();
+    duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
+    printf("TIMING index_search: %lu\n", duration.count());
+    #endif
+
+    if (!found) {
+        debugf("Index was empty\n");
+        fclose(compressed_file);
+        return;
+    }
+    debugf("entry reference_name_idx = %u, position = %u, byte_offset = %lu\n",
+        entry.reference_name_idx, entry.position, entry.byte_offset);
+
+    print_overlapping_lines(compressed_file, schema, query, entry.byte_offset);
+    fclose(compressed_file);
+}
+
+/**
+ * Query using a .vcfci-2level index. Only the summary of the index is read
+ * into memory, the lookup reads one leaf of it and then scans the data.
+ */
+void query_binned_index_two_level(const std::string& compressed_filename, VcfCoordinateQuery query) {
+    #ifdef TIMING
+    std::chrono::time_point<std::chrono::steady_clock> start;
+    std::chrono::time_point<std::chrono::steady_clock> end;
+    std::chrono::nanoseconds duration;
+    #endif
+
+    std::string index_filename = compressed_filename + VCFC_TWO_LEVEL_INDEX_EXTENSION;
+    TwoLevelIndex index;
+    if (index.open(index_filename) != 0) {
+        printf("Index file does not exist: %s\n", index_filename.c_str());
+        return;
+    }
+    FILE *compressed_file = fopen(compressed_filename.c_str(), "r");
+    if (compressed_file == NULL) {
+        perror("fopen");
+        debugf("Failed to open input file: %s\n", compressed_filename.c_str());
+        return;
+    }
+
+    VcfCompressionSchema schema;
+    std::vector<std::string> meta_header_lines;
+    meta_header_lines.reserve(256);
+    decompress2_metadata_headers(compressed_file, meta_header_lines, schema);
+
+    const reference_name_map& ref_name_map = schema.reference_names;
+    query.set_reference_names(ref_name_map);
+    uint32_t query_reference_name_idx = ref_name_map.reference_to_int(query.get_reference_name());
+
+    #ifdef TIMING
+    start = std::chrono::steady_clock::now();
+    #endif
+
+    struct index_entry entry;
+    int found = index.search(query_reference_name_idx, query.get_start_position(), &entry);
+
+    #ifdef TIMING
+    end = std::chrono::steady_clock::now();
+    duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
+    printf("TIMING index_search: %lu\n", duration.count());
+    #endif
+
+    if (found < 0) {
+        fclose(compressed_file);
+        throw std::runtime_error("Failed to read index: " + index_filename);
+    }
+    if (!found) {
+        debugf("Index was empty\n");
+        fclose(compressed_file);
+        return;
+    }
+    debugf("entry reference_name_idx = %u, position = %u, byte_offset = %lu\n",
+        entry.reference_name_idx, entry.position, entry.byte_offset);
+
+    print_overlapping_lines(compressed_file, schema, query, entry.byte_offset);
+    fclose(compressed_file);
+}
+
+/**
+ * Query with predicates using the .vcfci-zonemap zone maps of the bins of a
+ * binned index. Bins whose zone map rules out all of their lines are skipped
+ * without reading them, the lines of the other bins that overlap the query are
+ * decompressed and printed if they satisfy the predicates.
+ */
+void query_binned_index_zone_maps(
+        const std::string& compressed_filename,
+        VcfCoordinateQuery query,
+        const std::vector<struct zone_map_predicate>& predicates) {
+    std::string zone_map_filename = compressed_filename + VCFC_ZONE_MAP_INDEX_EXTENSION;
+    ZoneMap zone_map;
+    if (zone_map.open(zone_map_filename) != 0) {
+        printf("Index file does not exist: %s\n", zone_map_filename.c_str());
+        return;
+    }
+    if (!check_index_data(compressed_filename, zone_map_filename, "create-binned-index --zone-maps")) {
+        return;
+    }
+    FILE *compressed_file = fopen(compressed_filename.c_str(), "r");
+    if (compressed_file == NULL) {
+        perror("fopen");
+        debugf("Failed to open input file: %s\n", compressed_filename.c_str());
+        return;
+    }
+
+    VcfCompressionSchema schema;
+    std::vector<std::string> meta_header_lines;
+    meta_header_lines.reserve(256);
+    decompress2_metadata_headers(compressed_file, meta_header_lines, schema);
+
+    const reference_name_map& ref_name_map = schema.reference_names;
+    query.set_reference_names(ref_name_map);
+    uint32_t query_reference_name_idx = ref_name_map.reference_to_int(query.get_reference_name());
+
+    int status;
+    std::string linebuf;
+    std::string reference_name;
+    struct zone_map_line line;
+    size_t skipped_bins = 0;
+    bool after_query = false;
+    for (size_t bin = zone_map.search(query_reference_name_idx, query.get_start_position());
+            bin < zone_map.size() && !after_query; bin++) {
+        const struct zone_map_record& record = zone_map.get_record(bin);
+        // same order as VcfCoordinateQuery::compare_to_range, by the first line of the bin
+        if (record.reference_name_idx > query_reference_name_idx
+                || (record.reference_name_idx == query_reference_name_idx
+                    && query.get_has_end_position()
+                    && record.first_position > query.get_end_position())) {
+            break;
+        }
+        if (!zone_map.may_match(bin, predicates)) {
+            skipped_bins++;
+            continue;
+        }
+
+        fseek(compressed_file, record.start_offset, SEEK_SET);
+        while ((uint64_t) ftell(compressed_file) < record.end_offset) {
+            long line_byte_offset = ftell(compressed_file);
+            compressed_line_length_headers line_length_headers;
+            memset(&line_length_headers, 0, sizeof(compressed_line_length_headers));
+            status = read_compressed_line_length_headers(compressed_file, &line_length_headers);
+            if (status < (int) compressed_line_length_headers_size) {
+                throw std::runtime_error("Failed to read line length headers");
+            }
+            uint64_t pos;
+            long end_position;
+            read_line_coordinates(compressed_file, line_length_headers, reference_name, &pos, &end_position);
+
+            int query_compare_to_line = query.compare_to_range(reference_name, pos, end_position);
+            if (query_compare_to_line < 0) { // line is after query
+                after_query = true;
+                break;
+            }
+            if (query_compare_to_line == 0) {
+                fseek(compressed_file, line_byte_offset, SEEK_SET);
+                linebuf.clear();
+                size_t compressed_line_length;
+                status = decompress2_data_line(compressed_file, schema, linebuf, &compressed_line_length);
+                if (status < 0) {
+                    throw std::runtime_error("Failed to decompress line");
+                }
+                std::vector<std::string> columns = split_string(linebuf, "\t", 8);
+                if (columns.size() < 8) {
+                    throw std::runtime_error("Line has fewer than 8 columns");
+                }
+                parse_zone_map_line(columns[5], columns[6], columns[7], &line);
+                if (zone_map_line_matches(line, predicates)) {
+                    fputs(linebuf.c_str(), stdout);
+                }
+            }
+            long next_line_offset = line_byte_offset + 4 + line_length_headers.line_length;
+            if (fseek(compressed_file, next_line_offset, SEEK_SET) != 0) {
+                perror("fseek");
+                throw std::runtime_error("Failed to seek to next line");
+            }
+        }
+    }
+    debugf("Skipped %lu bins by their zone maps\n", skipped_bins);
+    fclose(compressed_file);
+}
+
+/**
+ * Creates a .vcfci-interval index, see IntervalIndexBuilder.
+ */
+void create_interval_index(const std::string& compressed_filename, const std::string& index_filename, uint32_t lines_per_record) {
+    FILE *compressed_file = fopen(compressed_filename.c_str(), "r");
+    if (compressed_file == NULL) {
+        perror("fopen");
+        throw std::runtime_error("Failed to open file: " + compressed_filename);
+    }
+    int status;
+    VcfCompressionSchema schema;
+    std::vector<std::string> meta_header_lines;
+    meta_header_lines.reserve(256);
+    decompress2_metadata_headers(compressed_file, meta_header_lines, schema);
+
+    IntervalIndexBuilder index_builder(lines_per_record);
+    std::string reference_name;
+    while (true) {
+        long line_byte_offset = ftell(compressed_file);
+        compressed_line_length_headers line_length_headers;
+        memset(&line_length_headers, 0, sizeof(compressed_line_length_headers));
+        status = read_compressed_line_length_headers(compressed_file, &line_length_headers);
+        if (status == 0) {
+            break;
+        } else if (status < (int) compressed_line_length_headers_size) {
+            throw std::runtime_error("Failed to read line length headers");
+        }
+
+        uint64_t pos;
+        long end_position;
+        read_line_coordinates(compressed_file, line_length_headers, reference_name, &pos, &end_position);
+        index_builder.add_line(reference_name, pos, std::max((long) pos, end_position), line_byte_offset);
+
+        long next_line_offset = line_byte_offset + 4 + line_length_headers.line_length;
+        if (fseek(compressed_file, next_line_offset, SEEK_SET) != 0) {
+            perror("fseek");
+            throw std::runtime_error("Failed to seek to next line");
+        }
+    }
+    fclose(compressed_file);
+
+    if (index_builder.write(index_filename) != 0) {
+        throw std::runtime_error("Failed to write index: " + index_filename);
+    }
+}
+
+/**
+ * Query using a .vcfci-interval index. Only the spans of lines overlapping the
+ * query are read, and each of their lines is checked against the query with
+ * its stored END.
+ */
+void query_interval_index(const std::string& compressed_filename, VcfCoordinateQuery query) {
+    std::string index_filename = compressed_filename + VCFC_INTERVAL_INDEX_EXTENSION;
+    IntervalIndex index;
+    if (index.open(index_filename) != 0) {
+        printf("Index file does not exist: %s\n", index_filename.c_str());
+        return;
+    }
+    if (!check_index_data(compressed_filename, index_filename, "create-interval-index")) {
+        return;
+    }
+    FILE *compressed_file = fopen(compressed_filename.c_str(), "r");
+    if (compressed_file == NULL) {
+        perror("fopen");
+        debugf("Failed to open input file: %s\n", compressed_filename.c_str());
+        return;
+    }
+
+    VcfCompressionSchema schema;
+    std::vector<std::string> meta_header_lines;
+    meta_header_lines.reserve(256);
+    decompress2_metadata_headers(compressed_file, meta_header_lines, schema);
+
+    uint32_t start = query.get_has_start_position() ? query.get_start_position() : 0;
+    uint32_t end = query.get_has_end_position() ? query.get_end_position() : UINT32_MAX;
+    std::vector<struct interval_index_record> spans;
+    index.query(query.get_reference_name(), start, end, spans);
+    debugf("%lu spans overlap the query\n", spans.size());
+
+    int status;
+    std::string linebuf;
+    linebuf.reserve(4 * 4096);
+    std::string reference_name;
+    for (const struct interval_index_record& span : spans) {
+        fseek(compressed_file, span.byte_offset, SEEK_SET);
+        for (uint32_t line_i = 0; line_i < span.line_count; line_i++) {
+            long line_byte_offset = ftell(compressed_file);
+            compressed_line_length_headers line_length_headers;
+            memset(&line_length_headers, 0, sizeof(compressed_line_length_headers));
+            status = read_compressed_line_length_headers(compressed_file, &line_length_headers);
+            if (status < (int) compressed_line_length_headers_size) {
+                throw std::runtime_error("Failed to read line length headers");
+            }
+            uint64_t pos;
+            long end_position;
+            read_line_coordinates(compressed_file, line_length_headers, reference_name, &pos, &end_position);
+            if (query.matches_range(reference_name, pos, std::max((long) pos, end_position))) {
+                fseek(compressed_file, line_byte_offset, SEEK_SET);
+                linebuf.clear();
+                size_t compressed_line_length;
+                status = decompress2_data_line(compressed_file, schema, linebuf, &compressed_line_length);
+                if (status < 0) {
+                    throw std::runtime_error("Failed to decompress line");
+                }
+                fputs(linebuf.c_str(), stdout);
+            } else {
+                fseek(compressed_file, line_byte_offset + 4 + line_length_headers.line_length, SEEK_SET);
+            }
+        }
+    }
+    fclose(compressed_file);
+}
+
+/**
+ * Creates a .vcfci-learned index, see LearnedIndexBuilder.
+ */
+void create_learned_index(const std::string& compressed_filename, const std::string& index_filename, uint32_t epsilon) {
+    FILE *compressed_file = fopen(compressed_filename.c_str(), "r");
+    if (compressed_file == NULL) {
+        perror("fopen");
+        throw std::runtime_error("Failed to open file: " + compressed_filename);
+    }
+    int status;
+    VcfCompressionSchema schema;
+    std::vector<std::string> meta_header_lines;
+    meta_header_lines.reserve(256);
+    decompress2_metadata_headers(compressed_file, meta_header_lines, schema);
+
+    LearnedIndexBuilder index_builder(epsilon);
+    std::string reference_name;
+    long line_byte_offset;
+    while (true) {
+        line_byte_offset = ftell(compressed_file);
+        compressed_line_length_headers line_length_headers;
+        memset(&line_length_headers, 0, sizeof(compressed_line_length_headers));
+        status = read_compressed_line_length_headers(compressed_file, &line_length_headers);
+        if (status == 0) {
+            break;
+        } else if (status < (int) compressed_line_length_headers_size) {
+            throw std::runtime_error("Failed to read line length headers");
+        }
+
+        uint64_t pos;
+        long end_position;
+        read_line_coordinates(compressed_file, line_length_headers, reference_name, &pos, &end_position);
+        index_builder.add_line(reference_name, end_position, line_byte_offset);
+
+        long next_line_offset = line_byte_offset + 4 + line_length_headers.line_length;
+        if (fseek(compressed_file, next_line_offset, SEEK_SET) != 0) {
+            perror("fseek");
+            throw std::runtime_error("Failed to seek to next line");
+        }
+    }
+    fclose(compressed_file);
+
+    if (index_builder.write(index_filename, line_byte_offset) != 0) {
+        throw std::runtime_error("Failed to write index: " + index_filename);
+    }
+}
+
+/**
+ * Query using a .vcfci-learned index. The segment of the query contig predicts
+ * an offset near the first overlapping line, and only the error window before
+ * it is searched for a line to start from.
+ */
+void query_learned_index(const std::string& compressed_filename, VcfCoordinateQuery query) {
+    #ifdef TIMING
+    std::chrono::time_point<std::chrono::steady_clock> start;
+    std::chrono::time_point<std::chrono::steady_clock> end;
+    std::chrono::nanoseconds duration;
+    #endif
+
+    std::string index_filename = compressed_filename + VCFC_LEARNED_INDEX_EXTENSION;
+    LearnedIndex index;
+    if (index.load(index_filename) != 0) {
+        printf("Index file does not exist: %s\n", index_filename.c_str());
+        return;
+    }
+    if (!check_index_data(compressed_filename, index_filename, "create-learned-index")) {
+        return;
+    }
+    FILE *compressed_file = fopen(compressed_filename.c_str(), "r");
+    if (compressed_file == NULL) {
+        perror("fopen");
+        debugf("Failed to open input file: %s\n", compressed_filename.c_str());
+        return;
+    }
+
+    VcfCompressionSchema schema;
+    std::vector<std::string> meta_header_lines;
+    meta_header_lines.reserve(256);
+    decompress2_metadata_headers(compressed_file, meta_header_lines, schema);
+    query.set_reference_names(schema.reference_names);
+
+    #ifdef TIMING
+    start = std::chrono::steady_clock::now();
+    #endif
+
+    int64_t start_offset = index.find_scan_start(
+        fileno(compressed_file), query.get_reference_name(), query.get_start_position());
+
+    #ifdef TIMING
+    end = std::chrono::steady_clock::now();
+    duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
+    printf("TIMING index_search: %lu\n", duration.count());
+    #endif
+
+    if (start_offset < 0) {
+        debugf("Contig %s is not in the index\n", query.get_reference_name().c_str());
+        fclose(compressed_file);
+        return;
+    }
+    debugf("Starting scan at offset %ld\n", start_offset);
+    print_overlapping_lines(compressed_file, schema, query, start_offset);
+    fclose(compressed_file);
+}
+
+
+/**
+ * Reads the CHROM, POS, ID, REF and ALT columns of the line whose length
+ * headers were just read from `compressed_file`.
+ */
+static void read_line_key_columns(
+        FILE *compressed_file,
+        std::string& reference_name,
+        uint64_t *pos,
+        std::string& id,
+        std::string& ref,
+        std::string& alt) {
+    std::string pos_str;
+    reference_name.clear();
+    id.clear();
+    ref.clear();
+    alt.clear();
+    if (read_to(compressed_file, '\t', true, reference_name) <= 0
+            || read_to(compressed_file, '\t', true, pos_str) <= 0
+            || read_to(compressed_file, '\t', true, id) <= 0
+            || read_to(compressed_file, '\t', true, ref) <= 0
+            || read_to(compressed_file, '\t', true, alt) <= 0) {
+        throw std::runtime_error("Failed to read required columns");
+    }
+    bool success = false;
+    *pos = str_to_uint64(pos_str, success);
+    if (!success) {
+        throw std::runtime_error("Failed to parse pos: " + pos_str);
+    }
+}
+
+/**
+ * Creates a .vcfci-hash index, see HashIndexBuilder.
+ */
+void create_hash_index(const std::string& compressed_filename, const std::string& index_filename) {
+    FILE *compressed_file = fopen(compressed_filename.c_str(), "r");
+    if (compressed_file == NULL) {
+        perror("fopen");
+        throw std::runtime_error("Failed to open file: " + compressed_filename);
+    }
+    int status;
+    VcfCompressionSchema schema;
+    std::vector<std::string> meta_header_lines;
+    meta_header_lines.reserve(256);
+    decompress2_metadata_headers(compressed_file, meta_header_lines, schema);
+
+    HashIndexBuilder index_builder;
+    std::string reference_name, id, ref, alt;
+    uint64_t pos;
+    while (true) {
+        long line_byte_offset = ftell(compressed_file);
+        compressed_line_length_headers line_length_headers;
+        memset(&line_length_headers, 0, sizeof(compressed_line_length_headers));
+        status = read_compressed_line_length_headers(compressed_file, &line_length_headers);
+        if (status == 0) {
+            break;
+        } else if (status < (int) compressed_line_length_headers_size) {
+            throw std::runtime_error("Failed to read line length headers");
+        }
+
+        read_line_key_columns(compressed_file, reference_name, &pos, id, ref, alt);
+        index_builder.add_line(reference_name, pos, id, ref, alt, line_byte_offset);
+
+        long next_line_offset = line_byte_offset + 4 + line_length_headers.line_length;
+        if (fseek(compressed_file, next_line_offset, SEEK_SET) != 0) {
+            perror("fseek");
+            throw std::runtime_error("Failed to seek to next line");
+        }
+    }
+    fclose(compressed_file);
+
+    if (index_builder.write(index_filename) != 0) {
+        throw std::runtime_error("Failed to write index: " + index_filename);
+    }
+}
+
+/**
+ * Creates a .vcfci-bloom index, see BloomFilterIndexBuilder, and prints the
+ * size and false positive rate of its filters.
+ */
+void create_bloom_filter_index(
+        const std::string& compressed_filename,
+        const std::string& index_filename,
+        const VcfPackedBinningIndexConfiguration& index_configuration,
+        uint32_t bits_per_key) {
+    FILE *compressed_file = fopen(compressed_filename.c_str(), "r");
+    if (compressed_file == NULL) {
+        perror("fopen");
+        throw std::runtime_error("Failed to open file: " + compressed_filename);
+    }
+    int status;
+    VcfCompressionSchema schema;
+    std::vector<std::string> meta_header_lines;
+    meta_header_lines.reserve(256);
+    decompress2_metadata_headers(compressed_file, meta_header_lines, schema);
+
+    BloomFilterIndexBuilder index_builder(index_configuration, bits_per_key);
+    std::string reference_name, id, ref, alt;
+    uint64_t pos;
+    long line_byte_offset;
+    while (true) {
+        line_byte_offset = ftell(compressed_file);
+        compressed_line_length_headers line_length_headers;
+        memset(&line_length_headers, 0, sizeof(compressed_line_length_headers));
+        status = read_compressed_line_length_headers(compressed_file, &line_length_headers);
+        if (status == 0) {
+            break;
+        } else if (status < (int) compressed_line_length_headers_size) {
+            throw std::runtime_error("Failed to read line length headers");
+        }
+
+        read_line_key_columns(compressed_file, reference_name, &pos, id, ref, alt);
+        index_builder.add_line(reference_name, pos, id, ref, alt, line_byte_offset);
+
+        long next_line_offset = line_byte_offset + 4 + line_length_headers.line_length;
+        if (fseek(compressed_file, next_line_offset, SEEK_SET) != 0) {
+            perror("fseek");
+            throw std::runtime_error("Failed to seek to next line");
+        }
+    }
+    fclose(compressed_file);
+
+    struct bloom_filter_stats stats;
+    if (index_builder.write(index_filename, line_byte_offset, &stats) != 0) {
+        throw std::runtime_error("Failed to write index: " + index_filename);
+    }
+    printf("bins: %lu\n", stats.bin_count);
+    printf("keys: %lu\n", stats.key_count);
+    printf("filter bytes: %lu (%.2f bits per key)\n", stats.filter_bytes,
+        stats.key_count > 0 ? 8.0 * stats.filter_bytes / stats.key_count : 0.0);
+    printf("expected false positive rate: %.6f\n", stats.expected_false_positive_rate);
+    printf("measured false positive rate: %.6f\n", stats.measured_false_positive_rate);
+}
+
+/**
+ * An exact lookup of a variant or of an ID.
+ */
+class VcfPointQuery {
+public:
+    VcfPointQuery(const std::string& id): is_id(true), id(id) {}
+
+    // The variant is normalized, see normalize_variant
+    VcfPointQuery(
+            const std::string& reference_name,
+            uint64_t position,
+            const std::string& ref,
+            const std::string& alt):
+                is_id(false), reference_name(reference_name), position(position), ref(ref), alt(alt) {
+        normalize_variant(&this->position, this->ref, this->alt);
+    }
+
+    // Hash of the query key, the key of the hash and Bloom filter indexes
+    uint64_t key() const {
+        if (this->is_id) {
+            return id_key_hash(this->id);
+        }
+        return variant_key_hash(this->reference_name, this->position, this->ref, this->alt);
+    }
+
+    // Whether the line with the first 5 `columns` holds the key
+    bool matches(const std::vector<std::string>& columns) const {
+        if (this->is_id) {
+            std::vector<std::string> line_ids = split_string(columns[2], ";");
+            return std::find(line_ids.begin(), line_ids.end(), this->id) != line_ids.end();
+        }
+        if (columns[0] != this->reference_name) {
+            return false;
+        }
+        bool success = false;
+        uint64_t line_position = str_to_uint64(columns[1], success);
+        if (!success) {
+            throw std::runtime_error("Failed to parse pos: " + columns[1]);
+        }
+        for (const std::string& line_alt : split_string(columns[4], ",")) {
+            uint64_t normalized_position = line_position;
+            std::string normalized_ref = columns[3];
+            std::string normalized_alt = line_alt;
+            normalize_variant(&normalized_position, normalized_ref, normalized_alt);
+            if (normalized_position == this->position
+                    && normalized_ref == this->ref
+                    && normalized_alt == this->alt) {
+                return true;
             }
-
         }
-        debugf("lines decompressed before query = %d\n", before_count);
+        return false;
+    }
 
+    bool is_id;
+    std::string id;
+    std::string reference_name;
+    uint64_t position = 0;
+    std::string ref;
+    std::string alt;
+};
+
+/**
+ * Prints the lines holding the key of `query`. The .vcfci-hash index gives the
+ * candidate lines, else the .vcfci-bloom index gives the candidate bins, and
+ * only those are read.
+ */
+void query_point(const std::string& compressed_filename, const VcfPointQuery& query) {
+    // byte ranges of the candidate lines, [start, end)
+    std::vector<std::pair<uint64_t,uint64_t>> ranges;
+    std::string hash_index_filename = compressed_filename + VCFC_HASH_INDEX_EXTENSION;
+    std::string bloom_index_filename = compressed_filename + VCFC_BLOOM_INDEX_EXTENSION;
+    if (use_index_layout(compressed_filename, VCFC_HASH_INDEX_EXTENSION, "create-hash-index")) {
+        HashIndex index;
+        if (index.open(hash_index_filename) != 0) {
+            throw std::runtime_error("Failed to open index: " + hash_index_filename);
+        }
+        std::vector<uint64_t> offsets;
+        if (query.is_id) {
+            index.find_id(query.key(), offsets);
+        } else {
+            index.find_variant(query.key(), offsets);
+        }
+        // reading one line stops at the first line start past the range
+        for (uint64_t offset : offsets) {
+            ranges.push_back(std::make_pair(offset, offset + 1));
+        }
+    } else if (use_index_layout(compressed_filename, VCFC_BLOOM_INDEX_EXTENSION, "create-bloom-index")) {
+        BloomFilterIndex index;
+        if (index.open(bloom_index_filename) != 0) {
+            throw std::runtime_error("Failed to open index: " + bloom_index_filename);
+        }
+        std::vector<struct bloom_filter_bin> bins;
+        index.find(query.key(), bins);
+        for (const struct bloom_filter_bin& bin : bins) {
+            ranges.push_back(std::make_pair(bin.start_offset, bin.end_offset));
+        }
     } else {
-        debugf("Index was empty\n");
+        printf("No usable index file: %s or %s\n", hash_index_filename.c_str(), bloom_index_filename.c_str());
+        return;
+    }
+    debugf("%lu candidate ranges\n", ranges.size());
+    if (ranges.empty()) {
+        return;
     }
 
-    #ifdef TIMING
-    decompress_end = std::chrono::steady_clock::now();
-    duration = std::chrono::duration_cast<std::chrono::nanoseconds>(decompress_end - decompress_start);
-    if (current_state == query_state::BEFORE_QUERY) {
-        // No lines were printed, and didn't reach end of query interval
-        printf("TIMING decompress_seeking: %lu\n", duration.count());
-    } else {
-        printf("TIMING decompress_iteration: %lu\n", duration.count());
+    FILE *compressed_file = fopen(compressed_filename.c_str(), "r");
+    if (compressed_file == NULL) {
+        perror("fopen");
+        debugf("Failed to open input file: %s\n", compressed_filename.c_str());
+        return;
     }
-    #endif
+    VcfCompressionSchema schema;
+    std::vector<std::string> meta_header_lines;
+    meta_header_lines.reserve(256);
+    decompress2_metadata_headers(compressed_file, meta_header_lines, schema);
 
-    fclose(index_file);
+    std::string linebuf;
+    std::vector<std::string> columns;
+    for (const std::pair<uint64_t,uint64_t>& range : ranges) {
+        if (fseek(compressed_file, range.first, SEEK_SET) != 0) {
+            perror("fseek");
+            throw std::runtime_error("Failed to seek to line");
+        }
+        while ((uint64_t) ftell(compressed_file) < range.second) {
+            linebuf.clear();
+            size_t compressed_line_length;
+            if (decompress2_data_line(compressed_file, schema, linebuf, &compressed_line_length) < 0) {
+                throw std::runtime_error("Failed to decompress line");
+            }
+            columns = split_string(linebuf, "\t", 5);
+            if (columns.size() < 5) {
+                throw std::runtime_error("Line has fewer than 5 columns");
+            }
+            if (query.matches(columns)) {
+                fputs(linebuf.c_str(), stdout);
+            }
+        }
+    }
     fclose(compressed_file);
 }
 
-
 void query_binned_index_FILE(const std::string& compressed_filename, VcfCoordinateQuery query) {
     int status;
     #ifdef TIMING
@@ -3404,9 +4052,10 @@ void query_binned_index_FILE(const std::string& compressed_filename, VcfCoordina
     struct index_entry start_entry;
     memset(&start_entry, 0, sizeof(start_entry));
 
-    reference_name_map ref_name_map;
+    const reference_name_map& ref_name_map = schema.reference_names;
+    query.set_reference_names(ref_name_map);
 
-    uint8_t query_reference_name_idx = ref_name_map.reference_to_int(query.get_reference_name());
+    uint32_t query_reference_name_idx = ref_name_map.reference_to_int(query.get_reference_name());
 
     // Find bin before the first bin start that matches the query
     long start_entry_address = 0;
@@ -3623,9 +4272,10 @@ void query_binned_index(const std::string& compressed_filename, VcfCoordinateQue
     struct index_entry start_entry;
     memset(&start_entry, 0, sizeof(start_entry));
 
-    reference_name_map ref_name_map;
+    const reference_name_map& ref_name_map = schema.reference_names;
+    query.set_reference_names(ref_name_map);
 
-    uint8_t query_reference_name_idx = ref_name_map.reference_to_int(query.get_reference_name());
+    uint32_t query_reference_name_idx = ref_name_map.reference_to_int(query.get_reference_name());
 
     // Find bin before the first bin start that matches the query
     long start_entry_address = 0;
@@ -3774,6 +4424,95 @@ void query_binned_index(const std::string& compressed_filename, VcfCoordinateQue
 }
 
 
+/**
+ * Query a block container, `input_file` positioned at the start of the data section.
+ * Blocks whose summary cannot match the query are skipped without inflating them,
+ * the rest are scanned line by line. In a sorted file the first block that can
+ * match is found by a binary search of the block table, and the scan stops at
+ * the first block past the query.
+ */
+size_t query_compressed_blocks(FILE *input_file, const VcfCompressionSchema& schema, VcfCoordinateQuery& query) {
+    size_t matched_line_count = 0;
+    std::string variant_line;
+    variant_line.reserve(1024 * 1024); // 1MiB
+    std::vector<byte_t> block;
+    struct block_header header;
+    VcfBlockReader block_reader(input_file);
+
+    size_t skipped_block_count = 0;
+
+    // the first header comes after the dictionary, which is read with it
+    int has_block = block_reader.next_block_header(&header);
+    bool sorted = false;
+    struct vcfc_trailer trailer;
+    std::vector<block_table_entry> block_table;
+    if (has_block == 1 && !query.get_reference_name().empty()
+            && read_vcfc_trailer(fileno(input_file), &trailer) == 0
+            && (trailer.flags & VCFC_TRAILER_FLAG_SORTED)
+            && read_block_table(fileno(input_file), trailer, block_table) == 0) {
+        sorted = true;
+        query.set_reference_names(schema.reference_names);
+        // first block whose last line is not before the query
+        size_t low = 0, high = block_table.size();
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            block_reader.seek_block(block_table[mid].byte_offset);
+            if (block_reader.next_block_header(&header) != 1) {
+                throw VcfValidationError("Block table entry does not point at a block");
+            }
+            if (query.compare_to(header.reference_name, header.last_position) > 0) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        skipped_block_count = low;
+        has_block = 0;
+        if (low < block_table.size()) {
+            block_reader.seek_block(block_table[low].byte_offset);
+            has_block = block_reader.next_block_header(&header);
+        }
+    }
+
+    for (; has_block == 1; has_block = block_reader.next_block_header(&header)) {
+        if (sorted && query.compare_to(header.reference_name, header.first_position) < 0) {
+            break;
+        }
+        if (!query.matches_range(header.reference_name, header.first_position, header.last_position)) {
+            block_reader.skip_block_payload(header);
+            skipped_block_count++;
+            continue;
+        }
+        block_reader.read_block_payload(header, block);
+        FILE *block_file = open_block_lines(block);
+        while (true) {
+            variant_line.clear();
+            size_t compressed_line_length = 0;
+            int status = decompress2_data_line(block_file, schema, variant_line, &compressed_line_length);
+            if (status == 0) {
+                break;
+            } else if (status < 0) {
+                throw std::runtime_error("Failed to decompressed data line\n");
+            }
+            SplitIterator spi(variant_line, "\t");
+            std::string ref = spi.next();
+            std::string pos_str = spi.next();
+            bool conversion_success = false;
+            uint64_t pos = str_to_uint64(pos_str, conversion_success);
+            if (!conversion_success) {
+                throw VcfValidationError(string_format("Malformed line, pos column must be int but got: %s", pos_str.c_str()).c_str());
+            }
+            if (query.matches(ref, pos)) {
+                matched_line_count++;
+                std::cout << variant_line;
+            }
+        }
+        fclose(block_file);
+    }
+    debugf("blocks skipped by block table or summary: %lu\n", skipped_block_count);
+    return matched_line_count;
+}
+
 void query_compressed_file(const std::string& input_filename, VcfCoordinateQuery query) {
     debugf("Querying %s for %s:%lu-%lu\n", input_filename.c_str(),
         query.get_reference_name().c_str(),
@@ -3794,6 +4533,18 @@ void query_compressed_file(const std::string& input_filename, VcfCoordinateQuery
     // string_t variant_line;
     // string_reserve(&variant_line, 1024 * 1024); // 1 MiB
 
+    FILE *input_file = fdopen(dup(input_fd), "r");
+    if (is_block_container(input_file)) {
+        matched_line_count = query_compressed_blocks(input_file, schema, query);
+        debugf("matched_line_count: %lu\n", matched_line_count);
+        fclose(input_file);
+        close(input_fd);
+        return;
+    }
+    // the FILE shares the offset of input_fd, reset it to account for readahead
+    lseek(input_fd, ftell(input_file), SEEK_SET);
+    fclose(input_file);
+
     while (true) {
         debugf("Start of line, stream positioned so next byte is at position %ld (0x%08lx)\n",
                 tellfd(input_fd),
@@ -3810,6 +4561,9 @@ void query_compressed_file(const std::string& input_filename, VcfCoordinateQuery
             break;
         } else if (status < 4) {
             throw std::runtime_error(string_format("Only read %d bytes, expected 4", status));
+        } else if (!is_line_start_byte(line_length_header_bytes[0])) {
+            debugf("Reached end of line data\n");
+            break;
         }
 
         debugf("line_length_header_bytes: 0x%02X 0x%02X 0x%02X 0x%02X\n",
@@ -3834,6 +4588,18 @@ void query_compressed_file(const std::string& input_filename, VcfCoordinateQuery
 
         int64_t read_bytes = 4 + 4; // length headers
 
+        if (required_columns_length_header_bytes[0] & REQUIRED_COLUMNS_FLAG_END) {
+            // skip the END position varint
+            uint8_t varint_byte = 0x80;
+            while (varint_byte & 0x80) {
+                status = read(input_fd, &varint_byte, 1);
+                if (status < 1) {
+                    throw VcfValidationError("Unexpected EOF while reading END position");
+                }
+                read_bytes++;
+            }
+        }
+
         debugf("After length headers, stream positioned so next byte is at position %ld (0x%08lx)\n",
                 tellfd(input_fd),
                 tellfd(input_fd));
@@ -4045,7 +4811,74 @@ int main(int argc, char **argv) {
             throw std::runtime_error("input and output file are the same");
         }
         if (action == "compress") {
-            status = compress(input_filename, output_filename);
+            VcfCompressionConfiguration compression_configuration;
+            for (int argi = 4; argi < argc; argi++) {
+                std::string option(argv[argi]);
+                long option_value;
+                if (option == "--entropy") {
+                    compression_configuration.entropy_code_samples = true;
+                } else if (option == "--no-end") {
+                    compression_configuration.store_end_position = false;
+                } else if (option == "--blocks") {
+                    compression_configuration.blocks = true;
+                } else if (option.find("--block-size=") == 0
+                        && str_to_long(option.substr(13), &option_value) == 0
+                        && option_value > 0) {
+                    compression_configuration.blocks = true;
+                    compression_configuration.block_configuration.block_size = option_value;
+                } else if (option == "--zstd") {
+                    compression_configuration.blocks = true;
+                    compression_configuration.block_configuration.zstd = true;
+                } else if (option.find("--zstd-level=") == 0
+                        && str_to_long(option.substr(13), &option_value) == 0) {
+                    compression_configuration.blocks = true;
+                    compression_configuration.block_configuration.zstd = true;
+                    compression_configuration.block_configuration.zstd_level = option_value;
+                } else if (option == "--index" && argi + 1 < argc) {
+                    // comma separated list of binned:<bin-size>, eytzinger, elias-fano, two-level and sparse
+                    std::vector<std::string> index_types = split_string(argv[++argi], ",");
+                    for (const std::string& index_type : index_types) {
+                        if (index_type == "sparse") {
+                            compression_configuration.sparse_index = true;
+                        } else if (index_type == "eytzinger") {
+                            compression_configuration.eytzinger_index = true;
+                        } else if (index_type == "elias-fano") {
+                            compression_configuration.elias_fano_index = true;
+                        } else if (index_type == "two-level") {
+                            compression_configuration.two_level_index = true;
+                        } else if (index_type.find("binned:") == 0
+                                && parse_binning_policy(index_type.substr(7), &compression_configuration.index_binning) == 0) {
+                        } else {
+                            printf("Unknown index type: %s\n", index_type.c_str());
+                            return usage();
+                        }
+                    }
+                } else if (option.find("--embed-index=") == 0
+                        && parse_binning_policy(option.substr(14), &compression_configuration.embedded_index_binning) == 0) {
+                } else {
+                    printf("Unknown compress option: %s\n", option.c_str());
+                    return usage();
+                }
+            }
+            if (compression_configuration.blocks
+                    && (compression_configuration.index_binning.enabled()
+                        || compression_configuration.embedded_index_binning.enabled()
+                        || compression_configuration.sparse_index)) {
+                // block headers already summarize their lines, see block.hpp
+                printf("--index and --embed-index can't be combined with --blocks, --block-size or --zstd\n");
+                return usage();
+            }
+            try {
+                status = compress(input_filename, output_filename, compression_configuration);
+            } catch (const VcfValidationError& e) {
+                // don't leave a partial output behind
+                std::cerr << e.what() << std::endl;
+                unlink(output_filename.c_str());
+                if (compression_configuration.sparse_index) {
+                    unlink((output_filename + VCFC_SPARSE_INDEX_EXTENSION).c_str());
+                }
+                return 1;
+            }
         } else {
             status = decompress2_fd(input_filename, output_filename);
         }
@@ -4082,7 +4915,45 @@ int main(int argc, char **argv) {
         if (!file_exists(input_filename.c_str())) {
             printf("Input file does not exist: %s\n", input_filename.c_str());
         }
-        sparsify_file(input_filename, output_filename);
+        SparseWriterConfiguration writer_configuration;
+        for (int argi = 4; argi < argc; argi++) {
+            std::string option(argv[argi]);
+            long thread_count = 0;
+            if (option == "--direct") {
+                writer_configuration.direct = true;
+            } else if (option == "--threads" && argi + 1 < argc) {
+                if (str_to_long(argv[++argi], &thread_count) != 0 || thread_count <= 0) {
+                    return usage();
+                }
+                writer_configuration.thread_count = thread_count;
+            } else if (option == "--regions") {
+                writer_configuration.regions = true;
+            } else if (option == "--preallocate") {
+                writer_configuration.preallocate = true;
+            } else {
+                return usage();
+            }
+        }
+        // the layout recommended by advise, if it was written for the file
+        std::string config_filename = input_filename + VCFC_CONFIG_EXTENSION;
+        if (!writer_configuration.direct && file_exists(config_filename.c_str())) {
+            struct advised_parameters parameters;
+            parameters.multiplication_factor = 0;
+            parameters.block_size = 0;
+            parameters.bucket_width = 0;
+            if (read_advised_parameters(config_filename, &parameters) != 0) {
+                throw std::runtime_error("Failed to read config file: " + config_filename);
+            }
+            if (parameters.multiplication_factor > 0 && parameters.block_size > 0 && parameters.bucket_width > 0) {
+                writer_configuration.multiplication_factor = parameters.multiplication_factor;
+                writer_configuration.block_size = parameters.block_size;
+                writer_configuration.bucket_width = parameters.bucket_width;
+            }
+        }
+        if (!check_line_container(input_filename, "sparsify")) {
+            return 1;
+        }
+        sparsify_file(input_filename, output_filename, writer_configuration);
     } else if (action == "sparse-query") {
         std::string input_filename(argv[2]);
         std::string query_input(argv[3]);
@@ -4093,44 +4964,225 @@ int main(int argc, char **argv) {
             return 1;
         }
         query_sparse_file_fd(input_filename, query);
+    } else if (action == "sparse-pack") {
+        if (argc < 4) {
+            return usage();
+        }
+        pack_sparse_file(argv[2], argv[3]);
+    } else if (action == "sparse-unpack") {
+        if (argc < 4) {
+            return usage();
+        }
+        long thread_count = 1;
+        if (argc > 4 && (argc != 6 || std::string(argv[4]) != "--threads"
+                || str_to_long(argv[5], &thread_count) != 0 || thread_count <= 0)) {
+            return usage();
+        }
+        unpack_sparse_file(argv[2], argv[3], thread_count);
+    } else if (action == "sparse-stats") {
+        if (argc < 3) {
+            printf("Usage: ./main sparse-stats <sparse-filename>\n");
+            return 1;
+        }
+        std::string input_filename(argv[2]);
+        struct sparse_file_stats stats;
+        if (read_sparse_file_stats(input_filename, &stats) != 0) {
+            throw std::runtime_error("Failed to read file stats: " + input_filename);
+        }
+        printf("logical size: %lu\n", stats.logical_size);
+        printf("allocated bytes: %lu (%.4f%% of logical size)\n", stats.allocated_bytes,
+            stats.logical_size > 0 ? 100.0 * stats.allocated_bytes / stats.logical_size : 0.0);
+        if (stats.fiemap_supported) {
+            printf("extents: %lu (%lu allocated bytes per extent)\n", stats.extent_count,
+                stats.extent_count > 0 ? stats.allocated_bytes / stats.extent_count : 0);
+            printf("unwritten extents: %lu\n", stats.unwritten_extent_count);
+        } else {
+            printf("extents: unknown, the filesystem does not support FIEMAP\n");
+        }
+        printf("data regions: %lu\n", stats.data_region_count);
+    } else if (action == "sparse-count") {
+        if (argc < 4) {
+            printf("Usage: ./main sparse-count <sparse-filename> <region>\n");
+            return 1;
+        }
+        std::string input_filename(argv[2]);
+        std::string query_input(argv[3]);
+        VcfCoordinateQuery query;
+        status = parse_coordinate_string(query_input, query);
+        if (status != 0 || !query.has_criteria()) {
+            printf("Failed to parse query string: %s\n", query_input.c_str());
+            return 1;
+        }
+        count_sparse_file_fd(input_filename, query);
 
+    } else if (action == "advise") {
+        if (argc < 3) {
+            return usage();
+        }
+        std::string input_filename(argv[2]);
+        AdviseConfiguration advise_configuration;
+        bool write_config = false;
+        for (int argi = 3; argi < argc; argi++) {
+            std::string option(argv[argi]);
+            long option_value = 0;
+            if (option.find("--max-overhead=") == 0) {
+                char *end = NULL;
+                double percent = strtod(option.c_str() + 15, &end);
+                if (end == option.c_str() + 15 || *end != '\0' || percent <= 0) {
+                    return usage();
+                }
+                advise_configuration.max_space_overhead = percent / 100;
+            } else if (option.find("--max-scan-bytes=") == 0
+                    && str_to_long(option.substr(17), &option_value) == 0
+                    && option_value > 0) {
+                advise_configuration.max_scan_bytes = option_value;
+            } else if (option == "--write-config") {
+                write_config = true;
+            } else {
+                return usage();
+            }
+        }
+        if (!check_line_container(input_filename, "advise")) {
+            return 1;
+        }
+        struct vcfc_line_stats stats;
+        struct advised_parameters parameters;
+        advise_file(input_filename, advise_configuration, &stats, &parameters);
+        printf("lines: %lu\n", stats.line_count);
+        printf("line bytes: %lu (%.1f per line)\n", stats.total_size, (double) stats.total_size / stats.line_count);
+        printf("line size min/p50/p90/p99/max: %lu/%lu/%lu/%lu/%lu\n",
+            stats.min_size, stats.p50_size, stats.p90_size, stats.p99_size, stats.max_size);
+        printf("largest line: %s:%lu (%lu bytes)\n", stats.max_reference_name.c_str(), stats.max_position, stats.max_size);
+        printf("lines per Mb: %.1f mean over %lu Mb with lines, %lu max\n",
+            (double) stats.line_count / stats.occupied_megabases, stats.occupied_megabases, stats.max_lines_per_megabase);
+        printf("lines per position: %lu max\n", stats.max_lines_per_position);
+        printf("targets: %.2f%% space overhead, %lu bytes scanned per lookup\n",
+            100 * advise_configuration.max_space_overhead, advise_configuration.max_scan_bytes);
+        printf("sparse layout: F=%d B=%d k=%d (%lu bytes of slots and overflow, %.2f%% over the lines)\n",
+            parameters.multiplication_factor, parameters.block_size, parameters.bucket_width, parameters.sparse_data_size,
+            100.0 * parameters.sparse_data_size / stats.total_size - 100);
+        if (!parameters.sparse_overhead_met) {
+            printf("sparse layout: over the %.2f%% space overhead target, ", 100 * advise_configuration.max_space_overhead);
+            if (parameters.sparse_headers_overhead > advise_configuration.max_space_overhead) {
+                printf("which no layout meets, the record headers alone are %.2f%% of the lines\n",
+                    100 * parameters.sparse_headers_overhead);
+            } else if (parameters.overhead_block_size > 0) {
+                printf("which F=1 B=%d k=%d meets with slots over the scan target (%lu bytes, %.2f%% over the lines)\n",
+                    parameters.overhead_block_size, parameters.overhead_bucket_width, parameters.overhead_data_size,
+                    100.0 * parameters.overhead_data_size / stats.total_size - 100);
+            } else {
+                printf("which no layout with slots of up to %d bytes meets\n", VCFC_ADVISE_MAX_SLOT_SIZE);
+            }
+        }
+        printf("direct sparse layout: F=%d B=%d k=1 (%lu bytes apparent size)\n",
+            parameters.direct_multiplication_factor, VCFC_PAGE_SIZE, parameters.direct_data_size);
+        printf("bin size: %s (about %.1f lines per bin, %lu bytes of index, %.2f%% of the lines)\n",
+            parameters.bin_size.c_str(),
+            (double) stats.line_count / (parameters.binned_index_size / struct_index_entry_size),
+            parameters.binned_index_size, 100.0 * parameters.binned_index_size / stats.total_size);
+        printf("sparse external index slot: %lu bytes needed, %d bytes built in\n",
+            parameters.external_index_slot_size, SPARSE_EXTERNAL_INDEX_BLOCK_SIZE);
+        if (write_config) {
+            std::string config_filename = input_filename + VCFC_CONFIG_EXTENSION;
+            if (write_advised_parameters(config_filename, parameters) != 0) {
+                perror("write");
+                throw std::runtime_error("Failed to write config file: " + config_filename);
+            }
+            printf("config: %s\n", config_filename.c_str());
+        }
     } else if (action == "create-binned-index") {
-        if (argc != 4) {
-            printf("Usage: ./main create-binned-index <bin-size> <compressed-filename>\n");
+        // an optional layout of the entries, and optional zone maps of the bins
+        std::string layout;
+        bool zone_maps = false;
+        bool usage_error = argc < 4;
+        for (int argi = 4; argi < argc; argi++) {
+            std::string option(argv[argi]);
+            if (option == "--zone-maps") {
+                zone_maps = true;
+            } else if (layout.empty() && (option == "--eytzinger" || option == "--elias-fano" || option == "--two-level")) {
+                layout = option;
+            } else {
+                usage_error = true;
+            }
+        }
+        if (usage_error) {
+            printf("Usage: ./main create-binned-index <lines>|<bytes>b[:aligned]|page|config <compressed-filename> [--eytzinger|--elias-fano|--two-level] [--zone-maps]\n");
             return 1;
         }
         std::string bin_size_str(argv[2]);
         std::string input_filename(argv[3]);
         std::string index_filename = input_filename + VCFC_BINNING_INDEX_EXTENSION;
-        bool success = false;
-        size_t bin_size = str_to_uint64(bin_size_str, success);
-        if (!success) {
-            printf("bin size must be a positive integer\n");
+        if (bin_size_str == "config") {
+            // the bin size recommended by advise
+            std::string config_filename = input_filename + VCFC_CONFIG_EXTENSION;
+            struct advised_parameters parameters;
+            if (read_advised_parameters(config_filename, &parameters) != 0 || parameters.bin_size.empty()) {
+                printf("No bin size in config file %s, write it with advise --write-config\n", config_filename.c_str());
+                return 1;
+            }
+            bin_size_str = parameters.bin_size;
+        }
+        VcfPackedBinningIndexConfiguration index_configuration(0);
+        if (parse_binning_policy(bin_size_str, &index_configuration) != 0) {
+            printf("bin size must be <lines>, <bytes>b, <bytes>b:aligned or page\n");
+            return 1;
+        }
+        if (!check_line_container(input_filename, "create-binned-index")) {
             return 1;
         }
-
-        VcfPackedBinningIndexConfiguration index_configuration(bin_size);
         // create_binned_index(input_filename, index_filename, index_configuration);
         // create_binned_index2(input_filename, index_filename, index_configuration);
-        create_binned_index4(input_filename, index_filename, index_configuration);
+        create_binned_index4(input_filename, index_filename, index_configuration,
+            zone_maps ? input_filename + VCFC_ZONE_MAP_INDEX_EXTENSION : "");
+        if (zone_maps && stamp_index_data(input_filename + VCFC_ZONE_MAP_INDEX_EXTENSION, input_filename) != 0) {
+            throw std::runtime_error("Failed to stamp index: " + input_filename + VCFC_ZONE_MAP_INDEX_EXTENSION);
+        }
+        if (!layout.empty()) {
+            // also write the entries in a mmappable layout
+            std::vector<struct index_entry> entries;
+            if (read_index_entries(index_filename, entries) != 0) {
+                throw std::runtime_error("Failed to read index: " + index_filename);
+            }
+            if (layout == "--eytzinger") {
+                status = write_eytzinger_index(input_filename + VCFC_EYTZINGER_INDEX_EXTENSION, entries);
+            } else if (layout == "--two-level") {
+                status = write_two_level_index(input_filename + VCFC_TWO_LEVEL_INDEX_EXTENSION, entries);
+            } else {
+                status = write_elias_fano_index(input_filename + VCFC_ELIAS_FANO_INDEX_EXTENSION, entries);
+            }
+            if (status != 0) {
+                throw std::runtime_error("Failed to write " + layout.substr(2) + " index for " + input_filename);
+            }
+            std::string layout_filename = input_filename + (layout == "--eytzinger" ? VCFC_EYTZINGER_INDEX_EXTENSION
+                : layout == "--two-level" ? VCFC_TWO_LEVEL_INDEX_EXTENSION : VCFC_ELIAS_FANO_INDEX_EXTENSION);
+            if (stamp_index_data(layout_filename, input_filename) != 0) {
+                throw std::runtime_error("Failed to stamp index: " + layout_filename);
+            }
+        }
 
     } else if (action == "query-binned-index") {
         if (argc < 4) {
-            printf("Usage: ./main query-binned-index <compressed-filename> <region>");
+            printf("Usage: ./main query-binned-index <compressed-filename> '<region>[ where <predicates>]'\n");
             return 1;
         }
         std::string input_filename(argv[2]);
-        std::string index_filename = input_filename + VCFC_BINNING_INDEX_EXTENSION;
         if (!file_exists(input_filename.c_str())) {
             printf("Input file does not exist: %s\n", input_filename.c_str());
             return 1;
         }
-        if (!file_exists(index_filename.c_str())) {
-            printf("Index file does not exist: %s\n", index_filename.c_str());
-            return 1;
-        }
+        // the index is either embedded in the file or the .vcfci file next to it
 
+        // <region> where <predicates> filters the lines with the zone maps
         std::string query_input(argv[3]);
+        std::vector<struct zone_map_predicate> predicates;
+        size_t where_idx = query_input.find(" where ");
+        if (where_idx != std::string::npos) {
+            if (parse_zone_map_predicates(query_input.substr(where_idx + 7), predicates) != 0) {
+                printf("Failed to parse predicates: %s\n", query_input.substr(where_idx + 7).c_str());
+                return 1;
+            }
+            query_input.resize(where_idx);
+        }
         VcfCoordinateQuery query;
         status = parse_coordinate_string(query_input, query);
         if (status != 0) {
@@ -4140,20 +5192,169 @@ int main(int argc, char **argv) {
         debugf("query reference_name = %s, start = %lu, end = %lu\n",
             query.get_reference_name().c_str(), query.get_start_position(), query.get_end_position());
         // query_binned_index_FILE(input_filename, query);
-        query_binned_index_binarysearch(input_filename, query);
+        if (!predicates.empty()) {
+            query_binned_index_zone_maps(input_filename, query, predicates);
+        } else if (use_index_layout(input_filename, VCFC_EYTZINGER_INDEX_EXTENSION)) {
+            query_binned_index_eytzinger(input_filename, query);
+        } else if (use_index_layout(input_filename, VCFC_ELIAS_FANO_INDEX_EXTENSION)) {
+            query_binned_index_elias_fano(input_filename, query);
+        } else if (use_index_layout(input_filename, VCFC_TWO_LEVEL_INDEX_EXTENSION)) {
+            query_binned_index_two_level(input_filename, query);
+        } else {
+            query_binned_index_binarysearch(input_filename, query);
+        }
+    } else if (action == "create-interval-index") {
+        if (argc != 3 && argc != 4) {
+            printf("Usage: ./main create-interval-index [<lines-per-record>] <compressed-filename>\n");
+            return 1;
+        }
+        std::string input_filename(argv[argc - 1]);
+        bool success = true;
+        uint64_t lines_per_record = 1;
+        if (argc == 4) {
+            lines_per_record = str_to_uint64(std::string(argv[2]), success);
+        }
+        if (!success || lines_per_record == 0 || lines_per_record > UINT32_MAX) {
+            printf("lines per record must be a positive integer\n");
+            return 1;
+        }
+        if (!check_line_container(input_filename, "create-interval-index")) {
+            return 1;
+        }
+        create_interval_index(input_filename, input_filename + VCFC_INTERVAL_INDEX_EXTENSION, lines_per_record);
+        if (stamp_index_data(input_filename + VCFC_INTERVAL_INDEX_EXTENSION, input_filename) != 0) {
+            throw std::runtime_error("Failed to stamp index: " + input_filename + VCFC_INTERVAL_INDEX_EXTENSION);
+        }
+    } else if (action == "query-interval-index") {
+        if (argc < 4) {
+            printf("Usage: ./main query-interval-index <compressed-filename> <region>\n");
+            return 1;
+        }
+        std::string input_filename(argv[2]);
+        std::string query_input(argv[3]);
+        VcfCoordinateQuery query;
+        status = parse_coordinate_string(query_input, query);
+        if (status != 0) {
+            printf("Failed to parse query string: %s\n", query_input.c_str());
+            return 1;
+        }
+        query_interval_index(input_filename, query);
+    } else if (action == "create-learned-index") {
+        if (argc != 3 && argc != 4) {
+            printf("Usage: ./main create-learned-index [<epsilon-bytes>] <compressed-filename>\n");
+            return 1;
+        }
+        std::string input_filename(argv[argc - 1]);
+        bool success = true;
+        uint64_t epsilon = VCFC_LEARNED_INDEX_DEFAULT_EPSILON;
+        if (argc == 4) {
+            epsilon = str_to_uint64(std::string(argv[2]), success);
+        }
+        if (!success || epsilon == 0 || epsilon > UINT32_MAX) {
+            printf("epsilon must be a positive integer number of bytes\n");
+            return 1;
+        }
+        if (!check_line_container(input_filename, "create-learned-index")) {
+            return 1;
+        }
+        create_learned_index(input_filename, input_filename + VCFC_LEARNED_INDEX_EXTENSION, epsilon);
+        if (stamp_index_data(input_filename + VCFC_LEARNED_INDEX_EXTENSION, input_filename) != 0) {
+            throw std::runtime_error("Failed to stamp index: " + input_filename + VCFC_LEARNED_INDEX_EXTENSION);
+        }
+    } else if (action == "query-learned-index") {
+        if (argc < 4) {
+            printf("Usage: ./main query-learned-index <compressed-filename> <region>\n");
+            return 1;
+        }
+        std::string input_filename(argv[2]);
+        std::string query_input(argv[3]);
+        VcfCoordinateQuery query;
+        status = parse_coordinate_string(query_input, query);
+        if (status != 0) {
+            printf("Failed to parse query string: %s\n", query_input.c_str());
+            return 1;
+        }
+        query_learned_index(input_filename, query);
+    } else if (action == "create-hash-index") {
+        if (argc != 3) {
+            printf("Usage: ./main create-hash-index <compressed-filename>\n");
+            return 1;
+        }
+        std::string input_filename(argv[2]);
+        if (!check_line_container(input_filename, "create-hash-index")) {
+            return 1;
+        }
+        create_hash_index(input_filename, input_filename + VCFC_HASH_INDEX_EXTENSION);
+        if (stamp_index_data(input_filename + VCFC_HASH_INDEX_EXTENSION, input_filename) != 0) {
+            throw std::runtime_error("Failed to stamp index: " + input_filename + VCFC_HASH_INDEX_EXTENSION);
+        }
+    } else if (action == "query-variant") {
+        if (argc != 4) {
+            printf("Usage: ./main query-variant <compressed-filename> <chrom>:<pos>:<ref>:<alt>\n");
+            return 1;
+        }
+        std::string input_filename(argv[2]);
+        std::string variant_input(argv[3]);
+        // the contig name may itself contain ':'
+        std::vector<std::string> terms = split_string(variant_input, ":");
+        bool success = false;
+        uint64_t position = 0;
+        if (terms.size() >= 4) {
+            position = str_to_uint64(terms[terms.size() - 3], success);
+        }
+        if (!success) {
+            printf("Failed to parse variant string: %s\n", variant_input.c_str());
+            return 1;
+        }
+        std::vector<std::string> name_terms(terms.begin(), terms.end() - 3);
+        VcfPointQuery query(vector_join(name_terms, ":"), position,
+            terms[terms.size() - 2], terms[terms.size() - 1]);
+        query_point(input_filename, query);
+    } else if (action == "query-id") {
+        if (argc != 4) {
+            printf("Usage: ./main query-id <compressed-filename> <id>\n");
+            return 1;
+        }
+        query_point(std::string(argv[2]), VcfPointQuery(std::string(argv[3])));
+    } else if (action == "create-bloom-index") {
+        if (argc != 4 && argc != 5) {
+            printf("Usage: ./main create-bloom-index <lines>|<bytes>b[:aligned]|page <compressed-filename> [<bits-per-key>]\n");
+            return 1;
+        }
+        VcfPackedBinningIndexConfiguration index_configuration(0);
+        if (parse_binning_policy(std::string(argv[2]), &index_configuration) != 0) {
+            printf("bin size must be <lines>, <bytes>b, <bytes>b:aligned or page\n");
+            return 1;
+        }
+        std::string input_filename(argv[3]);
+        bool success = true;
+        uint64_t bits_per_key = VCFC_BLOOM_DEFAULT_BITS_PER_KEY;
+        if (argc == 5) {
+            bits_per_key = str_to_uint64(std::string(argv[4]), success);
+        }
+        if (!success || bits_per_key == 0 || bits_per_key > 64) {
+            printf("bits per key must be from 1 to 64\n");
+            return 1;
+        }
+        if (!check_line_container(input_filename, "create-bloom-index")) {
+            return 1;
+        }
+        create_bloom_filter_index(input_filename, input_filename + VCFC_BLOOM_INDEX_EXTENSION,
+            index_configuration, bits_per_key);
+        if (stamp_index_data(input_filename + VCFC_BLOOM_INDEX_EXTENSION, input_filename) != 0) {
+            throw std::runtime_error("Failed to stamp index: " + input_filename + VCFC_BLOOM_INDEX_EXTENSION);
+        }
     } else if (action == "create-sparse-index") {
         if (argc != 3) {
             printf("Usage: ./main create-sparse-index <compressed-filename>\n");
             return 1;
         }
         std::string input_filename(argv[2]);
-        std::string index_filename = input_filename + VCFC_BINNING_INDEX_EXTENSION + "-sparse";
-
-        // Drop multiplication factor from default of 4 to 1 since this is only storing index entries, not whole lines
-        SparsificationConfiguration sparse_config;
-        sparse_config.multiplication_factor = 1;
-        sparse_config.block_size = SPARSE_EXTERNAL_INDEX_BLOCK_SIZE;
-
+        std::string index_filename = input_filename + VCFC_SPARSE_INDEX_EXTENSION;
+        SparsificationConfiguration sparse_config = sparse_external_index_configuration();
+        if (!check_line_container(input_filename, "create-sparse-index")) {
+            return 1;
+        }
         create_sparse_external_index(input_filename, index_filename, sparse_config);
     } else if (action == "query-sparse-index") {
         if (argc != 4) {
@@ -4161,7 +5362,7 @@ int main(int argc, char **argv) {
             return 1;
         }
         std::string input_filename(argv[2]);
-        std::string index_filename = input_filename + VCFC_BINNING_INDEX_EXTENSION + "-sparse";
+        std::string index_filename = input_filename + VCFC_SPARSE_INDEX_EXTENSION;
         std::string query_input(argv[3]);
         VcfCoordinateQuery query;
         status = parse_coordinate_string(query_input, query);
@@ -4170,10 +5371,7 @@ int main(int argc, char **argv) {
             return 1;
         }
 
-        // Drop multiplication factor from default of 4 to 1 since this is only storing index entries, not whole lines
-        SparsificationConfiguration sparse_config;
-        sparse_config.multiplication_factor = 1;
-        sparse_config.block_size = SPARSE_EXTERNAL_INDEX_BLOCK_SIZE;
+        SparsificationConfiguration sparse_config = sparse_external_index_configuration();
         query_sparse_external_index(input_filename, index_filename, query, sparse_config);
     }
     else if (action == "query-sparse-index") {
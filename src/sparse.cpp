@@ -1,57 +1,261 @@
 #include "sparse.hpp"
 
+#include <errno.h>
 #include <math.h>
-SparsificationConfiguration::SparsificationConfiguration() {}
-
-// size_t SparsificationConfiguration::compute_sparse_offset(
-//         const std::string& reference_name,
-//         size_t pos) {
-//     size_t block_offset =
-//         this->block_size
-//         * this->name_map.reference_to_int(reference_name)
-//         *  this->max_position;
-//     size_t in_block_offset =  pos * (this->multiplication_factor * this->block_size);
-//     size_t offset = block_offset + in_block_offset;
-//     return offset;
-// }
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+SparsificationConfiguration::SparsificationConfiguration() {
+    set_reference_names(reference_name_map());
+}
+
+size_t SparsificationConfiguration::reference_slots(uint32_t reference_idx) const {
+    uint64_t length = this->name_map.reference_length(reference_idx);
+    if (length == 0) {
+        length = this->max_position;
+    }
+    return length / this->bucket_width + 1;
+}
+
+void SparsificationConfiguration::set_reference_names(const reference_name_map& name_map) {
+    this->name_map = name_map;
+    this->single_reference = false;
+    this->reference_offsets.assign(1, 0);
+    for (uint32_t reference_idx = 1; reference_idx <= name_map.size(); reference_idx++) {
+        this->reference_offsets.push_back(this->reference_offsets.back() + reference_slots(reference_idx));
+    }
+    debugf("%lu contig regions, %lu slots\n", name_map.size(), this->reference_offsets.back());
+}
+
+bool SparsificationConfiguration::contains(const std::string& reference_name, size_t pos) const {
+    if (this->single_reference) {
+        return true;
+    }
+    uint32_t ref_int = this->name_map.reference_to_int(reference_name);
+    return ref_int != 0 && pos / this->bucket_width < reference_slots(ref_int);
+}
 
 size_t SparsificationConfiguration::compute_sparse_offset(
         const std::string& reference_name,
         size_t pos) {
-    // size_t block_offset =
-    //     // this->block_size
-    //     this->name_map.reference_to_int(reference_name)
-    //     *  this->max_position;
-    // size_t in_block_offset =  pos;// * (this->multiplication_factor * this->block_size);
-    // size_t offset = (block_offset + in_block_offset) * (this->multiplication_factor * this->block_size);
-    uint8_t ref_int = this->name_map.reference_to_int(reference_name);
+    if (!contains(reference_name, pos)) {
+        throw std::out_of_range(string_format(
+            "%s:%lu is not in a contig region of the sparse layout, check the ##contig lines",
+            reference_name.c_str(), pos));
+    }
+    uint32_t ref_int = this->name_map.reference_to_int(reference_name);
 
-    debugf("reference_int = %u, max_position = %d, pos = %lu, multiplication_factor = %d, block_size = %d\n",
-        ref_int, this->max_position, pos, this->multiplication_factor, this->block_size);
+    debugf("reference_int = %u, max_position = %d, pos = %lu, bucket_width = %d, multiplication_factor = %d, block_size = %d\n",
+        ref_int, this->max_position, pos, this->bucket_width, this->multiplication_factor, this->block_size);
 
     size_t offset;
-    if(VCFC_SPARSE_MULTIPLE_REF_PER_FILE) {
-        offset = (size_t)ref_int * (size_t)this->max_position;
-    } else {
+    if (this->single_reference) {
         offset = this->max_position;
+    } else {
+        offset = this->reference_offsets[ref_int - 1];
     }
-    offset += pos;
+    offset += pos / this->bucket_width;
     offset *= ((size_t)this->multiplication_factor * (size_t)this->block_size);
     debugf("offset = %lu\n", offset);
-
-    // debugf("%s: reference_name=%d, max_position=%d, pos=%lu, multiplication_factor=%d, block_size=%d, offset=%lu\n",
-    //     __FUNCTION__,
-    //     this->name_map.reference_to_int(reference_name),
-    //     this->max_position,
-    //     pos,
-    //     this->multiplication_factor,
-    //     this->block_size,
-    //     offset);
     return offset;
 }
 
+SparseBucketSizes::SparseBucketSizes() {
+    for (int k = 1; k <= VCFC_SPARSE_MAX_BUCKET_WIDTH; k *= 2) {
+        this->closed_size_counts.push_back(std::map<uint64_t, uint64_t>());
+        this->open_sizes.push_back(0);
+    }
+}
+
+void SparseBucketSizes::add_line(const struct sparse_line_extent& line) {
+    for (size_t i = 0; i < this->open_sizes.size(); i++) {
+        uint64_t k = (uint64_t) 1 << i;
+        if (this->has_lines && line.reference_idx == this->last_reference_idx
+                && line.position / k == this->last_position / k) {
+            this->open_sizes[i] += line.size;
+        } else {
+            if (this->has_lines) {
+                this->closed_size_counts[i][this->open_sizes[i]]++;
+            }
+            this->open_sizes[i] = line.size;
+        }
+    }
+    this->has_lines = true;
+    this->last_reference_idx = line.reference_idx;
+    this->last_position = line.position;
+}
+
+std::map<uint64_t, uint64_t> SparseBucketSizes::size_counts(int bucket_width) const {
+    size_t i = 0;
+    while (((size_t) 1 << i) < (size_t) bucket_width) {
+        i++;
+    }
+    std::map<uint64_t, uint64_t> counts = this->closed_size_counts[i];
+    if (this->has_lines) {
+        counts[this->open_sizes[i]]++;
+    }
+    return counts;
+}
+
+size_t SparsificationConfiguration::choose_bucket_layout(
+        const SparseBucketSizes& bucket_sizes,
+        size_t max_slot_size) {
+    int best_bucket_width = 1;
+    size_t best_slot_size = 0, best_file_size = 0;
+    for (int k = 1; k <= VCFC_SPARSE_MAX_BUCKET_WIDTH; k *= 2) {
+        std::map<uint64_t, uint64_t> size_counts = bucket_sizes.size_counts(k);
+        uint64_t bucket_count = 0;
+        for (const std::pair<const uint64_t, uint64_t>& size_count : size_counts) {
+            bucket_count += size_count.second;
+        }
+        // the slot fits all but the largest buckets, which overflow
+        uint64_t typical_bucket_size = 1;
+        if (bucket_count > 0) {
+            uint64_t rank = (bucket_count - 1) * VCFC_SPARSE_SLOT_PERCENTILE / 100;
+            uint64_t buckets_up_to_size = 0;
+            for (const std::pair<const uint64_t, uint64_t>& size_count : size_counts) {
+                buckets_up_to_size += size_count.second;
+                if (buckets_up_to_size > rank) {
+                    typical_bucket_size = size_count.first;
+                    break;
+                }
+            }
+        }
+        size_t slot_size = (typical_bucket_size + VCFC_SPARSE_SLOT_ALIGNMENT - 1)
+            / VCFC_SPARSE_SLOT_ALIGNMENT * VCFC_SPARSE_SLOT_ALIGNMENT;
+        if (k > 1 && slot_size > max_slot_size) {
+            // buckets only get larger with k
+            break;
+        }
+        slot_size = std::min(slot_size, max_slot_size);
+        this->bucket_width = k;
+        size_t slot_count = 0;
+        for (uint32_t reference_idx = 1; reference_idx <= this->name_map.size(); reference_idx++) {
+            slot_count += reference_slots(reference_idx);
+        }
+        size_t overflow_size = 0;
+        for (std::map<uint64_t, uint64_t>::const_iterator iter = size_counts.upper_bound(slot_size);
+                iter != size_counts.end(); iter++) {
+            overflow_size += iter->first * iter->second;
+        }
+        size_t file_size = slot_count * slot_size + overflow_size;
+        debugf("bucket_width = %d, slot_size = %lu, file_size = %lu\n", k, slot_size, file_size);
+        if (best_slot_size == 0 || file_size < best_file_size) {
+            best_bucket_width = k;
+            best_slot_size = slot_size;
+            best_file_size = file_size;
+        }
+    }
+    set_bucket_layout(1, best_slot_size, best_bucket_width);
+    return best_file_size;
+}
+
+void SparsificationConfiguration::set_bucket_layout(int multiplication_factor, int block_size, int bucket_width) {
+    this->multiplication_factor = multiplication_factor;
+    this->block_size = block_size;
+    this->bucket_width = bucket_width;
+    // the regions of the contigs depend on the bucket width
+    set_reference_names(this->name_map);
+}
+
+size_t SparsificationConfiguration::overflow_offset() const {
+    if (this->single_reference) {
+        // no overflow area, past any offset a data start can be added to
+        return LONG_MAX / 2;
+    }
+    return this->reference_offsets.back() * ((size_t) this->multiplication_factor * this->block_size);
+}
+
+size_t SparsificationConfiguration::reference_end_offset(const std::string& reference_name) const {
+    uint32_t ref_int = this->name_map.reference_to_int(reference_name);
+    if (this->single_reference || ref_int == 0) {
+        return overflow_offset();
+    }
+    return this->reference_offsets[ref_int] * ((size_t) this->multiplication_factor * this->block_size);
+}
+
+size_t SparsificationConfiguration::record_headers_size() const {
+    if (this->skip_pointers) {
+        return VCFC_SPARSE_DISTANCE_HEADERS_SIZE + 2 * sizeof(uint64_t);
+    }
+    return VCFC_SPARSE_DISTANCE_HEADERS_SIZE;
+}
+
+std::string SparsificationConfiguration::meta_line() const {
+    return string_format(VCFC_SPARSE_META_LINE_PREFIX "<multiplication_factor=%d,block_size=%d,max_position=%d,bucket_width=%d,skip_pointers=%d>",
+        this->multiplication_factor, this->block_size, this->max_position, this->bucket_width, this->skip_pointers);
+}
+
+int SparsificationConfiguration::parse_meta_lines(const std::vector<std::string>& meta_header_lines) {
+    set_reference_names(reference_name_map(meta_header_lines));
+    for (const std::string& line : meta_header_lines) {
+        if (line.compare(0, strlen(VCFC_SPARSE_META_LINE_PREFIX), VCFC_SPARSE_META_LINE_PREFIX) != 0) {
+            continue;
+        }
+        // files from before skip pointers end the line after bucket_width
+        this->skip_pointers = 0;
+        int field_count = sscanf(line.c_str(), VCFC_SPARSE_META_LINE_PREFIX "<multiplication_factor=%d,block_size=%d,max_position=%d,bucket_width=%d,skip_pointers=%d>",
+                &this->multiplication_factor, &this->block_size, &this->max_position, &this->bucket_width, &this->skip_pointers);
+        if ((field_count != 4 && field_count != 5)
+                || this->multiplication_factor <= 0 || this->block_size <= 0 || this->max_position <= 0
+                || this->bucket_width <= 0) {
+            debugf("Invalid sparse layout line: %s\n", line.c_str());
+            return -1;
+        }
+        // again, contigs without a length take max_position slots
+        set_reference_names(this->name_map);
+        return 0;
+    }
+    this->single_reference = true;
+    this->skip_pointers = 0;
+    return 0;
+}
+
+
+SparsificationConfiguration sparse_external_index_configuration() {
+    SparsificationConfiguration sparse_config;
+    sparse_config.multiplication_factor = 1;
+    sparse_config.block_size = SPARSE_EXTERNAL_INDEX_BLOCK_SIZE;
+    return sparse_config;
+}
+
+SparseIndexBuilder::SparseIndexBuilder(int output_fd, const SparsificationConfiguration& sparse_config):
+        output_fd(output_fd), sparse_config(sparse_config) {
+}
+
+void SparseIndexBuilder::add_line(
+        const std::string& reference_name,
+        uint32_t position,
+        uint64_t byte_offset) {
+    size_t sparse_offset = this->sparse_config.compute_sparse_offset(reference_name, position);
+    struct index_entry entry;
+    entry.reference_name_idx = this->sparse_config.reference_to_int(reference_name);
+    entry.position = position;
+    entry.byte_offset = byte_offset;
+    debugf("Writing entry (%d %d %ld) to index file offset %lu\n",
+        entry.reference_name_idx, entry.position, entry.byte_offset, sparse_offset);
+    // same packed layout as write_index_entry_fd, in one write
+    uint8_t entry_bytes[sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint64_t)];
+    memcpy(entry_bytes, &entry.reference_name_idx, sizeof(uint32_t));
+    memcpy(entry_bytes + sizeof(uint32_t), &entry.position, sizeof(uint32_t));
+    memcpy(entry_bytes + sizeof(uint32_t) + sizeof(uint32_t), &entry.byte_offset, sizeof(uint64_t));
+    ssize_t n = pwrite(this->output_fd, entry_bytes, sizeof(entry_bytes), sparse_offset);
+    if (n != (ssize_t) sizeof(entry_bytes)) {
+        perror("pwrite");
+        throw std::runtime_error(string_format("Failed to write index entry at offset %lu", sparse_offset));
+    }
+}
 
-uint8_t SparsificationConfiguration::reference_to_int(const std::string& reference_name) {
+uint32_t SparsificationConfiguration::reference_to_int(const std::string& reference_name) {
     return name_map.reference_to_int(reference_name);
 }
 
@@ -287,9 +491,555 @@ uint8_t SparsificationConfiguration::reference_to_int(const std::string& referen
 //     close(output_fd);
 // }
 
-void sparsify_file(const std::string& compressed_input_filename, const std::string& sparse_filename) {
+void decode_sparse_record_headers(
+        const SparsificationConfiguration& sparse_config,
+        uint8_t *bytes,
+        struct sparse_record_headers *headers) {
+    uint8_array_to_uint64(bytes, &headers->distance_to_previous);
+    uint8_array_to_uint64(bytes + 8, &headers->distance_to_next);
+    headers->skip_distances[0] = 0;
+    headers->skip_distances[1] = 0;
+    if (sparse_config.skip_pointers) {
+        uint8_array_to_uint64(bytes + VCFC_SPARSE_DISTANCE_HEADERS_SIZE, &headers->skip_distances[0]);
+        uint8_array_to_uint64(bytes + VCFC_SPARSE_DISTANCE_HEADERS_SIZE + 8, &headers->skip_distances[1]);
+    }
+}
+
+void encode_sparse_record_headers(
+        const SparsificationConfiguration& sparse_config,
+        struct sparse_record_headers& headers,
+        uint8_t *bytes) {
+    uint64_to_uint8_array(headers.distance_to_previous, bytes);
+    uint64_to_uint8_array(headers.distance_to_next, bytes + 8);
+    if (sparse_config.skip_pointers) {
+        uint64_to_uint8_array(headers.skip_distances[0], bytes + VCFC_SPARSE_DISTANCE_HEADERS_SIZE);
+        uint64_to_uint8_array(headers.skip_distances[1], bytes + VCFC_SPARSE_DISTANCE_HEADERS_SIZE + 8);
+    }
+}
+
+bool read_sparse_record(
+        int fd,
+        const SparsificationConfiguration& sparse_config,
+        long record_offset,
+        struct sparse_record_headers *headers,
+        std::string& reference_name,
+        uint64_t *position) {
+    // headers, length headers and the start of the required columns
+    uint8_t record_bytes[256];
+    memset(record_bytes, 0, sizeof(record_bytes));
+    size_t headers_size = sparse_config.record_headers_size();
+    ssize_t bytes_read = pread(fd, record_bytes, sizeof(record_bytes), record_offset);
+    if (bytes_read < (ssize_t) headers_size + 1) {
+        perror("pread");
+        throw std::runtime_error(string_format("Failed to read sparse record at offset %ld", record_offset));
+    }
+    decode_sparse_record_headers(sparse_config, record_bytes, headers);
+    if (!is_line_start_byte(record_bytes[headers_size])) {
+        return false;
+    }
+    FILE *record_file = fmemopen(record_bytes + headers_size, bytes_read - headers_size, "r");
+    if (record_file == NULL) {
+        perror("fmemopen");
+        throw std::runtime_error("Failed to open sparse record for reading");
+    }
+    compressed_line_length_headers line_length_headers;
+    memset(&line_length_headers, 0, sizeof(compressed_line_length_headers));
+    int status = read_compressed_line_length_headers(record_file, &line_length_headers);
+    if (status < (int) compressed_line_length_headers_size) {
+        fclose(record_file);
+        throw std::runtime_error(string_format("Failed to read line length headers at offset %ld", record_offset));
+    }
+    reference_name.clear();
+    std::string pos_str;
+    int c;
+    while ((c = fgetc(record_file)) != EOF && c != '\t') {
+        reference_name.push_back(c);
+    }
+    while ((c = fgetc(record_file)) != EOF && c != '\t') {
+        pos_str.push_back(c);
+    }
+    fclose(record_file);
+    if (c != '\t') {
+        throw std::runtime_error(string_format("Contig and position of the line at offset %ld are too long", record_offset));
+    }
+    bool success = false;
+    *position = str_to_uint64(pos_str, success);
+    if (!success) {
+        throw std::runtime_error("Failed to parse position value: " + pos_str);
+    }
+    return true;
+}
+
+long skip_sparse_lines_before(
+        int fd,
+        const SparsificationConfiguration& sparse_config,
+        long record_offset,
+        const std::string& reference_name,
+        uint64_t position) {
+    struct sparse_record_headers headers;
+    std::string line_reference_name;
+    uint64_t line_position;
+    while (true) {
+        if (!read_sparse_record(fd, sparse_config, record_offset, &headers, line_reference_name, &line_position)) {
+            return record_offset;
+        }
+        // longest hop first
+        bool skipped = false;
+        for (int level = 1; level >= 0 && !skipped; level--) {
+            if (headers.skip_distances[level] == 0) {
+                continue;
+            }
+            // backward distances wrap
+            long skip_offset = (long) ((uint64_t) record_offset + headers.skip_distances[level]);
+            struct sparse_record_headers skip_headers;
+            read_sparse_record(fd, sparse_config, skip_offset, &skip_headers, line_reference_name, &line_position);
+            if (line_reference_name == reference_name && line_position < position) {
+                debugf("Skipped from %ld to %ld, pos = %lu\n", record_offset, skip_offset, line_position);
+                record_offset = skip_offset;
+                skipped = true;
+            }
+        }
+        if (!skipped) {
+            return record_offset;
+        }
+    }
+}
+
+void find_sparse_data_extents(
+        int fd,
+        long begin,
+        long end,
+        long data_start_offset,
+        long slot_size,
+        std::vector<struct sparse_data_extent>& extents) {
+    long offset = begin;
+    while (offset < end) {
+        long data_offset = lseek(fd, offset, SEEK_DATA);
+        if (data_offset < 0) {
+            if (errno == ENXIO) {
+                // no data after offset
+                break;
+            }
+            perror("lseek");
+            throw std::runtime_error(string_format("Failed to call lseek SEEK_DATA from %ld", offset));
+        }
+        if (data_offset >= end) {
+            break;
+        }
+        long hole_offset = lseek(fd, data_offset, SEEK_HOLE);
+        if (hole_offset < 0) {
+            perror("lseek");
+            throw std::runtime_error(string_format("Failed to call lseek SEEK_HOLE from %ld", data_offset));
+        }
+        debugf("data from %ld to %ld\n", data_offset, hole_offset);
+        // whole slots, a slot is never split across reads
+        struct sparse_data_extent extent;
+        extent.begin = data_start_offset + (data_offset - data_start_offset) / slot_size * slot_size;
+        extent.end = data_start_offset + (hole_offset - data_start_offset + slot_size - 1) / slot_size * slot_size;
+        extent.begin = std::max(extent.begin, begin);
+        extent.end = std::min(extent.end, end);
+        if (!extents.empty() && extent.begin - extents.back().end < VCFC_SPARSE_SCAN_COALESCE_GAP) {
+            extents.back().end = std::max(extents.back().end, extent.end);
+        } else {
+            extents.push_back(extent);
+        }
+        offset = hole_offset;
+    }
+}
+
+int read_sparse_file_stats(const std::string& filename, struct sparse_file_stats *stats) {
+    memset(stats, 0, sizeof(struct sparse_file_stats));
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("fstat");
+        close(fd);
+        return -1;
+    }
+    stats->logical_size = st.st_size;
+    stats->allocated_bytes = (uint64_t) st.st_blocks * 512;
+
+    // extents as the filesystem laid them out, a batch of them per call
+    const size_t batch_extent_count = 512;
+    std::vector<uint8_t> fiemap_bytes(sizeof(struct fiemap) + batch_extent_count * sizeof(struct fiemap_extent));
+    struct fiemap *fiemap = (struct fiemap *) fiemap_bytes.data();
+    stats->fiemap_supported = true;
+    uint64_t fiemap_offset = 0;
+    while (true) {
+        memset(fiemap, 0, fiemap_bytes.size());
+        fiemap->fm_start = fiemap_offset;
+        fiemap->fm_length = FIEMAP_MAX_OFFSET - fiemap_offset;
+        fiemap->fm_flags = FIEMAP_FLAG_SYNC;
+        fiemap->fm_extent_count = batch_extent_count;
+        if (ioctl(fd, FS_IOC_FIEMAP, fiemap) != 0) {
+            if (errno == EOPNOTSUPP || errno == ENOTTY) {
+                debugf("FIEMAP is not supported for %s\n", filename.c_str());
+                stats->fiemap_supported = false;
+                break;
+            }
+            perror("ioctl");
+            close(fd);
+            return -1;
+        }
+        if (fiemap->fm_mapped_extents == 0) {
+            break;
+        }
+        for (uint32_t extent_i = 0; extent_i < fiemap->fm_mapped_extents; extent_i++) {
+            const struct fiemap_extent& extent = fiemap->fm_extents[extent_i];
+            stats->extent_count++;
+            if (extent.fe_flags & FIEMAP_EXTENT_UNWRITTEN) {
+                stats->unwritten_extent_count++;
+            }
+        }
+        const struct fiemap_extent& last_extent = fiemap->fm_extents[fiemap->fm_mapped_extents - 1];
+        if (last_extent.fe_flags & FIEMAP_EXTENT_LAST) {
+            break;
+        }
+        fiemap_offset = last_extent.fe_logical + last_extent.fe_length;
+    }
+
+    // data regions as SEEK_DATA scans see them
+    long offset = 0;
+    while (offset < (long) stats->logical_size) {
+        long data_offset = lseek(fd, offset, SEEK_DATA);
+        if (data_offset < 0) {
+            break;
+        }
+        long hole_offset = lseek(fd, data_offset, SEEK_HOLE);
+        if (hole_offset < 0) {
+            perror("lseek");
+            close(fd);
+            return -1;
+        }
+        stats->data_region_count++;
+        offset = hole_offset;
+    }
+    close(fd);
+    return 0;
+}
+
+SparseLineExtentReader::SparseLineExtentReader(FILE *input_file, SparsificationConfiguration& sparse_config):
+        input_file(input_file),
+        sparse_config(sparse_config) {
+}
+
+int SparseLineExtentReader::next(struct sparse_line_extent *line) {
+    long line_offset = ftell(this->input_file);
+    compressed_line_length_headers line_length_headers;
+    memset(&line_length_headers, 0, sizeof(compressed_line_length_headers));
+    int status = read_compressed_line_length_headers(this->input_file, &line_length_headers);
+    if (status == 0) {
+        return 0;
+    } else if (status < (int) compressed_line_length_headers_size) {
+        throw std::runtime_error("Failed to read line length headers");
+    }
+    this->reference_name.clear();
+    this->pos_str.clear();
+    int c;
+    while ((c = fgetc(this->input_file)) != EOF && c != '\t') {
+        this->reference_name.push_back(c);
+    }
+    while ((c = fgetc(this->input_file)) != EOF && c != '\t') {
+        this->pos_str.push_back(c);
+    }
+    bool success = false;
+    uint64_t pos = str_to_uint64(this->pos_str, success);
+    if (!success) {
+        throw std::runtime_error("Failed to parse position value: " + this->pos_str);
+    }
+    // throws for lines outside of the contig regions
+    this->sparse_config.compute_sparse_offset(this->reference_name, pos);
+
+    line->reference_idx = this->sparse_config.reference_to_int(this->reference_name);
+    line->position = pos;
+    line->input_offset = line_offset;
+    line->file_offset = 0;
+    line->redirect_offset = -1;
+    // record headers, then the line from its length headers
+    line->size = this->sparse_config.record_headers_size() + sizeof(uint32_t) + line_length_headers.line_length;
+    if (fseek(this->input_file, line_offset + sizeof(uint32_t) + line_length_headers.line_length, SEEK_SET) != 0) {
+        perror("fseek");
+        throw std::runtime_error("Failed to seek to next line");
+    }
+    return 1;
+}
+
+// Where the lines so far were placed, which is all the next line's placement depends on
+struct sparse_placement_state {
+    bool has_previous_line;
+    long previous_slot_offset;
+    long previous_end_offset;       // of the record of the previous line
+    long previous_file_offset;      // of the record of the previous line, the start of the data before the first
+    long overflow_end_offset;
+    bool bucket_overflowed;
+};
+
+static void start_sparse_placement(
+        const SparsificationConfiguration& sparse_config,
+        long data_start_offset,
+        struct sparse_placement_state *state) {
+    state->has_previous_line = false;
+    state->previous_slot_offset = data_start_offset;
+    state->previous_end_offset = data_start_offset;
+    state->previous_file_offset = data_start_offset;
+    // lines that do not fit their slot go to the overflow area after the last slot
+    state->overflow_end_offset = data_start_offset + sparse_config.overflow_offset();
+    state->bucket_overflowed = false;
+}
+
+/**
+ * Places the record of `line`, and the redirect before it if the line does
+ * not fit its slot, after the lines placed so far. The lines must come in
+ * file order, sorted by contig and position.
+ */
+static void place_sparse_line(
+        SparsificationConfiguration& sparse_config,
+        long data_start_offset,
+        struct sparse_placement_state *state,
+        struct sparse_line_extent *line) {
+    const long slot_size = (long) sparse_config.multiplication_factor * sparse_config.block_size;
+    const std::string& reference_name = sparse_config.name_map.int_to_reference(line->reference_idx);
+    long slot_offset = data_start_offset + sparse_config.compute_sparse_offset(reference_name, line->position);
+    line->redirect_offset = -1;
+    if (state->has_previous_line && slot_offset == state->previous_slot_offset) {
+        // next line of the bucket, in the slot while the lines fit
+        if (!state->bucket_overflowed && state->previous_end_offset + (long) line->size <= slot_offset + slot_size) {
+            line->file_offset = state->previous_end_offset;
+        } else {
+            state->bucket_overflowed = true;
+            line->file_offset = state->overflow_end_offset;
+        }
+    } else {
+        if (state->has_previous_line && slot_offset < state->previous_slot_offset) {
+            throw std::runtime_error(string_format(
+                "Line %s:%lu is before the previous line, sparse files need lines sorted by contig and position",
+                reference_name.c_str(), line->position));
+        }
+        state->bucket_overflowed = false;
+        if ((long) line->size <= slot_size) {
+            line->file_offset = slot_offset;
+        } else {
+            // the line does not fit the slot, leave a redirect to it there
+            line->redirect_offset = slot_offset;
+            state->bucket_overflowed = true;
+            line->file_offset = state->overflow_end_offset;
+        }
+    }
+    if (state->bucket_overflowed) {
+        state->overflow_end_offset += line->size;
+    }
+    debugf("slot_offset = %ld, file_offset = %ld\n", slot_offset, line->file_offset);
+    state->has_previous_line = true;
+    state->previous_slot_offset = slot_offset;
+    state->previous_end_offset = line->file_offset + line->size;
+    state->previous_file_offset = line->file_offset;
+}
+
+// Offset of the first record of a line, its redirect if it has one
+static long first_record_offset(const struct sparse_line_extent& line) {
+    return line.redirect_offset >= 0 ? line.redirect_offset : line.file_offset;
+}
+
+/**
+ * Headers of the record of the first of `lines`, and of the redirect to it
+ * if it has one. `lines` holds the placed lines from it on, as far ahead as
+ * the skip pointers reach, and `previous_file_offset` is the record of the
+ * line before it. They need not be written yet.
+ */
+static void sparse_line_record_headers(
+        const std::deque<struct sparse_line_extent>& lines,
+        long previous_file_offset,
+        struct sparse_record_headers *redirect_headers,
+        struct sparse_record_headers *line_headers) {
+    const struct sparse_line_extent& line = lines[0];
+    memset(redirect_headers, 0, sizeof(struct sparse_record_headers));
+    // backward distances wrap
+    long previous_offset = previous_file_offset;
+    if (line.redirect_offset >= 0) {
+        redirect_headers->distance_to_previous = (uint64_t) (line.redirect_offset - previous_offset);
+        redirect_headers->distance_to_next = (uint64_t) (line.file_offset - line.redirect_offset);
+        previous_offset = line.redirect_offset;
+    }
+    line_headers->distance_to_previous = (uint64_t) (line.file_offset - previous_offset);
+    line_headers->distance_to_next = 0;
+    if (lines.size() > 1) {
+        line_headers->distance_to_next = (uint64_t) (first_record_offset(lines[1]) - line.file_offset);
+    }
+    const size_t skip_lengths[2] = {VCFC_SPARSE_SKIP_SHORT, VCFC_SPARSE_SKIP_LONG};
+    for (int level = 0; level < 2; level++) {
+        line_headers->skip_distances[level] = 0;
+        if (skip_lengths[level] < lines.size()) {
+            line_headers->skip_distances[level] = (uint64_t) (lines[skip_lengths[level]].file_offset - line.file_offset);
+        }
+    }
+}
+
+// Records written with one pwrite from `offset`, holes between them as zeros
+struct sparse_run {
+    long offset;
+    std::vector<uint8_t> bytes;
+};
+
+static void flush_sparse_run(int output_fd, struct sparse_run& run) {
+    if (!run.bytes.empty() && pwrite(output_fd, run.bytes.data(), run.bytes.size(), run.offset) != (ssize_t) run.bytes.size()) {
+        perror("pwrite");
+        throw std::runtime_error(string_format("Failed to write records at offset %ld", run.offset));
+    }
+    run.bytes.clear();
+}
+
+/**
+ * Returns the bytes of the record of `record_size` bytes at `record_offset`
+ * in `run`. The run is written out and restarted at the record first if the
+ * record is `region_gap` or more bytes past its end, or would make it longer
+ * than VCFC_SPARSE_SCAN_BATCH_SIZE bytes.
+ */
+static uint8_t *append_sparse_record(
+        int output_fd,
+        struct sparse_run& run,
+        long record_offset,
+        long record_size,
+        long region_gap) {
+    long run_end = run.offset + (long) run.bytes.size();
+    if (run.bytes.empty() || record_offset < run_end || record_offset - run_end >= region_gap
+            || record_offset + record_size - run.offset > VCFC_SPARSE_SCAN_BATCH_SIZE) {
+        flush_sparse_run(output_fd, run);
+        run.offset = record_offset;
+    }
+    run.bytes.resize(record_offset - run.offset + record_size, 0);
+    return run.bytes.data() + (record_offset - run.offset);
+}
+
+// Lines of the input a thread writes, from input_offset to end_input_offset
+struct sparse_partition {
+    uint64_t input_offset;                  // of its first line
+    uint64_t end_input_offset;
+    struct sparse_placement_state state;    // before its first line is placed
+};
+
+/**
+ * Places and writes the records of the lines of `partition`, reading them
+ * from the compressed input. The lines ahead are placed as far as the skip
+ * pointers reach, past the end of the partition too, and the rest are not
+ * kept. Records in the slots and in the overflow area are written in runs of
+ * their own, with holes under `region_gap` bytes written as zeros.
+ */
+static void write_sparse_partition(
+        const std::string& compressed_input_filename,
+        int output_fd,
+        SparsificationConfiguration sparse_config,
+        long data_start_offset,
+        long region_gap,
+        const struct sparse_partition& partition) {
+    if (partition.input_offset >= partition.end_input_offset) {
+        return;
+    }
+    // one stream reads the lines ahead, the other the lines being written
+    FILE *ahead_file = fopen(compressed_input_filename.c_str(), "r");
+    FILE *line_file = fopen(compressed_input_filename.c_str(), "r");
+    if (ahead_file == NULL || line_file == NULL) {
+        perror("fopen");
+        if (ahead_file != NULL) {
+            fclose(ahead_file);
+        }
+        if (line_file != NULL) {
+            fclose(line_file);
+        }
+        throw std::runtime_error("Failed to open file " + compressed_input_filename);
+    }
+    try {
+        if (fseek(ahead_file, partition.input_offset, SEEK_SET) != 0
+                || fseek(line_file, partition.input_offset, SEEK_SET) != 0) {
+            perror("fseek");
+            throw std::runtime_error("Failed to seek to line in file " + compressed_input_filename);
+        }
+        SparseLineExtentReader reader(ahead_file, sparse_config);
+        struct sparse_placement_state state = partition.state;
+        long previous_file_offset = partition.state.previous_file_offset;
+        const long overflow_start_offset = data_start_offset + sparse_config.overflow_offset();
+        const size_t headers_size = sparse_config.record_headers_size();
+        struct sparse_run slot_run, overflow_run;
+        slot_run.offset = 0;
+        overflow_run.offset = 0;
+
+        std::deque<struct sparse_line_extent> lines;
+        bool more_lines = true;
+        while (true) {
+            // the skip pointers of the first line reach VCFC_SPARSE_SKIP_LONG lines ahead
+            while (more_lines && lines.size() <= VCFC_SPARSE_SKIP_LONG) {
+                struct sparse_line_extent line;
+                if (reader.next(&line) == 0) {
+                    more_lines = false;
+                    break;
+                }
+                place_sparse_line(sparse_config, data_start_offset, &state, &line);
+                lines.push_back(line);
+            }
+            if (lines.empty() || lines.front().input_offset >= partition.end_input_offset) {
+                break;
+            }
+            const struct sparse_line_extent& line = lines.front();
+            struct sparse_record_headers redirect_headers, line_headers;
+            sparse_line_record_headers(lines, previous_file_offset, &redirect_headers, &line_headers);
+            if (line.redirect_offset >= 0) {
+                // followed by a 0 byte, which does not start a line
+                uint8_t *redirect_bytes = append_sparse_record(
+                    output_fd, slot_run, line.redirect_offset, headers_size + 1, region_gap);
+                encode_sparse_record_headers(sparse_config, redirect_headers, redirect_bytes);
+                redirect_bytes[headers_size] = 0;
+            }
+            struct sparse_run& run = line.file_offset >= overflow_start_offset ? overflow_run : slot_run;
+            uint8_t *record_bytes = append_sparse_record(output_fd, run, line.file_offset, line.size, region_gap);
+            encode_sparse_record_headers(sparse_config, line_headers, record_bytes);
+            // length headers and the rest of the line, as in the compressed file
+            size_t line_size = line.size - headers_size;
+            if (fread(record_bytes + headers_size, 1, line_size, line_file) != line_size) {
+                throw VcfValidationError(string_format(
+                    "Unexpectedly reached end of compressed file reading line at offset %lu", line.input_offset).c_str());
+            }
+            previous_file_offset = line.file_offset;
+            lines.pop_front();
+        }
+        flush_sparse_run(output_fd, slot_run);
+        flush_sparse_run(output_fd, overflow_run);
+    } catch (const std::exception&) {
+        fclose(ahead_file);
+        fclose(line_file);
+        throw;
+    }
+    fclose(ahead_file);
+    fclose(line_file);
+}
+
+/**
+ * Allocates the populated region `region` of the file before it is written.
+ * Returns false if the filesystem does not support it.
+ */
+static bool preallocate_sparse_region(int output_fd, const struct sparse_data_extent& region) {
+    if (region.end <= region.begin) {
+        return true;
+    }
+    if (fallocate(output_fd, 0, region.begin, region.end - region.begin) != 0) {
+        if (errno == EOPNOTSUPP) {
+            debugf("fallocate is not supported, writing without preallocation\n");
+            return false;
+        }
+        perror("fallocate");
+        throw std::runtime_error(string_format(
+            "Failed to preallocate %ld bytes at offset %ld", region.end - region.begin, region.begin));
+    }
+    return true;
+}
+
+void sparsify_file(
+        const std::string& compressed_input_filename,
+        const std::string& sparse_filename,
+        const SparseWriterConfiguration& writer_configuration) {
     debugf("Creating sparse indexed file %s from %s\n", sparse_filename.c_str(), compressed_input_filename.c_str());
-    // int input_fd = open(compressed_input_filename.c_str(), O_RDONLY);
     FILE *input_file = fopen(compressed_input_filename.c_str(), "r");
     if (input_file == NULL) {
         perror("fopen");
@@ -298,284 +1048,445 @@ void sparsify_file(const std::string& compressed_input_filename, const std::stri
     int output_fd = open(sparse_filename.c_str(), DEFAULT_FILE_CREATE_FLAGS, DEFAULT_FILE_CREATE_MODE);
     if (output_fd < 0) {
         perror("open");
+        fclose(input_file);
         throw std::runtime_error("Failed to open output file: " + sparse_filename);
-        return;
     }
 
-    // FILE *output_file = fopen(sparse_filename.c_str(), "wb");
-    // if (output_file == NULL) {
-    //     perror("fopen");
-    //     throw std::runtime_error("Failed to open output file: " + sparse_filename);
-    // }
-    int status = 0;
-    off_t lseek_ret = 0;
-
-    // long r = fseeko64(output_file, (loff_t)108397364464709, SEEK_SET);
-    debugf("LONG_MAX: %ld\n", LONG_MAX);
-
-
-    // Tests for extent of file address space, EXT4 supports up to 2^44
-    // off_t test_off = powl(2, 48);
-    // lseek_ret = lseek(output_fd, test_off, SEEK_SET);
-    // if (lseek_ret != test_off) {
-    //     perror("fseek");
-    //     debugf("Failed to seek to long offset %ld, ret = %ld\n", test_off, lseek_ret);
-    //     return;
-    // }
-
     VcfCompressionSchema schema;
     debugf("Parsing metadata lines and header line\n");
     std::vector<std::string> meta_header_lines;
     meta_header_lines.reserve(256);
     decompress2_metadata_headers(input_file, meta_header_lines, schema);
-
-    for (auto iter = meta_header_lines.begin(); iter != meta_header_lines.end(); iter++) {
-        write(output_fd, iter->c_str(), iter->size());
-        // fwrite(iter->c_str(), sizeof(char), iter->size(), output_file);
+    long lines_offset = ftell(input_file);
+    struct stat input_stat;
+    if (fstat(fileno(input_file), &input_stat) != 0) {
+        perror("fstat");
+        throw std::runtime_error("Failed to stat file " + compressed_input_filename);
     }
 
-    std::string variant_line;
-    variant_line.reserve(1024 * 1024);
-    std::vector<uint8_t> line_bytes;
-
     // sparsification configuration
     SparsificationConfiguration sparse_config;
+    sparse_config.set_reference_names(schema.reference_names);
+    if (writer_configuration.direct) {
+        // the default layout is the direct one
+    } else if (writer_configuration.block_size > 0) {
+        sparse_config.set_bucket_layout(
+            writer_configuration.multiplication_factor,
+            writer_configuration.block_size,
+            writer_configuration.bucket_width);
+        debugf("configured bucket_width = %d, slot_size = %d\n", sparse_config.bucket_width,
+            sparse_config.multiplication_factor * sparse_config.block_size);
+    } else {
+        // a pass over the lines for the sizes of their buckets
+        SparseBucketSizes bucket_sizes;
+        SparseLineExtentReader reader(input_file, sparse_config);
+        struct sparse_line_extent line;
+        while (reader.next(&line) == 1) {
+            bucket_sizes.add_line(line);
+        }
+        sparse_config.choose_bucket_layout(bucket_sizes);
+        debugf("bucket_width = %d, slot_size = %d\n", sparse_config.bucket_width, sparse_config.block_size);
+        if (fseek(input_file, lines_offset, SEEK_SET) != 0) {
+            perror("fseek");
+            throw std::runtime_error("Failed to seek to the lines of " + compressed_input_filename);
+        }
+    }
 
-    // placeholder for first skip count from data_start_offset to first line in data
-    for (size_t initial_count_i = 0; initial_count_i < 8; initial_count_i++) {
-        const char zero = 0;
-        write(output_fd, &zero, 1);
-        // fwrite(&zero, 1, 1, output_file);
+    // the layout line goes last of the meta lines, before the header line
+    meta_header_lines.insert(meta_header_lines.end() - 1, sparse_config.meta_line() + "\n");
+    for (auto iter = meta_header_lines.begin(); iter != meta_header_lines.end(); iter++) {
+        write(output_fd, iter->c_str(), iter->size());
     }
 
+    // number of bytes from the start of the data to the first record
+    uint64_t first_line_offset = 0;
+    write(output_fd, &first_line_offset, sizeof(first_line_offset));
     long data_start_offset = tellfd(output_fd);
     debugf("data_start_offset = %lu\n", data_start_offset);
-    bool is_first_line = true;
-    long previous_offset = data_start_offset;
 
-    while (true) {
-        debugf("Start of line, stream positioned so next byte is at position %ld (0x%08lx)\n",
-                ftell(input_file),
-                ftell(input_file));
-
-        compressed_line_length_headers line_length_headers;
-        memset(&line_length_headers, 0, sizeof(compressed_line_length_headers));
-        status = read_compressed_line_length_headers(input_file, &line_length_headers);
-        if (status == 0) {
-            debugf("Finished creating index\n");
-            break;
-        } else if (status != (int) compressed_line_length_headers_size) {
-            throw std::runtime_error("Failed to read line length headers");
+    // the regions mode writes populated regions whole, gaps under a
+    // filesystem block between records are written as zeros
+    long region_gap = 1;
+    if (writer_configuration.regions || writer_configuration.preallocate) {
+        struct stat output_stat;
+        if (fstat(output_fd, &output_stat) != 0) {
+            perror("fstat");
+            throw std::runtime_error("Failed to stat output file: " + sparse_filename);
         }
-        uint64_t read_bytes = 4 + 4; // length headers
-
-        debugf("After length headers, stream positioned so next byte is at position %ld (0x%08lx)\n",
-                ftell(input_file),
-                ftell(input_file));
-
-        // Need to re-serialize the length headers
-        uint8_t line_length_header_bytes[4];
-        uint8_t required_columns_length_header_bytes[4];
-        LineLengthHeader length_header_serializer;
-        length_header_serializer.set_extension_count(3);
-
-        // Serialize line length header
-        length_header_serializer.set_length(line_length_headers.line_length);
-        length_header_serializer.serialize(line_length_header_bytes);
-        // Serialize required cols length header
-        length_header_serializer.set_length(line_length_headers.required_columns_length);
-        length_header_serializer.serialize(required_columns_length_header_bytes);
+        region_gap = output_stat.st_blksize;
+    }
 
+    // a placement pass records where each thread's byte range of the input
+    // starts, at a line boundary, and the placement up to it. Populated
+    // regions are preallocated as the pass finds them, in offset order in the
+    // slots and in the overflow area
+    int thread_count = std::max(1, writer_configuration.thread_count);
+    std::vector<struct sparse_partition> partitions(thread_count);
+    struct sparse_placement_state state;
+    start_sparse_placement(sparse_config, data_start_offset, &state);
+    bool preallocate = writer_configuration.preallocate;
+    struct sparse_data_extent slot_region = {0, 0}, overflow_region = {0, 0};
+    const long overflow_start_offset = data_start_offset + sparse_config.overflow_offset();
+    auto preallocate_record = [&](long record_offset, long record_end) {
+        struct sparse_data_extent& region = record_offset >= overflow_start_offset ? overflow_region : slot_region;
+        if (region.end > region.begin && record_offset >= region.end && record_offset - region.end < region_gap) {
+            region.end = record_end;
+            return;
+        }
+        preallocate = preallocate_sparse_region(output_fd, region);
+        region.begin = record_offset;
+        region.end = record_end;
+    };
+    SparseLineExtentReader reader(input_file, sparse_config);
+    struct sparse_line_extent line;
+    size_t line_count = 0;
+    int partition_i = 0;
+    while (reader.next(&line) == 1) {
+        while (partition_i < thread_count && line.input_offset
+                >= lines_offset + (uint64_t) (input_stat.st_size - lines_offset) * partition_i / thread_count) {
+            partitions[partition_i].input_offset = line.input_offset;
+            partitions[partition_i].state = state;
+            partition_i++;
+        }
+        place_sparse_line(sparse_config, data_start_offset, &state, &line);
+        if (line_count == 0) {
+            first_line_offset = first_record_offset(line) - data_start_offset;
+        }
+        line_count++;
+        if (preallocate) {
+            if (line.redirect_offset >= 0) {
+                preallocate_record(line.redirect_offset, line.redirect_offset + sparse_config.record_headers_size() + 1);
+            }
+            preallocate_record(line.file_offset, line.file_offset + line.size);
+        }
+    }
+    if (preallocate && preallocate_sparse_region(output_fd, slot_region)) {
+        preallocate_sparse_region(output_fd, overflow_region);
+    }
+    // ranges starting past the last line are empty
+    uint64_t lines_end_offset = ftell(input_file);
+    fclose(input_file);
+    for (; partition_i < thread_count; partition_i++) {
+        partitions[partition_i].input_offset = lines_end_offset;
+        partitions[partition_i].state = state;
+    }
+    for (int thread_i = 0; thread_i < thread_count; thread_i++) {
+        partitions[thread_i].end_input_offset = thread_i + 1 < thread_count
+            ? partitions[thread_i + 1].input_offset : lines_end_offset;
+    }
+    if (line_count > 0 && pwrite(output_fd, &first_line_offset, 8, data_start_offset - 8) != 8) {
+        perror("pwrite");
+        throw std::runtime_error("Failed to write first line offset");
+    }
 
-        // uint32_to_uint8_array(line_length_headers.line_length, line_length_header_bytes);
-        // uint32_to_uint8_array(line_length_headers.required_columns_length, required_columns_length_header_bytes);
+    // each thread places and writes the lines of its range, independent of the others
+    debugf("Writing %lu lines with %d threads\n", line_count, thread_count);
+    std::vector<std::thread> threads;
+    std::vector<std::exception_ptr> thread_errors(thread_count);
+    for (int thread_i = 0; thread_i < thread_count; thread_i++) {
+        threads.push_back(std::thread([&, thread_i]() {
+            try {
+                write_sparse_partition(compressed_input_filename, output_fd, sparse_config,
+                    data_start_offset, region_gap, partitions[thread_i]);
+            } catch (...) {
+                thread_errors[thread_i] = std::current_exception();
+            }
+        }));
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    close(output_fd);
+    for (std::exception_ptr& thread_error : thread_errors) {
+        if (thread_error) {
+            std::rethrow_exception(thread_error);
+        }
+    }
+}
 
-        debugf("Line length: %d\n", line_length_headers.line_length);
 
-        // collect bytes to end of line
-        size_t i = 0;
-        line_bytes.clear();
-        if (line_bytes.capacity() < line_length_headers.line_length + read_bytes) {
-            line_bytes.reserve(line_length_headers.line_length + read_bytes);
+/**
+ * Bytes of slot `slot_bytes` used by its records, from the start of the slot
+ * to the end of its last record, 0 if the slot is empty.
+ */
+static long sparse_slot_used_size(
+        const SparsificationConfiguration& sparse_config,
+        uint8_t *slot_bytes,
+        long slot_size,
+        bool is_first_slot) {
+    const long headers_size = sparse_config.record_headers_size();
+    struct sparse_record_headers headers;
+    decode_sparse_record_headers(sparse_config, slot_bytes, &headers);
+    // IF prev offset value is zero and this is not the first line, the slot is empty
+    if (headers.distance_to_previous == 0 && !is_first_slot) {
+        return 0;
+    }
+    long record_offset = 0;
+    while (true) {
+        long record_size = headers_size + 1;
+        if (is_line_start_byte(slot_bytes[record_offset + headers_size])) {
+            struct compressed_line_length_headers line_length_headers;
+            if (parse_compressed_line_length_headers(slot_bytes + record_offset + headers_size,
+                    slot_size - record_offset - headers_size, &line_length_headers) == 0) {
+                throw std::runtime_error("Failed to parse line length headers of a sparse record");
+            }
+            record_size = headers_size + sizeof(uint32_t) + line_length_headers.line_length;
         }
-
-        // two uint64 placeholders for diffs to previous, next line
-        for (size_t placeholder_i = 0; placeholder_i < 16; placeholder_i++) {
-            line_bytes.push_back(0);
+        if (record_offset + record_size > slot_size) {
+            throw std::runtime_error("A sparse record runs past the end of its slot, the file can not be packed");
+        }
+        // the records of a slot follow each other, the chain then leaves the slot
+        long next_offset = (long) ((uint64_t) record_offset + headers.distance_to_next);
+        if (headers.distance_to_next == 0 || next_offset <= record_offset || next_offset + headers_size >= slot_size) {
+            return record_offset + record_size;
         }
+        record_offset = next_offset;
+        decode_sparse_record_headers(sparse_config, slot_bytes + record_offset, &headers);
+    }
+}
 
-        line_bytes.push_back(line_length_header_bytes[0]);
-        line_bytes.push_back(line_length_header_bytes[1]);
-        line_bytes.push_back(line_length_header_bytes[2]);
-        line_bytes.push_back(line_length_header_bytes[3]);
+void pack_sparse_file(const std::string& sparse_filename, const std::string& pack_filename) {
+    int input_fd = open(sparse_filename.c_str(), O_RDONLY);
+    if (input_fd < 0) {
+        perror("open");
+        throw std::runtime_error("Failed to open file: " + sparse_filename);
+    }
+    FILE *pack_file = pack_filename == "-" ? stdout : fopen(pack_filename.c_str(), "wb");
+    if (pack_file == NULL) {
+        perror("fopen");
+        throw std::runtime_error("Failed to open output file: " + pack_filename);
+    }
 
-        line_bytes.push_back(required_columns_length_header_bytes[0]);
-        line_bytes.push_back(required_columns_length_header_bytes[1]);
-        line_bytes.push_back(required_columns_length_header_bytes[2]);
-        line_bytes.push_back(required_columns_length_header_bytes[3]);
+    VcfCompressionSchema schema;
+    std::vector<std::string> meta_header_lines;
+    meta_header_lines.reserve(256);
+    decompress2_metadata_headers_fd(input_fd, meta_header_lines, schema);
+    SparsificationConfiguration sparse_config;
+    if (sparse_config.parse_meta_lines(meta_header_lines) != 0) {
+        throw std::runtime_error("Invalid sparse layout line in file: " + sparse_filename);
+    }
+    struct stat input_stat;
+    if (fstat(input_fd, &input_stat) != 0) {
+        perror("fstat");
+        throw std::runtime_error("Failed to stat file: " + sparse_filename);
+    }
+    long data_start_offset = tellfd(input_fd) + 8;
+    uint64_t first_line_offset = 0;
+    if (pread(input_fd, &first_line_offset, sizeof(uint64_t), data_start_offset - 8) < (ssize_t) sizeof(uint64_t)) {
+        throw std::runtime_error("Failed to read first_line_offset value from file");
+    }
+    const long first_record_offset = data_start_offset + first_line_offset;
+    const long slot_size = (long) sparse_config.multiplication_factor * sparse_config.block_size;
+    const long overflow_start_offset = std::min(
+        data_start_offset + (long) sparse_config.overflow_offset(), (long) input_stat.st_size);
+
+    struct sparse_pack_header pack_header;
+    memset(&pack_header, 0, sizeof(pack_header));
+    memcpy(pack_header.magic, VCFC_SPARSE_PACK_MAGIC, sizeof(pack_header.magic));
+    pack_header.logical_size = input_stat.st_size;
+    pack_header.prefix_size = data_start_offset;
+    std::vector<uint8_t> batch(data_start_offset);
+    if (pread(input_fd, batch.data(), data_start_offset, 0) != data_start_offset) {
+        perror("pread");
+        throw std::runtime_error("Failed to read the start of file: " + sparse_filename);
+    }
+    fwrite(&pack_header, sizeof(pack_header), 1, pack_file);
+    fwrite(batch.data(), 1, batch.size(), pack_file);
+
+    auto write_run = [&](long offset, const uint8_t *bytes, long length) {
+        struct sparse_pack_run run;
+        run.offset = offset;
+        run.length = length;
+        fwrite(&run, sizeof(run), 1, pack_file);
+        if (fwrite(bytes, 1, length, pack_file) != (size_t) length) {
+            perror("fwrite");
+            throw std::runtime_error("Failed to write to packed file: " + pack_filename);
+        }
+    };
+
+    // the used part of each populated slot
+    std::vector<struct sparse_data_extent> extents;
+    find_sparse_data_extents(input_fd, data_start_offset, overflow_start_offset, data_start_offset, slot_size, extents);
+    long max_batch_size = std::max(slot_size, VCFC_SPARSE_SCAN_BATCH_SIZE / slot_size * slot_size);
+    size_t run_count = 0;
+    for (const struct sparse_data_extent& extent : extents) {
+        for (long batch_offset = extent.begin; batch_offset < extent.end; batch_offset += max_batch_size) {
+            long batch_size = std::min(extent.end - batch_offset, max_batch_size);
+            // short read past the end of the file leaves the rest zero
+            batch.assign(batch_size, 0);
+            if (pread(input_fd, batch.data(), batch_size, batch_offset) < 0) {
+                perror("pread");
+                throw std::runtime_error(string_format("Failed to read %ld bytes at offset %ld", batch_size, batch_offset));
+            }
+            for (long slot_offset = batch_offset; slot_offset < batch_offset + batch_size; slot_offset += slot_size) {
+                uint8_t *slot_bytes = batch.data() + (slot_offset - batch_offset);
+                long used_size = sparse_slot_used_size(sparse_config, slot_bytes, slot_size, slot_offset == first_record_offset);
+                if (used_size > 0) {
+                    write_run(slot_offset, slot_bytes, used_size);
+                    run_count++;
+                }
+            }
+        }
+    }
 
-        debugf("line_bytes with headers only: %s\n", byte_vector_to_string(line_bytes).c_str());
+    // the overflow area is dense
+    for (long offset = overflow_start_offset; offset < (long) input_stat.st_size; offset += VCFC_SPARSE_SCAN_BATCH_SIZE) {
+        long length = std::min((long) input_stat.st_size - offset, (long) VCFC_SPARSE_SCAN_BATCH_SIZE);
+        batch.resize(length);
+        if (pread(input_fd, batch.data(), length, offset) != length) {
+            perror("pread");
+            throw std::runtime_error(string_format("Failed to read %ld bytes at offset %ld", length, offset));
+        }
+        write_run(offset, batch.data(), length);
+        run_count++;
+    }
+    write_run(0, batch.data(), 0);
+    debugf("Packed %lu runs of %s\n", run_count, sparse_filename.c_str());
 
-        // keep track of some column values as we go across, for offset calculation
-        bool got_reference_name = false;
-        std::string reference_name;
-        reference_name.reserve(32);
+    close(input_fd);
+    if (pack_file == stdout) {
+        fflush(stdout);
+    } else {
+        fclose(pack_file);
+    }
+}
 
-        bool got_pos = false;
-        std::string pos_str;
-        pos_str.reserve(32);
+// Runs read from a packed file, written by one of the unpacking threads
+struct sparse_pack_batch {
+    std::vector<struct sparse_pack_run> runs;
+    std::vector<uint8_t> bytes;
+};
 
-        size_t pos = 0;
+void unpack_sparse_file(const std::string& pack_filename, const std::string& sparse_filename, int thread_count) {
+    FILE *pack_file = pack_filename == "-" ? stdin : fopen(pack_filename.c_str(), "rb");
+    if (pack_file == NULL) {
+        perror("fopen");
+        throw std::runtime_error("Failed to open file: " + pack_filename);
+    }
+    struct sparse_pack_header pack_header;
+    if (fread(&pack_header, sizeof(pack_header), 1, pack_file) != 1
+            || memcmp(pack_header.magic, VCFC_SPARSE_PACK_MAGIC, sizeof(pack_header.magic)) != 0) {
+        throw std::runtime_error("Not a packed sparse file: " + pack_filename);
+    }
+    int output_fd = open(sparse_filename.c_str(), DEFAULT_FILE_CREATE_FLAGS, DEFAULT_FILE_CREATE_MODE);
+    if (output_fd < 0) {
+        perror("open");
+        throw std::runtime_error("Failed to open output file: " + sparse_filename);
+    }
+    std::vector<uint8_t> prefix(pack_header.prefix_size);
+    if (fread(prefix.data(), 1, prefix.size(), pack_file) != prefix.size()) {
+        throw std::runtime_error("Unexpected end of packed file: " + pack_filename);
+    }
+    if (pwrite(output_fd, prefix.data(), prefix.size(), 0) != (ssize_t) prefix.size()) {
+        perror("pwrite");
+        throw std::runtime_error("Failed to write to file: " + sparse_filename);
+    }
 
-        // iterate over the rest of the line
-        // subtract 4 due to length of required_columns_length_header_bytes, which are already read
-        while (i++ < line_length_headers.line_length - 4) {
-            unsigned char b;
-            // if (read(input_fd, &b, 1) <= 0) {
-            if (fread(&b, 1, 1, input_file) < 1) {
-                std::string msg = string_format(
-                    "Unexpectedly reached end of compressed file, line header said %d, but only read %d bytes from line",
-                    line_length_headers.line_length, i);
-                throw VcfValidationError(msg.c_str());
-            }
-            line_bytes.push_back(b);
-
-            if (!got_reference_name) {
-                if (b != '\t') {
-                    reference_name.push_back(b);
-                } else {
-                    if (reference_name.size() == 0) {
-                        throw std::runtime_error("Line did not contain a reference name");
-                    } else {
-                        debugf("Got reference name: %s\n", reference_name.c_str());
-                        got_reference_name = true;
+    // batches go from the reading thread to the writing threads through a
+    // queue of at most two batches per writing thread
+    thread_count = std::max(1, thread_count);
+    std::deque<struct sparse_pack_batch> queue;
+    std::mutex queue_mutex;
+    std::condition_variable queue_not_empty, queue_not_full;
+    bool end_of_runs = false;
+    std::vector<std::exception_ptr> thread_errors(thread_count);
+    std::vector<std::thread> threads;
+    for (int thread_i = 0; thread_i < thread_count; thread_i++) {
+        threads.push_back(std::thread([&, thread_i]() {
+            while (true) {
+                struct sparse_pack_batch batch;
+                {
+                    std::unique_lock<std::mutex> lock(queue_mutex);
+                    queue_not_empty.wait(lock, [&]() { return !queue.empty() || end_of_runs; });
+                    if (queue.empty()) {
+                        return;
                     }
+                    batch = std::move(queue.front());
+                    queue.pop_front();
                 }
-            } else if (!got_pos) {
-                if (b != '\t') {
-                    pos_str.push_back(b);
-                } else {
-                    if (pos_str.size() == 0) {
-                        throw std::runtime_error("Line did not contain a position value");
-                    } else {
-                        debugf("Got position: %s\n", pos_str.c_str());
-                        got_pos = true;
-                        char *endptr = NULL;
-                        pos = strtoul(pos_str.c_str(), &endptr, 10);
-                        if (endptr != pos_str.c_str() + pos_str.size()) {
-                            throw std::runtime_error("Failed to parse full position value to long: " + pos_str);
+                queue_not_full.notify_one();
+                if (thread_errors[thread_i]) {
+                    // drain the queue so the reading thread does not block
+                    continue;
+                }
+                try {
+                    const uint8_t *bytes = batch.bytes.data();
+                    for (const struct sparse_pack_run& run : batch.runs) {
+                        if (pwrite(output_fd, bytes, run.length, run.offset) != (ssize_t) run.length) {
+                            perror("pwrite");
+                            throw std::runtime_error(string_format("Failed to write %lu bytes at offset %lu", run.length, run.offset));
                         }
+                        bytes += run.length;
                     }
+                } catch (...) {
+                    thread_errors[thread_i] = std::current_exception();
                 }
             }
-        }
-
-        // Compute sparse file offset for this line
-        size_t variant_offset = sparse_config.compute_sparse_offset(reference_name, pos);
-        size_t file_offset = variant_offset + data_start_offset;
-        debugf("variant_offset = %lu, file_offset = %lu\n", variant_offset, file_offset);
-
-        // Store uint64 number bytes back to previous line start
-        uint64_t count_to_prev = file_offset - previous_offset;
-        debugf("Updating line_bytes distance_to_previous = %lu\n", count_to_prev);
-        uint8_t offset_bytes[8];
-        uint64_to_uint8_array(count_to_prev, offset_bytes);
-        for (int offi = 0; offi < 8; offi++) {
-            debugf("offset_bytes[%d] = %u\n", offi, offset_bytes[offi]);
-        }
-        for (int offi = 0; offi < 8; offi++) {
-            line_bytes[offi] = offset_bytes[offi];
-        }
-        debugf("line_bytes (size=%lu): %s\n", line_bytes.size(), byte_vector_to_string(line_bytes).c_str());
-
-        // off_t lseek_ret;
-
-        // If this is not the first line, update previous next byte offset
-        // with int32 number of bytes forward to this line start
-        if (is_first_line) {
-            // Write out the first count representing the number of bytes from the start of variant data
-            // to the start of the first line. Reader should skip ahead this many bytes.
-            off_t first_jump_offset = (data_start_offset - 8);
-            lseek_ret = lseek(output_fd, first_jump_offset, SEEK_SET);
-            if (lseek_ret != first_jump_offset) {
-                perror("lseek");
-                debugf("Failed to seek to address: %ld\n", first_jump_offset);
-                return;
-            }
-
-            debugf("Writing first skip uint64_t length: %lu (0x%08lx) to file address: %ld\n",
-                variant_offset, variant_offset, tellfd(output_fd));
-
-            uint8_t variant_offset_bytes[8] = {0,0,0,0,0,0,0,0};
-            uint64_to_uint8_array(variant_offset, variant_offset_bytes);
-            if (write(output_fd, &variant_offset, 8) != 8) {
-                debugf("Failed to write\n");
-                return;
-            }
+        }));
+    }
 
-            // Verify that it was written
-            lseek_ret = lseek(output_fd, -8, SEEK_CUR);
-            uint64_t validated_variant_offset = 0;
-            if (read(output_fd, &validated_variant_offset, 8) != 8) {
-                debugf("Failed to read validated variant offset\n");
-                return;
+    auto push_batch = [&](struct sparse_pack_batch& batch) {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_not_full.wait(lock, [&]() { return queue.size() < 2 * (size_t) thread_count; });
+            queue.push_back(std::move(batch));
+        }
+        queue_not_empty.notify_one();
+        batch = sparse_pack_batch();
+    };
+    std::exception_ptr read_error;
+    try {
+        struct sparse_pack_batch batch;
+        while (true) {
+            struct sparse_pack_run run;
+            if (fread(&run, sizeof(run), 1, pack_file) != 1) {
+                throw std::runtime_error("Unexpected end of packed file: " + pack_filename);
             }
-            debugf("Read back validated_variant_offset: %lu\n", validated_variant_offset);
-            if (validated_variant_offset != variant_offset) {
-                debugf("validated_variant_offset %lu does not match variant_offset %lu\n", validated_variant_offset, variant_offset);
-                return;
+            if (run.length == 0) {
+                break;
             }
-            is_first_line = false;
-        } else {
-            debugf("Updating previous line next byte diff\n");
-            // long current_offset = tellfd(output_fd);
-            off_t prev_distance_to_next_address = previous_offset + 8;
-            lseek_ret = lseek(output_fd, prev_distance_to_next_address, SEEK_SET);
-            if (lseek_ret != prev_distance_to_next_address) {
-                perror("lseek");
-                debugf("Failed to seek to address: %ld, instead got: %ld\n", prev_distance_to_next_address, lseek_ret);
-                return;
+            size_t batch_size = batch.bytes.size();
+            batch.bytes.resize(batch_size + run.length);
+            if (fread(batch.bytes.data() + batch_size, 1, run.length, pack_file) != run.length) {
+                throw std::runtime_error("Unexpected end of packed file: " + pack_filename);
             }
-            uint64_t prev_distance_to_next = file_offset - previous_offset;
-            uint8_t prev_distance_to_next_bytes[8] = {0,0,0,0,0,0,0,0};
-            uint64_to_uint8_array(prev_distance_to_next, prev_distance_to_next_bytes);
-            debugf("Updating previous distance_to_next at address %lu to %lu\n",
-                    prev_distance_to_next_address,
-                    prev_distance_to_next);
-            write(output_fd, &prev_distance_to_next_bytes, 8);
-            // fwrite(&prev_distance_to_next, 1, 8, output_file);
-            lseek_ret = lseek(output_fd, prev_distance_to_next_address, SEEK_SET);
-            if (lseek_ret != prev_distance_to_next_address) {
-                perror("fseek");
-                debugf("Failed to seek to address: %ld, instead got: %ld\n", prev_distance_to_next_address, lseek_ret);
-                return;
+            batch.runs.push_back(run);
+            if (batch.bytes.size() >= VCFC_SPARSE_SCAN_BATCH_SIZE) {
+                push_batch(batch);
             }
         }
-
-
-        // Seek to this offset in the output file
-        debugf("max_position = %d, block_size = %d, multiplication_factor = %d, ref_int = %d\n",
-            sparse_config.max_position, sparse_config.block_size,
-            sparse_config.multiplication_factor, sparse_config.reference_to_int(reference_name));
-        debugf("Seeking to output file_offset: %lu\n", file_offset);
-        lseek_ret = lseek(output_fd, (off_t) file_offset, SEEK_SET);
-        if (lseek_ret != (off_t) file_offset) {
-            perror("fseek");
-            debugf("Failed to seek to address: %ld, instead got: %ld\n", file_offset, lseek_ret);
-            return;
+        if (!batch.runs.empty()) {
+            push_batch(batch);
         }
-
-        previous_offset = file_offset; // update prev address pointer
-
-        // Write the compressed line bytes to the sparse file
-        for (auto iter = line_bytes.begin(); iter != line_bytes.end(); iter++) {
-            debugf("%02X ", *iter);
-            write(output_fd, &(*iter), 1);
-            // fwrite(&(*iter), 1, 1, output_file);
+    } catch (...) {
+        read_error = std::current_exception();
+    }
+    {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        end_of_runs = true;
+    }
+    queue_not_empty.notify_all();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    if (pack_file != stdin) {
+        fclose(pack_file);
+    }
+    if (read_error) {
+        close(output_fd);
+        std::rethrow_exception(read_error);
+    }
+    for (std::exception_ptr& thread_error : thread_errors) {
+        if (thread_error) {
+            close(output_fd);
+            std::rethrow_exception(thread_error);
         }
-        debugf("\n");
     }
-    fclose(input_file);
+    // the end of the file may be a hole
+    if (ftruncate(output_fd, pack_header.logical_size) != 0) {
+        perror("ftruncate");
+        throw std::runtime_error("Failed to set the size of file: " + sparse_filename);
+    }
     close(output_fd);
 }
 
@@ -2,9 +2,12 @@
 #ifndef _SPARSE_H
 #define _SPARSE_H
 
+#include <map>
 #include <string>
+#include <vector>
 
 #include <fcntl.h>
+#include <stdio.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -12,32 +15,369 @@
 
 #include "compress.hpp"
 
-#define VCFC_SPARSE_MULTIPLE_REF_PER_FILE false
+#define SPARSE_EXTERNAL_INDEX_BLOCK_SIZE 256
+// Meta line of a sparse file recording its layout, see SparsificationConfiguration
+#define VCFC_SPARSE_META_LINE_PREFIX "##vcfc_sparse="
+// Largest slot of the bucketed layout, the slot size of the direct layout
+#define VCFC_SPARSE_MAX_SLOT_SIZE (4 * 4096)
+#define VCFC_SPARSE_SLOT_ALIGNMENT 64
+// Percentile of the bucket sizes the bucketed layout sizes slots for
+#define VCFC_SPARSE_SLOT_PERCENTILE 95
+// Distances to the previous and the next record, which start every record
+#define VCFC_SPARSE_DISTANCE_HEADERS_SIZE (2 * 8)
+// Lines ahead the two skip pointers of a record point to
+#define VCFC_SPARSE_SKIP_SHORT 16
+#define VCFC_SPARSE_SKIP_LONG 256
+#define VCFC_SPARSE_MAX_BUCKET_WIDTH (1 << 20)
+// Range scans read holes shorter than this instead of seeking past them
+#define VCFC_SPARSE_SCAN_COALESCE_GAP (64 * 1024)
+// Largest read of a range scan
+#define VCFC_SPARSE_SCAN_BATCH_SIZE (1024 * 1024)
 
+// A line as laid out in a sparse file
+struct sparse_line_extent {
+    uint32_t reference_idx;
+    uint64_t position;
+    uint64_t size;          // bytes in the sparse file, with the record headers
+    uint64_t input_offset;  // of the line in the compressed file
+    long file_offset;       // of the record of the line in the sparse file
+    long redirect_offset;   // of the redirect to the line in its slot, -1 if none
+};
+
+/**
+ * Sizes of the buckets of the lines for each bucket width that
+ * choose_bucket_layout tries, kept as a count per size so a layout is chosen
+ * without holding the lines. Lines are added in file order, sorted by contig
+ * and position.
+ */
+class SparseBucketSizes {
+public:
+    SparseBucketSizes();
+
+    void add_line(const struct sparse_line_extent& line);
+
+    /**
+     * Count of the buckets of each size with bucket width `bucket_width`, a
+     * power of 2 up to VCFC_SPARSE_MAX_BUCKET_WIDTH.
+     */
+    std::map<uint64_t, uint64_t> size_counts(int bucket_width) const;
+
+private:
+    // per bucket width 1 << i, the counts of the closed buckets and the size of the open one
+    std::vector<std::map<uint64_t, uint64_t>> closed_size_counts;
+    std::vector<uint64_t> open_sizes;
+    bool has_lines = false;
+    uint32_t last_reference_idx = 0;
+    uint64_t last_position = 0;
+};
 
+// Magic of a packed sparse file, see pack_sparse_file
+#define VCFC_SPARSE_PACK_MAGIC "VCFCSPK1"
+
+// Headers of a record of a sparse file
+struct sparse_record_headers {
+    uint64_t distance_to_previous;
+    uint64_t distance_to_next;
+    // to the lines VCFC_SPARSE_SKIP_SHORT and VCFC_SPARSE_SKIP_LONG lines ahead, 0 if none
+    uint64_t skip_distances[2];
+};
+
+// Populated byte range [begin, end) of a sparse file
+struct sparse_data_extent {
+    long begin;
+    long end;
+};
+
+/**
+ * Start of a packed sparse file. It is followed by the prefix_size bytes of
+ * the sparse file before its data, then by runs, each a sparse_pack_run and
+ * its bytes. A run of length 0 ends the file.
+ */
+struct sparse_pack_header {
+    char magic[8];
+    uint64_t logical_size;  // of the sparse file
+    uint64_t prefix_size;   // meta lines, header line and first line offset
+};
+
+// Populated bytes [offset, offset + length) of a sparse file
+struct sparse_pack_run {
+    uint64_t offset;
+    uint64_t length;
+};
+
+// Filesystem layout of a sparse file, see read_sparse_file_stats
+struct sparse_file_stats {
+    uint64_t logical_size;
+    uint64_t allocated_bytes;
+    bool fiemap_supported;
+    uint64_t extent_count;              // from FIEMAP
+    uint64_t unwritten_extent_count;    // preallocated and never written
+    uint64_t data_region_count;         // from SEEK_DATA and SEEK_HOLE
+};
+
+
+/**
+ * Layout of a sparse file. Slots are F * B bytes apart, one slot per bucket
+ * of k (bucket_width) positions, and the lines of a bucket are written one
+ * after the other from the start of its slot. Lines that do not fit go to the
+ * overflow area after the last slot, still chained in file order by the
+ * distance headers of the lines. A line larger than a slot leaves a redirect
+ * record in its slot, headers followed by a 0 byte instead of a line. With
+ * skip pointers, the headers of a line also hold the distances to the lines
+ * VCFC_SPARSE_SKIP_SHORT and VCFC_SPARSE_SKIP_LONG lines ahead, which a scan
+ * follows to get past a dense run of lines in a few hops. Each contig of the file's
+ * contig dictionary has a region of length / k + 1 slots, the regions laid out
+ * one after the other in dictionary order, so a line of any contig is in the
+ * slot at the prefix sum of the regions before it plus pos / k. Contigs
+ * without a length take max_position positions.
+ *
+ * The direct layout has a slot of 4 * 4096 bytes per position. The bucketed
+ * layout (see choose_bucket_layout) picks k and the slot size from the lines
+ * of the file, which gives a far smaller file for the same single seek.
+ */
 class SparsificationConfiguration {
 public:
     SparsificationConfiguration();
 
+    /**
+     * Sets the contig dictionary of the file, which lays out the contig
+     * regions. Without one the legacy contigs are used.
+     */
+    void set_reference_names(const reference_name_map& name_map);
+
+    /**
+     * Offset of the slot of (reference_name, pos) from the start of the data.
+     * Throws std::out_of_range if the contig is not in the dictionary or pos
+     * is past its length, see contains.
+     */
     size_t compute_sparse_offset(
             const std::string& reference_name,
             size_t pos);
 
-    uint8_t reference_to_int(const std::string& reference_name);
+    // Whether (reference_name, pos) has a slot
+    bool contains(const std::string& reference_name, size_t pos) const;
+
+    // Offset of the overflow area from the start of the data, past the last slot
+    size_t overflow_offset() const;
+
+    // Bytes of the headers of each record, with the skip pointers if the file has them
+    size_t record_headers_size() const;
+
+    // Offset past the last slot of the region of reference_name from the start of the data
+    size_t reference_end_offset(const std::string& reference_name) const;
+
+    /**
+     * Picks the bucket width and the slot size, as block_size with a
+     * multiplication factor of 1, that give the smallest file. Slots fit
+     * VCFC_SPARSE_SLOT_PERCENTILE percent of the buckets, up to
+     * max_slot_size, and larger buckets overflow. Returns the estimated size
+     * of the data with the chosen layout, slots and overflow area.
+     */
+    size_t choose_bucket_layout(
+            const SparseBucketSizes& bucket_sizes,
+            size_t max_slot_size = VCFC_SPARSE_MAX_SLOT_SIZE);
+
+    // Sets the layout to slots of F * B bytes of k positions each
+    void set_bucket_layout(int multiplication_factor, int block_size, int bucket_width);
+
+    uint32_t reference_to_int(const std::string& reference_name);
+
+    /**
+     * The ##vcfc_sparse meta line written to sparse files with this layout,
+     * without a newline.
+     */
+    std::string meta_line() const;
+
+    /**
+     * Reads the layout from the meta lines of a sparse file. Sparse files
+     * without a ##vcfc_sparse line hold a single contig at max_position, the
+     * layout before contig regions. Returns 0 on success.
+     */
+    int parse_meta_lines(const std::vector<std::string>& meta_header_lines);
 
     // sparsification constant values
     int multiplication_factor = 4;  // F: offset block multiplier, dependent on VCF file, number of samples
     int block_size = 4096;          // B: 4k
     //int min_position = 1;                 // min vcf pos. VCFv4.3 defines this as 1
-    int max_position = 300000000;   // L: 300 million, should be size of largest reference
+    int max_position = 300000000;   // L: 300 million, size of a contig without a length
+    int bucket_width = 1;           // k: positions per slot
+    int skip_pointers = 1;          // whether record headers hold skip pointers
+
+    reference_name_map name_map;    // contig dictionary of the file
+
+private:
+    size_t reference_slots(uint32_t reference_idx) const;
+
+    // first slot of the region of each contig by id, and the total slot count last
+    std::vector<size_t> reference_offsets;
+    bool single_reference = false;
+};
+
+/**
+ * Configuration of the sparse external index (.vcfci-sparse). The multiplication
+ * factor is dropped from the default of 4 to 1 since this is only storing index
+ * entries, not whole lines.
+ */
+SparsificationConfiguration sparse_external_index_configuration();
+
+/**
+ * Writes sparse external index entries to `output_fd`, each at the offset
+ * computed from its reference name and position.
+ */
+class SparseIndexBuilder {
+public:
+    SparseIndexBuilder(int output_fd, const SparsificationConfiguration& sparse_config);
+
+    void add_line(
+            const std::string& reference_name,
+            uint32_t position,
+            uint64_t byte_offset);
+
+    void set_reference_names(const reference_name_map& name_map) {
+        this->sparse_config.set_reference_names(name_map);
+    }
+
+private:
+    int output_fd;
+    SparsificationConfiguration sparse_config;
+};
+
+/**
+ * Decodes the headers of a record from `bytes`, record_headers_size() bytes.
+ * The skip distances are 0 for files without skip pointers.
+ */
+void decode_sparse_record_headers(
+        const SparsificationConfiguration& sparse_config,
+        uint8_t *bytes,
+        struct sparse_record_headers *headers);
+
+/**
+ * Encodes the headers of a record to `bytes`, record_headers_size() bytes.
+ */
+void encode_sparse_record_headers(
+        const SparsificationConfiguration& sparse_config,
+        struct sparse_record_headers& headers,
+        uint8_t *bytes);
+
+/**
+ * Reads the headers of the record at `record_offset` in `fd`, and the contig
+ * and position of its line. Returns false if the record is a redirect, which
+ * has no line.
+ */
+bool read_sparse_record(
+        int fd,
+        const SparsificationConfiguration& sparse_config,
+        long record_offset,
+        struct sparse_record_headers *headers,
+        std::string& reference_name,
+        uint64_t *position);
+
+/**
+ * From the record at `record_offset`, follows skip pointers while they point
+ * to lines of reference_name before `position`, and returns the offset of the
+ * last record reached. Lines are read only at the ends of the hops.
+ */
+long skip_sparse_lines_before(
+        int fd,
+        const SparsificationConfiguration& sparse_config,
+        long record_offset,
+        const std::string& reference_name,
+        uint64_t position);
+
+/**
+ * Appends to `extents` the populated ranges of [begin, end) in `fd`, found
+ * with SEEK_DATA and SEEK_HOLE. Ranges are widened to the slots of
+ * `slot_size` bytes from `data_start_offset` and merged when fewer than
+ * VCFC_SPARSE_SCAN_COALESCE_GAP bytes apart, so each can be read at once.
+ */
+void find_sparse_data_extents(
+        int fd,
+        long begin,
+        long end,
+        long data_start_offset,
+        long slot_size,
+        std::vector<struct sparse_data_extent>& extents);
+
+/**
+ * Reads the size, allocation and extents of the sparse file `filename`.
+ * Extents are counted with FIEMAP where the filesystem supports it. Returns 0
+ * on success.
+ */
+int read_sparse_file_stats(const std::string& filename, struct sparse_file_stats *stats);
+
+/**
+ * Writes the records of the sparse file `sparse_filename` to a dense packed
+ * file, or to stdout if `pack_filename` is "-". Only the used bytes of each
+ * slot and the overflow area are read and written, not the holes.
+ */
+void pack_sparse_file(const std::string& sparse_filename, const std::string& pack_filename);
+
+/**
+ * Recreates a sparse file from a packed file, or from stdin if
+ * `pack_filename` is "-". The packed runs are read in order and written by
+ * `thread_count` threads with pwrite.
+ */
+void unpack_sparse_file(const std::string& pack_filename, const std::string& sparse_filename, int thread_count = 1);
+
+class SparseWriterConfiguration {
+public:
+    SparseWriterConfiguration(){};
+
+    // One 16 KiB slot per position instead of the bucketed layout
+    bool direct = false;
+
+    // Threads writing the records
+    int thread_count = 1;
+
+    // Write populated regions whole and in offset order instead of runs of
+    // lines, which keeps the extent count down
+    bool regions = false;
+
+    // fallocate the populated regions before writing them, implies regions
+    bool preallocate = false;
+
+    // Layout to use instead of choosing one from the lines, unset if
+    // block_size is 0, see advise
+    int multiplication_factor = 0;
+    int block_size = 0;
+    int bucket_width = 0;
+};
+
+/**
+ * Reads the size, contig and position of each line of a compressed file from
+ * `input_file`, positioned after the header line or at a line, without
+ * decompressing the lines. Lines are read one at a time and not kept. Throws
+ * for lines outside of the contig regions of `sparse_config`.
+ */
+class SparseLineExtentReader {
+public:
+    SparseLineExtentReader(FILE *input_file, SparsificationConfiguration& sparse_config);
 
-    reference_name_map name_map;
+    /**
+     * Reads the next line into `line`, with file_offset and redirect_offset
+     * unset. Returns 1 if a line was read, 0 at the end of the lines.
+     */
+    int next(struct sparse_line_extent *line);
 
 private:
-    //std::map<std::string,uint8_t> n_map;
+    FILE *input_file;
+    SparsificationConfiguration& sparse_config;
+    std::string reference_name;
+    std::string pos_str;
 };
 
 // void sparsify_file_fd(const std::string& compressed_input_filename, const std::string& sparse_filename);
-void sparsify_file(const std::string& compressed_input_filename, const std::string& sparse_filename);
+/**
+ * Writes the lines of a compressed file to a sparse file. Without a
+ * configured layout, a first pass over the lines chooses one. A placement
+ * pass then records where each thread's byte range of the input starts, and
+ * each thread places and writes its lines from there, looking ahead only as
+ * far as the skip pointers reach. No pass holds more than that window of
+ * lines, so memory does not grow with the file.
+ */
+void sparsify_file(
+        const std::string& compressed_input_filename,
+        const std::string& sparse_filename,
+        const SparseWriterConfiguration& writer_configuration = SparseWriterConfiguration());
 
 #endif
@@ -1,4 +1,8 @@
 #include <string>
+#include <cmath>
+#include <cctype>
+#include <set>
+#include <algorithm>
 
 #include "utils.hpp"
 
@@ -14,14 +18,147 @@ size_t compressed_line_length_headers_size =
     sizeof(uint32_t) + sizeof(uint32_t);
 
 reference_name_map::reference_name_map() {
-    uint8_t ref_map_val = 1; // counter val for ref -> int map
-    for (size_t ref_idx = 0; ref_idx < references.size(); ref_idx++) {
-        n_map[references[ref_idx]] = ref_map_val++;
+    build({
+        "1", "2", "3", "4", "5", "6", "7", "8", "9", "10", "11", "12",
+        "13", "14", "15", "16", "17", "18", "19", "20", "21", "22",
+        "X", "Y", "M"});
+}
+
+reference_name_map::reference_name_map(const std::vector<std::string>& meta_header_lines) {
+    const std::string contig_prefix = "##contig=<";
+    std::vector<std::string> contigs;
+    std::vector<uint64_t> contig_lengths;
+    std::set<std::string> seen;
+    for (const std::string& line : meta_header_lines) {
+        if (line.compare(0, contig_prefix.size(), contig_prefix) != 0) {
+            continue;
+        }
+        // ID is the first field, or follows a comma
+        size_t id_idx = line.compare(contig_prefix.size(), 3, "ID=") == 0
+            ? contig_prefix.size() : line.find(",ID=");
+        if (id_idx == std::string::npos) {
+            continue;
+        }
+        id_idx = line.find('=', id_idx) + 1;
+        std::string id = line.substr(id_idx, line.find_first_of(",>", id_idx) - id_idx);
+        if (!id.empty() && seen.insert(id).second) {
+            contigs.push_back(id);
+            uint64_t length = 0;
+            size_t length_idx = line.compare(contig_prefix.size(), 7, "length=") == 0
+                ? contig_prefix.size() : line.find(",length=");
+            if (length_idx != std::string::npos) {
+                length = strtoull(line.c_str() + line.find('=', length_idx) + 1, NULL, 10);
+            }
+            contig_lengths.push_back(length);
+        }
+    }
+    if (contigs.empty()) {
+        *this = reference_name_map();
+        return;
+    }
+    build(contigs);
+    this->lengths = contig_lengths;
+}
+
+static uint64_t reference_name_hash(const std::string& reference_name) {
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (char c : reference_name) {
+        hash ^= (uint8_t) c;
+        hash *= 0x100000001b3ULL;
     }
+    return hash;
 }
 
-uint8_t reference_name_map::reference_to_int(const std::string& reference_name) {
-    return n_map[reference_name];
+static uint64_t mix_hash(uint64_t hash) {
+    // splitmix64 finalizer
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+    return hash;
+}
+
+size_t reference_name_map::slot(uint64_t name_hash, uint32_t displacement) const {
+    return mix_hash(name_hash + (uint64_t) displacement * 0x9e3779b97f4a7c15ULL) % this->slots.size();
+}
+
+void reference_name_map::build(const std::vector<std::string>& references) {
+    this->references = references;
+    this->lengths.assign(references.size(), 0);
+    size_t n = references.size();
+    // about 4 names per bucket, and a quarter of the slots spare so every
+    // bucket finds a displacement quickly
+    size_t bucket_count = n / 4 + 1;
+    this->displacements.assign(bucket_count, 0);
+    this->slots.assign(n + n / 4 + 1, 0);
+
+    std::vector<std::vector<uint32_t>> buckets(bucket_count);
+    for (uint32_t i = 0; i < n; i++) {
+        buckets[mix_hash(reference_name_hash(references[i])) % bucket_count].push_back(i);
+    }
+    // place the largest buckets first, while most slots are free
+    std::vector<size_t> bucket_order(bucket_count);
+    for (size_t b = 0; b < bucket_count; b++) {
+        bucket_order[b] = b;
+    }
+    std::stable_sort(bucket_order.begin(), bucket_order.end(), [&buckets](size_t a, size_t b) {
+        return buckets[a].size() > buckets[b].size();
+    });
+    std::vector<size_t> bucket_slots;
+    for (size_t b : bucket_order) {
+        if (buckets[b].empty()) {
+            break;
+        }
+        for (uint32_t displacement = 1; ; displacement++) {
+            bucket_slots.clear();
+            for (uint32_t i : buckets[b]) {
+                size_t s = slot(reference_name_hash(references[i]), displacement);
+                if (this->slots[s] != 0
+                        || std::find(bucket_slots.begin(), bucket_slots.end(), s) != bucket_slots.end()) {
+                    break;
+                }
+                bucket_slots.push_back(s);
+            }
+            if (bucket_slots.size() == buckets[b].size()) {
+                for (size_t i = 0; i < bucket_slots.size(); i++) {
+                    this->slots[bucket_slots[i]] = buckets[b][i] + 1;
+                }
+                this->displacements[b] = displacement;
+                break;
+            }
+        }
+    }
+}
+
+uint32_t reference_name_map::reference_to_int(const std::string& reference_name) const {
+    uint64_t name_hash = reference_name_hash(reference_name);
+    uint32_t displacement = this->displacements[mix_hash(name_hash) % this->displacements.size()];
+    if (displacement == 0) {
+        // empty bucket
+        return 0;
+    }
+    uint32_t reference_idx = this->slots[slot(name_hash, displacement)];
+    if (reference_idx == 0 || this->references[reference_idx - 1] != reference_name) {
+        return 0;
+    }
+    return reference_idx;
+}
+
+const std::string& reference_name_map::int_to_reference(uint32_t reference_idx) const {
+    static const std::string empty;
+    if (reference_idx == 0 || reference_idx > this->references.size()) {
+        return empty;
+    }
+    return this->references[reference_idx - 1];
+}
+
+uint64_t reference_name_map::reference_length(uint32_t reference_idx) const {
+    if (reference_idx == 0 || reference_idx > this->lengths.size()) {
+        return 0;
+    }
+    return this->lengths[reference_idx - 1];
 }
 
 
@@ -174,6 +311,28 @@ int str_to_long(const std::string& s, long *out) {
     return 0;
 }
 
+size_t uint32_to_varint(uint32_t val, uint8_t bytes[VARINT_MAX_LENGTH_32]) {
+    size_t i = 0;
+    while (val >= 0x80) {
+        bytes[i++] = (uint8_t) (val & 0x7F) | 0x80;
+        val >>= 7;
+    }
+    bytes[i++] = (uint8_t) val;
+    return i;
+}
+
+size_t varint_to_uint32(const uint8_t *bytes, size_t len, uint32_t *val) {
+    uint32_t result = 0;
+    for (size_t i = 0; i < len && i < VARINT_MAX_LENGTH_32; i++) {
+        result |= (uint32_t) (bytes[i] & 0x7F) << (7 * i);
+        if ((bytes[i] & 0x80) == 0) {
+            *val = result;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
 // Return value must be deleted by caller
 void uint64_to_uint8_array(uint64_t val, uint8_t bytes[8]) {
     //uint8_t *bytes = new uint8_t[8];
@@ -274,4 +433,132 @@ long file_size(const char *filename) {
     long size = ftell(file);
     fclose(file);
     return size;
-}
\ No newline at end of file
+}
+
+int parse_kvp(const std::string& input, std::map<std::string,std::string>& output_map) {
+    const std::vector<std::string> pairs = split_string(input, ";");
+    for (size_t pair_i = 0; pair_i < pairs.size(); pair_i++) {
+        const std::string& pair = pairs[pair_i];
+        const std::vector<std::string> parts = split_string(pair, "=");
+        if (parts.size() == 2) {
+            const std::string& key = parts[0];
+            const std::string& val = parts[1];
+            // No duplicate checking
+            output_map[key] = val;
+        } else if (parts.size() == 1) {
+            const std::string& key = parts[0];
+            const std::string& val = "";
+            // No duplicate checking
+            output_map[key] = val;
+        } else {
+            throw std::runtime_error("Invalid kvp format: " + input);
+        }
+    }
+    return 0;
+}
+
+bool alt_is_structural(const std::string& alt) {
+    return alt.find('<') != std::string::npos;
+}
+
+void normalize_variant(uint64_t *pos, std::string& ref, std::string& alt) {
+    for (std::string::iterator iter = ref.begin(); iter != ref.end(); iter++) {
+        *iter = toupper(*iter);
+    }
+    for (std::string::iterator iter = alt.begin(); iter != alt.end(); iter++) {
+        *iter = toupper(*iter);
+    }
+    if (alt_is_structural(alt) || alt == "*"
+            || alt.find('[') != std::string::npos || alt.find(']') != std::string::npos) {
+        return;
+    }
+    while (ref.size() > 1 && alt.size() > 1 && ref.back() == alt.back()) {
+        ref.pop_back();
+        alt.pop_back();
+    }
+    size_t common_prefix = 0;
+    while (ref.size() - common_prefix > 1 && alt.size() - common_prefix > 1
+            && ref[common_prefix] == alt[common_prefix]) {
+        common_prefix++;
+    }
+    if (common_prefix > 0) {
+        ref.erase(0, common_prefix);
+        alt.erase(0, common_prefix);
+        *pos += common_prefix;
+    }
+}
+
+long compute_end_position(
+        long pos,
+        const std::string& reference_name,
+        const std::string& ref,
+        const std::string& alt,
+        const std::string& info) {
+    // long read_to_ret = 0;
+    long end_position = 0;
+    // debugf("ID=%s\n", id.c_str());
+    // debugf("REF=%s\n", ref.c_str());
+    debugf("ALT=%s\n", alt.c_str());
+
+    if (alt_is_structural(alt)) {
+        debugf("ALT is structural: %s\n", alt.c_str());
+        // std::string info;
+        debugf("INFO=%s\n", info.c_str());
+        std::map<std::string,std::string> info_kvp;
+        if (parse_kvp(info, info_kvp) < 0) {
+            throw std::runtime_error("Failed to parse info kvp");
+        }
+        std::string svtype = info_kvp["SVTYPE"];
+        debugf("Structural variant type: %s\n", svtype.c_str());
+
+        // SV without END info: SVA, ALU (alt begins with: <INS:)
+        if (info_kvp.count("END")) {
+            long end;
+            std::vector<std::string> end_strings = split_string(info_kvp["END"], ",");
+            long max_end = 0;
+            for (auto iter = end_strings.begin(); iter != end_strings.end(); iter++) {
+                if (str_to_long(*iter, &end) != 0) {
+                    throw std::runtime_error("Failed to parse END integer: " + *iter);
+                }
+                if (end > max_end) {
+                    max_end = end;
+                }
+            }
+            end_position = std::abs(max_end);
+        } else if (info_kvp.count("SVLEN")) {
+            long svlen = 0, max_svlen = 0;
+            std::vector<std::string> svlen_strings = split_string(info_kvp["SVLEN"], ",");
+            for (size_t i = 0; i < svlen_strings.size(); i++) {
+                if (str_to_long(svlen_strings[i], &svlen) != 0) {
+                    throw std::runtime_error("Failed to parse SVLEN integer: " + svlen_strings[i]);
+                }
+                // Using abs to handle INS types, and DEL, DUP together
+                if (std::abs(svlen) > max_svlen) {
+                    max_svlen = std::abs(svlen);
+                }
+            }
+            end_position = pos + max_svlen - 1;
+        } else {
+            debugf("Could not find END or SVLEN to determine end position of structural variant, using start_position\n");
+            end_position = pos;
+        }
+
+    } else {
+        debugf("Non structural variant\n");
+        std::vector<std::string> alts = split_string(alt, ",");
+        size_t max_alt_size = 0;
+        for (auto iter = alts.begin(); iter != alts.end(); iter++) {
+            if (iter->size() > max_alt_size) {
+                max_alt_size = iter->size();
+            }
+        }
+        // POS plus longest region, either insertion or deletion
+        // end_position = pos + std::abs((long)(reference_name.size() - max_alt_size));
+        if (ref.size() >= max_alt_size) {
+            end_position = pos + ref.size() - 1;
+        } else {
+            end_position = pos + max_alt_size - 1;
+        }
+    }
+    return end_position;
+}
@@ -27,6 +27,15 @@ typedef uint8_t byte_t;
 #define DEFAULT_FILE_CREATE_FLAGS (O_CREAT | O_TRUNC | O_RDWR)
 #define DEFAULT_FILE_CREATE_MODE (S_IRUSR | S_IWUSR)
 #define VCFC_BINNING_INDEX_EXTENSION ".vcfci"
+#define VCFC_EYTZINGER_INDEX_EXTENSION ".vcfci-eytzinger"
+#define VCFC_ELIAS_FANO_INDEX_EXTENSION ".vcfci-ef"
+#define VCFC_TWO_LEVEL_INDEX_EXTENSION ".vcfci-2level"
+#define VCFC_INTERVAL_INDEX_EXTENSION ".vcfci-interval"
+#define VCFC_LEARNED_INDEX_EXTENSION ".vcfci-learned"
+#define VCFC_HASH_INDEX_EXTENSION ".vcfci-hash"
+#define VCFC_BLOOM_INDEX_EXTENSION ".vcfci-bloom"
+#define VCFC_ZONE_MAP_INDEX_EXTENSION ".vcfci-zonemap"
+#define VCFC_SPARSE_INDEX_EXTENSION ".vcfci-sparse"
 
 
 // regex submatch flag to match everything not in the pattern
@@ -54,6 +63,12 @@ typedef uint8_t byte_t;
 #define SAMPLE_MASK_UNCOMPRESSED    0b11100000
 #define SAMPLE_MASKED_UNCOMPRESSED  0b11100000
 // the value of the remaining 5 bits in the 0b111 case are unused
+//
+// An uncompressed flag with a column count of zero is never written for a
+// sample, so as the first sample byte it marks an entropy coded sample section.
+// It is followed by a 4 byte big-endian count of decoded sample bytes, then the
+// coded stream up to the line ending newline. See entropy.hpp.
+#define SAMPLE_MASKED_ENTROPY       0b11100000
 ////////////////////////////////////////////////////////////////
 
 extern const char *tab;
@@ -87,19 +102,39 @@ extern const int eof;
 //     return v;
 // }
 
+/**
+ * Contig dictionary of a file. Maps reference names to ids from 1 in the order
+ * of the contigs, 0 for names not in the dictionary. The contigs are the
+ * ##contig=<ID=...> meta lines of the file, or the human chromosomes 1-22, X,
+ * Y and M if it has none. The length of a contig is the length= field of its
+ * meta line, 0 if it has none.
+ *
+ * Names are resolved with a perfect hash (hash and displace): a name hashes to
+ * a bucket, and the bucket's displacement to a slot holding its id that no
+ * other name uses, so a lookup is two hashes and one string compare.
+ */
 class reference_name_map {
 public:
     reference_name_map();
+    reference_name_map(const std::vector<std::string>& meta_header_lines);
 
-    uint8_t reference_to_int(const std::string& reference_name);
+    uint32_t reference_to_int(const std::string& reference_name) const;
+    // Name of id `reference_idx`, empty if there is none
+    const std::string& int_to_reference(uint32_t reference_idx) const;
+    uint64_t reference_length(uint32_t reference_idx) const;
+
+    size_t size() const {
+        return this->references.size();
+    }
 
 private:
-    const std::vector<std::string> references = {
-        "1", "2", "3", "4", "5", "6", "7", "8", "9", "10", "11", "12",
-        "13", "14", "15", "16", "17", "18", "19", "20", "21", "22",
-        "X", "Y", "M"};
+    void build(const std::vector<std::string>& references);
+    size_t slot(uint64_t name_hash, uint32_t displacement) const;
 
-    std::map<std::string,uint8_t> n_map;
+    std::vector<std::string> references;    // name of id i + 1
+    std::vector<uint64_t> lengths;          // length of id i + 1
+    std::vector<uint32_t> displacements;    // per bucket
+    std::vector<uint32_t> slots;            // id of the name in each slot, 0 if unused
 };
 
 typedef struct {
@@ -128,15 +163,30 @@ public:
     size_t alt_allele_count = 0;
     size_t sample_count = 0;
     std::map<std::string,byte_array> sequence_map;
+    // from the meta lines, see reference_name_map
+    reference_name_map reference_names;
 };
 
 
 struct compressed_line_length_headers {
     uint32_t line_length;
     uint32_t required_columns_length;
+    // END - POS of the variant. Present if the required columns length header
+    // has REQUIRED_COLUMNS_FLAG_END set, stored as a varint after that header.
+    bool has_end_position;
+    uint32_t end_position_delta;
+    uint8_t end_position_length;    // bytes of the varint, 0 if not present
 };
+// size of the two fixed length headers, not including the END varint
 extern size_t compressed_line_length_headers_size;
 
+// Bit in the first byte of the required columns length header, below the
+// extension count bits, marking that an END varint follows the header.
+// Limits the required columns length of such a line to 29 bits.
+#define REQUIRED_COLUMNS_FLAG_END 0x20
+#define REQUIRED_COLUMNS_FLAG_END_MAX_LENGTH (uint32_t)0x1FFFFFFF
+#define VARINT_MAX_LENGTH_32 5
+
 #define LINE_LENGTH_HEADER_MAX_EXTENSION 3
 class LineLengthHeader {
 public:
@@ -257,6 +307,37 @@ std::string byte_vector_to_string(const std::vector<byte_t>& v);
 uint64_t str_to_uint64(const std::string& s, bool& success);
 int str_to_long(const std::string& s, long *out);
 
+int parse_kvp(const std::string& input, std::map<std::string,std::string>& output_map);
+bool alt_is_structural(const std::string& alt);
+/**
+ * Returns the last reference position covered by a variant. Uses END or SVLEN
+ * from INFO for structural variants, otherwise the longest of REF and ALT.
+ */
+long compute_end_position(
+        long pos,
+        const std::string& reference_name,
+        const std::string& ref,
+        const std::string& alt,
+        const std::string& info);
+/**
+ * Normalizes a single REF/ALT allele pair in place without the reference
+ * sequence: uppercases both and trims bases they share at the end, then at the
+ * start, advancing `pos`. Structural and spanning deletion alleles are only
+ * uppercased.
+ */
+void normalize_variant(uint64_t *pos, std::string& ref, std::string& alt);
+
+/**
+ * LEB128 varint, 7 bits per byte, low bits first, high bit set on all but the last byte.
+ * Returns the number of bytes written.
+ */
+size_t uint32_to_varint(uint32_t val, uint8_t bytes[VARINT_MAX_LENGTH_32]);
+/**
+ * Returns the number of bytes read from `bytes`, 0 if the varint is
+ * truncated or longer than VARINT_MAX_LENGTH_32.
+ */
+size_t varint_to_uint32(const uint8_t *bytes, size_t len, uint32_t *val);
+
 void uint64_to_uint8_array(uint64_t val, uint8_t bytes[8]);
 void uint8_array_to_uint64(uint8_t bytes[8], uint64_t *val);
 void uint32_to_uint8_array(uint32_t val, uint8_t bytes[4]);
@@ -0,0 +1,51 @@
+#!/bin/bash
+# Checks that binned index queries return the same lines as a full scan, for
+# lines and byte bins that cross contig boundaries, and with zone maps.
+# Usage: ./test-binned-index.sh [main-binary]
+set -e
+main="${1:-./main_release}"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# 3 contigs of 200 SNVs, so END is POS and both queries agree on overlaps.
+# Each contig reaches further than the one before, so lines at its start
+# have a smaller END than the last bin of the previous contig
+vcf="$dir/contigs.vcf"
+awk 'BEGIN {
+    print "##fileformat=VCFv4.2"
+    for (c = 1; c <= 3; c++) print "##contig=<ID=chr" c ",length=100000>"
+    print "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT\tS0\tS1\tS2\tS3"
+    for (c = 1; c <= 3; c++) for (i = 0; i < 200; i++)
+        printf "chr%d\t%d\t.\tA\tG\t50\t%s\tDP=%d\tGT\t0|0\t0|1\t1|0\t0|0\n", c, 100 + 10 * c * i, i % 4 ? "PASS" : "q10", i
+}' > "$vcf"
+"$main" compress "$vcf" "$vcf.vcfc" > /dev/null
+
+failures=0
+for bin_size in 1 7 512b 2000b 2000b:aligned page; do
+    "$main" create-binned-index "$bin_size" "$vcf.vcfc"
+    for region in chr1:100-100 chr2:100-100 chr2:90-150 chr2:2070-2130 chr3:100-600 chr3:5900-6100 chr2 chr3; do
+        expected=$("$main" query "$vcf.vcfc" "$region" | md5sum)
+        actual=$("$main" query-binned-index "$vcf.vcfc" "$region" | md5sum)
+        if [ "$expected" != "$actual" ]; then
+            echo "FAIL bin size $bin_size, region $region"
+            failures=$((failures + 1))
+        fi
+    done
+done
+# zone maps skip bins by their FILTER and INFO values, the lines of a region
+# and of a whole contig must still all be found
+for bin_size in 7 2000b; do
+    "$main" create-binned-index "$bin_size" "$vcf.vcfc" --zone-maps
+    for region in chr2:90-150 chr3:100-600 chr2 chr3; do
+        expected=$("$main" query "$vcf.vcfc" "$region" | awk -F '\t' '$7 == "PASS"' | md5sum)
+        actual=$("$main" query-binned-index "$vcf.vcfc" "$region where FILTER=PASS" | md5sum)
+        if [ "$expected" != "$actual" ]; then
+            echo "FAIL zone maps, bin size $bin_size, region $region"
+            failures=$((failures + 1))
+        fi
+    done
+done
+if [ $failures -ne 0 ]; then
+    exit 1
+fi
+echo "binned index: all regions match"